@@ -7,9 +7,12 @@
 .section .bootstrap.text
 
 .global _bootstrap_start
+.global _bootstrap_secondary_start
 
 .extern _stack_base
 .extern main_bootstrap
+.extern setup_vmem_bootstrap
+.extern _high_secondary_start
 
 _bootstrap_start:
 
@@ -45,6 +48,48 @@ el1_start:
 .loop:
     b .loop
 
+# Entry point for secondary CPUs started with PSCI CPU_ON
+# x0: Physical address of the top of this CPU's stack
+_bootstrap_secondary_start:
+    mov x19, x0
+
+    mrs x1, CurrentEL
+    cmp x1, 0x8
+    b.ne el1_secondary_start
+
+    // Started in EL2. Setup EL2 the same way as the boot CPU
+    ldr x2, =el2_exception_vectors
+    msr VBAR_EL2, x2
+
+    mov x2, 0x80000000
+    msr HCR_EL2, x2
+
+    mov x2, 0x00300000
+    msr CPTR_EL2, x2
+
+    ldr x2, =el1_secondary_start
+    msr ELR_EL2, x2
+
+    mov x2, 0x5
+    msr SPSR_EL2, x2
+
+    eret
+
+el1_secondary_start:
+
+    ldr x0, =el1_bootstrap_exception_vectors
+    msr VBAR_EL1, x0
+
+    mov sp, x19
+
+    // The bootstrap tables are left in place after boot. Setting them
+    // up again writes the same entries and enables the MMU on this CPU
+    bl setup_vmem_bootstrap
+
+    mov x0, x19
+    ldr x1, =_high_secondary_start
+    br x1
+
 el3_start:
     // Setup EL3 exception vectors
     ldr x2, =el3_exception_vectors
@@ -111,6 +111,75 @@ void gicv3_set_spi_trigger(void* ctx, uint64_t intid, interrupt_trigger_type_t t
     }
 }
 
+/*
+ * Find the redistributor for a CPU by matching the affinity reported in
+ * GICR_TYPER
+ */
+static volatile GICR_Struct* gicv3_find_gicr(uint64_t mpidr) {
+
+    uint64_t aff = (((mpidr >> 32) & 0xFF) << 24) | (mpidr & 0xFFFFFF);
+
+    uintptr_t frame = (uintptr_t)s_gicv3_ctx.gicr;
+    while (true) {
+        volatile GICR_Struct* gicr = (volatile GICR_Struct*)frame;
+        uint64_t typer = gicr->typer;
+
+        if ((typer >> GICR_TYPER_AFF_SHIFT) == aff) {
+            return gicr;
+        }
+        if (typer & GICR_TYPER_LAST) {
+            return NULL;
+        }
+        frame += GICR_FRAME_SIZE;
+    }
+}
+
+void gicv3_enable_cpu(void* ctx, uint64_t mpidr) {
+
+    volatile GICR_Struct* gicr = gicv3_find_gicr(mpidr);
+    ASSERT(gicr != NULL);
+
+    volatile GICR_PPI_Struct* gicrppi = (volatile GICR_PPI_Struct*)((uintptr_t)gicr + GICR_SGI_FRAME_OFFSET);
+
+    gicr->waker &= ~GICR_WAKER_PROCESSOR_SLEEP;
+    while (gicr->waker & GICR_WAKER_CHILDREN_ASLEEP);
+
+    // SGIs and PPIs are banked per CPU. Enable the same ones
+    // that are enabled on the boot CPU
+    gicrppi->igroupr0 = s_gicv3_ctx.gicrppi->igroupr0;
+    gicrppi->isenabler0 = s_gicv3_ctx.gicrppi->isenabler0;
+
+    uint64_t icc_ctlr = 0;
+    WRITE_SYS_REG(ICC_REG_CTLR_EL1, icc_ctlr);
+
+    uint64_t icc_igrpen1 = ICC_IGRPEN1_ENABLE;
+    WRITE_SYS_REG(ICC_REG_IGRPEN1_EL1, icc_igrpen1);
+
+    uint64_t icc_pmr = 0xFF;
+    WRITE_SYS_REG(ICC_REG_PMR_EL1, icc_pmr);
+
+    uint64_t icc_bpr1 = 0;
+    WRITE_SYS_REG(ICC_REG_BPR1_EL1, icc_bpr1);
+}
+
+void gicv3_send_sgi(void* ctx, uint64_t intid, uint64_t mpidr) {
+
+    ASSERT(intid < GIC_INTID_SGI_LIMIT);
+    // The target list only covers Aff0 values below 16
+    ASSERT((mpidr & 0xFF) < 16);
+
+    uint64_t icc_sgi1r = BIT(mpidr & 0xF) |
+                         (((mpidr >> 8) & 0xFF) << 16) |
+                         (intid << 24) |
+                         (((mpidr >> 16) & 0xFF) << 32) |
+                         (((mpidr >> 32) & 0xFF) << 48);
+
+    // Make scheduler updates visible before the target takes the IRQ
+    asm volatile ("DSB ISH");
+    WRITE_SYS_REG(ICC_REG_SGI1R_EL1, icc_sgi1r);
+    asm volatile ("ISB");
+}
+
 bool gic_try_irq_handler(void) {
     uint32_t intid = 0;
     READ_SYS_REG(ICC_REG_IAR1_EL1, intid);
@@ -153,7 +222,9 @@ static intc_funcs_t intc_funcs = {
     .disable_irq = gicv3_disable_intid,
     .set_irq_trigger = gicv3_set_spi_trigger,
     .get_msi = gicv3_get_spi_msi_intid,
-    .irq_handler = gic_irq_handler
+    .irq_handler = gic_irq_handler,
+    .enable_cpu = gicv3_enable_cpu,
+    .send_sgi = gicv3_send_sgi
 };
 
 static void gicv3_dtb_get_intid_list(void* ctx, dt_prop_ints_t* ints_prop, uint64_t* intids) {
@@ -245,7 +316,7 @@ void gicv3_discover(void* ctx) {
     console_log(LOG_DEBUG, " GICD_CTLR: %8x", s_gicv3_ctx.gicd->ctlr);
     console_log(LOG_DEBUG, " GICD_TYPER: %8x", s_gicv3_ctx.gicd->typer);
     console_log(LOG_DEBUG, " GICD_CTLR: %8x", s_gicv3_ctx.gicr->ctlr);
-    console_log(LOG_DEBUG, " GICD_TYPER: %8x", s_gicv3_ctx.gicr->typer);
+    console_log(LOG_DEBUG, " GICD_TYPER: %16x", s_gicv3_ctx.gicr->typer);
 
     bitalloc_init(&s_gicv3_ctx.intid_alloc, GIC_INTID_SPI_BASE, GIC_INTID_SPI_LIMIT, vmalloc);
 
@@ -66,7 +66,7 @@ typedef struct __attribute__((__packed__)) {
 typedef struct __attribute__((__packed__)) {
     uint32_t ctlr;
     uint32_t iidr;
-    uint32_t typer;
+    uint64_t typer;
     uint32_t statusr;
     uint32_t waker;
     uint32_t res0[2];
@@ -162,6 +162,16 @@ enum {
 #define GICD_CTRL_ENG1 BIT(1)
 #define GICD_CTRL_ENG0 BIT(0)
 
+// Each redistributor has an RD_base frame followed by an SGI_base frame
+#define GICR_FRAME_SIZE (2 * 64 * 1024)
+#define GICR_SGI_FRAME_OFFSET (64 * 1024)
+
+#define GICR_TYPER_LAST BIT(4)
+#define GICR_TYPER_AFF_SHIFT (32)
+
+#define GICR_WAKER_CHILDREN_ASLEEP BIT(2)
+#define GICR_WAKER_PROCESSOR_SLEEP BIT(1)
+
 
 
 #define ICC_CTRL_A3V BIT(15)
@@ -182,6 +192,7 @@ enum {
 #define ICC_REG_BPR1_EL1 s3_0_c12_c12_3
 #define ICC_REG_IAR1_EL1 s3_0_c12_c12_0
 #define ICC_REG_EOIR1_EL1 s3_0_c12_c12_1
+#define ICC_REG_SGI1R_EL1 s3_0_c12_c11_5
 
 /*
 #define GICD_CLEAR_ACTIVE(intid) \
@@ -208,7 +208,7 @@ static int64_t bcm2711_gpio_ioctl_op(void* ctx, const uint64_t ioctl, const uint
         case GPIO_IOCTL_LISTENER:
             if (arg_count != 1) return -1;
 
-            k_gpio_listener_t* listener_info = get_kptr_for_ptr(args[0]);
+            k_gpio_listener_t* listener_info = get_kptr_for_ptr(args[0], sizeof(k_gpio_listener_t));
             if (listener_info == NULL) return -1;
 
             if (listener_info->gpio_num < gpio_ctx->offset ||
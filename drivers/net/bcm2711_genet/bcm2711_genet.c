@@ -14,6 +14,7 @@
 #include "kernel/memoryspace.h"
 #include "kernel/vmem.h"
 #include "kernel/task.h"
+#include "kernel/schedule.h"
 #include "kernel/kmalloc.h"
 #include "kernel/gtimer.h"
 #include "kernel/interrupt/interrupt.h"
@@ -38,7 +39,11 @@ typedef struct {
 
     net_dev_t net_dev;
 
+    // Frames stay on the Tx ring until a later send or the receive
+    // thread finds them completed
+    uint64_t tx_prod_idx;
     uint64_t last_tx_cons_idx;
+    net_send_buffer_t* tx_inflight[GENET_DMA_DESC_COUNT];
 } bcm2711_genet_ctx_t;
 
 static int32_t genet_read_mii(void* ctx, uint32_t reg) {
@@ -320,48 +325,46 @@ static void genet_init_tx_descs(bcm2711_genet_ctx_t* genet_ctx) {
         desc[idx].addr_lo = 0;
         desc[idx].addr_hi = 0;
         desc[idx].length_status = 0;
+        genet_ctx->tx_inflight[idx] = NULL;
     }
+
+    genet_ctx->tx_prod_idx = 0;
+    genet_ctx->last_tx_cons_idx = 0;
 }
 
-static void genet_send_packet(bcm2711_genet_ctx_t* genet_ctx, uint64_t tid, void* buffer, uint64_t len) {
+/*
+ * Put a frame on the Tx ring. The hardware does not see it until
+ * genet_kick_tx moves the producer index
+ */
+static void genet_queue_tx_packet(bcm2711_genet_ctx_t* genet_ctx, net_send_buffer_t* buffer) {
+
+    dcache_clean_invalidate_range(buffer->data, buffer->len);
+
+    uint64_t prod_idx = genet_ctx->tx_prod_idx;
+    volatile BCM2711GenetDmaDesc_t* desc = &genet_ctx->mem->tx_desc[prod_idx];
+
+    desc->length_status = BCM2711_GENET_DMA_TX_DESC_STATUS_SOP |
+                          BCM2711_GENET_DMA_TX_DESC_STATUS_EOP |
+                          //   BCM2711_GENET_DMA_TX_DESC_STATUS_CRC |
+                          (0x3F << 7) |
+                          ((buffer->len & 0xFFF) << BCM2711_GENET_DMA_DESC_LENGTH_SHIFT);
+    uintptr_t addr_phy = KSPACE_TO_PHY(buffer->data);
+    desc->addr_lo = addr_phy & 0xFFFFFFFF;
+    desc->addr_hi = (addr_phy >> 32) & 0xFFFFFFFF;
 
-    console_log(LOG_DEBUG, "Genet Sending packet");
-    dcache_clean_invalidate_range(buffer, len);
+    ASSERT(genet_ctx->tx_inflight[prod_idx] == NULL);
+    genet_ctx->tx_inflight[prod_idx] = buffer;
+
+    genet_ctx->tx_prod_idx = (prod_idx + 1) % GENET_DMA_DESC_COUNT;
+}
+
+static void genet_kick_tx(bcm2711_genet_ctx_t* genet_ctx, uint64_t tid) {
 
     volatile BCM2711GenetTxDmaRing_t* r = &genet_ctx->mem->tx_ring[tid];
-    uint64_t next_idx = ((r->prod_index & 0xFFFF) + 1) % GENET_DMA_DESC_COUNT;
-    volatile BCM2711GenetDmaDesc_t* desc = &genet_ctx->mem->tx_desc[r->prod_index & 0xFFFF];
-
-    //for () {
-        // volatile BCM2711GenetDmaDesc_t* desc = &genet_ctx->mem->tx_desc[i];
-
-        desc->length_status = BCM2711_GENET_DMA_TX_DESC_STATUS_SOP |
-                            BCM2711_GENET_DMA_TX_DESC_STATUS_EOP |
-                            //   BCM2711_GENET_DMA_TX_DESC_STATUS_CRC |
-                            (0x3F << 7) |
-                            ((len & 0xFFF) << BCM2711_GENET_DMA_DESC_LENGTH_SHIFT);
-        uintptr_t addr_phy = KSPACE_TO_PHY(buffer);
-        desc->addr_lo = addr_phy & 0xFFFFFFFF;
-        desc->addr_hi = (addr_phy >> 32) & 0xFFFFFFFF;
-
-        MEM_DSB();
-    //}
-
-    r->prod_index = next_idx;
-
-    char row_msg[16*3+1];
-
-    console_log(LOG_DEBUG, "Sending Packet: %d", len);
-    int idx = 0;
-    for (int row = 0; idx < len; row+=16) {
-        memset(row_msg, 0, sizeof(row_msg));
-        for (int col = 0; col < 16 && idx < len; col++,idx++) {
-            if (idx < len) {
-                snprintf(&row_msg[col*3], 4, "%02x ", ((uint8_t*)buffer)[idx]);
-            }
-        }
-        console_log(LOG_DEBUG, "%4x: %s", row, row_msg);
-    }
+
+    // Descriptors must be written before the hardware can see them
+    MEM_DSB();
+    r->prod_index = genet_ctx->tx_prod_idx;
 
     // int32_t bmsr = genet_read_mii(genet_ctx, GENET_PHY_REG_BMSR);
     // int32_t stat1000 = genet_read_mii(genet_ctx, GENET_PHY_REG_100T2SR);
@@ -387,7 +390,7 @@ static void genet_send_packet(bcm2711_genet_ctx_t* genet_ctx, uint64_t tid, void
     // console_log(LOG_DEBUG, "Tx DMA Ring Cfg: %8x %16x", genet_ctx->mem->tx_dma_ring_cfg, &genet_ctx->mem->tx_dma_ring_cfg);
     // console_log(LOG_DEBUG, "Tx DMA Ring Ctrl: %8x %16x", genet_ctx->mem->tx_dma_ctrl, &genet_ctx->mem->tx_dma_ctrl);
     // genet_print_dma_tx_ring(genet_ctx, 16);
-    // genet_print_dma_tx_desc(genet_ctx, next_idx);
+    // genet_print_dma_tx_desc(genet_ctx, genet_ctx->tx_prod_idx);
 }
 
 static void genet_reclaim_tx_packets(bcm2711_genet_ctx_t* genet_ctx, uint64_t tid) {
@@ -395,25 +398,20 @@ static void genet_reclaim_tx_packets(bcm2711_genet_ctx_t* genet_ctx, uint64_t ti
 
     uint64_t cons_index = r->cons_index & 0xFFFF;
 
-    uint64_t count = 0;
-
     while (genet_ctx->last_tx_cons_idx != cons_index)  {
-        genet_ctx->last_tx_cons_idx = (genet_ctx->last_tx_cons_idx + 1) % GENET_DMA_DESC_COUNT;
-
-        volatile BCM2711GenetDmaDesc_t* desc = &genet_ctx->mem->tx_desc[genet_ctx->last_tx_cons_idx];
+        net_send_buffer_t* buffer = genet_ctx->tx_inflight[genet_ctx->last_tx_cons_idx];
+        ASSERT(buffer != NULL);
+        genet_ctx->tx_inflight[genet_ctx->last_tx_cons_idx] = NULL;
 
-        uintptr_t addr_phy = ((uintptr_t)desc->addr_hi) << 32 | (uintptr_t)desc->addr_lo;
-        void* addr = PHY_TO_KSPACE_PTR(addr_phy);
-        // TODO: Free memory
-        //kfree_phy(addr);
-        (void)addr;
+        kfree_phy(KSPACE_TO_PHY_PTR(buffer->data));
+        vfree(buffer);
 
-        count++;
+        genet_ctx->last_tx_cons_idx = (genet_ctx->last_tx_cons_idx + 1) % GENET_DMA_DESC_COUNT;
     }
+}
 
-    if (count > 0) {
-        console_log(LOG_DEBUG, "Genet reclaimed %d Tx buffers", count);
-    }
+static bool genet_tx_ring_full(bcm2711_genet_ctx_t* genet_ctx) {
+    return (genet_ctx->tx_prod_idx + 1) % GENET_DMA_DESC_COUNT == genet_ctx->last_tx_cons_idx;
 }
 
 static void genet_irq_handler(uint32_t intid, void* ctx) {
@@ -457,7 +455,7 @@ static int64_t genet_receive_packet(bcm2711_genet_ctx_t* genet_ctx, uint64_t did
     }
     dcache_clean_invalidate_range(data, len);
 
-    net_packet_t* recv_packet = vmalloc(sizeof(net_packet_t));
+    net_packet_t* recv_packet = net_alloc_packet();
     recv_packet->dev = &genet_ctx->net_dev;
     recv_packet->nic_pkt_ctx = (void*)desc;
     recv_packet->data = vmalloc(len);
@@ -480,27 +478,52 @@ static void genet_irq_handler_b(uint32_t intid, void* ctx) {
 }
 
 static net_send_buffer_t* genet_nic_get_buffer(net_dev_t* ctx, const int64_t size, const uint64_t flags) {
+    // The hardware reads the frame from one physically contiguous buffer
+    void* data_phy = kmalloc_phy(size);
+    if (data_phy == NULL) {
+        return NULL;
+    }
+
     net_send_buffer_t* send_buffer = vmalloc(sizeof(net_send_buffer_t));
 
     send_buffer->dev = ctx;
-    send_buffer->data = kmalloc_phy(size);
+    send_buffer->data = PHY_TO_KSPACE_PTR(data_phy);
     send_buffer->len = size;
     send_buffer->nic_buffer_ctx = ctx->nic_ctx;
+    send_buffer->csum_start = 0;
+    send_buffer->csum_offset = 0;
+    send_buffer->gso_size = 0;
+    send_buffer->hdr_len = 0;
 
     return send_buffer;
 }
 
 static void genet_nic_free_buffer(net_dev_t* ctx, net_send_buffer_t* buffer) {
-    vfree(buffer->data);
+    kfree_phy(KSPACE_TO_PHY_PTR(buffer->data));
     vfree(buffer);
 }
 
-static void genet_nic_send_buffer(net_dev_t* ctx, net_send_buffer_t* buffer) {
+static void genet_nic_send_buffers(net_dev_t* ctx, net_send_buffer_t** buffers, uint64_t num_buffers) {
+    bcm2711_genet_ctx_t* genet_ctx = ctx->nic_ctx;
 
-    genet_send_packet(ctx->nic_ctx, 16, buffer->data, buffer->len);
-    vfree(buffer);
+    genet_reclaim_tx_packets(genet_ctx, 16);
+
+    for (uint64_t idx = 0; idx < num_buffers; idx++) {
+        while (genet_tx_ring_full(genet_ctx)) {
+            // Let the hardware drain what is already queued
+            genet_kick_tx(genet_ctx, 16);
+            task_wait_timer_in(1000);
+            genet_reclaim_tx_packets(genet_ctx, 16);
+        }
 
-    genet_reclaim_tx_packets(ctx->nic_ctx, 16);
+        genet_queue_tx_packet(genet_ctx, buffers[idx]);
+    }
+
+    genet_kick_tx(genet_ctx, 16);
+}
+
+static void genet_nic_send_buffer(net_dev_t* ctx, net_send_buffer_t* buffer) {
+    genet_nic_send_buffers(ctx, &buffer, 1);
 }
 
 static void genet_nic_return_packet(net_packet_t* packet) {
@@ -515,6 +538,9 @@ static void genet_net_recv_thread(void* ctx) {
     while(1) {
         task_wait_timer_in(100*1000);
 
+        // Sends only reclaim when there is traffic
+        genet_reclaim_tx_packets(genet_ctx, 16);
+
         // genet_print_dma_rx_ring(genet_ctx, 16);
         uint64_t prod_idx = genet_ctx->mem->rx_ring[16].prod_index & 0xFFFF;
 
@@ -577,6 +603,7 @@ static int64_t genet_nic_ioctl(void* ctx, const uint64_t ioctl, const uint64_t*
 static nic_ops_t s_genet_nic_ops = {
     .get_buffer = genet_nic_get_buffer,
     .send_buffer = genet_nic_send_buffer,
+    .send_buffers = genet_nic_send_buffers,
     .free_buffer = genet_nic_free_buffer,
     .return_packet = genet_nic_return_packet,
     .ioctl = genet_nic_ioctl
@@ -731,7 +758,8 @@ static void genet_late_init(void* ctx) {
     console_log(LOG_INFO, "GENET Tx DMA Ctrl %16x", &genet_ctx->mem->tx_dma_ctrl);
     console_log(LOG_INFO, "GENET Tx SCB %16x", &genet_ctx->mem->tx_scb_burst_size);
     
-    create_kernel_task(8192, genet_net_recv_thread, genet_ctx, "genet-recv");
+    uint64_t tid = create_kernel_task(8192, genet_net_recv_thread, genet_ctx, "genet-recv");
+    task_set_priority(get_task_for_tid(tid), TASK_PRIORITY_HIGH);
 
     genet_ctx->mem->intrl2_cpu_mask_clear = BCM2711_GENET_INTRL2_IRQ_RXDMA_DONE;
 
@@ -808,6 +836,11 @@ void bcm2711_genet_discover(void* ctx) {
     uint8_t mac_d[6] = {0xd8, 0x3a, 0xdd, 0x4c, 0xf0, 0xcf};
     memcpy(&genet_ctx->net_dev.mac.d, mac_d, sizeof(mac_d));
     genet_ctx->net_dev.name = "genet0";
+    genet_ctx->net_dev.features = 0;
+
+    // Receive buffers are reused as soon as the handler returns
+    genet_ctx->net_dev.rx_pin_max = 0;
+    genet_ctx->net_dev.rx_pinned = 0;
 
     net_device_register(&genet_ctx->net_dev);
 
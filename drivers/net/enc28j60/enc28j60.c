@@ -9,6 +9,7 @@
 #include "kernel/drivers.h"
 #include "kernel/fd.h"
 #include "kernel/task.h"
+#include "kernel/schedule.h"
 #include "kernel/select.h"
 #include "kernel/net/net.h"
 #include "kernel/select.h"
@@ -375,7 +376,7 @@ void enc28j60_read_thread(void* ctx) {
 
             if (packet_ok) {
                 uint8_t* packet_buffer = vmalloc(packet_len+8);
-                net_packet_t* pkt = vmalloc(sizeof(net_packet_t));
+                net_packet_t* pkt = net_alloc_packet();
                 enc_cmd_read_buffer(enc_ctx, &packet_buffer[7], packet_len+1);
 
                 pkt->dev = &enc_ctx->nic;
@@ -497,7 +498,7 @@ static void enc_nic_free_buffer_fn(net_dev_t* ctx, net_send_buffer_t* buffer) {
 
 static void enc_nic_return_packet_fn(net_packet_t* packet) {
     vfree(packet->nic_pkt_ctx);
-    vfree(packet);
+    net_free_packet(packet);
 }
 
 static int64_t enc_nic_ioctl_fn(void* ctx, const uint64_t ioctl, const uint64_t* args, const uint64_t arg_count) {
@@ -525,6 +526,12 @@ void enc28j60_discover(void* ctx) {
     enc_ctx->nic.ops = &s_enc_nic_ops;
     enc_ctx->nic.nic_ctx = enc_ctx;
     enc_ctx->nic.name = "enc28j60";
+    enc_ctx->nic.features = 0;
+
+    // Each packet is read into its own allocation, holding it does not
+    // take anything from the device
+    enc_ctx->nic.rx_pin_max = UINT32_MAX;
+    enc_ctx->nic.rx_pinned = 0;
     memcpy(enc_ctx->nic.mac.d, "\xd8\x3a\xdd\x4c\xf0\x00", 6);
 
     lstruct_init_head(&enc_ctx->send_buffers);
@@ -606,7 +613,8 @@ void enc28j60_discover(void* ctx) {
 
     net_device_register(&enc_ctx->nic);
 
-    create_kernel_task(8192, enc28j60_read_thread, enc_ctx, "enc28j60-recv");
+    uint64_t tid = create_kernel_task(8192, enc28j60_read_thread, enc_ctx, "enc28j60-recv");
+    task_set_priority(get_task_for_tid(tid), TASK_PRIORITY_HIGH);
 }
 
 void enc28j60_register() {
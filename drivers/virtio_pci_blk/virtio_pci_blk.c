@@ -9,10 +9,10 @@
 #include "kernel/lib/llist.h"
 #include "kernel/lib/vmalloc.h"
 #include "kernel/drivers.h"
+#include "kernel/fs/bcache.h"
 #include "kernel/fd.h"
 #include "kernel/sys_device.h"
 #include "kernel/kernelspace.h"
-#include "kernel/memoryspace.h"
 #include "kernel/vmem.h"
 #include "kernel/kmalloc.h"
 
@@ -46,14 +46,53 @@ typedef struct __attribute__((__packed__)) {
     uint8_t res1[3];
 } virtio_blk_config_t;
 
+#define VIRTIO_BLK_SECTOR_SIZE 512
+#define VIRTIO_BLK_QUEUE_SIZE 128
+#define VIRTIO_BLK_POOL_SIZE (16 * 1024)
+
+// Adjacent requests merged into a single device request
+#define VIRTIO_BLK_MAX_SEGS 32
+
+/**
+ * A single transfer to or from physically contiguous memory. Requests
+ * wait on the pending list until there are enough free descriptors,
+ * and runs of pending requests covering adjacent sectors are sent to
+ * the device as one request with a data segment per request. A flush
+ * is a barrier: requests are never sorted or merged across it, and it
+ * is only sent once everything queued before it has completed.
+ */
+typedef struct blk_req_s {
+    struct blk_req_s* next;     /* Pending or in flight list */
+    uint32_t type;
+    uint64_t sector;
+    uintptr_t phy;
+    uint32_t len;
+    volatile bool done;
+    uint8_t status;
+} blk_req_t;
+
+typedef struct {
+    blk_req_t* reqs;            /* Requests sent in this chain, NULL if unused */
+    void* header;
+    void* status;
+} blk_inflight_t;
+
 typedef struct {
     pci_device_ctx_t* pci_device;
     virtio_virtq_ctx_t virtio_requestq;
     uint64_t device_pos;
     virtio_blk_config_t device_config;
     char name[MAX_SYS_DEVICE_NAME_LEN];
-    void* cache_virtaddr;
+    bcache_dev_t* bcache;
+    bcache_ra_t ra;
+    bool has_flush;             /* VIRTIO_BLK_F_FLUSH was negotiated */
+    uint32_t max_segs;          /* Data segments per device request */
     virtio_virtq_shared_irq_ctx_t virtio_irq_ctx;
+
+    blk_req_t* pending;         /* Sorted by sector between flushes */
+    blk_inflight_t* inflight;   /* Indexed by head descriptor */
+    uint64_t num_inflight;      /* Chains sent and not yet reaped */
+    bool flush_inflight;        /* Nothing may pass a flush in flight */
 } blk_disk_ctx_t;
 
 static llist_head_t s_blk_disks;
@@ -73,6 +112,12 @@ typedef struct __attribute__((__packed__)) {
     uint8_t status;
 } virtio_blk_req_status_t;
 
+enum {
+    VIRTIO_BLK_S_OK = 0,
+    VIRTIO_BLK_S_IOERR = 1,
+    VIRTIO_BLK_S_UNSUPP = 2
+};
+
 enum {
     VIRTIO_BLK_T_IN = 0,
     VIRTIO_BLK_T_OUT = 1,
@@ -117,14 +162,20 @@ static void init_blk_device(blk_disk_ctx_t* disk_ctx) {
 
     common_cfg = common_cap->ctx;
 
-    virtio_set_status(common_cfg, VIRTIO_STATUS_ACKNOWLEGE);
-    virtio_set_status(common_cfg, VIRTIO_STATUS_DRIVER);
-
-    virtio_set_features(common_cfg, VIRTIO_F_VERSION_1);
+    // A device with a volatile write cache only makes writes durable
+    // on a flush request
+    uint64_t features_req = (1UL << VIRTIO_F_VERSION_1);
+    uint64_t features_dev = virtio_get_features(common_cfg);
+    if (features_dev & (1UL << VIRTIO_BLK_F_FLUSH)) {
+        features_req |= (1UL << VIRTIO_BLK_F_FLUSH);
+    }
+    if (features_dev & (1UL << VIRTIO_BLK_F_SEG_MAX)) {
+        features_req |= (1UL << VIRTIO_BLK_F_SEG_MAX);
+    }
+    bool status = virtio_init_with_features(pci_ctx, features_req);
+    ASSERT(status);
 
-    virtio_set_status(common_cfg, VIRTIO_STATUS_FEATURES_OK);
-    uint8_t device_status = virtio_get_status(common_cfg);
-    ASSERT(device_status & VIRTIO_STATUS_FEATURES_OK);
+    disk_ctx->has_flush = (features_req & (1UL << VIRTIO_BLK_F_FLUSH)) != 0;
 
     uint32_t queue_intid;
     queue_intid = pci_register_interrupt_handler(
@@ -149,12 +200,22 @@ static void init_blk_device(blk_disk_ctx_t* disk_ctx) {
     disk_ctx->virtio_irq_ctx.wait_queue = llist_create();
     disk_ctx->virtio_irq_ctx.intid = queue_intid;
 
+    // Data is transferred in place, so the pool only holds the
+    // request headers and status bytes
     virtio_alloc_queue(common_cfg,
                        VIRTIO_QUEUE_BLOCK_REQUESTQ,
-                       8, 98304,
+                       VIRTIO_BLK_QUEUE_SIZE, VIRTIO_BLK_POOL_SIZE,
                        &disk_ctx->virtio_requestq,
                        msix_item->entry_idx);
 
+    uint64_t queue_size = disk_ctx->virtio_requestq.queue_size;
+    disk_ctx->inflight = vmalloc(queue_size * sizeof(blk_inflight_t));
+    ASSERT(disk_ctx->inflight != NULL);
+    memset(disk_ctx->inflight, 0, queue_size * sizeof(blk_inflight_t));
+    disk_ctx->pending = NULL;
+    disk_ctx->num_inflight = 0;
+    disk_ctx->flush_inflight = false;
+
     virtio_set_status(common_cfg, VIRTIO_STATUS_DRIVER_OK);
 
 
@@ -162,87 +223,214 @@ static void init_blk_device(blk_disk_ctx_t* disk_ctx) {
     ASSERT(blk_cfg_cap);
     memcpy(&disk_ctx->device_config, blk_cfg_cap->ctx, sizeof(disk_ctx->device_config));
 
+    // The device limits the number of data segments in one request
+    disk_ctx->max_segs = VIRTIO_BLK_MAX_SEGS;
+    if ((features_req & (1UL << VIRTIO_BLK_F_SEG_MAX)) &&
+        disk_ctx->device_config.seg_max > 0 &&
+        disk_ctx->device_config.seg_max < disk_ctx->max_segs) {
+        disk_ctx->max_segs = disk_ctx->device_config.seg_max;
+    }
+
     pci_enable_vector(disk_ctx->pci_device, queue_intid);
     pci_enable_interrupts(disk_ctx->pci_device);
 }
 
-static void read_blk_device(blk_disk_ctx_t* disk_ctx, uint64_t sector, void* buffer, uint64_t len) {
+static void virtio_blk_queue_req(blk_disk_ctx_t* disk_ctx, blk_req_t* req) {
 
-    pci_device_ctx_t* pci_ctx = disk_ctx->pci_device;
-    virtio_virtq_buffer_t write_buffers[1] = {0};
-    virtio_virtq_buffer_t read_buffers[2] = {0};
+    req->done = false;
+    req->status = VIRTIO_BLK_S_OK;
 
-    bool get_ok;
-    get_ok = virtio_get_buffer(&disk_ctx->virtio_requestq, sizeof(virtio_blk_req_header_t), (uintptr_t*)&write_buffers[0].ptr);
-    ASSERT(get_ok);
-    write_buffers[0].len = sizeof(virtio_blk_req_header_t);
+    // Only sort among the requests queued after the last flush, which
+    // itself goes at the end
+    blk_req_t** pos = &disk_ctx->pending;
+    for (blk_req_t** walk = pos; *walk != NULL; walk = &(*walk)->next) {
+        if ((*walk)->type == VIRTIO_BLK_T_FLUSH) {
+            pos = &(*walk)->next;
+        }
+    }
 
-    virtio_blk_req_header_t* blk_req_header = write_buffers[0].ptr;
-    blk_req_header->type = VIRTIO_BLK_T_IN;
-    blk_req_header->res = 0;
-    blk_req_header->sector = sector;
+    // Insert after any request for the same or an earlier sector
+    while (*pos != NULL &&
+           (req->type == VIRTIO_BLK_T_FLUSH || (*pos)->sector <= req->sector)) {
+        pos = &(*pos)->next;
+    }
 
-    get_ok = virtio_get_buffer(&disk_ctx->virtio_requestq, len, (uintptr_t*)&read_buffers[0].ptr);
-    ASSERT(get_ok);
-    read_buffers[0].len = len;
-    get_ok = virtio_get_buffer(&disk_ctx->virtio_requestq, sizeof(virtio_blk_req_status_t), (uintptr_t*)&read_buffers[1].ptr);
-    ASSERT(get_ok);
-    read_buffers[1].len = sizeof(virtio_blk_req_status_t);
+    req->next = *pos;
+    *pos = req;
+}
 
-    virtio_virtq_send(&disk_ctx->virtio_requestq, write_buffers, 1,
-                      read_buffers, 2);
+/*
+ * Send as many pending requests as there are free descriptors for and
+ * notify the device once
+ */
+static void virtio_blk_submit(blk_disk_ctx_t* disk_ctx) {
 
-    virtio_virtq_notify(pci_ctx, &disk_ctx->virtio_requestq);
+    virtio_virtq_ctx_t* queue_ctx = &disk_ctx->virtio_requestq;
+    virtio_virtq_seg_t segs[VIRTIO_BLK_MAX_SEGS + 2];
+    bool submitted = false;
 
-    uint64_t delta = virtio_poll_virtq_irq(&disk_ctx->virtio_requestq, &disk_ctx->virtio_irq_ctx);
-    (void)delta;
+    while (disk_ctx->pending != NULL) {
 
-    // TODO: Necessary delay for some file reads. Not sure what the underlying problem is
-    for (volatile int i = 0; i < 100000; i++);
+        // Take the longest run of requests of the same type
+        // covering adjacent sectors
+        blk_req_t* first_req = disk_ctx->pending;
 
-    memcpy(buffer, read_buffers[0].ptr, len);
+        // A flush only covers writes that have completed
+        if (disk_ctx->flush_inflight ||
+            (first_req->type == VIRTIO_BLK_T_FLUSH && disk_ctx->num_inflight > 0)) {
+            break;
+        }
 
-    virtio_return_buffer(&disk_ctx->virtio_requestq, write_buffers[0].ptr);
-    virtio_return_buffer(&disk_ctx->virtio_requestq, read_buffers[0].ptr);
-    virtio_return_buffer(&disk_ctx->virtio_requestq, read_buffers[1].ptr);
+        blk_req_t* last_req = first_req;
+        uint64_t num_reqs = 1;
+        uint64_t end_sector = first_req->sector + (first_req->len / VIRTIO_BLK_SECTOR_SIZE);
+
+        while (last_req->next != NULL &&
+               num_reqs < disk_ctx->max_segs &&
+               last_req->next->type == first_req->type &&
+               last_req->next->sector == end_sector &&
+               first_req->len > 0) {
+            last_req = last_req->next;
+            end_sector += last_req->len / VIRTIO_BLK_SECTOR_SIZE;
+            num_reqs++;
+        }
+
+        uint64_t num_segs = (first_req->len > 0 ? num_reqs : 0) + 2;
+        if (num_segs > queue_ctx->num_free) {
+            break;
+        }
+
+        virtio_blk_req_header_t* header;
+        virtio_blk_req_status_t* status;
+        if (!virtio_get_buffer(queue_ctx, sizeof(virtio_blk_req_header_t), (uintptr_t*)&header)) {
+            break;
+        }
+        if (!virtio_get_buffer(queue_ctx, sizeof(virtio_blk_req_status_t), (uintptr_t*)&status)) {
+            virtio_return_buffer(queue_ctx, header);
+            break;
+        }
+
+        header->type = first_req->type;
+        header->res = 0;
+        header->sector = first_req->sector;
+        status->status = 0xFF;
+
+        segs[0].phy = virtio_buffer_phy(queue_ctx, header);
+        segs[0].len = sizeof(virtio_blk_req_header_t);
+        segs[0].device_write = false;
+
+        uint64_t seg_idx = 1;
+        if (first_req->len > 0) {
+            for (blk_req_t* req = first_req; req != last_req->next; req = req->next) {
+                segs[seg_idx].phy = req->phy;
+                segs[seg_idx].len = req->len;
+                segs[seg_idx].device_write = req->type == VIRTIO_BLK_T_IN;
+                seg_idx++;
+            }
+        }
+
+        segs[seg_idx].phy = virtio_buffer_phy(queue_ctx, status);
+        segs[seg_idx].len = sizeof(virtio_blk_req_status_t);
+        segs[seg_idx].device_write = true;
+
+        int64_t head_idx = virtio_virtq_submit(queue_ctx, segs, num_segs);
+        ASSERT(head_idx >= 0);
+
+        disk_ctx->pending = last_req->next;
+        last_req->next = NULL;
+
+        blk_inflight_t* inflight = &disk_ctx->inflight[head_idx];
+        ASSERT(inflight->reqs == NULL);
+        inflight->reqs = first_req;
+        inflight->header = header;
+        inflight->status = status;
+        disk_ctx->num_inflight++;
+        disk_ctx->flush_inflight = first_req->type == VIRTIO_BLK_T_FLUSH;
+
+        submitted = true;
+    }
+
+    if (submitted) {
+        virtio_virtq_notify(disk_ctx->pci_device, queue_ctx);
+    }
 }
 
-static void write_blk_device(blk_disk_ctx_t* disk_ctx, uint64_t sector, void* buffer, uint64_t len) {
+/*
+ * Complete every request the device has finished with. Completions are
+ * matched to their requests by the head descriptor in the used ring
+ */
+static void virtio_blk_reap(blk_disk_ctx_t* disk_ctx) {
 
-    pci_device_ctx_t* pci_ctx = disk_ctx->pci_device;
-    virtio_virtq_buffer_t write_buffers[2] = {0};
-    virtio_virtq_buffer_t read_buffers[1] = {0};
+    virtio_virtq_ctx_t* queue_ctx = &disk_ctx->virtio_requestq;
+    uint16_t head_idx;
 
-    bool get_ok;
-    get_ok = virtio_get_buffer(&disk_ctx->virtio_requestq, sizeof(virtio_blk_req_header_t), (uintptr_t*)&write_buffers[0].ptr);
-    ASSERT(get_ok);
-    write_buffers[0].len = sizeof(virtio_blk_req_header_t);
+    while (virtio_virtq_next_used(queue_ctx, &head_idx, NULL)) {
+        blk_inflight_t* inflight = &disk_ctx->inflight[head_idx];
+        ASSERT(inflight->reqs != NULL);
 
-    virtio_blk_req_header_t* blk_req_header = write_buffers[0].ptr;
-    blk_req_header->type = VIRTIO_BLK_T_OUT;
-    blk_req_header->res = 0;
-    blk_req_header->sector = sector;
+        uint8_t status = ((virtio_blk_req_status_t*)inflight->status)->status;
 
-    get_ok = virtio_get_buffer(&disk_ctx->virtio_requestq, len, (uintptr_t*)&write_buffers[1].ptr);
-    ASSERT(get_ok);
-    write_buffers[1].len = len;
-    memcpy(write_buffers[1].ptr, buffer, len);
+        blk_req_t* req = inflight->reqs;
+        if (req->type == VIRTIO_BLK_T_FLUSH) {
+            disk_ctx->flush_inflight = false;
+        }
+        while (req != NULL) {
+            // The owner may release the request once it is done
+            blk_req_t* next_req = req->next;
+            req->next = NULL;
+            req->status = status;
+            req->done = true;
+            req = next_req;
+        }
 
-    get_ok = virtio_get_buffer(&disk_ctx->virtio_requestq, sizeof(virtio_blk_req_status_t), (uintptr_t*)&read_buffers[0].ptr);
-    ASSERT(get_ok);
-    read_buffers[0].len = sizeof(virtio_blk_req_status_t);
+        virtio_return_buffer(queue_ctx, inflight->header);
+        virtio_return_buffer(queue_ctx, inflight->status);
+        inflight->reqs = NULL;
+        ASSERT(disk_ctx->num_inflight > 0);
+        disk_ctx->num_inflight--;
+    }
+}
+
+/*
+ * Queue a batch of requests and wait for all of them to complete.
+ * Returns the number of requests that failed
+ */
+static uint64_t virtio_blk_run_reqs(blk_disk_ctx_t* disk_ctx, blk_req_t* reqs, uint64_t num_reqs) {
 
-    virtio_virtq_send(&disk_ctx->virtio_requestq, write_buffers, 2,
-                      read_buffers, 1);
+    for (uint64_t idx = 0; idx < num_reqs; idx++) {
+        virtio_blk_queue_req(disk_ctx, &reqs[idx]);
+    }
+
+    while (true) {
+        // Completions free descriptors for more pending requests. Any
+        // task waiting on the queue may complete another's requests
+        virtio_blk_reap(disk_ctx);
+        virtio_blk_submit(disk_ctx);
+
+        bool all_done = true;
+        for (uint64_t idx = 0; idx < num_reqs; idx++) {
+            if (!reqs[idx].done) {
+                all_done = false;
+                break;
+            }
+        }
+        if (all_done) {
+            break;
+        }
 
-    virtio_virtq_notify(pci_ctx, &disk_ctx->virtio_requestq);
+        virtio_wait_virtq_used(&disk_ctx->virtio_requestq, &disk_ctx->virtio_irq_ctx);
+    }
 
-    virtio_poll_virtq_irq(&disk_ctx->virtio_requestq, &disk_ctx->virtio_irq_ctx);
-    //virtio_poll_virtq(&disk_ctx->virtio_requestq, true);
+    uint64_t num_failed = 0;
+    for (uint64_t idx = 0; idx < num_reqs; idx++) {
+        if (reqs[idx].status != VIRTIO_BLK_S_OK) {
+            console_log(LOG_WARN, "%s: Request %u at sector %u failed: %u",
+                        disk_ctx->name, reqs[idx].type, reqs[idx].sector, reqs[idx].status);
+            num_failed++;
+        }
+    }
 
-    virtio_return_buffer(&disk_ctx->virtio_requestq, write_buffers[0].ptr);
-    virtio_return_buffer(&disk_ctx->virtio_requestq, write_buffers[1].ptr);
-    virtio_return_buffer(&disk_ctx->virtio_requestq, read_buffers[0].ptr);
+    return num_failed;
 }
 
 /*
@@ -259,29 +447,77 @@ static void print_blk_device(pci_device_ctx_t* pci_ctx) {
 }
 */
 
-static bool virtio_blk_populate_virt_cache(void* ctx, uintptr_t addr, memcache_phy_entry_t* new_entry) {
+/*
+ * Build one request per cache page. The last page of a disk whose size
+ * is not a multiple of the page size is only partly on the device.
+ * Returns -1 if any of the requests failed
+ */
+static int64_t virtio_blk_page_io(blk_disk_ctx_t* disk_ctx, uint32_t type,
+                               bcache_page_t** pages, uint64_t num_pages) {
+
+    uint64_t disk_size = disk_ctx->device_config.capacity * VIRTIO_BLK_SECTOR_SIZE;
+
+    blk_req_t* reqs = vmalloc(num_pages * sizeof(blk_req_t));
+    ASSERT(reqs != NULL);
+
+    for (uint64_t idx = 0; idx < num_pages; idx++) {
+        uint64_t offset = pages[idx]->key.page_idx * BCACHE_PAGE_SIZE;
+        ASSERT(offset < disk_size);
+
+        uint64_t len = BCACHE_PAGE_SIZE;
+        if (offset + len > disk_size) {
+            len = disk_size - offset;
+            if (type == VIRTIO_BLK_T_IN) {
+                memset(&pages[idx]->data[len], 0, BCACHE_PAGE_SIZE - len);
+            }
+        }
 
-    blk_disk_ctx_t* disk_ctx = ctx;
+        reqs[idx].type = type;
+        reqs[idx].sector = offset / VIRTIO_BLK_SECTOR_SIZE;
+        reqs[idx].phy = pages[idx]->phy;
+        reqs[idx].len = len;
+    }
+
+    uint64_t num_failed = virtio_blk_run_reqs(disk_ctx, reqs, num_pages);
 
-    void* phy_addr = kmalloc_phy(VMEM_PAGE_SIZE);
+    vfree(reqs);
+
+    return num_failed > 0 ? -1 : 0;
+}
+
+static int64_t virtio_blk_read_pages(void* ctx, bcache_page_t** pages, uint64_t num_pages) {
+    return virtio_blk_page_io(ctx, VIRTIO_BLK_T_IN, pages, num_pages);
+}
+
+static int64_t virtio_blk_write_pages(void* ctx, bcache_page_t** pages, uint64_t num_pages) {
+    return virtio_blk_page_io(ctx, VIRTIO_BLK_T_OUT, pages, num_pages);
+}
 
-    uintptr_t addr_page = PAGE_FLOOR(addr);
-    ASSERT(addr_page >= (uintptr_t)disk_ctx->cache_virtaddr);
-    uint64_t offset = addr_page - (uintptr_t)disk_ctx->cache_virtaddr;
-    uint64_t sector = offset / 512;
-    ASSERT(sector <= disk_ctx->device_config.capacity);
+/*
+ * Wait for every completed write to reach stable storage. Called after
+ * the cache has written back the dirty pages
+ */
+static int64_t virtio_blk_flush(void* ctx) {
 
-    read_blk_device(disk_ctx, sector, PHY_TO_KSPACE_PTR(phy_addr), VMEM_PAGE_SIZE);
+    blk_disk_ctx_t* disk_ctx = ctx;
 
-    new_entry->offset = offset;
-    new_entry->phy_addr = (uintptr_t)phy_addr;
-    new_entry->len = VMEM_PAGE_SIZE;
+    if (!disk_ctx->has_flush) {
+        return 0;
+    }
 
-    return true;
+    blk_req_t req = {
+        .type = VIRTIO_BLK_T_FLUSH,
+        .sector = 0,
+        .phy = 0,
+        .len = 0
+    };
+    return virtio_blk_run_reqs(disk_ctx, &req, 1) > 0 ? -1 : 0;
 }
 
-memcache_ops_t s_virtio_blk_memcache_ops = {
-    .populate_virt_fn = virtio_blk_populate_virt_cache
+static bcache_dev_ops_t s_virtio_blk_bcache_ops = {
+    .read_pages = virtio_blk_read_pages,
+    .write_pages = virtio_blk_write_pages,
+    .flush = virtio_blk_flush
 };
 
 static int64_t virtio_pci_blk_open_op(void* ctx, const char* path, const uint64_t flags, void** ctx_out, fd_ctx_t* fd_ctx) {
@@ -311,36 +547,22 @@ static int64_t virtio_pci_blk_read_op(void* ctx, uint8_t* buffer, const int64_t
     }
     int64_t read_size = size_left < size ? size_left : size;
 
-    // Map all necessary memory
-    uint64_t pos_page = PAGE_FLOOR(pos);
-    uint64_t read_max = pos + read_size;
-    bool updated_vm = false;
-    memory_entry_cache_t* mem_entry = NULL;
-    while (pos_page < read_max) {
-        uint64_t par_el1 = vmem_check_address((uintptr_t)blk_ctx->cache_virtaddr + pos_page);
-        if ((par_el1 & 1) == 1) {
-            // Translation failed. Read in page
-            mem_entry = (memory_entry_cache_t*)memspace_get_entry_at_addr_kernel(blk_ctx->cache_virtaddr);
-            ASSERT(mem_entry != NULL && mem_entry->type == MEMSPACE_CACHE);
-
-            memcache_phy_entry_t* new_phy_entry = vmalloc(sizeof(memcache_phy_entry_t));
-            bool ok = virtio_blk_populate_virt_cache(blk_ctx, (uintptr_t)blk_ctx->cache_virtaddr + pos_page, new_phy_entry);
-            ASSERT(ok);
-
-            llist_append_ptr(mem_entry->phy_addr_list, new_phy_entry);
-            updated_vm = true;
-        }
+    uint64_t ra_start;
+    uint64_t ra_len = bcache_ra_update(&blk_ctx->ra, pos, read_size, &ra_start);
 
-        pos_page += VMEM_PAGE_SIZE;
+    read_size = bcache_read(blk_ctx->bcache, pos, buffer, read_size);
+    if (read_size < 0) {
+        return -1;
     }
 
-    if (updated_vm) {
-        memspace_update_kernel_cache(mem_entry);
-        memspace_update_kernel_vmem();
+    // Queue the next window of a sequential reader, which is read
+    // without holding up this read
+    if (ra_len > 0) {
+        uint64_t ra_page = ra_start / BCACHE_PAGE_SIZE;
+        bcache_readahead(blk_ctx->bcache, ra_page,
+                         PAGE_CEIL(ra_start + ra_len) / BCACHE_PAGE_SIZE - ra_page);
     }
 
-    memcpy(buffer, blk_ctx->cache_virtaddr + pos, read_size);
-
     blk_ctx->device_pos += read_size;
 
     return read_size;
@@ -363,41 +585,10 @@ static int64_t virtio_pci_blk_write_op(void* ctx, const uint8_t* buffer, const i
     }
     int64_t write_size = size_left < size ? size_left : size;
 
-    // Map all necessary memory
-    uint64_t pos_page = PAGE_FLOOR(pos);
-    uint64_t write_max = pos + write_size;
-    bool updated_vm = false;
-    memory_entry_cache_t* mem_entry = NULL;
-    while (pos_page < write_max) {
-        uint64_t par_el1 = vmem_check_address((uintptr_t)blk_ctx->cache_virtaddr + pos_page);
-        if ((par_el1 & 1) == 1) {
-            // Translation failed. Read in page
-            mem_entry = (memory_entry_cache_t*)memspace_get_entry_at_addr_kernel(blk_ctx->cache_virtaddr);
-            ASSERT(mem_entry != NULL && mem_entry->type == MEMSPACE_CACHE);
-
-            memcache_phy_entry_t* new_phy_entry = vmalloc(sizeof(memcache_phy_entry_t));
-            bool ok = virtio_blk_populate_virt_cache(blk_ctx, (uintptr_t)blk_ctx->cache_virtaddr + pos_page, new_phy_entry);
-            ASSERT(ok);
-
-            llist_append_ptr(mem_entry->phy_addr_list, new_phy_entry);
-            updated_vm = true;
-        }
-
-        pos_page += VMEM_PAGE_SIZE;
-    }
-
-    if (updated_vm) {
-        memspace_update_kernel_cache(mem_entry);
-        memspace_update_kernel_vmem();
-    }
-
-    memcpy(blk_ctx->cache_virtaddr + pos, buffer, write_size);
-
-    uint64_t end_pos = blk_ctx->device_pos + write_size;
-
-    for (uint64_t write_page = PAGE_FLOOR(pos); write_page < end_pos; write_page += VMEM_PAGE_SIZE) {
-        uint64_t write_sector = write_page / 512;
-        write_blk_device(blk_ctx, write_sector, blk_ctx->cache_virtaddr + write_page, VMEM_PAGE_SIZE);
+    // The data reaches the disk with the next cache writeback
+    write_size = bcache_write(blk_ctx->bcache, pos, buffer, write_size);
+    if (write_size < 0) {
+        return -1;
     }
 
     blk_ctx->device_pos += write_size;
@@ -435,6 +626,17 @@ static int64_t virtio_pci_blk_ioctl_op(void* ctx, const uint64_t ioctl, const ui
         case BLK_IOCTL_SIZE:
             ret = blk_ctx->device_config.capacity;
             break;
+        case IOCTL_FSYNC:
+            ret = bcache_fsync_dev(blk_ctx->bcache);
+            break;
+        case BLK_IOCTL_GET_BCACHE:
+            if (arg_count != 1) {
+                ret = -1;
+            } else {
+                *(bcache_dev_t**)args[0] = blk_ctx->bcache;
+                ret = 0;
+            }
+            break;
         default:
             ret = -1;
     }
@@ -454,6 +656,7 @@ static void virtio_pci_blk_late_init(void* ctx) {
 
     blk_disk_ctx_t* disk_ctx = vmalloc(sizeof(blk_disk_ctx_t));
     disk_ctx->device_pos = 0;
+    memset(&disk_ctx->ra, 0, sizeof(bcache_ra_t));
     disk_ctx->pci_device = ctx;
 
     init_blk_device(disk_ctx);
@@ -461,27 +664,13 @@ static void virtio_pci_blk_late_init(void* ctx) {
     strncpy(disk_ctx->name, "virtio_disk0", MAX_SYS_DEVICE_NAME_LEN);
     disk_ctx->name[11] = '0' + (s_disk_counter % 10);
 
+    uint64_t len_page = PAGE_CEIL(disk_ctx->device_config.capacity * VIRTIO_BLK_SECTOR_SIZE);
+    disk_ctx->bcache = bcache_register_dev(disk_ctx->name, &s_virtio_blk_bcache_ops,
+                                           disk_ctx, len_page / BCACHE_PAGE_SIZE);
+
     sys_device_register(&s_bulk_file_ops, virtio_pci_blk_open_op, disk_ctx, disk_ctx->name);
 
     llist_append_ptr(s_blk_disks, disk_ctx);
-
-    uint64_t len_page = PAGE_CEIL(disk_ctx->device_config.capacity * 512);
-    disk_ctx->cache_virtaddr = memspace_alloc_kernel_virt(len_page, VMEM_PAGE_SIZE);
-    memory_entry_cache_t blk_cache_entry = {
-        .start = (uintptr_t)disk_ctx->cache_virtaddr,
-        .end = (uintptr_t)disk_ctx->cache_virtaddr + len_page,
-        .type = MEMSPACE_CACHE,
-        .flags = MEMSPACE_FLAG_PERM_KRW,
-        .phy_addr_list = NULL,
-        .cacheops_ptr = &s_virtio_blk_memcache_ops,
-        .cacheops_ctx = disk_ctx,
-        .res = {0}
-    };
-    blk_cache_entry.phy_addr_list = llist_create();
-    memspace_add_entry_to_kernel_memory((memory_entry_t*)&blk_cache_entry);
-
-    memspace_update_kernel_vmem();
-
 }
 
 
@@ -12,6 +12,7 @@
 #include "kernel/fd.h"
 #include "kernel/sys_device.h"
 #include "kernel/task.h"
+#include "kernel/schedule.h"
 
 #include "include/k_select.h"
 
@@ -418,7 +419,8 @@ static void init_console_device(virtio_console_ctx_t* console_ctx) {
     send_control_message(console_ctx, 0, VIRTIO_CONSOLE_PORT_OPEN, 1);
 
     // Setup a kernel thread to monitor for receiveq messages
-    create_kernel_task(8192, virtio_pci_control_monitor_thread, console_ctx, "virtio-con-ctrlq");
+    uint64_t tid = create_kernel_task(8192, virtio_pci_control_monitor_thread, console_ctx, "virtio-con-ctrlq");
+    task_set_priority(get_task_for_tid(tid), TASK_PRIORITY_HIGH);
 
 }
 
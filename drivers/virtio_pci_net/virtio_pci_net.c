@@ -10,160 +10,574 @@
 #include "kernel/lib/vmalloc.h"
 #include "kernel/drivers.h"
 #include "kernel/task.h"
+#include "kernel/schedule.h"
+#include "kernel/smp.h"
 
 #include "kernel/net/net.h"
 #include "kernel/net/nic_ops.h"
+#include "kernel/net/rss.h"
+
+#include "stdlib/bitutils.h"
+#include "stdlib/printf.h"
+
+// Receive buffers stay posted to the device and are handed up the stack
+// in place. Each goes back on the ring once its packet is released
+#define VIRTIO_NET_RX_QUEUE_SIZE 64
+#define VIRTIO_NET_RX_BUFFER_SIZE 2048
+
+// Sent frames stay on the ring until the next send finds them completed
+#define VIRTIO_NET_TX_QUEUE_SIZE 64
+#define VIRTIO_NET_TX_BUFFER_SIZE 2048
+
+// Room for large TCP sends handed to the device in one buffer
+#define VIRTIO_NET_TSO_BUFFER_SIZE (64 * 1024)
+#define VIRTIO_NET_TSO_BUFFERS 4
+
+// Places the header so that the frame following it is 8 byte aligned
+#define VIRTIO_NET_RX_PAD (8 - (sizeof(virtio_net_hdr_t) % 8))
+
+// Each queue pair has its own vector and receive task
+#define VIRTIO_NET_MAX_QUEUE_PAIRS 4
+
+// Entries in the RSS indirection table, a power of two
+#define VIRTIO_NET_RSS_TABLE_LEN 128
+
+#define VIRTIO_NET_CTRL_QUEUE_SIZE 8
+#define VIRTIO_NET_CTRL_POOL_SIZE 4096
+
+struct virtio_net_queue_;
+struct virtio_pci_net_ctx_;
 
 typedef struct {
+    struct virtio_net_queue_* queue;
+    uint8_t* ptr;
+    net_packet_t* packet;
+} virtio_net_rx_buffer_t;
+
+typedef struct virtio_net_queue_ {
+    struct virtio_pci_net_ctx_* nic_ctx;
+    uint64_t idx;
+
+    virtio_virtq_ctx_t receiveq;
+    virtio_virtq_ctx_t transmitq;
+
+    // Both queues of the pair share one vector
+    virtio_virtq_shared_irq_ctx_t irq_ctx;
+
+    virtio_net_rx_buffer_t* rx_buffers;
+    virtio_net_rx_buffer_t** rx_posted;     /* Indexed by head descriptor */
+
+    net_send_buffer_t** tx_inflight;        /* Indexed by head descriptor */
+} virtio_net_queue_t;
+
+/**
+ * With VIRTIO_NET_F_MQ the device gets several receive and transmit
+ * queue pairs. If it also supports RSS, it is programmed to steer flows
+ * by the Toeplitz hash of their addresses and ports, otherwise it steers
+ * them itself. With RSS, frames are sent on the queue the device picks
+ * for the replies, found through the same indirection table, so each
+ * flow stays on one queue in both directions. Without it, frames are
+ * sent on the queue of the sending CPU
+ */
+typedef struct virtio_pci_net_ctx_ {
     pci_device_ctx_t* pci_ctx;
+    uint64_t features;
 
-    virtio_virtq_ctx_t receiveq1;
-    virtio_virtq_ctx_t transmitq1;
+    virtio_net_queue_t queues[VIRTIO_NET_MAX_QUEUE_PAIRS];
+    uint64_t num_queues;
 
-    virtio_virtq_shared_irq_ctx_t receiveq1_irq_ctx;
+    virtio_virtq_ctx_t controlq;            /* Only with VIRTIO_NET_F_MQ */
+
+    bool has_rss;                           /* The device was given an RSS config */
+    uint32_t rss_hash_types;                /* NET_RSS_HASH_* */
+    uint64_t rss_table_mask;
+    uint16_t rss_table[VIRTIO_NET_RSS_TABLE_LEN];
 
     net_dev_t net_dev;
 
 } virtio_pci_net_ctx_t;
 
 static void virtio_pci_net_device_irq_fn(uint32_t intid, void* ctx) {
-    virtio_pci_net_ctx_t* net_ctx = ctx;
-    pci_interrupt_clear_pending(net_ctx->pci_ctx, intid);
+    virtio_net_queue_t* queue = ctx;
+    pci_interrupt_clear_pending(queue->nic_ctx->pci_ctx, intid);
 
-    if (net_ctx->receiveq1_irq_ctx.intid == intid) {
-        virtio_handle_irq(&net_ctx->receiveq1_irq_ctx);
+    if (queue->irq_ctx.intid == intid) {
+        virtio_handle_irq(&queue->irq_ctx);
     }
 }
 
-static void virtio_net_recv_thread(void* ctx) {
+/*
+ * Make a receive buffer available to the device. The caller notifies
+ */
+static void virtio_net_post_rx_buffer(virtio_net_queue_t* queue, virtio_net_rx_buffer_t* rx_buffer) {
 
-    virtio_pci_net_ctx_t* net_ctx = ctx;
+    virtio_virtq_ctx_t* queue_ctx = &queue->receiveq;
 
-    const uint64_t buf_size = NET_MTU + sizeof(virtio_net_hdr_t);
+    virtio_virtq_seg_t seg = {
+        .phy = virtio_buffer_phy(queue_ctx, rx_buffer->ptr + VIRTIO_NET_RX_PAD),
+        .len = NET_MTU + sizeof(virtio_net_hdr_t),
+        .device_write = true
+    };
 
-    virtio_virtq_buffer_t* recv_buffer = vmalloc(sizeof(virtio_virtq_buffer_t));
-    bool status;
-    status = virtio_get_buffer(&net_ctx->receiveq1, buf_size, (uintptr_t*)&recv_buffer->ptr);
-    ASSERT(status);
-    recv_buffer->len = buf_size;
+    // There are never more buffers than descriptors
+    int64_t head_idx = virtio_virtq_submit(queue_ctx, &seg, 1);
+    ASSERT(head_idx >= 0);
+    ASSERT(queue->rx_posted[head_idx] == NULL);
 
-    virtio_virtq_send(&net_ctx->receiveq1,
-                      NULL, 0,
-                      recv_buffer, 1);
-    virtio_virtq_notify(net_ctx->pci_ctx, &net_ctx->receiveq1);
+    queue->rx_posted[head_idx] = rx_buffer;
+}
 
+static void virtio_net_init_rx_buffers(virtio_net_queue_t* queue) {
 
-    while (1) {
+    uint64_t num_buffers = queue->receiveq.queue_size;
 
-        virtio_poll_virtq_irq(&net_ctx->receiveq1, &net_ctx->receiveq1_irq_ctx);
+    queue->rx_buffers = vmalloc(sizeof(virtio_net_rx_buffer_t) * num_buffers);
+    queue->rx_posted = vmalloc(sizeof(virtio_net_rx_buffer_t*) * num_buffers);
+    ASSERT(queue->rx_buffers != NULL && queue->rx_posted != NULL);
 
-        int64_t recv_len = virtio_get_last_used_elem(&net_ctx->receiveq1);
-        ASSERT(recv_len > 0);
+    for (uint64_t idx = 0; idx < num_buffers; idx++) {
+        queue->rx_posted[idx] = NULL;
+    }
 
-        net_packet_t* packet = vmalloc(sizeof(net_packet_t));
-        packet->dev = &net_ctx->net_dev;
-        packet->data = recv_buffer->ptr + sizeof(virtio_net_hdr_t);
-        packet->len = recv_len - sizeof(virtio_net_hdr_t);
-        packet->nic_pkt_ctx = recv_buffer;
+    for (uint64_t idx = 0; idx < num_buffers; idx++) {
+        virtio_net_rx_buffer_t* rx_buffer = &queue->rx_buffers[idx];
 
-        recv_buffer = vmalloc(sizeof(virtio_virtq_buffer_t));
-        status = virtio_get_buffer(&net_ctx->receiveq1, buf_size, (uintptr_t*)&recv_buffer->ptr);
+        bool status;
+        status = virtio_get_buffer(&queue->receiveq,
+                                   VIRTIO_NET_RX_PAD + NET_MTU + sizeof(virtio_net_hdr_t),
+                                   (uintptr_t*)&rx_buffer->ptr);
         ASSERT(status);
-        recv_buffer->len = buf_size;
 
-        virtio_virtq_send(&net_ctx->receiveq1,
-                        NULL, 0,
-                        recv_buffer, 1);
-        virtio_virtq_notify(net_ctx->pci_ctx, &net_ctx->receiveq1);
+        rx_buffer->queue = queue;
+        rx_buffer->packet = net_alloc_packet();
+        rx_buffer->packet->dev = &queue->nic_ctx->net_dev;
+        rx_buffer->packet->data = rx_buffer->ptr + VIRTIO_NET_RX_PAD + sizeof(virtio_net_hdr_t);
+        rx_buffer->packet->nic_pkt_ctx = rx_buffer;
+
+        virtio_net_post_rx_buffer(queue, rx_buffer);
+    }
+
+    virtio_virtq_notify(queue->nic_ctx->pci_ctx, &queue->receiveq);
+}
+
+/*
+ * Each receive queue has its own task, which runs the packets through
+ * the stack itself instead of handing them to the net task
+ */
+static void virtio_net_recv_thread(void* ctx) {
+
+    virtio_net_queue_t* queue = ctx;
+    virtio_virtq_ctx_t* queue_ctx = &queue->receiveq;
 
-        net_recv_packet(packet);
+    while (1) {
+
+        virtio_wait_virtq_used(queue_ctx, &queue->irq_ctx);
+
+        uint16_t head_idx;
+        uint32_t recv_len;
+        bool reposted = false;
+        while (virtio_virtq_next_used(queue_ctx, &head_idx, &recv_len)) {
+            virtio_net_rx_buffer_t* rx_buffer = queue->rx_posted[head_idx];
+            ASSERT(rx_buffer != NULL);
+            queue->rx_posted[head_idx] = NULL;
+
+            if (recv_len <= sizeof(virtio_net_hdr_t)) {
+                virtio_net_post_rx_buffer(queue, rx_buffer);
+                reposted = true;
+                continue;
+            }
+
+            // The stack holds the buffer until the packet is released
+            net_packet_t* packet = rx_buffer->packet;
+            packet->len = recv_len - sizeof(virtio_net_hdr_t);
+            packet->ref_count = 1;
+
+            // A frame that still needs its checksum came from the host
+            // itself, so it can't have been corrupted on the wire
+            virtio_net_hdr_t* recv_header = (virtio_net_hdr_t*)(rx_buffer->ptr + VIRTIO_NET_RX_PAD);
+            packet->csum_valid = (recv_header->flags & (VIRTIO_NET_HDR_F_DATA_VALID |
+                                                        VIRTIO_NET_HDR_F_NEEDS_CSUM)) != 0;
+
+            net_input_packet(packet);
+        }
+
+        if (reposted) {
+            virtio_virtq_notify(queue->nic_ctx->pci_ctx, queue_ctx);
+        }
     }
 
 }
 
 void virtio_pci_net_nic_return_packet(struct net_packet* packet) {
-    // TODO: Need to allocate packets on the heap
-    ASSERT(false);
 
-    virtio_virtq_buffer_t* virtq_buffer = packet->nic_pkt_ctx;
-    net_dev_t* net_dev = packet->dev;
-    virtio_pci_net_ctx_t* nic_ctx = net_dev->nic_ctx;
+    virtio_net_rx_buffer_t* rx_buffer = packet->nic_pkt_ctx;
+    virtio_net_queue_t* queue = rx_buffer->queue;
 
-    virtio_return_buffer(&nic_ctx->receiveq1, virtq_buffer->ptr);
-    (void)net_dev;
+    virtio_net_post_rx_buffer(queue, rx_buffer);
+    virtio_virtq_notify(queue->nic_ctx->pci_ctx, &queue->receiveq);
 }
 
 int64_t virtio_pci_net_nic_ioctl(void* ctx, const uint64_t ioctl, const uint64_t* args, const uint64_t arg_count) {
     return -1;
 }
 
-net_send_buffer_t* virtio_pci_net_nic_get_buffer(net_dev_t* net_dev, const int64_t size, const uint64_t flags) {
+/*
+ * Send buffers are allocated before it is known which queue sends them,
+ * so they all come from the first transmit queue's pool
+ */
+static virtio_virtq_ctx_t* virtio_net_tx_pool(virtio_pci_net_ctx_t* nic_ctx) {
+    return &nic_ctx->queues[0].transmitq;
+}
 
+void virtio_pci_net_nic_free_buffer(net_dev_t* net_dev, net_send_buffer_t* send_buffer) {
     virtio_pci_net_ctx_t* nic_ctx = net_dev->nic_ctx;
+    virtio_return_buffer(virtio_net_tx_pool(nic_ctx), send_buffer->nic_buffer_ctx);
 
-    net_send_buffer_t* send_buffer = vmalloc(sizeof(net_send_buffer_t));
+    vfree(send_buffer);
+}
+
+/*
+ * Free every frame the device has finished sending. Completions are only
+ * reaped here, from the senders, so the device is never waited on while
+ * there is room in the ring
+ */
+static void virtio_net_reclaim_tx(virtio_net_queue_t* queue) {
+
+    uint16_t head_idx;
+    while (virtio_virtq_next_used(&queue->transmitq, &head_idx, NULL)) {
+        net_send_buffer_t* send_buffer = queue->tx_inflight[head_idx];
+        ASSERT(send_buffer != NULL);
+        queue->tx_inflight[head_idx] = NULL;
+
+        virtio_pci_net_nic_free_buffer(&queue->nic_ctx->net_dev, send_buffer);
+    }
+}
 
-    virtio_virtq_buffer_t* virtq_send_buffer = vmalloc(sizeof(virtio_virtq_buffer_t));
-    bool get_ok;
-    get_ok = virtio_get_buffer(&nic_ctx->transmitq1, size + sizeof(virtio_net_hdr_t), (uintptr_t*)&virtq_send_buffer->ptr);
-    
-    if (!get_ok) {
-        console_log(LOG_WARN, "Net %s unable to allocate a buffer", net_dev->name);
-        vfree(send_buffer);
-        vfree(virtq_send_buffer);
-        return NULL;
+static void virtio_net_reclaim_all_tx(virtio_pci_net_ctx_t* nic_ctx) {
+    for (uint64_t idx = 0; idx < nic_ctx->num_queues; idx++) {
+        virtio_net_reclaim_tx(&nic_ctx->queues[idx]);
     }
+}
+
+/*
+ * Wait for the device to send at least one frame. The transmit queue only
+ * raises interrupts while someone waits on it
+ */
+static void virtio_net_wait_tx(virtio_net_queue_t* queue) {
+
+    volatile virtio_virtq_avail_t* virtq_avail = queue->transmitq.avail_ptr;
+
+    virtq_avail->flags &= ~VIRTQ_VAIL_F_NO_INTERRUPT;
+    MEM_DSB();
+
+    virtio_wait_virtq_used(&queue->transmitq, &queue->irq_ctx);
+
+    virtq_avail->flags |= VIRTQ_VAIL_F_NO_INTERRUPT;
+
+    virtio_net_reclaim_tx(queue);
+}
+
+net_send_buffer_t* virtio_pci_net_nic_get_buffer(net_dev_t* net_dev, const int64_t size, const uint64_t flags) {
+
+    virtio_pci_net_ctx_t* nic_ctx = net_dev->nic_ctx;
+
+    // Buffers of sent frames go back to the pool here
+    virtio_net_reclaim_all_tx(nic_ctx);
+
+    uint8_t* virtq_send_buffer;
+    while (!virtio_get_buffer(virtio_net_tx_pool(nic_ctx), size + sizeof(virtio_net_hdr_t), (uintptr_t*)&virtq_send_buffer)) {
+        // Only frames still on a ring can give memory back
+        virtio_net_queue_t* busy_queue = NULL;
+        for (uint64_t idx = 0; idx < nic_ctx->num_queues; idx++) {
+            virtio_virtq_ctx_t* transmitq = &nic_ctx->queues[idx].transmitq;
+            if (transmitq->num_free < transmitq->queue_size) {
+                busy_queue = &nic_ctx->queues[idx];
+                break;
+            }
+        }
+
+        if (busy_queue == NULL) {
+            console_log(LOG_WARN, "Net %s unable to allocate a buffer", net_dev->name);
+            return NULL;
+        }
+        virtio_net_wait_tx(busy_queue);
+    }
+
+    net_send_buffer_t* send_buffer = vmalloc(sizeof(net_send_buffer_t));
 
     send_buffer->dev = net_dev;
-    send_buffer->data = virtq_send_buffer->ptr + sizeof(virtio_net_hdr_t);
+    send_buffer->data = virtq_send_buffer + sizeof(virtio_net_hdr_t);
     send_buffer->len = size;
     send_buffer->nic_buffer_ctx = virtq_send_buffer;
+    send_buffer->csum_start = 0;
+    send_buffer->csum_offset = 0;
+    send_buffer->gso_size = 0;
+    send_buffer->hdr_len = 0;
 
     return send_buffer;
 }
 
-void virtio_pci_net_nic_free_buffer(net_dev_t* net_dev, net_send_buffer_t* send_buffer) {
-    virtio_pci_net_ctx_t* nic_ctx = net_dev->nic_ctx;
-    virtio_virtq_buffer_t* virtq_send_buffer = send_buffer->nic_buffer_ctx;
-    virtio_return_buffer(&nic_ctx->transmitq1, virtq_send_buffer->ptr);
-}
+static virtio_net_queue_t* virtio_net_tx_queue(virtio_pci_net_ctx_t* nic_ctx, net_send_buffer_t* send_buffer) {
 
-void virtio_pci_net_nic_send_buffer(net_dev_t* net_dev, net_send_buffer_t* send_buffer) {
+    if (nic_ctx->num_queues == 1) {
+        return &nic_ctx->queues[0];
+    }
 
-    virtio_pci_net_ctx_t* nic_ctx = net_dev->nic_ctx;
-    virtio_virtq_buffer_t* virtq_send_buffer = send_buffer->nic_buffer_ctx;
+    if (!nic_ctx->has_rss) {
+        return &nic_ctx->queues[smp_cpu_idx() % nic_ctx->num_queues];
+    }
 
-    virtio_net_hdr_t* send_header = virtq_send_buffer->ptr;
+    // Receive hashes the tuple of the frames coming back
+    uint32_t hash;
+    if (!net_rss_hash_frame(send_buffer->data, send_buffer->len,
+                            nic_ctx->rss_hash_types, true, &hash)) {
+        return &nic_ctx->queues[0];
+    }
+    return &nic_ctx->queues[nic_ctx->rss_table[hash & nic_ctx->rss_table_mask]];
+}
+
+/*
+ * Put a frame on the transmit ring without notifying the device. Waits
+ * for the device only if the ring is full
+ */
+static void virtio_net_queue_tx(virtio_net_queue_t* queue, net_send_buffer_t* send_buffer) {
+
+    virtio_pci_net_ctx_t* nic_ctx = queue->nic_ctx;
+    virtio_net_hdr_t* send_header = send_buffer->nic_buffer_ctx;
 
     send_header->flags = 0;
-    send_header->gso_type = 0;
+    send_header->gso_type = VIRTIO_NET_HDR_GSO_NONE;
     send_header->hdr_len = 0;
     send_header->gso_size = 0;
     send_header->csum_start = 0;
     send_header->csum_offset = 0;
     send_header->num_buffers = 0;
 
-    virtq_send_buffer->len = send_buffer->len + sizeof(virtio_net_hdr_t);
+    if (send_buffer->csum_start != 0) {
+        send_header->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        send_header->csum_start = send_buffer->csum_start;
+        send_header->csum_offset = send_buffer->csum_offset;
+    }
+
+    if (send_buffer->gso_size != 0) {
+        send_header->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        send_header->hdr_len = send_buffer->hdr_len;
+        send_header->gso_size = send_buffer->gso_size;
+    }
 
-    //console_log(LOG_DEBUG, "Net Transmit packet of size %d", send_buffer->len);
+    virtio_virtq_seg_t seg = {
+        .phy = virtio_buffer_phy(virtio_net_tx_pool(nic_ctx), send_header),
+        .len = send_buffer->len + sizeof(virtio_net_hdr_t),
+        .device_write = false
+    };
+
+    int64_t head_idx;
+    while ((head_idx = virtio_virtq_submit(&queue->transmitq, &seg, 1)) < 0) {
+        // Make sure the device knows about everything queued so far
+        virtio_virtq_notify(nic_ctx->pci_ctx, &queue->transmitq);
+        virtio_net_wait_tx(queue);
+    }
 
-    virtio_virtq_send(&nic_ctx->transmitq1, virtq_send_buffer, 1, NULL, 0);
-    virtio_virtq_notify(nic_ctx->pci_ctx, &nic_ctx->transmitq1);
+    ASSERT(queue->tx_inflight[head_idx] == NULL);
+    queue->tx_inflight[head_idx] = send_buffer;
+}
 
-    virtio_poll_virtq(&nic_ctx->transmitq1, true);
+void virtio_pci_net_nic_send_buffers(net_dev_t* net_dev, net_send_buffer_t** send_buffers, uint64_t num_buffers) {
 
-    virtio_pci_net_nic_free_buffer(net_dev, send_buffer);
+    virtio_pci_net_ctx_t* nic_ctx = net_dev->nic_ctx;
+
+    virtio_net_reclaim_all_tx(nic_ctx);
+
+    uint64_t queues_used = 0;
+    for (uint64_t idx = 0; idx < num_buffers; idx++) {
+        virtio_net_queue_t* queue = virtio_net_tx_queue(nic_ctx, send_buffers[idx]);
+        virtio_net_queue_tx(queue, send_buffers[idx]);
+        queues_used |= BIT(queue->idx);
+    }
+
+    for (uint64_t idx = 0; idx < nic_ctx->num_queues; idx++) {
+        if (queues_used & BIT(idx)) {
+            virtio_virtq_notify(nic_ctx->pci_ctx, &nic_ctx->queues[idx].transmitq);
+        }
+    }
+}
+
+void virtio_pci_net_nic_send_buffer(net_dev_t* net_dev, net_send_buffer_t* send_buffer) {
+    virtio_pci_net_nic_send_buffers(net_dev, &send_buffer, 1);
 }
 
 
 static nic_ops_t s_nic_ops = {
     .get_buffer = virtio_pci_net_nic_get_buffer,
     .send_buffer = virtio_pci_net_nic_send_buffer,
+    .send_buffers = virtio_pci_net_nic_send_buffers,
     .free_buffer = virtio_pci_net_nic_free_buffer,
     .return_packet = virtio_pci_net_nic_return_packet,
     .ioctl = virtio_pci_net_nic_ioctl
 };
 
+/*
+ * Send a command on the control queue and wait for the device to
+ * acknowledge it. Only used during setup, so the device is polled
+ */
+static bool virtio_net_ctrl_cmd(virtio_pci_net_ctx_t* nic_ctx, uint8_t class, uint8_t command,
+                                const void* data, uint64_t len) {
+
+    virtio_virtq_ctx_t* queue_ctx = &nic_ctx->controlq;
+
+    uint8_t* cmd;
+    volatile uint8_t* ack;
+    if (!virtio_get_buffer(queue_ctx, sizeof(virtio_net_ctrl_hdr_t) + len, (uintptr_t*)&cmd)) {
+        return false;
+    }
+    if (!virtio_get_buffer(queue_ctx, sizeof(uint8_t), (uintptr_t*)&ack)) {
+        virtio_return_buffer(queue_ctx, cmd);
+        return false;
+    }
+
+    virtio_net_ctrl_hdr_t* hdr = (virtio_net_ctrl_hdr_t*)cmd;
+    hdr->class = class;
+    hdr->command = command;
+    memcpy(cmd + sizeof(virtio_net_ctrl_hdr_t), data, len);
+    *ack = VIRTIO_NET_ERR;
+
+    virtio_virtq_seg_t segs[2] = {
+        {
+            .phy = virtio_buffer_phy(queue_ctx, cmd),
+            .len = sizeof(virtio_net_ctrl_hdr_t) + len,
+            .device_write = false
+        },
+        {
+            .phy = virtio_buffer_phy(queue_ctx, (void*)ack),
+            .len = sizeof(uint8_t),
+            .device_write = true
+        }
+    };
+
+    int64_t head_idx = virtio_virtq_submit(queue_ctx, segs, 2);
+    ASSERT(head_idx >= 0);
+    virtio_virtq_notify(nic_ctx->pci_ctx, queue_ctx);
+
+    uint16_t used_idx;
+    while (!virtio_virtq_next_used(queue_ctx, &used_idx, NULL)) {
+    }
+    ASSERT(used_idx == head_idx);
+
+    bool ok = *ack == VIRTIO_NET_OK;
+
+    virtio_return_buffer(queue_ctx, cmd);
+    virtio_return_buffer(queue_ctx, (void*)ack);
+
+    return ok;
+}
+
+/*
+ * Tell the device how many queue pairs to use. With RSS the device is
+ * also given the hash key and an indirection table that spreads flows
+ * evenly over the receive queues
+ */
+static bool virtio_net_set_queues(virtio_pci_net_ctx_t* nic_ctx, virtio_net_config_t* net_cfg) {
+
+    uint16_t num_queues = nic_ctx->num_queues;
+
+    if (!(nic_ctx->features & (1UL << VIRTIO_NET_F_RSS)) ||
+        net_cfg->rss_max_key_size < NET_RSS_KEY_LEN) {
+        return virtio_net_ctrl_cmd(nic_ctx, VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET,
+                                   &num_queues, sizeof(num_queues));
+    }
+
+    uint64_t table_len = VIRTIO_NET_RSS_TABLE_LEN;
+    while (table_len > net_cfg->rss_max_indirection_table_length && table_len > 1) {
+        table_len /= 2;
+    }
+
+    uint64_t cfg_len = sizeof(virtio_net_rss_config_t) +
+                       table_len * sizeof(uint16_t) +
+                       sizeof(uint16_t) + sizeof(uint8_t) + NET_RSS_KEY_LEN;
+    virtio_net_rss_config_t* rss_cfg = vmalloc(cfg_len);
+
+    rss_cfg->hash_types = (VIRTIO_NET_HASH_TYPE_IPV4 |
+                           VIRTIO_NET_HASH_TYPE_TCPV4 |
+                           VIRTIO_NET_HASH_TYPE_UDPV4) & net_cfg->supported_hash_types;
+    rss_cfg->indirection_table_mask = table_len - 1;
+    rss_cfg->unclassified_queue = 0;
+
+    for (uint64_t idx = 0; idx < table_len; idx++) {
+        rss_cfg->indirection_table[idx] = idx % num_queues;
+    }
+
+    uint8_t* tail = (uint8_t*)&rss_cfg->indirection_table[table_len];
+    memcpy(tail, &num_queues, sizeof(uint16_t));
+    tail[sizeof(uint16_t)] = NET_RSS_KEY_LEN;
+    memcpy(&tail[sizeof(uint16_t) + sizeof(uint8_t)], net_rss_key, NET_RSS_KEY_LEN);
+
+    bool ok = virtio_net_ctrl_cmd(nic_ctx, VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_RSS_CONFIG,
+                                  rss_cfg, cfg_len);
+
+    // Sends look up their queue the way the device does
+    if (ok) {
+        nic_ctx->has_rss = true;
+        nic_ctx->rss_hash_types = 0;
+        if (rss_cfg->hash_types & VIRTIO_NET_HASH_TYPE_IPV4) {
+            nic_ctx->rss_hash_types |= NET_RSS_HASH_IPV4;
+        }
+        if (rss_cfg->hash_types & VIRTIO_NET_HASH_TYPE_TCPV4) {
+            nic_ctx->rss_hash_types |= NET_RSS_HASH_TCPV4;
+        }
+        if (rss_cfg->hash_types & VIRTIO_NET_HASH_TYPE_UDPV4) {
+            nic_ctx->rss_hash_types |= NET_RSS_HASH_UDPV4;
+        }
+        nic_ctx->rss_table_mask = table_len - 1;
+        memcpy(nic_ctx->rss_table, rss_cfg->indirection_table, table_len * sizeof(uint16_t));
+    }
+
+    vfree(rss_cfg);
+
+    return ok;
+}
+
+static void virtio_net_init_queue(virtio_pci_net_ctx_t* nic_ctx, pci_virtio_common_cfg_t* common_cfg,
+                                  uint64_t idx, uint64_t tx_pool_size) {
+
+    virtio_net_queue_t* queue = &nic_ctx->queues[idx];
+    queue->nic_ctx = nic_ctx;
+    queue->idx = idx;
+
+    uint32_t intid;
+    intid = pci_register_interrupt_handler(nic_ctx->pci_ctx,
+                                           virtio_pci_net_device_irq_fn,
+                                           queue);
+
+    pci_msix_vector_ctx_t* msix_item = pci_get_msix_entry(nic_ctx->pci_ctx, intid);
+    ASSERT(msix_item);
+
+    virtio_alloc_queue(common_cfg,
+                       VIRTIO_QUEUE_NET_RECEIVEQ(idx),
+                       VIRTIO_NET_RX_QUEUE_SIZE,
+                       VIRTIO_NET_RX_QUEUE_SIZE * VIRTIO_NET_RX_BUFFER_SIZE,
+                       &queue->receiveq,
+                       msix_item->entry_idx);
+
+    virtio_alloc_queue(common_cfg,
+                       VIRTIO_QUEUE_NET_TRANSMITQ(idx),
+                       VIRTIO_NET_TX_QUEUE_SIZE,
+                       tx_pool_size,
+                       &queue->transmitq,
+                       msix_item->entry_idx);
+
+    // Completions are reaped by the senders, see virtio_net_wait_tx
+    queue->transmitq.avail_ptr->flags = VIRTQ_VAIL_F_NO_INTERRUPT;
+
+    queue->tx_inflight = vmalloc(sizeof(net_send_buffer_t*) * queue->transmitq.queue_size);
+    ASSERT(queue->tx_inflight != NULL);
+    for (uint64_t desc_idx = 0; desc_idx < queue->transmitq.queue_size; desc_idx++) {
+        queue->tx_inflight[desc_idx] = NULL;
+    }
+
+    queue->irq_ctx.wait_queue = llist_create();
+    queue->irq_ctx.intid = intid;
+}
+
 static void virtio_pci_net_late_init(void* ctx) {
     discovery_pci_ctx_t* pci_ctx = ctx;
 
@@ -179,49 +593,110 @@ static void virtio_pci_net_late_init(void* ctx) {
     uint64_t features_req = (1UL << VIRTIO_NET_F_MAC) |
                             (1UL << VIRTIO_NET_F_STATUS) |
                             (1UL << VIRTIO_F_VERSION_1);
-    bool status = virtio_init_with_features(nic_ctx->pci_ctx, features_req);
+    uint64_t features_opt = (1UL << VIRTIO_NET_F_CTRL_VQ) |
+                            (1UL << VIRTIO_NET_F_MQ) |
+                            (1UL << VIRTIO_NET_F_RSS) |
+                            (1UL << VIRTIO_NET_F_CSUM) |
+                            (1UL << VIRTIO_NET_F_GUEST_CSUM) |
+                            (1UL << VIRTIO_NET_F_HOST_TSO4);
+    bool status = virtio_init_with_opt_features(nic_ctx->pci_ctx, features_req,
+                                                features_opt, &nic_ctx->features);
     ASSERT(status);
 
-    uint32_t receiveq_intid;
-    receiveq_intid = pci_register_interrupt_handler(nic_ctx->pci_ctx,
-                                                    virtio_pci_net_device_irq_fn,
-                                                    nic_ctx);
-                                                
-    pci_msix_vector_ctx_t* receiveq_msix_item = pci_get_msix_entry(nic_ctx->pci_ctx, receiveq_intid);
-    ASSERT(receiveq_msix_item);
+    pci_cap_t* net_cfg_cap = virtio_get_capability(nic_ctx->pci_ctx, VIRTIO_PCI_CAP_DEVICE_CFG); 
+    ASSERT(net_cfg_cap);
+    virtio_net_config_t* net_cfg = net_cfg_cap->ctx;
 
-    virtio_alloc_queue(common_cfg,
-                       VIRTIO_QUEUE_NET_RECEIVEQ1,
-                       //32, 32 * 16384,
-                       4, 4 * 8000,
-                       &nic_ctx->receiveq1,
-                       receiveq_msix_item->entry_idx);
+    // One vector per queue pair
+    bool has_mq = (nic_ctx->features & (1UL << VIRTIO_NET_F_MQ)) &&
+                  (nic_ctx->features & (1UL << VIRTIO_NET_F_CTRL_VQ));
+
+    nic_ctx->num_queues = 1;
+    nic_ctx->has_rss = false;
+    if (has_mq) {
+        nic_ctx->num_queues = net_cfg->max_virtqueue_pairs;
+        if (nic_ctx->num_queues > VIRTIO_NET_MAX_QUEUE_PAIRS) {
+            nic_ctx->num_queues = VIRTIO_NET_MAX_QUEUE_PAIRS;
+        }
+        if (nic_ctx->num_queues > pci_num_msix_vectors(nic_ctx->pci_ctx)) {
+            nic_ctx->num_queues = pci_num_msix_vectors(nic_ctx->pci_ctx);
+        }
+        if (nic_ctx->num_queues == 0) {
+            nic_ctx->num_queues = 1;
+        }
+    }
 
-    virtio_alloc_queue(common_cfg,
-                       VIRTIO_QUEUE_NET_TRANSMITQ1,
-                       32, 32 * 16384,
-                       &nic_ctx->transmitq1, 0);
+    // The device only segments frames it also checksums
+    nic_ctx->net_dev.features = 0;
+    if (nic_ctx->features & (1UL << VIRTIO_NET_F_CSUM)) {
+        nic_ctx->net_dev.features |= NET_DEV_F_TX_CSUM;
 
-    nic_ctx->receiveq1_irq_ctx.wait_queue = llist_create();
-    nic_ctx->receiveq1_irq_ctx.intid = receiveq_intid;
+        if (nic_ctx->features & (1UL << VIRTIO_NET_F_HOST_TSO4)) {
+            nic_ctx->net_dev.features |= NET_DEV_F_TSO4;
+        }
+    }
+    if (nic_ctx->features & (1UL << VIRTIO_NET_F_GUEST_CSUM)) {
+        nic_ctx->net_dev.features |= NET_DEV_F_RX_CSUM;
+    }
+
+    for (uint64_t idx = 0; idx < nic_ctx->num_queues; idx++) {
+        // Only the first transmit queue's pool is used, see virtio_net_tx_pool
+        uint64_t tx_pool_size = VIRTIO_NET_TX_BUFFER_SIZE;
+        if (idx == 0) {
+            tx_pool_size = nic_ctx->num_queues * VIRTIO_NET_TX_QUEUE_SIZE * VIRTIO_NET_TX_BUFFER_SIZE;
+            if (nic_ctx->net_dev.features & NET_DEV_F_TSO4) {
+                tx_pool_size += VIRTIO_NET_TSO_BUFFERS * VIRTIO_NET_TSO_BUFFER_SIZE;
+            }
+        }
+
+        virtio_net_init_queue(nic_ctx, common_cfg, idx, tx_pool_size);
+    }
+
+    if (has_mq) {
+        virtio_alloc_queue(common_cfg,
+                           VIRTIO_QUEUE_NET_CONTROLQ(net_cfg->max_virtqueue_pairs),
+                           VIRTIO_NET_CTRL_QUEUE_SIZE,
+                           VIRTIO_NET_CTRL_POOL_SIZE,
+                           &nic_ctx->controlq,
+                           VIRTIO_MSI_NO_VECTOR);
+    }
 
     virtio_set_status(common_cfg, VIRTIO_STATUS_DRIVER_OK);
 
-    pci_enable_vector(nic_ctx->pci_ctx, nic_ctx->receiveq1_irq_ctx.intid);
+    for (uint64_t idx = 0; idx < nic_ctx->num_queues; idx++) {
+        pci_enable_vector(nic_ctx->pci_ctx, nic_ctx->queues[idx].irq_ctx.intid);
+    }
     pci_enable_interrupts(nic_ctx->pci_ctx);
 
-    pci_cap_t* net_cfg_cap = virtio_get_capability(nic_ctx->pci_ctx, VIRTIO_PCI_CAP_DEVICE_CFG); 
-    ASSERT(net_cfg_cap);
-    virtio_net_config_t* net_cfg = net_cfg_cap->ctx;
+    // The device starts out using one pair
+    if (nic_ctx->num_queues > 1 && !virtio_net_set_queues(nic_ctx, net_cfg)) {
+        console_log(LOG_WARN, "virtio-pci-net failed to enable %u queues", nic_ctx->num_queues);
+        nic_ctx->num_queues = 1;
+    }
 
     nic_ctx->net_dev.ops = &s_nic_ops;
     nic_ctx->net_dev.nic_ctx = nic_ctx;
     memcpy(&nic_ctx->net_dev.mac, net_cfg->mac, sizeof(mac_t));
     nic_ctx->net_dev.name = "virtio-pci-net0";
 
+    // Keep at least half of a receive ring posted
+    nic_ctx->net_dev.rx_pin_max = VIRTIO_NET_RX_QUEUE_SIZE / 2;
+    nic_ctx->net_dev.rx_pinned = 0;
+
     net_device_register(&nic_ctx->net_dev);
 
-    create_kernel_task(8192, virtio_net_recv_thread, nic_ctx, "virtio-net-recvq");
+    console_log(LOG_INFO, "virtio-pci-net using %u queue pairs%s", nic_ctx->num_queues,
+                (nic_ctx->features & (1UL << VIRTIO_NET_F_RSS)) ? " with RSS" : "");
+
+    for (uint64_t idx = 0; idx < nic_ctx->num_queues; idx++) {
+        virtio_net_init_rx_buffers(&nic_ctx->queues[idx]);
+
+        char task_name[32];
+        snprintf(task_name, sizeof(task_name), "virtio-net-rxq%u", idx);
+
+        uint64_t tid = create_kernel_task(8192, virtio_net_recv_thread, &nic_ctx->queues[idx], task_name);
+        task_set_priority(get_task_for_tid(tid), TASK_PRIORITY_HIGH);
+    }
 
     vfree(pci_ctx);
 }
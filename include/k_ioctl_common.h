@@ -4,6 +4,7 @@
 
 #define IOCTL_SEEK 0
 #define IOCTL_SEEK_END 1
+#define IOCTL_FSYNC 2
 
 // Bulk Ops
 #define BLK_IOCTL_SIZE 32
@@ -19,6 +20,12 @@
 
 // Taskops Ops
 #define TASKCTRL_IOCTL_WAIT 128
+#define TASKCTRL_IOCTL_SET_PRIORITY 129
+#define TASKCTRL_IOCTL_GET_PRIORITY 130
+
+#define TASKCTRL_PRIORITY_HIGH 0
+#define TASKCTRL_PRIORITY_NORMAL 1
+#define TASKCTRL_PRIORITY_LOW 2
 
 // GPIO Ops
 #define GPIO_IOCTL_PROPERTIES 160
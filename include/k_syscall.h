@@ -22,6 +22,9 @@
 #define SYSCALL_CONNECT 15
 #define SYSCALL_SELECT 16
 #define SYSCALL_TASKCTRL 17
+#define SYSCALL_MMAP 18
+#define SYSCALL_MUNMAP 19
+#define SYSCALL_MSYNC 20
 
 
 #define EXEC_ARGV_ARG_MAXLEN 256
@@ -47,6 +50,14 @@ enum {
     SYSCALL_OPEN_WRITE = 2
 };
 
+enum {
+    SYSCALL_MMAP_WRITE = 1
+};
+
+enum {
+    SYSCALL_MSYNC_SYNC = 1
+};
+
 typedef struct {
     int64_t fd;
     uint64_t ready_mask;
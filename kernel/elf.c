@@ -11,6 +11,8 @@
 #include "kernel/assert.h"
 #include "kernel/kmalloc.h"
 #include "kernel/console.h"
+#include "kernel/mmap.h"
+#include "kernel/lib/vmalloc.h"
 
 #define MAX_ARG_LEN 256
 
@@ -62,11 +64,7 @@ static elf_result_t elf_valid(uint8_t* elf_data, uint64_t elf_size) {
     return ELF_VALID;
 }
 
-static elf_result_t elf_add_memspace_entry(memory_space_t* memspace, _elf64_phdr_t* phdr, uint8_t* elf_data, uint64_t elf_size) {
-    /* Parse a segment andd add a memoryspace entry as appropriate */
-
-    ASSERT(memspace != NULL);
-    ASSERT(phdr != NULL);
+static elf_result_t elf_valid_phdr(_elf64_phdr_t* phdr, uint64_t elf_size) {
 
     // Return early if the PHDR entry is empty
     if (phdr->p_memsz == 0 && phdr->p_filesz == 0) {
@@ -97,21 +95,10 @@ static elf_result_t elf_add_memspace_entry(memory_space_t* memspace, _elf64_phdr
         return ELF_BADPHDR;
     }
 
-    // Allocate physical memory for the segment
-    uint8_t* phy_mem = kmalloc_phy(phdr->p_memsz);
-    if (phy_mem == NULL) {
-        return ELF_CANTALLOC;
-    }
-
-    // Copy file data into physical memory
-    if (phdr->p_offset > 0) {
-        memcpy((void*)PHY_TO_KSPACE(phy_mem), &elf_data[phdr->p_offset], phdr->p_filesz);
-    }
+    return ELF_VALID;
+}
 
-    // Zero remaining memory if necessary
-    if (phdr->p_memsz > phdr->p_filesz) {
-        memset(PHY_TO_KSPACE_PTR(phy_mem + phdr->p_filesz), 0, phdr->p_memsz - phdr->p_filesz);
-    }
+static uint32_t elf_memspace_flags(_elf64_phdr_t* phdr) {
 
     // Translate memory permission flags
     uint32_t memspace_flags = 0;
@@ -125,12 +112,40 @@ static elf_result_t elf_add_memspace_entry(memory_space_t* memspace, _elf64_phdr
         ASSERT(0);
     }
 
+    return memspace_flags;
+}
+
+/*
+ * Copy a segment into newly allocated memory. seg_data holds the file
+ * bytes of the segment
+ */
+static elf_result_t elf_add_memspace_entry(memory_space_t* memspace, _elf64_phdr_t* phdr, const uint8_t* seg_data) {
+
+    ASSERT(memspace != NULL);
+    ASSERT(phdr != NULL);
+
+    // Allocate physical memory for the segment. Every byte of
+    // the pages is written below, so skip zeroing the allocation
+    uint8_t* phy_mem = kmalloc_phy_nozero(phdr->p_memsz);
+    if (phy_mem == NULL) {
+        return ELF_CANTALLOC;
+    }
+
+    // Copy file data into physical memory
+    if (phdr->p_offset > 0) {
+        memcpy((void*)PHY_TO_KSPACE(phy_mem), seg_data, phdr->p_filesz);
+    }
+
+    // Zero remaining memory through the end of the last page
+    uint64_t copied_size = phdr->p_offset > 0 ? phdr->p_filesz : 0;
+    memset(PHY_TO_KSPACE_PTR(phy_mem + copied_size), 0, PAGE_CEIL(phdr->p_memsz) - copied_size);
+
     // Create the memory space entry
     memory_entry_phy_t phdr_entry = {
         .start = phdr->p_vaddr,
         .end = PAGE_CEIL((phdr->p_vaddr + phdr->p_memsz)),
         .type = MEMSPACE_PHY,
-        .flags = memspace_flags,
+        .flags = elf_memspace_flags(phdr),
         .phy_addr = (uintptr_t)phy_mem,
         .kmem_addr = (uint64_t)phy_mem
     };
@@ -144,27 +159,76 @@ static elf_result_t elf_add_memspace_entry(memory_space_t* memspace, _elf64_phdr
     return ELF_VALID;
 }
 
-uint64_t create_elf_task(uint8_t* elf_data,
-                         uint64_t elf_size,
-                         elf_result_t* result,
-                         bool system_task,
-                         const char* name,
-                         char** argv) {
+/*
+ * Map a segment of an ELF file to be paged in as it is used. Segments
+ * are private mappings, so read only and execute pages are shared with
+ * every task running the same file and written pages are copied
+ */
+static elf_result_t elf_add_file_entry(memory_space_t* memspace, _elf64_phdr_t* phdr, file_ctx_t* file_ctx) {
 
-    ASSERT(elf_data != NULL);
-    ASSERT(elf_size > 0);
+    ASSERT(memspace != NULL);
+    ASSERT(phdr != NULL);
 
-    elf_result_t tmp_result;
+    uintptr_t start = PAGE_FLOOR(phdr->p_vaddr);
+    uint64_t lead = phdr->p_vaddr - start;
+
+    // The segment can only be paged from the file if it has the same
+    // offset into a page in the file and in memory
+    if (phdr->p_filesz > 0 && (phdr->p_offset & (VMEM_PAGE_SIZE - 1)) != lead) {
+        uint8_t* seg_data = vmalloc(phdr->p_filesz);
+        file_read_at(file_ctx, phdr->p_offset, seg_data, phdr->p_filesz);
+        elf_result_t res = elf_add_memspace_entry(memspace, phdr, seg_data);
+        vfree(seg_data);
+        return res;
+    }
 
-    // Validate this is a valid ELF that is loadable
-    tmp_result = elf_valid(elf_data, elf_size);
-    if (tmp_result != ELF_VALID) {
-        if (result != NULL) {
-            *result = tmp_result;
-        }
-        return 0;
+    uint64_t offset = 0;
+    uint64_t file_len = 0;
+    if (phdr->p_filesz > 0) {
+        offset = phdr->p_offset - lead;
+        file_len = lead + phdr->p_filesz;
+    }
+
+    bool ok = mmap_add_private(memspace, file_ctx, start,
+                               phdr->p_vaddr + phdr->p_memsz,
+                               elf_memspace_flags(phdr),
+                               offset, file_len);
+    if (!ok) {
+        return ELF_CANTALLOC;
     }
 
+    return ELF_VALID;
+}
+
+/*
+ * Drops the file mappings of a memory space that was not used
+ */
+static void elf_deallocate(memory_space_t* memspace) {
+
+    memory_entry_t* entry;
+    FOR_LLIST(memspace->new_entries, entry)
+        if (entry->type == MEMSPACE_FILE) {
+            mmap_release((memory_entry_file_t*)entry);
+        }
+    END_FOR_LLIST()
+
+    memspace_deallocate(memspace);
+}
+
+/*
+ * Segments come from elf_data when it is set, otherwise from file_ctx
+ */
+static uint64_t elf_create_task(_elf64_ehdr_t* header,
+                                _elf64_phdr_t* phdr,
+                                uint8_t* elf_data,
+                                file_ctx_t* file_ctx,
+                                uint64_t elf_size,
+                                elf_result_t* result,
+                                const char* name,
+                                char** argv) {
+
+    elf_result_t tmp_result;
+
     // Start building a memoryspace for this object
     memory_space_t elf_space;
     memory_valloc_ctx_t elf_space_alloc_ctx;
@@ -179,17 +243,23 @@ uint64_t create_elf_task(uint8_t* elf_data,
         return 0;
     }
 
-    _elf64_ehdr_t* header = (_elf64_ehdr_t*)elf_data;
-    _elf64_phdr_t* phdr = (_elf64_phdr_t*)(elf_data + header->e_phoff);
-
     // Loop through the segments and add a memory entry for
     for (uint64_t idx = 0; idx < header->e_phnum; idx++) {
         switch (phdr[idx].p_type) {
             case PT_LOAD:
-                tmp_result = elf_add_memspace_entry(&elf_space, &phdr[idx], elf_data, elf_size);
+                tmp_result = elf_valid_phdr(&phdr[idx], elf_size);
                 if (tmp_result == ELF_EMPTYPHDR) {
                     continue;
                 }
+                if (tmp_result != ELF_VALID) {
+                    break;
+                }
+                if (elf_data != NULL) {
+                    tmp_result = elf_add_memspace_entry(&elf_space, &phdr[idx],
+                                                        &elf_data[phdr[idx].p_offset]);
+                } else {
+                    tmp_result = elf_add_file_entry(&elf_space, &phdr[idx], file_ctx);
+                }
                 break;
             case PT_NULL:
                 tmp_result = ELF_VALID;
@@ -207,7 +277,7 @@ uint64_t create_elf_task(uint8_t* elf_data,
         }
 
         if (tmp_result != ELF_VALID) {
-            memspace_deallocate(&elf_space);
+            elf_deallocate(&elf_space);
             if (result != NULL) {
                 *result = tmp_result;
             }
@@ -218,7 +288,7 @@ uint64_t create_elf_task(uint8_t* elf_data,
     // Allocate a stack for the task
     uint8_t* stack_phy_space = kmalloc_phy(USER_STACK_SIZE);
     if (stack_phy_space == NULL) {
-        memspace_deallocate(&elf_space);
+        elf_deallocate(&elf_space);
         if (result != NULL) {
             *result = ELF_CANTALLOC;
         }
@@ -241,7 +311,7 @@ uint64_t create_elf_task(uint8_t* elf_data,
     bool memspace_result;
     memspace_result = memspace_add_entry_to_memory(&elf_space, (memory_entry_t*)&elf_stack);
     if (!memspace_result) {
-        memspace_deallocate(&elf_space);
+        elf_deallocate(&elf_space);
         kfree_phy(stack_phy_space);
         if (result != NULL) {
             *result = ELF_CANTALLOC;
@@ -282,7 +352,6 @@ uint64_t create_elf_task(uint8_t* elf_data,
     ((char**)argv_base_kptr)[argc] = 0;
 
     uint64_t tid = 0;
-    (void)system_task;
     tid = create_user_task(KERNEL_STD_STACK_SIZE,
                             stack_base,
                             USER_STACK_SIZE,
@@ -292,7 +361,7 @@ uint64_t create_elf_task(uint8_t* elf_data,
                             name);
 
     if (tid == 0) {
-        memspace_deallocate(&elf_space);
+        elf_deallocate(&elf_space);
         if (result != NULL) {
             *result = ELF_BADTASK;
         }
@@ -306,3 +375,79 @@ uint64_t create_elf_task(uint8_t* elf_data,
 }
 
 
+
+uint64_t create_elf_task(uint8_t* elf_data,
+                         uint64_t elf_size,
+                         elf_result_t* result,
+                         bool system_task,
+                         const char* name,
+                         char** argv) {
+
+    ASSERT(elf_data != NULL);
+    ASSERT(elf_size > 0);
+
+    elf_result_t tmp_result;
+
+    // Validate this is a valid ELF that is loadable
+    tmp_result = elf_valid(elf_data, elf_size);
+    if (tmp_result != ELF_VALID) {
+        if (result != NULL) {
+            *result = tmp_result;
+        }
+        return 0;
+    }
+
+    (void)system_task;
+
+    _elf64_ehdr_t* header = (_elf64_ehdr_t*)elf_data;
+    _elf64_phdr_t* phdr = (_elf64_phdr_t*)(elf_data + header->e_phoff);
+
+    return elf_create_task(header, phdr, elf_data, NULL, elf_size, result, name, argv);
+}
+
+/*
+ * Only the headers are read here. Segments are paged in from the file
+ * as the task uses them, and the file is held open until the task exits
+ */
+uint64_t create_elf_task_file(file_ctx_t* file_ctx,
+                              elf_result_t* result,
+                              const char* name,
+                              char** argv) {
+
+    ASSERT(file_ctx != NULL);
+
+    uint64_t elf_size = file_ctx->file_data->size;
+    elf_result_t tmp_result;
+
+    _elf64_ehdr_t header;
+    uint64_t len = file_read_at(file_ctx, 0, (uint8_t*)&header, sizeof(header));
+    if (len != sizeof(header)) {
+        tmp_result = ELF_BADHEADER;
+    } else {
+        tmp_result = elf_valid((uint8_t*)&header, elf_size);
+    }
+
+    if (tmp_result != ELF_VALID) {
+        if (result != NULL) {
+            *result = tmp_result;
+        }
+        return 0;
+    }
+
+    uint64_t phdr_size = header.e_phentsize * header.e_phnum;
+    _elf64_phdr_t* phdr = vmalloc(phdr_size);
+    len = file_read_at(file_ctx, header.e_phoff, (uint8_t*)phdr, phdr_size);
+    if (len != phdr_size) {
+        vfree(phdr);
+        if (result != NULL) {
+            *result = ELF_BADHEADER;
+        }
+        return 0;
+    }
+
+    uint64_t tid = elf_create_task(&header, phdr, NULL, file_ctx, elf_size, result, name, argv);
+
+    vfree(phdr);
+
+    return tid;
+}
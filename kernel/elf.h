@@ -5,6 +5,8 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "kernel/fs/file.h"
+
 typedef enum {
     ELF_VALID = 0,
     ELF_BADHEADER = 1,
@@ -60,6 +62,11 @@ uint64_t create_elf_task(uint8_t* elf_data,
                          const char* name,
                          char** argv);
 
+uint64_t create_elf_task_file(file_ctx_t* file_ctx,
+                              elf_result_t* result,
+                              const char* name,
+                              char** argv);
+
 #define ELF_MAX_MEMSPACE_ENTRIES 128
 
 #endif
\ No newline at end of file
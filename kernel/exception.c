@@ -10,6 +10,7 @@
 #include "kernel/schedule.h"
 #include "kernel/console.h"
 #include "kernel/kernelspace.h"
+#include "kernel/smp.h"
 #include "stdlib/printf.h"
 
 void unhandled_exception(uint64_t exception_num) {
@@ -58,6 +59,8 @@ void unhandled_exception(uint64_t exception_num) {
 
 void exception_handler_sync(uint64_t vector) {
 
+    smp_kernel_lock();
+
     uint32_t esr;
 
     READ_SYS_REG(ESR_EL1, esr);
@@ -87,10 +90,23 @@ void exception_handler_sync_lower(uint64_t vector) {
 
 uint64_t exception_handler_irq(uint64_t vector, irq_stackframe_t* frame) {
 
+    // Already held if a kernel task was interrupted
+    smp_kernel_lock();
+
     interrupt_handle_irq_entry(vector);
 
-    if (get_active_task() == NULL) {
+    task_t* active_task = get_active_task();
+
+    if (active_task == NULL) {
         schedule_from_irq();
+    } else if (VECTOR_FROM_LOW_64(vector)) {
+        // Interrupted in EL0, so the user context has already been saved.
+        // Let a higher priority task run if one was woken by this interrupt
+        if (schedule_should_preempt()) {
+            schedule();
+        } else {
+            restore_context(active_task->tid);
+        }
     }
 
     return 0;
@@ -106,6 +122,8 @@ void panic_exception_handler(uint64_t vector) {
 
 uint64_t exception_handler_sync_kernel(uint64_t vector, irq_stackframe_t* frame) {
 
+    smp_kernel_lock();
+
     uint32_t esr;
 
     READ_SYS_REG(ESR_EL1, esr);
@@ -31,6 +31,15 @@ void exception_init();
 #define EC_DATA_ABORT_LOWER (0x24)
 #define EC_DATA_ABORT (0x25)
 
+// Abort ISS fields
+#define ESR_FSC_MASK (0x3F)
+#define ESR_FSC_TRANSLATION_L0 (0x4)
+#define ESR_FSC_TRANSLATION_L3 (0x7)
+#define ESR_FSC_PERMISSION_L0 (0xC)
+#define ESR_FSC_PERMISSION_L3 (0xF)
+#define ESR_WNR BIT(6)
+#define ESR_FNV BIT(10)
+
 #define VECTOR_FROM_CURR_EL_SP0(x) ((x & 0xC) == 0)
 #define VECTOR_FROM_CURR_EL_SPx(x) ((x & 0xC) == 0x4)
 #define VECTOR_FROM_LOW_64(x) ((x & 0xC) == 0x8)
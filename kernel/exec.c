@@ -7,6 +7,7 @@
 #include "kernel/fd.h"
 #include "kernel/assert.h"
 #include "kernel/task.h"
+#include "kernel/fs/file.h"
 #include "kernel/lib/vmalloc.h"
 
 #include "include/k_ioctl_common.h"
@@ -24,6 +25,23 @@ uint64_t exec_user_task(const char* device, const char* path, const char* name,
     file_fd_ctx = get_kernel_fd(file_fd);
     ASSERT(file_fd_ctx != NULL);
 
+    uint64_t tid = 0;
+    elf_result_t res;
+
+    // Files are paged in on demand. Anything else is read in whole
+    file_ctx_t* file_ctx = NULL;
+    fd_call_ioctl_ptr(file_fd_ctx, FILE_IOCTL_GET_CTX, &file_ctx);
+    if (file_ctx != NULL) {
+        tid = create_elf_task_file(file_ctx, &res, name, argv);
+        if (tid == 0) {
+            console_log(LOG_INFO, "Cannot Exec: ELF load failed %d", res);
+        }
+
+        fd_call_close(file_fd_ctx);
+
+        return res == ELF_VALID ? tid : 0;
+    }
+
     int64_t file_size = fd_call_ioctl(file_fd_ctx, BLK_IOCTL_SIZE, NULL, 0);
     if (file_size < 0) {
         console_log(LOG_INFO, "Cannot Exec: Can't get file size %d", file_size);
@@ -41,8 +59,6 @@ uint64_t exec_user_task(const char* device, const char* path, const char* name,
         return 0;
     }
 
-    uint64_t tid = 0;
-    elf_result_t res;
     tid = create_elf_task(read_buffer, size, &res, false, name, argv);
     if (tid == 0) {
         console_log(LOG_INFO, "Cannot Exec: ELF load failed %d", res);
@@ -11,27 +11,26 @@
 #include "kernel/vmem.h"
 #include "kernel/vfs.h"
 #include "kernel/kernelspace.h"
+#include "kernel/mmap.h"
+#include "kernel/lib/vmalloc.h"
 
 int64_t syscall_open(uint64_t device, uint64_t path, uint64_t flags, uint64_t dummy) {
 
     task_t* task = get_active_task();
 
-    uint64_t device_phy;
-    bool walk_ok;
-    walk_ok = vmem_walk_table(task->low_vm_table, device, &device_phy);
-    if (!walk_ok) {
-        return -1;
-    }
-    void* device_kptr = PHY_TO_KSPACE_PTR(device_phy);
+    char* device_kstr = vmalloc(SYSCALL_PATH_MAXLEN);
+    char* path_kstr = vmalloc(SYSCALL_PATH_MAXLEN);
 
-    uint64_t path_phy;
-    walk_ok = vmem_walk_table(task->low_vm_table, path, &path_phy);
-    if (!walk_ok) {
-        return -1;
+    int64_t ret = -1;
+    if (mmap_copy_user_str(task, device, device_kstr, SYSCALL_PATH_MAXLEN) &&
+        mmap_copy_user_str(task, path, path_kstr, SYSCALL_PATH_MAXLEN)) {
+        ret = vfs_open_device_fd(device_kstr, path_kstr, flags);
     }
-    void* path_kptr = PHY_TO_KSPACE_PTR(path_phy);
 
-    return vfs_open_device_fd(device_kptr, path_kptr, flags);
+    vfree(device_kstr);
+    vfree(path_kstr);
+
+    return ret;
 }
 
 int64_t syscall_read(uint64_t fd, uint64_t buffer, uint64_t len, uint64_t flags) {
@@ -47,20 +46,28 @@ int64_t syscall_read(uint64_t fd, uint64_t buffer, uint64_t len, uint64_t flags)
         return -1;
     }
 
-    uint64_t buffer_phy;
-    bool walk_ok;
-    void* buffer_kptr;
-    walk_ok = vmem_walk_table(task->low_vm_table, buffer, &buffer_phy);
-    if (!walk_ok) {
+    if (!mmap_user_access(task, buffer, len, true)) {
         return -1;
     }
-    buffer_kptr = PHY_TO_KSPACE_PTR(buffer_phy);
 
-    if (task->fds[fd].ops.read != NULL) {
-        return fd_call_read(&task->fds[fd], buffer_kptr, len, flags);
-    } else {
+    if (task->fds[fd].ops.read == NULL) {
         return -1;
     }
+
+    void* buffer_kptr = get_userspace_ptr(task->low_vm_table, buffer, len);
+    if (buffer_kptr != NULL) {
+        return fd_call_read(&task->fds[fd], buffer_kptr, len, flags);
+    }
+
+    // The buffer spans pages which are not contiguous
+    uint8_t* bounce = vmalloc(len);
+    int64_t ret = fd_call_read(&task->fds[fd], bounce, len, flags);
+    if (ret > 0 && !mmap_copy_user(task, buffer, bounce, ret, true)) {
+        ret = -1;
+    }
+    vfree(bounce);
+
+    return ret;
 }
 
 int64_t syscall_write(uint64_t fd, uint64_t buffer, uint64_t len, uint64_t flags) {
@@ -76,27 +83,35 @@ int64_t syscall_write(uint64_t fd, uint64_t buffer, uint64_t len, uint64_t flags
         return -1;
     }
 
-    uint64_t buffer_phy;
-    bool walk_ok;
-    void* buffer_kptr;
-    walk_ok = vmem_walk_table(task->low_vm_table, buffer, &buffer_phy);
-    if (!walk_ok) {
+    if (!mmap_user_access(task, buffer, len, false)) {
         return -1;
     }
-    buffer_kptr = PHY_TO_KSPACE_PTR(buffer_phy);
 
-    if (task->fds[fd].ops.write != NULL) {
-        return fd_call_write(&task->fds[fd], buffer_kptr, len, flags);
-    } else {
+    if (task->fds[fd].ops.write == NULL) {
         return -1;
     }
 
+    void* buffer_kptr = get_userspace_ptr(task->low_vm_table, buffer, len);
+    if (buffer_kptr != NULL) {
+        return fd_call_write(&task->fds[fd], buffer_kptr, len, flags);
+    }
+
+    // The buffer spans pages which are not contiguous
+    uint8_t* bounce = vmalloc(len);
+    int64_t ret = -1;
+    if (mmap_copy_user(task, buffer, bounce, len, false)) {
+        ret = fd_call_write(&task->fds[fd], bounce, len, flags);
+    }
+    vfree(bounce);
+
+    return ret;
+
 }
 
 int64_t syscall_ioctl(uint64_t fd, uint64_t ioctl, uint64_t args, uint64_t arg_count) {
     task_t* task = get_active_task();
 
-    if (fd >= MAX_TASK_FDS) {
+    if (fd >= MAX_TASK_FDS || ioctl >= IOCTL_KERNEL_BASE) {
         return -1;
     }
 
@@ -110,16 +125,16 @@ int64_t syscall_ioctl(uint64_t fd, uint64_t ioctl, uint64_t args, uint64_t arg_c
     }
 
     if (arg_count > 0) {
-        uint64_t args_phy;
-        bool walk_ok;
-        void* args_kptr;
-        walk_ok = vmem_walk_table(task->low_vm_table, args, &args_phy);
-        if (!walk_ok) {
-            return -1;
+        uint64_t* args_kptr = vmalloc(arg_count * sizeof(uint64_t));
+
+        int64_t ret = -1;
+        if (mmap_copy_user(task, args, args_kptr, arg_count * sizeof(uint64_t), false)) {
+            ret = fd_call_ioctl(&task->fds[fd], ioctl, args_kptr, arg_count);
         }
-        args_kptr = PHY_TO_KSPACE_PTR(args_phy);
 
-        return fd_call_ioctl(&task->fds[fd], ioctl, args_kptr, arg_count);
+        vfree(args_kptr);
+
+        return ret;
     } else {
         return fd_call_ioctl(&task->fds[fd], ioctl, NULL, 0);
     }
@@ -5,6 +5,16 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+// Ioctls at or above this value pass kernel pointers and are only
+// available through fd_call_ioctl
+#define IOCTL_KERNEL_BASE 0x10000
+
+// File Ops
+#define FILE_IOCTL_GET_CTX (IOCTL_KERNEL_BASE + 0)
+
+// Blk Ops
+#define BLK_IOCTL_GET_BCACHE (IOCTL_KERNEL_BASE + 32)
+
 typedef int64_t (*fd_read_op)(void* ctx, uint8_t* buffer, const int64_t size, const uint64_t flags);
 typedef int64_t (*fd_write_op)(void* ctx, const uint8_t* buffer, const int64_t size, const uint64_t flags);
 typedef int64_t (*fd_ioctl_op)(void* ctx, const uint64_t ioctl, const uint64_t* args, const uint64_t arg_count);
@@ -0,0 +1,40 @@
+
+#ifndef __FPSIMD_H__
+#define __FPSIMD_H__
+
+#include <stdint.h>
+
+#include "kernel/interrupt/interrupt.h"
+
+#include "stdlib/bitutils.h"
+
+#define FPSIMD_CPACR_FPEN (3 << 20)
+
+/**
+ * A section of kernel code that uses the FP/SIMD registers. The kernel
+ * runs with FP disabled, and a user task's FP registers are saved when it
+ * enters the kernel and restored when it leaves, so the registers are
+ * free to clobber as long as nothing else runs on this CPU in between.
+ * Interrupts are masked for the whole section, so keep it short
+ */
+typedef struct {
+    uint64_t daif;
+    uint64_t cpacr;
+} fpsimd_state_t;
+
+#define BEGIN_FPSIMD(x) \
+    do { \
+    BEGIN_CRITICAL((x).daif); \
+    READ_SYS_REG(CPACR_EL1, (x).cpacr); \
+    WRITE_SYS_REG(CPACR_EL1, (x).cpacr | FPSIMD_CPACR_FPEN); \
+    asm volatile ("isb"); \
+    } while(0)
+
+#define END_FPSIMD(x) \
+    do { \
+    WRITE_SYS_REG(CPACR_EL1, (x).cpacr); \
+    asm volatile ("isb"); \
+    END_CRITICAL((x).daif); \
+    } while(0)
+
+#endif
@@ -0,0 +1,918 @@
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "kernel/assert.h"
+#include "kernel/console.h"
+#include "kernel/kernelspace.h"
+#include "kernel/kmalloc.h"
+#include "kernel/schedule.h"
+#include "kernel/task.h"
+#include "kernel/lib/hashmap.h"
+#include "kernel/lib/llist.h"
+#include "kernel/lib/lstruct.h"
+#include "kernel/lib/slab.h"
+#include "kernel/lib/vmalloc.h"
+#include "kernel/lock/lock.h"
+#include "kernel/lock/mutex.h"
+#include "kernel/fs/bcache.h"
+
+#include "stdlib/bitutils.h"
+
+// Pages read or written back with a single device call
+#define BCACHE_IO_BATCH 64
+
+// Share of physical memory the cache may use
+#define BCACHE_MEM_DIV 4
+
+// Read-ahead batches waiting for the read-ahead task
+#define BCACHE_RA_QUEUE_LEN 16
+
+#define BCACHE_PAGE_FROM_CLOCK(entry) \
+    ((bcache_page_t*)((uintptr_t)(entry) - offsetof(bcache_page_t, clock_entry)))
+
+/**
+ * A batch of read-ahead pages. The pages are in the cache, referenced
+ * and being filled while the batch is queued
+ */
+typedef struct {
+    bcache_dev_t* dev;
+    uint64_t num_pages;
+    bcache_page_t* pages[BCACHE_IO_BATCH];
+} bcache_ra_batch_t;
+
+/**
+ * All pages live in one hashmap keyed by (device, page index). Every
+ * page is also on the clock ring, and dirty pages are on the dirty
+ * list until they are written back. A page is added to the hashmap
+ * before it is filled so that only one task reads it, and the cache
+ * lock is not held across device I/O. Lookups that find a page that
+ * is still being filled sleep until its fill is done.
+ */
+typedef struct {
+    hashmap_ctx_t* pages;
+    llist_head_t devs;
+
+    lstruct_head_t clock_pages;
+    lstruct_t* clock_hand;
+
+    lstruct_head_t dirty_pages;
+
+    uint64_t num_pages;
+    uint64_t max_pages;
+    uint64_t num_evicted;
+
+    bcache_ra_batch_t ra_queue[BCACHE_RA_QUEUE_LEN];
+    uint64_t ra_head;           /* Next batch the read-ahead task fills */
+    uint64_t ra_tail;           /* Next free slot */
+    bool ra_running;            /* The read-ahead task has started */
+    bool ra_wake;
+    wait_queue_t ra_wait_queue;
+
+    lock_t lock;
+} bcache_ctx_t;
+
+static bcache_ctx_t s_bcache;
+
+static slab_cache_t s_bcache_page_cache = SLAB_CACHE_INIT("bcache_page", bcache_page_t);
+
+static uint64_t bcache_hash_hash(void* key) {
+    bcache_key_t* page_key = key;
+
+    return ((uintptr_t)page_key->dev >> 4) ^ (page_key->page_idx * 0x9E3779B97F4A7C15UL);
+}
+
+static bool bcache_hash_cmp(void* key1, void* key2) {
+    bcache_key_t* page_key1 = key1;
+    bcache_key_t* page_key2 = key2;
+
+    return page_key1->dev == page_key2->dev &&
+           page_key1->page_idx == page_key2->page_idx;
+}
+
+static void bcache_hash_free(void* ctx, void* key, void* dataptr) {
+    // Keys are part of the page, which is freed by the caller
+}
+
+void bcache_init(void) {
+
+    s_bcache.pages = hashmap_alloc(bcache_hash_hash,
+                                   bcache_hash_cmp,
+                                   bcache_hash_free,
+                                   10,
+                                   NULL);
+    s_bcache.devs = llist_create();
+
+    lstruct_init_head(&s_bcache.clock_pages);
+    lstruct_init_head(&s_bcache.dirty_pages);
+    s_bcache.clock_hand = NULL;
+
+    kmalloc_stat_t kmalloc_stat;
+    kmalloc_calc_stat(&kmalloc_stat);
+
+    s_bcache.num_pages = 0;
+    s_bcache.max_pages = kmalloc_stat.total_mem / BCACHE_MEM_DIV / BCACHE_PAGE_SIZE;
+    s_bcache.num_evicted = 0;
+
+    s_bcache.ra_head = 0;
+    s_bcache.ra_tail = 0;
+    s_bcache.ra_running = false;
+    s_bcache.ra_wake = false;
+    s_bcache.ra_wait_queue.head = NULL;
+
+    mutex_init(&s_bcache.lock, 32);
+}
+
+bcache_dev_t* bcache_register_dev(const char* name, const bcache_dev_ops_t* ops,
+                                  void* ctx, uint64_t num_pages) {
+
+    ASSERT(name != NULL);
+    ASSERT(ops != NULL);
+
+    bcache_dev_t* dev = vmalloc(sizeof(bcache_dev_t));
+    ASSERT(dev != NULL);
+    memset(dev, 0, sizeof(bcache_dev_t));
+
+    strncpy(dev->name, name, sizeof(dev->name) - 1);
+    dev->ops = *ops;
+    dev->ctx = ctx;
+    dev->num_pages = num_pages;
+
+    llist_append_ptr(s_bcache.devs, dev);
+
+    return dev;
+}
+
+static bool bcache_page_evictable(bcache_page_t* page) {
+    return page->ref_count == 0 &&
+           !page->dirty &&
+           page->key.dev->ops.read_pages != NULL;
+}
+
+static void bcache_free_page(bcache_page_t* page) {
+
+    if (s_bcache.clock_hand == &page->clock_entry) {
+        s_bcache.clock_hand = page->clock_entry.n;
+    }
+
+    hashmap_del(s_bcache.pages, &page->key);
+    lstruct_remove(&page->clock_entry);
+
+    page->key.dev->num_cached--;
+    s_bcache.num_pages--;
+
+    kfree_phy((void*)page->phy);
+    slab_free(&s_bcache_page_cache, page);
+}
+
+/*
+ * Run the clock hand until an unreferenced clean page is found and
+ * evict it. Pages used since the last pass get a second chance
+ */
+static bool bcache_evict_one(void) {
+
+    lstruct_t* entry = s_bcache.clock_hand;
+
+    for (uint64_t step = 0; step < 2 * (s_bcache.num_pages + 1); step++) {
+        if (entry == NULL) {
+            entry = s_bcache.clock_pages->n;
+            if (entry == NULL) {
+                break;
+            }
+        }
+
+        bcache_page_t* page = BCACHE_PAGE_FROM_CLOCK(entry);
+        entry = entry->n;
+
+        if (!bcache_page_evictable(page)) {
+            continue;
+        }
+
+        if (page->referenced) {
+            page->referenced = 0;
+            continue;
+        }
+
+        s_bcache.clock_hand = entry;
+        bcache_free_page(page);
+        s_bcache.num_evicted++;
+        return true;
+    }
+
+    s_bcache.clock_hand = entry;
+    return false;
+}
+
+/*
+ * Write back dirty pages, all of them or only those of one device.
+ * Pages that fail to write stay dirty and the error is reported by
+ * the next fsync of their device. Called with the cache lock held
+ */
+static void bcache_writeback_locked(bcache_dev_t* only_dev) {
+
+    bcache_page_t* batch[BCACHE_IO_BATCH];
+
+    // Failed pages are kept aside so that this pass does not retry them
+    lstruct_t failed_sentinel = { .n = NULL, .p = NULL };
+    lstruct_head_t failed_pages = &failed_sentinel;
+
+    while (true) {
+        bcache_dev_t* batch_dev = only_dev;
+        uint64_t num_batch = 0;
+
+        bcache_page_t* page;
+        FOREACH_LSTRUCT(s_bcache.dirty_pages, page, dirty_entry) {
+            if (num_batch >= BCACHE_IO_BATCH) {
+                break;
+            }
+            if (batch_dev == NULL) {
+                batch_dev = page->key.dev;
+            }
+            if (page->key.dev != batch_dev) {
+                continue;
+            }
+
+            lstruct_remove(&page->dirty_entry);
+            page->dirty = 0;
+            page->ref_count++;
+            batch_dev->num_dirty--;
+
+            batch[num_batch] = page;
+            num_batch++;
+        }
+
+        if (num_batch == 0) {
+            break;
+        }
+
+        ASSERT(batch_dev->ops.write_pages != NULL);
+        int64_t res = batch_dev->ops.write_pages(batch_dev->ctx, batch, num_batch);
+        if (res == 0) {
+            batch_dev->num_writeback += num_batch;
+        } else {
+            batch_dev->num_io_errors++;
+            batch_dev->wb_error = true;
+            console_log(LOG_WARN, "bcache: %s: Writeback of %u pages failed",
+                        batch_dev->name, num_batch);
+        }
+
+        for (uint64_t idx = 0; idx < num_batch; idx++) {
+            page = batch[idx];
+            page->ref_count--;
+
+            // A page dirtied again during the write is already listed
+            if (res != 0 && !page->dirty) {
+                page->dirty = 1;
+                batch_dev->num_dirty++;
+                lstruct_prepend(failed_pages, &page->dirty_entry);
+            }
+        }
+    }
+
+    bcache_page_t* page;
+    FOREACH_LSTRUCT(failed_pages, page, dirty_entry) {
+        lstruct_remove(&page->dirty_entry);
+        lstruct_prepend(s_bcache.dirty_pages, &page->dirty_entry);
+    }
+}
+
+/*
+ * Allocate a page and insert it into the cache. The page is returned
+ * referenced and being filled. Called with the cache lock held
+ */
+static bcache_page_t* bcache_alloc_page(bcache_dev_t* dev, uint64_t page_idx) {
+
+    if (s_bcache.num_pages >= s_bcache.max_pages && !bcache_evict_one()) {
+        // Everything unreferenced is dirty. Clean it and try again,
+        // otherwise let the cache grow past its limit
+        bcache_writeback_locked(NULL);
+        bcache_evict_one();
+    }
+
+    void* phy = kmalloc_phy_nozero(BCACHE_PAGE_SIZE);
+    while (phy == NULL) {
+        if (!bcache_evict_one()) {
+            bcache_writeback_locked(NULL);
+            ASSERT(bcache_evict_one());
+        }
+        phy = kmalloc_phy_nozero(BCACHE_PAGE_SIZE);
+    }
+
+    bcache_page_t* page = slab_alloc(&s_bcache_page_cache);
+    ASSERT(page != NULL);
+
+    page->key.dev = dev;
+    page->key.page_idx = page_idx;
+    page->phy = (uintptr_t)phy;
+    page->data = PHY_TO_KSPACE_PTR(phy);
+    page->ref_count = 1;
+    page->referenced = 1;
+    page->dirty = 0;
+    page->readahead = 0;
+    page->uptodate = 0;
+    page->fill_done = false;
+    page->fill_queue.head = NULL;
+
+    hashmap_add(s_bcache.pages, &page->key, page);
+    lstruct_prepend(s_bcache.clock_pages, &page->clock_entry);
+
+    dev->num_cached++;
+    s_bcache.num_pages++;
+
+    return page;
+}
+
+static void bcache_page_hit(bcache_page_t* page) {
+
+    page->ref_count++;
+    page->referenced = 1;
+    page->key.dev->num_hits++;
+
+    if (page->readahead) {
+        page->readahead = 0;
+        page->key.dev->num_ra_hits++;
+    }
+}
+
+/*
+ * Fill pages from the device and wake any task that found them while
+ * they were being filled. Pages that fail to read are left out of date
+ * and are read again by their next user. Called without the cache lock
+ * held
+ */
+static void bcache_fill_pages(bcache_dev_t* dev, bcache_page_t** pages, uint64_t num_pages) {
+
+    int64_t res = 0;
+    if (dev->ops.read_pages != NULL) {
+        res = dev->ops.read_pages(dev->ctx, pages, num_pages);
+    } else {
+        for (uint64_t idx = 0; idx < num_pages; idx++) {
+            memset(pages[idx]->data, 0, BCACHE_PAGE_SIZE);
+        }
+    }
+
+    lock_acquire(&s_bcache.lock, true);
+
+    if (res != 0) {
+        dev->num_io_errors++;
+    }
+
+    for (uint64_t idx = 0; idx < num_pages; idx++) {
+        pages[idx]->uptodate = res == 0;
+        pages[idx]->fill_done = true;
+        wait_queue_signal(&pages[idx]->fill_queue);
+    }
+
+    lock_release(&s_bcache.lock);
+}
+
+/*
+ * Sleep until a referenced page has been filled
+ */
+static void bcache_wait_fill(bcache_page_t* page) {
+
+    wait_ctx_t wait_ctx = {
+        .signal.trywake = &page->fill_done,
+        .queue = &page->fill_queue,
+        .wake_at = 0
+    };
+
+    while (!page->fill_done) {
+        task_wait_kernel(get_active_task(), WAIT_SIGNAL, &wait_ctx, TASK_WAIT_WAKEUP, signal_wakeup_fn);
+    }
+}
+
+static bcache_page_t* bcache_lookup(bcache_dev_t* dev, uint64_t page_idx) {
+
+    bcache_key_t key = {
+        .dev = dev,
+        .page_idx = page_idx
+    };
+
+    return hashmap_get(s_bcache.pages, &key);
+}
+
+/*
+ * Get num_pages consecutive pages of a device, reading all of the ones
+ * that are not cached with one device call. Each page is returned
+ * referenced and must be released with bcache_put. Returns false and
+ * no pages if any of them could not be read
+ */
+bool bcache_get_range(bcache_dev_t* dev, uint64_t page_start,
+                      uint64_t num_pages, bcache_page_t** pages_out) {
+
+    ASSERT(dev != NULL);
+    ASSERT(pages_out != NULL);
+    ASSERT(page_start + num_pages <= dev->num_pages);
+
+    bcache_page_t* missing_local[BCACHE_IO_BATCH];
+    bcache_page_t** missing = missing_local;
+    if (num_pages > BCACHE_IO_BATCH) {
+        missing = vmalloc(num_pages * sizeof(bcache_page_t*));
+        ASSERT(missing != NULL);
+    }
+
+    lock_acquire(&s_bcache.lock, true);
+
+    uint64_t num_missing = 0;
+    for (uint64_t idx = 0; idx < num_pages; idx++) {
+        bcache_page_t* page = bcache_lookup(dev, page_start + idx);
+
+        if (page != NULL) {
+            bcache_page_hit(page);
+
+            // Retry a page whose last read failed
+            if (page->fill_done && !page->uptodate) {
+                page->fill_done = false;
+                missing[num_missing] = page;
+                num_missing++;
+            }
+        } else {
+            page = bcache_alloc_page(dev, page_start + idx);
+            missing[num_missing] = page;
+            num_missing++;
+            dev->num_misses++;
+        }
+
+        pages_out[idx] = page;
+    }
+
+    lock_release(&s_bcache.lock);
+
+    if (num_missing > 0) {
+        bcache_fill_pages(dev, missing, num_missing);
+    }
+
+    // Pages found in the cache may still be filled by another task
+    bool uptodate = true;
+    for (uint64_t idx = 0; idx < num_pages; idx++) {
+        bcache_wait_fill(pages_out[idx]);
+        if (!pages_out[idx]->uptodate) {
+            uptodate = false;
+        }
+    }
+
+    if (!uptodate) {
+        for (uint64_t idx = 0; idx < num_pages; idx++) {
+            bcache_put(pages_out[idx]);
+            pages_out[idx] = NULL;
+        }
+    }
+
+    if (missing != missing_local) {
+        vfree(missing);
+    }
+
+    return uptodate;
+}
+
+/*
+ * Get one referenced page of a device. Returns NULL if it could not be
+ * read
+ */
+bcache_page_t* bcache_get(bcache_dev_t* dev, uint64_t page_idx) {
+    bcache_page_t* page;
+    if (!bcache_get_range(dev, page_idx, 1, &page)) {
+        return NULL;
+    }
+    return page;
+}
+
+/*
+ * Get a page that the caller is going to overwrite completely. A page
+ * that is not cached is not read and starts zeroed
+ */
+bcache_page_t* bcache_get_nofill(bcache_dev_t* dev, uint64_t page_idx) {
+
+    ASSERT(dev != NULL);
+    ASSERT(page_idx < dev->num_pages);
+
+    lock_acquire(&s_bcache.lock, true);
+
+    bcache_page_t* page = bcache_lookup(dev, page_idx);
+
+    if (page != NULL) {
+        bcache_page_hit(page);
+    } else {
+        page = bcache_alloc_page(dev, page_idx);
+        memset(page->data, 0, BCACHE_PAGE_SIZE);
+        page->uptodate = 1;
+        page->fill_done = true;
+    }
+
+    lock_release(&s_bcache.lock);
+
+    // The caller overwrites the page, which must not race a fill
+    bcache_wait_fill(page);
+
+    if (!page->uptodate) {
+        memset(page->data, 0, BCACHE_PAGE_SIZE);
+        page->uptodate = 1;
+    }
+
+    return page;
+}
+
+/*
+ * Take another reference on a page the caller already holds
+ */
+bcache_page_t* bcache_ref(bcache_page_t* page) {
+
+    ASSERT(page != NULL);
+
+    lock_acquire(&s_bcache.lock, true);
+
+    ASSERT(page->ref_count > 0);
+    page->ref_count++;
+
+    lock_release(&s_bcache.lock);
+
+    return page;
+}
+
+void bcache_put(bcache_page_t* page) {
+
+    ASSERT(page != NULL);
+
+    lock_acquire(&s_bcache.lock, true);
+
+    ASSERT(page->ref_count > 0);
+    page->ref_count--;
+
+    lock_release(&s_bcache.lock);
+}
+
+void bcache_mark_dirty(bcache_page_t* page) {
+
+    ASSERT(page != NULL);
+    ASSERT(page->ref_count > 0);
+
+    if (page->key.dev->ops.write_pages == NULL) {
+        return;
+    }
+
+    lock_acquire(&s_bcache.lock, true);
+
+    if (!page->dirty) {
+        page->dirty = 1;
+        page->key.dev->num_dirty++;
+        lstruct_prepend(s_bcache.dirty_pages, &page->dirty_entry);
+    }
+
+    lock_release(&s_bcache.lock);
+}
+
+static uint64_t bcache_clamp_len(bcache_dev_t* dev, uint64_t offset, uint64_t len) {
+
+    uint64_t dev_size = dev->num_pages * BCACHE_PAGE_SIZE;
+
+    if (dev->num_pages == UINT64_MAX || offset + len <= dev_size) {
+        return len;
+    } else if (offset >= dev_size) {
+        return 0;
+    } else {
+        return dev_size - offset;
+    }
+}
+
+/*
+ * Copy len bytes at offset out of the cache. Misses are read in
+ * batches of up to BCACHE_IO_BATCH pages. Returns the number of bytes
+ * copied before a read failed, or -1 if nothing was
+ */
+int64_t bcache_read(bcache_dev_t* dev, uint64_t offset, void* buffer, uint64_t len) {
+
+    ASSERT(dev != NULL);
+    ASSERT(buffer != NULL);
+
+    len = bcache_clamp_len(dev, offset, len);
+
+    bcache_page_t* pages[BCACHE_IO_BATCH];
+    uint64_t count = 0;
+
+    while (count < len) {
+        uint64_t pos = offset + count;
+        uint64_t page_start = pos / BCACHE_PAGE_SIZE;
+        uint64_t page_end = PAGE_CEIL(offset + len) / BCACHE_PAGE_SIZE;
+        uint64_t num_pages = page_end - page_start;
+        if (num_pages > BCACHE_IO_BATCH) {
+            num_pages = BCACHE_IO_BATCH;
+        }
+
+        if (!bcache_get_range(dev, page_start, num_pages, pages)) {
+            return count > 0 ? count : -1;
+        }
+
+        for (uint64_t idx = 0; idx < num_pages; idx++) {
+            uint64_t page_offset = pos % BCACHE_PAGE_SIZE;
+            uint64_t copy_len = BCACHE_PAGE_SIZE - page_offset;
+            if (copy_len > len - count) {
+                copy_len = len - count;
+            }
+
+            memcpy(buffer + count, &pages[idx]->data[page_offset], copy_len);
+            count += copy_len;
+            pos += copy_len;
+
+            bcache_put(pages[idx]);
+        }
+    }
+
+    return count;
+}
+
+/*
+ * Copy len bytes into the cache at offset. Pages that are only partly
+ * written are read first. The data reaches the device on the next
+ * writeback. Returns the number of bytes copied before a read failed,
+ * or -1 if nothing was
+ */
+int64_t bcache_write(bcache_dev_t* dev, uint64_t offset, const void* buffer, uint64_t len) {
+
+    ASSERT(dev != NULL);
+    ASSERT(buffer != NULL);
+
+    len = bcache_clamp_len(dev, offset, len);
+
+    uint64_t count = 0;
+
+    while (count < len) {
+        uint64_t pos = offset + count;
+        uint64_t page_offset = pos % BCACHE_PAGE_SIZE;
+        uint64_t copy_len = BCACHE_PAGE_SIZE - page_offset;
+        if (copy_len > len - count) {
+            copy_len = len - count;
+        }
+
+        bcache_page_t* page;
+        if (copy_len == BCACHE_PAGE_SIZE) {
+            page = bcache_get_nofill(dev, pos / BCACHE_PAGE_SIZE);
+        } else {
+            page = bcache_get(dev, pos / BCACHE_PAGE_SIZE);
+            if (page == NULL) {
+                return count > 0 ? count : -1;
+            }
+        }
+
+        memcpy(&page->data[page_offset], buffer + count, copy_len);
+        bcache_mark_dirty(page);
+        bcache_put(page);
+
+        count += copy_len;
+    }
+
+    return count;
+}
+
+/*
+ * Fill a batch of read-ahead pages and drop the references the batch
+ * held on them
+ */
+static void bcache_ra_fill(bcache_dev_t* dev, bcache_page_t** pages, uint64_t num_pages) {
+
+    bcache_fill_pages(dev, pages, num_pages);
+
+    lock_acquire(&s_bcache.lock, true);
+
+    dev->num_ra_pages += num_pages;
+    for (uint64_t idx = 0; idx < num_pages; idx++) {
+        pages[idx]->ref_count--;
+    }
+
+    lock_release(&s_bcache.lock);
+}
+
+/*
+ * Start filling the pages of a range that are not cached, without
+ * keeping references to them. The pages are added to the cache as
+ * being filled and are read by the read-ahead task, so the caller does
+ * not wait for the device. Pages read this way count as read-ahead
+ * until they are first used. A failed read is retried by the first
+ * user of the page
+ */
+void bcache_readahead(bcache_dev_t* dev, uint64_t page_start, uint64_t num_pages) {
+
+    ASSERT(dev != NULL);
+
+    if (dev->ops.read_pages == NULL || page_start >= dev->num_pages) {
+        return;
+    }
+    if (num_pages > dev->num_pages - page_start) {
+        num_pages = dev->num_pages - page_start;
+    }
+
+    dev->ra_window = num_pages * BCACHE_PAGE_SIZE;
+
+    bcache_page_t* missing[BCACHE_IO_BATCH];
+
+    lock_acquire(&s_bcache.lock, true);
+
+    uint64_t idx = 0;
+    while (idx < num_pages) {
+
+        // Read-ahead is only a hint, drop what does not fit the queue
+        bool queued = s_bcache.ra_running;
+        if (queued && s_bcache.ra_tail - s_bcache.ra_head >= BCACHE_RA_QUEUE_LEN) {
+            break;
+        }
+
+        bcache_page_t** batch = missing;
+        if (queued) {
+            batch = s_bcache.ra_queue[s_bcache.ra_tail % BCACHE_RA_QUEUE_LEN].pages;
+        }
+
+        uint64_t num_missing = 0;
+        for (; idx < num_pages && num_missing < BCACHE_IO_BATCH; idx++) {
+            if (bcache_lookup(dev, page_start + idx) != NULL) {
+                continue;
+            }
+
+            bcache_page_t* page = bcache_alloc_page(dev, page_start + idx);
+            page->readahead = 1;
+            batch[num_missing] = page;
+            num_missing++;
+        }
+
+        if (num_missing == 0) {
+            continue;
+        }
+
+        if (queued) {
+            bcache_ra_batch_t* ra_batch = &s_bcache.ra_queue[s_bcache.ra_tail % BCACHE_RA_QUEUE_LEN];
+            ra_batch->dev = dev;
+            ra_batch->num_pages = num_missing;
+            s_bcache.ra_tail++;
+
+            s_bcache.ra_wake = true;
+            wait_queue_signal(&s_bcache.ra_wait_queue);
+        } else {
+            // Before the read-ahead task runs the pages are read here
+            lock_release(&s_bcache.lock);
+            bcache_ra_fill(dev, missing, num_missing);
+            lock_acquire(&s_bcache.lock, true);
+        }
+    }
+
+    lock_release(&s_bcache.lock);
+}
+
+/*
+ * Record a read of len bytes at offset. Returns how many bytes to read
+ * ahead from *start_out, or 0 if nothing needs to be read ahead
+ */
+uint64_t bcache_ra_update(bcache_ra_t* ra, uint64_t offset, uint64_t len, uint64_t* start_out) {
+
+    ASSERT(ra != NULL);
+    ASSERT(start_out != NULL);
+
+    uint64_t read_end = offset + len;
+
+    if (offset != ra->next) {
+        ra->next = read_end;
+        ra->end = 0;
+        ra->window = 0;
+        return 0;
+    }
+
+    ra->next = read_end;
+
+    if (ra->window == 0) {
+        ra->window = BCACHE_RA_MIN;
+    }
+
+    // Wait until the reader is half way through what was read ahead
+    if (read_end + ra->window / 2 <= ra->end) {
+        return 0;
+    }
+
+    uint64_t start = read_end > ra->end ? read_end : ra->end;
+    ra->end = read_end + ra->window;
+
+    if (ra->window < BCACHE_RA_MAX) {
+        ra->window *= 2;
+    }
+
+    *start_out = start;
+    return ra->end - start;
+}
+
+void bcache_sync_dev(bcache_dev_t* dev) {
+
+    ASSERT(dev != NULL);
+
+    lock_acquire(&s_bcache.lock, true);
+    bcache_writeback_locked(dev);
+    lock_release(&s_bcache.lock);
+}
+
+/*
+ * Write back the dirty pages of a device and wait until the device
+ * has made them durable. Returns -1 if a writeback of the device has
+ * failed since the last fsync, or if the flush failed
+ */
+int64_t bcache_fsync_dev(bcache_dev_t* dev) {
+
+    ASSERT(dev != NULL);
+
+    lock_acquire(&s_bcache.lock, true);
+    bcache_writeback_locked(dev);
+
+    int64_t ret = dev->wb_error ? -1 : 0;
+    dev->wb_error = false;
+
+    if (dev->ops.flush != NULL) {
+        if (dev->ops.flush(dev->ctx) != 0) {
+            dev->num_io_errors++;
+            ret = -1;
+        }
+        dev->num_flush++;
+    }
+    lock_release(&s_bcache.lock);
+
+    return ret;
+}
+
+void bcache_sync_all(void) {
+
+    lock_acquire(&s_bcache.lock, true);
+    bcache_writeback_locked(NULL);
+    lock_release(&s_bcache.lock);
+}
+
+static void bcache_writeback_thread(void* ctx) {
+
+    while (true) {
+        task_wait_timer_in(BCACHE_WRITEBACK_INTERVAL_US);
+        bcache_sync_all();
+    }
+}
+
+void bcache_start_writeback(void) {
+    uint64_t tid = create_kernel_task(8192, bcache_writeback_thread, NULL, "bcache-wb");
+    task_set_priority(get_task_for_tid(tid), TASK_PRIORITY_LOW);
+}
+
+static void bcache_readahead_thread(void* ctx) {
+
+    wait_ctx_t wait_ctx = {
+        .signal.trywake = &s_bcache.ra_wake,
+        .queue = &s_bcache.ra_wait_queue,
+        .wake_at = 0
+    };
+
+    while (true) {
+        lock_acquire(&s_bcache.lock, true);
+
+        if (s_bcache.ra_head == s_bcache.ra_tail) {
+            s_bcache.ra_wake = false;
+            lock_release(&s_bcache.lock);
+            task_wait_kernel(get_active_task(), WAIT_SIGNAL, &wait_ctx, TASK_WAIT_WAKEUP, signal_wakeup_fn);
+            continue;
+        }
+
+        // The slot stays in use until the batch is filled
+        bcache_ra_batch_t* ra_batch = &s_bcache.ra_queue[s_bcache.ra_head % BCACHE_RA_QUEUE_LEN];
+
+        lock_release(&s_bcache.lock);
+
+        bcache_ra_fill(ra_batch->dev, ra_batch->pages, ra_batch->num_pages);
+
+        lock_acquire(&s_bcache.lock, true);
+        s_bcache.ra_head++;
+        lock_release(&s_bcache.lock);
+    }
+}
+
+/*
+ * Start the task that fills read-ahead pages. Until it runs,
+ * bcache_readahead reads the pages itself
+ */
+void bcache_start_readahead(void) {
+    create_kernel_task(8192, bcache_readahead_thread, NULL, "bcache-ra");
+    s_bcache.ra_running = true;
+}
+
+void bcache_get_stat(bcache_stat_t* stat_out) {
+
+    ASSERT(stat_out != NULL);
+
+    memset(stat_out, 0, sizeof(bcache_stat_t));
+
+    stat_out->num_pages = s_bcache.num_pages;
+    stat_out->max_pages = s_bcache.max_pages;
+    stat_out->num_evicted = s_bcache.num_evicted;
+
+    bcache_dev_t* dev;
+    FOR_LLIST(s_bcache.devs, dev)
+        stat_out->num_dirty += dev->num_dirty;
+        stat_out->num_hits += dev->num_hits;
+        stat_out->num_misses += dev->num_misses;
+        stat_out->num_writeback += dev->num_writeback;
+    END_FOR_LLIST()
+}
+
+bcache_dev_t* bcache_get_dev(uint64_t dev_idx) {
+    return llist_at(s_bcache.devs, dev_idx);
+}
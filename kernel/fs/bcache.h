@@ -0,0 +1,133 @@
+#ifndef __FS_BCACHE_H__
+#define __FS_BCACHE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "kernel/vmem.h"
+#include "kernel/task.h"
+#include "kernel/lib/lstruct.h"
+
+#define BCACHE_PAGE_SIZE VMEM_PAGE_SIZE
+
+// Dirty pages are written back at least this often
+#define BCACHE_WRITEBACK_INTERVAL_US (5 * 1000 * 1000)
+
+// Read-ahead window bounds for sequential access
+#define BCACHE_RA_MIN (4 * BCACHE_PAGE_SIZE)
+#define BCACHE_RA_MAX (64 * BCACHE_PAGE_SIZE)
+
+struct bcache_dev_;
+struct bcache_page_;
+
+// Fill or write back a batch of pages. The pages are in no particular
+// order and are all from the same device. Returns 0 on success, or -1
+// if any page failed, in which case the whole batch is treated as failed
+typedef int64_t (*bcache_io_fn)(void* ctx, struct bcache_page_** pages, uint64_t num_pages);
+
+typedef struct {
+    bcache_io_fn read_pages;    /* NULL if the device has no backing store */
+    bcache_io_fn write_pages;   /* NULL if the device has no backing store */
+    int64_t (*flush)(void* ctx); /* Optional, makes completed writes durable */
+} bcache_dev_ops_t;
+
+typedef struct bcache_dev_ {
+    char name[32];
+    bcache_dev_ops_t ops;
+    void* ctx;
+    uint64_t num_pages;         /* Size of the device, UINT64_MAX if unbounded */
+
+    uint64_t num_cached;
+    uint64_t num_dirty;
+    uint64_t num_hits;
+    uint64_t num_misses;
+    uint64_t num_writeback;
+    uint64_t num_flush;
+    uint64_t num_io_errors;
+    bool wb_error;              /* A writeback failed since the last fsync */
+
+    uint64_t ra_window;         /* Size of the last read-ahead in bytes */
+    uint64_t num_ra_pages;      /* Pages read ahead */
+    uint64_t num_ra_hits;       /* Pages read ahead that were used */
+} bcache_dev_t;
+
+typedef struct {
+    bcache_dev_t* dev;
+    uint64_t page_idx;
+} bcache_key_t;
+
+/**
+ * A cached page of a device. The page stays in the cache while it is
+ * referenced. Unreferenced clean pages are evicted with the CLOCK
+ * algorithm when the cache is full or memory runs out. A page is in
+ * the cache while it is being filled, and tasks that look it up sleep
+ * on fill_queue until the fill is done.
+ */
+typedef struct bcache_page_ {
+    bcache_key_t key;
+    uint8_t* data;
+    uintptr_t phy;
+
+    uint32_t ref_count;
+    uint32_t referenced:1;      /* Used since the clock hand last passed */
+    uint32_t dirty:1;
+    uint32_t readahead:1;       /* Read ahead and not used yet */
+    uint32_t uptodate:1;        /* Data holds the device contents */
+
+    bool fill_done;             /* False while the page is being filled */
+    wait_queue_t fill_queue;
+
+    lstruct_t clock_entry;
+    lstruct_t dirty_entry;
+} bcache_page_t;
+
+/**
+ * Sequential access state of one reader. The window starts small when
+ * a reader continues where its last read ended and doubles each time
+ * more is read ahead, up to BCACHE_RA_MAX. Any other access resets it.
+ */
+typedef struct {
+    uint64_t next;              /* Offset a sequential read starts at */
+    uint64_t end;               /* Read ahead up to here */
+    uint64_t window;            /* 0 while access is not sequential */
+} bcache_ra_t;
+
+typedef struct {
+    uint64_t num_pages;
+    uint64_t max_pages;
+    uint64_t num_dirty;
+    uint64_t num_hits;
+    uint64_t num_misses;
+    uint64_t num_evicted;
+    uint64_t num_writeback;
+} bcache_stat_t;
+
+void bcache_init(void);
+void bcache_start_writeback(void);
+void bcache_start_readahead(void);
+
+bcache_dev_t* bcache_register_dev(const char* name, const bcache_dev_ops_t* ops,
+                                  void* ctx, uint64_t num_pages);
+
+bcache_page_t* bcache_get(bcache_dev_t* dev, uint64_t page_idx);
+bool bcache_get_range(bcache_dev_t* dev, uint64_t page_start,
+                      uint64_t num_pages, bcache_page_t** pages_out);
+bcache_page_t* bcache_get_nofill(bcache_dev_t* dev, uint64_t page_idx);
+bcache_page_t* bcache_ref(bcache_page_t* page);
+void bcache_put(bcache_page_t* page);
+void bcache_mark_dirty(bcache_page_t* page);
+
+int64_t bcache_read(bcache_dev_t* dev, uint64_t offset, void* buffer, uint64_t len);
+int64_t bcache_write(bcache_dev_t* dev, uint64_t offset, const void* buffer, uint64_t len);
+
+void bcache_readahead(bcache_dev_t* dev, uint64_t page_start, uint64_t num_pages);
+uint64_t bcache_ra_update(bcache_ra_t* ra, uint64_t offset, uint64_t len, uint64_t* start_out);
+
+void bcache_sync_dev(bcache_dev_t* dev);
+int64_t bcache_fsync_dev(bcache_dev_t* dev);
+void bcache_sync_all(void);
+
+void bcache_get_stat(bcache_stat_t* stat_out);
+bcache_dev_t* bcache_get_dev(uint64_t dev_idx);
+
+#endif
@@ -8,6 +8,7 @@
 #include "kernel/fd.h"
 #include "kernel/task.h"
 #include "kernel/lib/vmalloc.h"
+#include "kernel/lib/slab.h"
 #include "kernel/lock/lock.h"
 #include "kernel/lock/lock.h"
 #include "kernel/lock/mutex.h"
@@ -21,6 +22,7 @@
 
 #include "stdlib/bitutils.h"
 
+#include "kernel/fs/ext2/ext2.h"
 #include "kernel/fs/ext2/ext2_helpers.h"
 #include "kernel/fs/ext2/ext2_structures.h"
 
@@ -34,9 +36,15 @@ typedef struct {
 } ext2_fid_ctx_t;
 
 typedef struct {
-    uint32_t block_num;
+    uint32_t block_num;         /* 0 for a hole */
+    uint64_t file_block;
+    bcache_page_t* page;        /* Cache page holding the block, if cached */
 } ext2_fid_entry_ctx_t;
 
+static llist_head_t s_ext2_mounts;
+
+static slab_cache_t s_ext2_fid_entry_cache = SLAB_CACHE_INIT("ext2_fid_entry", ext2_fid_entry_ctx_t);
+
 typedef struct {
     file_data_t* filedata;
     ext2_inode_t* inode;
@@ -70,6 +78,12 @@ static int64_t ext2_mount(int64_t disk_fd, void** ctx_out) {
     fs_ctx->disk_fd = disk_fd;
     fs_ctx->disk_fd_ctx = get_kernel_fd(disk_fd);
 
+    // Disks without a block cache are accessed through the fd
+    fs_ctx->bcache = NULL;
+    if (fd_call_ioctl_ptr(fs_ctx->disk_fd_ctx, BLK_IOCTL_GET_BCACHE, &fs_ctx->bcache) < 0) {
+        fs_ctx->bcache = NULL;
+    }
+
     uint8_t sb[1024];
     int64_t sb_idx = 0;
     int64_t res;
@@ -123,6 +137,10 @@ static int64_t ext2_mount(int64_t disk_fd, void** ctx_out) {
 
     mutex_init(&fs_ctx->fs_lock, 32);
 
+    ext2_ind_cache_init(fs_ctx);
+    ext2_dcache_init(&fs_ctx->dcache);
+    ext2_bitmaps_init(fs_ctx);
+
     fs_ctx->sb_dirty = false;
     fs_ctx->bgs_dirty = false;
 
@@ -132,6 +150,8 @@ static int64_t ext2_mount(int64_t disk_fd, void** ctx_out) {
                                       8,
                                       fs_ctx);
 
+    llist_append_ptr(s_ext2_mounts, fs_ctx);
+
     *ctx_out = fs_ctx;
 
     return 0;
@@ -142,21 +162,39 @@ ext2_mount_failure:
     return -1;
 }
 
+/*
+ * File blocks are used in place in the block cache when a block fits in
+ * a cache page. The page is held until the last open file is closed
+ */
+static bool ext2_file_block_cached(ext2_fs_ctx_t* fs) {
+    return fs->bcache != NULL && BLOCK_SIZE(fs->sb) <= BCACHE_PAGE_SIZE;
+}
+
 static void ext2_file_populate_data(void* ctx, file_data_entry_t* entry) {
 
     ext2_fid_ctx_t* file_ctx = ctx;
     ext2_fid_entry_ctx_t* entry_ctx = entry->ctx;
+    ext2_fs_ctx_t* fs = file_ctx->fs_ctx;
 
-    const uint32_t block_size = BLOCK_SIZE(file_ctx->fs_ctx->sb);
-    const uint64_t alloc_size = ((entry->len + block_size - 1) / block_size) * block_size;
-    entry->data = vmalloc(alloc_size);
+    const uint32_t block_size = BLOCK_SIZE(fs->sb);
 
     lock_acquire(&file_ctx->inode_lock, true);
-    lock_acquire(&file_ctx->fs_ctx->fs_lock, true);
+    lock_acquire(&fs->fs_lock, true);
 
-    ext2_read_block(file_ctx->fs_ctx, entry_ctx->block_num, entry->data);
+    if (ext2_file_block_cached(fs) && entry_ctx->block_num != 0) {
+        uint64_t block_offset = (uint64_t)entry_ctx->block_num * block_size;
 
-    lock_release(&file_ctx->fs_ctx->fs_lock);
+        entry_ctx->page = bcache_get(fs->bcache, block_offset / BCACHE_PAGE_SIZE);
+        ASSERT(entry_ctx->page != NULL);
+        entry->data = &entry_ctx->page->data[block_offset % BCACHE_PAGE_SIZE];
+    } else {
+        const uint64_t alloc_size = ((entry->len + block_size - 1) / block_size) * block_size;
+        entry->data = vmalloc(alloc_size);
+
+        ext2_read_block(fs, entry_ctx->block_num, entry->data);
+    }
+
+    lock_release(&fs->fs_lock);
     lock_release(&file_ctx->inode_lock);
 
     entry->available = 1;
@@ -169,24 +207,70 @@ static void ext2_file_new_data(void* ctx, llist_head_t new_entries, uint64_t len
 
     // Allocate len bytes for the file
     uint64_t num_blocks = BLOCKS_FOR_LEN(len, block_size);
-    uint64_t start_offset = file_ctx->inode->blocks * block_size;
+
+    // New blocks always follow every block already in the file data
+    uint64_t file_block = file_ctx->file_ctx->file_data->num_entries;
+
+    lock_acquire(&file_ctx->fs_ctx->fs_lock, true);
+
+    // New files are created with their first block. Every other block
+    // is allocated in as few contiguous runs as possible
+    uint32_t* block_nums = vmalloc(num_blocks * sizeof(uint32_t));
+    ASSERT(block_nums != NULL);
 
     for (uint64_t idx = 0; idx < num_blocks; idx++) {
-        file_data_entry_t* entry = vmalloc(sizeof(file_data_entry_t));
+        block_nums[idx] = ext2_get_inode_block_num(file_ctx->fs_ctx, file_ctx->inode, file_block + idx);
+    }
 
-        uint64_t block_num = ext2_alloc_block_to_inode(file_ctx->fs_ctx, file_ctx->inode);
+    uint64_t run_idx = 0;
+    while (run_idx < num_blocks) {
+        if (block_nums[run_idx] != 0) {
+            run_idx++;
+            continue;
+        }
+
+        uint64_t num_unmapped = 1;
+        while (run_idx + num_unmapped < num_blocks && block_nums[run_idx + num_unmapped] == 0) {
+            num_unmapped++;
+        }
 
-        uintptr_t block_data_phy = (uintptr_t)kmalloc_phy(block_size);
-        uint8_t* block_data_ptr = PHY_TO_KSPACE_PTR(block_data_phy);
+        uint64_t num_alloc = ext2_alloc_blocks_to_inode(file_ctx->fs_ctx, file_ctx->inode,
+                                                        file_block + run_idx, num_unmapped,
+                                                        &block_nums[run_idx]);
+        ASSERT(num_alloc == num_unmapped);
+        run_idx += num_unmapped;
+    }
 
-        memset(block_data_ptr, 0, block_size);
+    for (uint64_t idx = 0; idx < num_blocks; idx++) {
+        file_data_entry_t* entry = file_alloc_data_entry();
+        uint64_t block_num = block_nums[idx];
 
-        ext2_fid_entry_ctx_t* entry_ctx = vmalloc(sizeof(ext2_fid_entry_ctx_t));
+        ext2_fid_entry_ctx_t* entry_ctx = slab_alloc(&s_ext2_fid_entry_cache);
         entry_ctx->block_num = block_num;
+        entry_ctx->file_block = file_block + idx;
+        entry_ctx->page = NULL;
+
+        uint8_t* block_data_ptr;
+        if (ext2_file_block_cached(file_ctx->fs_ctx)) {
+            // A new block does not need its old contents read
+            uint64_t block_offset = block_num * block_size;
+            uint64_t page_idx = block_offset / BCACHE_PAGE_SIZE;
+            if (block_size == BCACHE_PAGE_SIZE) {
+                entry_ctx->page = bcache_get_nofill(file_ctx->fs_ctx->bcache, page_idx);
+            } else {
+                entry_ctx->page = bcache_get(file_ctx->fs_ctx->bcache, page_idx);
+                ASSERT(entry_ctx->page != NULL);
+            }
+            block_data_ptr = &entry_ctx->page->data[block_offset % BCACHE_PAGE_SIZE];
+            memset(block_data_ptr, 0, block_size);
+        } else {
+            // Taken from the pre-zeroed pool where possible
+            uintptr_t block_data_phy = (uintptr_t)kmalloc_phy(block_size);
+            block_data_ptr = PHY_TO_KSPACE_PTR(block_data_phy);
+        }
 
         entry->data = block_data_ptr;
         entry->len = block_size;
-        entry->offset = start_offset + idx * block_size;
         entry->ctx = entry_ctx;
         entry->dirty = 1;
         entry->available = 1;
@@ -194,28 +278,137 @@ static void ext2_file_new_data(void* ctx, llist_head_t new_entries, uint64_t len
         llist_append_ptr(new_entries, entry);
     }
 
+    vfree(block_nums);
+
+    lock_release(&file_ctx->fs_ctx->fs_lock);
+
     file_ctx->inode_dirty = true;
     ext2_mark_sb_dirty(file_ctx->fs_ctx);
 }
 
+/*
+ * Add the entry for the next block of the file. Blocks are only looked
+ * up when the file layer first reaches them
+ */
+static file_data_entry_t* ext2_file_map_data(void* ctx, uint64_t entry_idx) {
+
+    ext2_fid_ctx_t* file_ctx = ctx;
+    ext2_fs_ctx_t* fs = file_ctx->fs_ctx;
+    const uint32_t block_size = BLOCK_SIZE(fs->sb);
+
+    if (entry_idx * block_size >= ext2_get_inode_size(fs, file_ctx->inode)) {
+        return NULL;
+    }
+
+    lock_acquire(&file_ctx->inode_lock, true);
+    lock_acquire(&fs->fs_lock, true);
+
+    uint32_t block_num = ext2_get_inode_block_num(fs, file_ctx->inode, entry_idx);
+
+    lock_release(&fs->fs_lock);
+    lock_release(&file_ctx->inode_lock);
+
+    file_data_entry_t* entry = file_alloc_data_entry();
+    ext2_fid_entry_ctx_t* entry_ctx = slab_alloc(&s_ext2_fid_entry_cache);
+    entry_ctx->block_num = block_num;
+    entry_ctx->file_block = entry_idx;
+    entry_ctx->page = NULL;
+
+    entry->data = NULL;
+    entry->len = block_size;
+    entry->ctx = entry_ctx;
+    entry->dirty = 0;
+    entry->available = 0;
+
+    return entry;
+}
+
+static bool ext2_block_is_zero(const uint8_t* data, uint32_t block_size) {
+    for (uint32_t idx = 0; idx < block_size; idx++) {
+        if (data[idx] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * A hole is given a block when it is first flushed with data in it.
+ * Holes left zero stay holes
+ */
 static void ext2_file_flush_data(void* ctx, file_data_entry_t* entry) {
     
     ext2_fid_ctx_t* file_ctx = ctx;
+    ext2_fs_ctx_t* fs = file_ctx->fs_ctx;
     
     ext2_fid_entry_ctx_t* entry_ctx = entry->ctx;
+
+    if (entry_ctx->block_num == 0) {
+        ASSERT(entry_ctx->page == NULL);
+
+        if (ext2_block_is_zero(entry->data, BLOCK_SIZE(fs->sb))) {
+            entry->dirty = 0;
+            return;
+        }
+
+        lock_acquire(&file_ctx->inode_lock, true);
+        lock_acquire(&fs->fs_lock, true);
+
+        uint64_t num_alloc = ext2_alloc_blocks_to_inode(fs, file_ctx->inode,
+                                                        entry_ctx->file_block, 1,
+                                                        &entry_ctx->block_num);
+        ASSERT(num_alloc == 1);
+
+        lock_release(&fs->fs_lock);
+        lock_release(&file_ctx->inode_lock);
+
+        file_ctx->inode_dirty = true;
+        ext2_mark_sb_dirty(fs);
+    }
+
     uint32_t block_num = entry_ctx->block_num;
+    ASSERT(block_num != 0);
+
+    if (entry_ctx->page != NULL) {
+        bcache_mark_dirty(entry_ctx->page);
+    } else {
+        ext2_write_block(fs, block_num, entry->data);
+    }
 
-    ext2_write_block(file_ctx->fs_ctx, block_num, entry->data);
+    entry->dirty = 0;
 }
 
-static int64_t ext2_file_close(void* ctx) {
+/*
+ * Give the cache pages of an unused file back to the block cache. They
+ * are looked up again on the next open
+ */
+static void ext2_file_release_pages(file_data_t* file_data) {
+
+    for (uint64_t idx = 0; idx < file_data->num_entries; idx++) {
+        file_data_entry_t* entry = file_data->entries[idx];
+        ext2_fid_entry_ctx_t* entry_ctx = entry->ctx;
+        if (entry_ctx->page != NULL) {
+            if (entry->dirty) {
+                bcache_mark_dirty(entry_ctx->page);
+                entry->dirty = 0;
+            }
+            bcache_put(entry_ctx->page);
+            entry_ctx->page = NULL;
+            entry->data = NULL;
+            entry->available = 0;
+        }
+    }
+}
 
-    file_data_t* file_data = ctx;
-    ext2_fid_ctx_t* ext2_file_ctx = file_data->op_ctx;
+static void ext2_file_flush_inode(ext2_fid_ctx_t* ext2_file_ctx) {
+
+    file_data_t* file_data = ext2_file_ctx->file_ctx->file_data;
 
     // Update Inode
-    if (ext2_file_ctx->inode->size != file_data->size) {
+    if (ext2_file_ctx->inode->size != file_data->size ||
+        ext2_file_ctx->inode_dirty) {
         ext2_file_ctx->inode->size = file_data->size;
+        ext2_file_ctx->inode_dirty = false;
 
         // Write inode
         ext2_flush_inode(ext2_file_ctx->fs_ctx, ext2_file_ctx->inode_num, ext2_file_ctx->inode);
@@ -223,138 +416,120 @@ static int64_t ext2_file_close(void* ctx) {
 
     // Flush filesystem metadata
     ext2_flush_fs(ext2_file_ctx->fs_ctx);
+}
 
-    lock_acquire(&file_data->ref_lock, true);
-    file_data->ref_count--;
-    lock_release(&file_data->ref_lock);
+/*
+ * The file's blocks have already been marked dirty in the cache. Write
+ * the metadata and have the disk write everything back durably
+ */
+static int64_t ext2_file_sync(void* ctx) {
 
-    mutex_destroy(&ext2_file_ctx->inode_lock);
+    ext2_fid_ctx_t* ext2_file_ctx = ctx;
 
-    // TODO: Free file_data cache when appropriate
-    // if (file_data->ref_count == 0) {
-        // vfree(ext2_file_ctx);
-    // }
+    ext2_file_flush_inode(ext2_file_ctx);
 
-    return 0;
+    return fd_call_ioctl(ext2_file_ctx->fs_ctx->disk_fd_ctx, IOCTL_FSYNC, NULL, 0);
 }
 
+/*
+ * Blocks are shared with mappings only when a block fills a cache page
+ */
+static bcache_page_t* ext2_file_get_page(void* ctx, file_data_entry_t* entry) {
 
-static file_data_t* ext2_create_file_data(ext2_fid_ctx_t* file_ctx) {
+    ext2_fid_entry_ctx_t* entry_ctx = entry->ctx;
 
-    file_data_t* file_data = vmalloc(sizeof(file_data_t));
-    file_data->data_list = llist_create();
-    
-    // Only support direct and 1 indirect blocks right now...
+    if (entry_ctx->page == NULL || entry->len != BCACHE_PAGE_SIZE) {
+        return NULL;
+    }
 
-    int size_remaining = file_ctx->inode->size;
-    uint64_t offset = 0;
-    const uint32_t block_size = BLOCK_SIZE(file_ctx->fs_ctx->sb);
-    for (int idx = 0; idx < 12; idx++) {
-        // Break if no file data is present
-        if (file_ctx->inode->block_direct[idx] == 0) {
-            break;
-        }
+    return bcache_ref(entry_ctx->page);
+}
 
-        file_data_entry_t* fd_entry = vmalloc(sizeof(file_data_entry_t));
-        ext2_fid_entry_ctx_t* entry_ctx = vmalloc(sizeof(ext2_fid_entry_ctx_t));
-        entry_ctx->block_num = file_ctx->inode->block_direct[idx];
+static int64_t ext2_file_close(void* ctx) {
 
-        fd_entry->data = NULL;
-        fd_entry->len = block_size;
-        fd_entry->offset = offset;
-        fd_entry->ctx = entry_ctx;
-        fd_entry->dirty = 0;
-        fd_entry->available = 0;
+    file_data_t* file_data = ctx;
+    ext2_fid_ctx_t* ext2_file_ctx = file_data->op_ctx;
 
-        llist_append_ptr(file_data->data_list, fd_entry);
+    ext2_file_flush_inode(ext2_file_ctx);
 
-        size_remaining -= block_size;
-        offset += block_size;
+    lock_acquire(&file_data->ref_lock, true);
+    file_data->ref_count--;
+    if (file_data->ref_count == 0) {
+        ext2_file_release_pages(file_data);
     }
+    lock_release(&file_data->ref_lock);
 
-    if (file_ctx->inode->block_1indirect != 0) {
-        uint32_t* indirect_block = vmalloc(block_size);
-
-        ext2_read_block(file_ctx->fs_ctx,
-                        file_ctx->inode->block_1indirect,
-                        (void*)indirect_block);
-
-        for (int idx = 0; idx < EXT2_BLOCKS_PER_BLOCK(file_ctx->fs_ctx); idx++) {
-            if (indirect_block[idx] == 0) {
-                break;
-            }
+    mutex_destroy(&ext2_file_ctx->inode_lock);
 
-            ASSERT(size_remaining > 0);
+    // TODO: Free file_data cache when appropriate
+    // if (file_data->ref_count == 0) {
+        // vfree(ext2_file_ctx);
+    // }
 
-            file_data_entry_t* fd_entry = vmalloc(sizeof(file_data_entry_t));
-            ext2_fid_entry_ctx_t* entry_ctx = vmalloc(sizeof(ext2_fid_entry_ctx_t));
-            entry_ctx->block_num = indirect_block[idx];
+    return 0;
+}
 
-            fd_entry->data = NULL;
-            fd_entry->len = block_size;
-            fd_entry->offset = offset;
-            fd_entry->ctx = entry_ctx;
-            fd_entry->dirty = 0;
-            fd_entry->available = 0;
 
-            llist_append_ptr(file_data->data_list, fd_entry);
+/*
+ * Read ahead the cache pages holding a run of file blocks. Blocks that
+ * are adjacent on disk are read with a single request
+ */
+static void ext2_file_readahead(void* ctx, file_data_entry_t** entries, uint64_t num_entries) {
 
-            size_remaining -= block_size;
-            offset += block_size;
-        }
+    ext2_fid_ctx_t* file_ctx = ctx;
+    ext2_fs_ctx_t* fs = file_ctx->fs_ctx;
+    const uint32_t block_size = BLOCK_SIZE(fs->sb);
 
-        vfree(indirect_block);
+    if (!ext2_file_block_cached(fs)) {
+        return;
     }
 
-    if (file_ctx->inode->block_2indirect != 0) {
-        uint32_t* indirect2_block = vmalloc(block_size);
-        uint32_t* indirect1_block = vmalloc(block_size);
-
-        ext2_read_block(file_ctx->fs_ctx,
-                        file_ctx->inode->block_2indirect,
-                        (void*)indirect2_block);
-
-        for (int idx2 = 0; idx2 < EXT2_BLOCKS_PER_BLOCK(file_ctx->fs_ctx); idx2++) {
-            if (indirect2_block[idx2] == 0) {
-                break;
-            }
-
-            ext2_read_block(file_ctx->fs_ctx,
-                            indirect2_block[idx2],
-                            (void*)indirect1_block);
-
-            for (int idx1 = 0; idx1 < EXT2_BLOCKS_PER_BLOCK(file_ctx->fs_ctx); idx1++) {
-                if (indirect1_block[idx1] == 0) {
-                    break;
-                }
-
-                ASSERT(size_remaining > 0);
+    uint64_t run_start = 0;
+    uint64_t run_len = 0;
 
-                file_data_entry_t* fd_entry = vmalloc(sizeof(file_data_entry_t));
-                ext2_fid_entry_ctx_t* entry_ctx = vmalloc(sizeof(ext2_fid_entry_ctx_t));
-                entry_ctx->block_num = indirect1_block[idx1];
+    for (uint64_t idx = 0; idx < num_entries; idx++) {
+        ext2_fid_entry_ctx_t* entry_ctx = entries[idx]->ctx;
 
-                fd_entry->data = NULL;
-                fd_entry->len = block_size;
-                fd_entry->offset = offset;
-                fd_entry->ctx = entry_ctx;
-                fd_entry->dirty = 0;
-                fd_entry->available = 0;
+        if (entries[idx]->available || entry_ctx->block_num == 0) {
+            continue;
+        }
 
-                llist_append_ptr(file_data->data_list, fd_entry);
+        uint64_t page_idx = ((uint64_t)entry_ctx->block_num * block_size) / BCACHE_PAGE_SIZE;
 
-                size_remaining -= block_size;
-                offset += block_size;
+        if (run_len > 0 && page_idx >= run_start && page_idx < run_start + run_len) {
+            // Several blocks share the page
+            continue;
+        } else if (run_len > 0 && page_idx == run_start + run_len) {
+            run_len++;
+        } else {
+            if (run_len > 0) {
+                bcache_readahead(fs->bcache, run_start, run_len);
             }
+            run_start = page_idx;
+            run_len = 1;
         }
     }
 
+    if (run_len > 0) {
+        bcache_readahead(fs->bcache, run_start, run_len);
+    }
+}
+
+static file_data_t* ext2_create_file_data(ext2_fid_ctx_t* file_ctx) {
+
+    file_data_t* file_data = vmalloc(sizeof(file_data_t));
+    file_data_init(file_data);
+
     file_data->size = file_ctx->inode->size;
     file_data->ref_count = 0;
     file_data->close_op = ext2_file_close;
     file_data->populate_op = ext2_file_populate_data;
     file_data->new_data_op = ext2_file_new_data;
     file_data->flush_data_op = ext2_file_flush_data;
+    file_data->map_op = ext2_file_map_data;
+    file_data->readahead_op = ext2_file_readahead;
+    file_data->sync_op = ext2_file_sync;
+    file_data->get_page_op = ext2_file_get_page;
     file_data->op_ctx = NULL;
     mutex_init(&file_data->ref_lock, 16);
 
@@ -413,7 +588,11 @@ static int64_t ext2_open(void* ctx, const char* file, const uint64_t flags, void
     }
 
     file_ctx->seek_idx = 0;
+    file_ctx->cursor = 0;
+    memset(&file_ctx->ra, 0, sizeof(bcache_ra_t));
     file_ctx->can_write = 1;
+    file_ctx->close_pending = 0;
+    file_ctx->num_maps = 0;
     file_ctx->fd_ctx = fd_ctx;
     file_ctx->file_data->op_ctx = ext2_file_ctx;
 
@@ -445,5 +624,24 @@ static fs_ops_t ext2_opts = {
 
 void ext2_register() {
 
+    s_ext2_mounts = llist_create();
+
     fs_manager_register_filesystem(&ext2_opts, FS_TYPE_EXT2);
 }
+
+bool ext2_get_stat(uint64_t mount_idx, ext2_stat_t* stat_out) {
+
+    ext2_fs_ctx_t* fs_ctx = llist_at(s_ext2_mounts, mount_idx);
+    if (fs_ctx == NULL) {
+        return false;
+    }
+
+    stat_out->disk_fd = fs_ctx->disk_fd;
+    stat_out->num_ind_hits = fs_ctx->ind_cache.num_hits;
+    stat_out->num_ind_misses = fs_ctx->ind_cache.num_misses;
+    stat_out->num_dcache_entries = hashmap_len(fs_ctx->dcache.dentries);
+    stat_out->num_dcache_hits = fs_ctx->dcache.num_hits;
+    stat_out->num_dcache_misses = fs_ctx->dcache.num_misses;
+
+    return true;
+}
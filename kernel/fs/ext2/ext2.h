@@ -2,6 +2,20 @@
 #ifndef __EXT2_H__
 #define __EXT2_H__
 
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct {
+    int64_t disk_fd;
+    uint64_t num_ind_hits;
+    uint64_t num_ind_misses;
+    uint64_t num_dcache_entries;
+    uint64_t num_dcache_hits;
+    uint64_t num_dcache_misses;
+} ext2_stat_t;
+
 void ext2_register(void);
 
+bool ext2_get_stat(uint64_t mount_idx, ext2_stat_t* stat_out);
+
 #endif
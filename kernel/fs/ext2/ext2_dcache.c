@@ -0,0 +1,135 @@
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "kernel/assert.h"
+#include "kernel/lib/hashmap.h"
+#include "kernel/lib/lstruct.h"
+#include "kernel/lib/slab.h"
+
+#include "kernel/fs/ext2/ext2_dcache.h"
+
+static slab_cache_t s_ext2_dentry_cache = SLAB_CACHE_INIT("ext2_dentry", ext2_dentry_t);
+
+#define EXT2_DENTRY_FROM_LRU(entry) \
+    ((ext2_dentry_t*)((uintptr_t)(entry) - offsetof(ext2_dentry_t, lru_entry)))
+
+/*
+ * The list head does not track its last entry, so the tail is kept
+ * up to date as entries are unlinked
+ */
+static void ext2_dcache_lru_remove(ext2_dcache_t* dcache, ext2_dentry_t* dentry) {
+
+    if (dcache->lru_tail == &dentry->lru_entry) {
+        dcache->lru_tail = dentry->lru_entry.p == dcache->lru ? NULL : dentry->lru_entry.p;
+    }
+
+    lstruct_remove(&dentry->lru_entry);
+}
+
+static void ext2_dcache_lru_prepend(ext2_dcache_t* dcache, ext2_dentry_t* dentry) {
+
+    lstruct_prepend(dcache->lru, &dentry->lru_entry);
+
+    if (dcache->lru_tail == NULL) {
+        dcache->lru_tail = &dentry->lru_entry;
+    }
+}
+
+static uint64_t ext2_dcache_hash(void* key) {
+    ext2_dentry_t* dentry = key;
+    return hashmap_hash_bytes(dentry->name, dentry->name_len, dentry->dir_inode);
+}
+
+static bool ext2_dcache_cmp(void* key1, void* key2) {
+    ext2_dentry_t* dentry1 = key1;
+    ext2_dentry_t* dentry2 = key2;
+
+    return dentry1->dir_inode == dentry2->dir_inode &&
+           dentry1->name_len == dentry2->name_len &&
+           memcmp(dentry1->name, dentry2->name, dentry1->name_len) == 0;
+}
+
+static void ext2_dcache_free(void* ctx, void* key, void* dataptr) {
+    ext2_dcache_t* dcache = ctx;
+    ext2_dentry_t* dentry = dataptr;
+
+    ext2_dcache_lru_remove(dcache, dentry);
+    slab_free(&s_ext2_dentry_cache, dentry);
+}
+
+void ext2_dcache_init(ext2_dcache_t* dcache) {
+
+    dcache->dentries = hashmap_alloc(ext2_dcache_hash,
+                                     ext2_dcache_cmp,
+                                     ext2_dcache_free,
+                                     10,
+                                     dcache);
+    lstruct_init_head(&dcache->lru);
+    dcache->lru_tail = NULL;
+    dcache->num_hits = 0;
+    dcache->num_misses = 0;
+}
+
+static void ext2_dcache_key(ext2_dentry_t* key, const uint32_t dir_inode_num,
+                            const char* name, const uint8_t name_len) {
+    key->dir_inode = dir_inode_num;
+    key->name_len = name_len;
+    memcpy(key->name, name, name_len);
+    key->name[name_len] = '\0';
+}
+
+/*
+ * Find a cached entry and make it the most recently used. Returns NULL
+ * if the name is not cached
+ */
+ext2_dentry_t* ext2_dcache_get(ext2_dcache_t* dcache, const uint32_t dir_inode_num,
+                               const char* name, const uint8_t name_len) {
+
+    ext2_dentry_t key;
+    ext2_dcache_key(&key, dir_inode_num, name, name_len);
+
+    ext2_dentry_t* dentry = hashmap_get(dcache->dentries, &key);
+    if (dentry == NULL) {
+        dcache->num_misses++;
+        return NULL;
+    }
+
+    dcache->num_hits++;
+    ext2_dcache_lru_remove(dcache, dentry);
+    ext2_dcache_lru_prepend(dcache, dentry);
+
+    return dentry;
+}
+
+void ext2_dcache_add(ext2_dcache_t* dcache, const uint32_t dir_inode_num,
+                     const char* name, const uint8_t name_len,
+                     const uint32_t inode_num) {
+
+    // Unlinked and freed by ext2_dcache_free
+    if (hashmap_len(dcache->dentries) >= EXT2_DCACHE_MAX) {
+        ASSERT(dcache->lru_tail != NULL);
+        hashmap_del(dcache->dentries, EXT2_DENTRY_FROM_LRU(dcache->lru_tail));
+    }
+
+    ext2_dentry_t* dentry = slab_alloc(&s_ext2_dentry_cache);
+    ASSERT(dentry != NULL);
+    ext2_dcache_key(dentry, dir_inode_num, name, name_len);
+    dentry->inode = inode_num;
+
+    hashmap_add(dcache->dentries, dentry, dentry);
+    ext2_dcache_lru_prepend(dcache, dentry);
+}
+
+/*
+ * Drop the cached entry for a name, called when the directory changes
+ */
+void ext2_dcache_drop(ext2_dcache_t* dcache, const uint32_t dir_inode_num,
+                      const char* name, const uint8_t name_len) {
+
+    ext2_dentry_t key;
+    ext2_dcache_key(&key, dir_inode_num, name, name_len);
+    hashmap_del(dcache->dentries, &key);
+}
@@ -0,0 +1,53 @@
+
+#ifndef __EXT2_DCACHE_H__
+#define __EXT2_DCACHE_H__
+
+#include <stdint.h>
+
+#include "kernel/lib/hashmap.h"
+#include "kernel/lib/lstruct.h"
+
+// Longest name a directory entry can hold
+#define EXT2_NAME_MAX 255
+
+// Number of directory entries kept per filesystem
+#define EXT2_DCACHE_MAX 1024
+
+/**
+ * A cached directory entry. An inode of 0 records that the name does
+ * not exist in the directory.
+ */
+typedef struct {
+    uint32_t dir_inode;
+    uint32_t inode;
+    uint8_t name_len;
+    char name[EXT2_NAME_MAX + 1];
+
+    lstruct_t lru_entry;
+} ext2_dentry_t;
+
+/**
+ * Path lookups go through a hashmap keyed by (directory inode, name),
+ * so repeated opens of a path do not scan any directory blocks. Once
+ * the cache is full the least recently used entry is dropped. Adding
+ * a name to a directory drops the entry for that name.
+ */
+typedef struct {
+    hashmap_ctx_t* dentries;
+    lstruct_head_t lru;         /* Most recently used first */
+    lstruct_t* lru_tail;        /* Least recently used, NULL if empty */
+    uint64_t num_hits;
+    uint64_t num_misses;
+} ext2_dcache_t;
+
+void ext2_dcache_init(ext2_dcache_t* dcache);
+
+ext2_dentry_t* ext2_dcache_get(ext2_dcache_t* dcache, const uint32_t dir_inode_num,
+                               const char* name, const uint8_t name_len);
+void ext2_dcache_add(ext2_dcache_t* dcache, const uint32_t dir_inode_num,
+                     const char* name, const uint8_t name_len,
+                     const uint32_t inode_num);
+void ext2_dcache_drop(ext2_dcache_t* dcache, const uint32_t dir_inode_num,
+                      const char* name, const uint8_t name_len);
+
+#endif
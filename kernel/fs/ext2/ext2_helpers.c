@@ -7,6 +7,7 @@
 #include "kernel/assert.h"
 #include "kernel/fd.h"
 #include "kernel/console.h"
+#include "kernel/lib/slab.h"
 #include "kernel/lib/vmalloc.h"
 
 #include "kernel/fs/ext2/ext2_helpers.h"
@@ -16,7 +17,6 @@
 
 #include "stdlib/bitutils.h"
 
-
 void ext2_get_inode_idx(ext2_superblock_t* sb, const uint32_t inode,
                         uint32_t* bg_out, uint32_t* ino_idx_out) {
     ASSERT(bg_out != NULL);
@@ -27,8 +27,53 @@ void ext2_get_inode_idx(ext2_superblock_t* sb, const uint32_t inode,
     *ino_idx_out = (inode - 1) % sb->inodes_per_group;
 }
 
+void ext2_ind_cache_init(ext2_fs_ctx_t* fs) {
+
+    for (uint64_t idx = 0; idx < EXT2_IND_CACHE_SLOTS; idx++) {
+        fs->ind_cache.entries[idx].block = 0;
+        fs->ind_cache.entries[idx].ptrs = NULL;
+    }
+
+    fs->ind_cache.num_hits = 0;
+    fs->ind_cache.num_misses = 0;
+}
+
+/*
+ * Drop every cached indirect block overlapping a disk write
+ */
+static void ext2_ind_cache_invalidate(ext2_fs_ctx_t* fs, const uint64_t offset, const uint64_t size) {
+
+    if (size == 0) {
+        return;
+    }
+
+    const uint64_t block_size = BLOCK_SIZE(fs->sb);
+    uint64_t first_block = offset / block_size;
+    uint64_t last_block = (offset + size - 1) / block_size;
+
+    if (last_block - first_block >= EXT2_IND_CACHE_SLOTS) {
+        for (uint64_t idx = 0; idx < EXT2_IND_CACHE_SLOTS; idx++) {
+            fs->ind_cache.entries[idx].block = 0;
+        }
+        return;
+    }
+
+    for (uint64_t block = first_block; block <= last_block; block++) {
+        ext2_ind_cache_entry_t* entry = &fs->ind_cache.entries[block % EXT2_IND_CACHE_SLOTS];
+        if (entry->block == block) {
+            entry->block = 0;
+        }
+    }
+}
+
 void ext2_disk_read(ext2_fs_ctx_t* fs, uint64_t offset, void* buffer, uint64_t size) {
 
+    if (fs->bcache != NULL) {
+        int64_t res = bcache_read(fs->bcache, offset, buffer, size);
+        ASSERT(res == size);
+        return;
+    }
+
     int64_t res;
     uint64_t seek_args[2] = {offset, 0};
     res = fd_call_ioctl(fs->disk_fd_ctx, IOCTL_SEEK, seek_args, 2);
@@ -80,80 +125,172 @@ uint64_t ext2_get_inode_size(ext2_fs_ctx_t* fs, const ext2_inode_t* inode) {
 }
 
 
-uint32_t ext2_get_inode_block_num(ext2_fs_ctx_t* fs, const ext2_inode_t* inode, const uint32_t block_num) {
+/*
+ * Split a file block number into the inode block pointer it is reached
+ * through and the index into each level of indirect blocks below it.
+ * Returns the number of indirect levels
+ */
+static uint32_t ext2_block_path(ext2_fs_ctx_t* fs, const uint64_t block_num,
+                                uint32_t* slot_out, uint32_t idx_out[3]) {
 
-    const uint32_t num_direct_blocks = EXT2_BLOCK_DIRECT_MAX(fs);
-    const uint32_t num_1indirect_blocks = EXT2_BLOCK_1INDIRECT_MAX(fs);
-    const uint32_t num_2indirect_blocks = EXT2_BLOCK_2INDIRECT_MAX(fs);
-    const uint32_t num_3indirect_blocks = EXT2_BLOCK_3INDIRECT_MAX(fs);
+    const uint64_t ptrs = EXT2_BLOCKS_PER_BLOCK(fs);
 
-    uint32_t disk_block_num = 0;
+    if (block_num < EXT2_BLOCK_DIRECT_MAX(fs)) {
+        *slot_out = block_num;
+        return 0;
+    } else if (block_num < EXT2_BLOCK_1INDIRECT_MAX(fs)) {
+        uint64_t block_idx = block_num - EXT2_BLOCK_DIRECT_MAX(fs);
+        *slot_out = EXT2_BLOCK_SLOT_1INDIRECT;
+        idx_out[0] = block_idx;
+        return 1;
+    } else if (block_num < EXT2_BLOCK_2INDIRECT_MAX(fs)) {
+        uint64_t block_idx = block_num - EXT2_BLOCK_1INDIRECT_MAX(fs);
+        *slot_out = EXT2_BLOCK_SLOT_2INDIRECT;
+        idx_out[0] = block_idx / ptrs;
+        idx_out[1] = block_idx % ptrs;
+        return 2;
+    } else {
+        ASSERT(block_num < EXT2_BLOCK_3INDIRECT_MAX(fs));
+        uint64_t block_idx = block_num - EXT2_BLOCK_2INDIRECT_MAX(fs);
+        *slot_out = EXT2_BLOCK_SLOT_3INDIRECT;
+        idx_out[0] = block_idx / (ptrs * ptrs);
+        idx_out[1] = (block_idx / ptrs) % ptrs;
+        idx_out[2] = block_idx % ptrs;
+        return 3;
+    }
+}
+
+static uint32_t ext2_get_inode_block_slot(const ext2_inode_t* inode, const uint32_t slot) {
+
+    switch (slot) {
+        case EXT2_BLOCK_SLOT_1INDIRECT:
+            return inode->block_1indirect;
+        case EXT2_BLOCK_SLOT_2INDIRECT:
+            return inode->block_2indirect;
+        case EXT2_BLOCK_SLOT_3INDIRECT:
+            return inode->block_3indirect;
+        default:
+            ASSERT(slot < 12);
+            return inode->block_direct[slot];
+    }
+}
+
+static void ext2_set_inode_block_slot(ext2_inode_t* inode, const uint32_t slot, const uint32_t block) {
+
+    switch (slot) {
+        case EXT2_BLOCK_SLOT_1INDIRECT:
+            inode->block_1indirect = block;
+            break;
+        case EXT2_BLOCK_SLOT_2INDIRECT:
+            inode->block_2indirect = block;
+            break;
+        case EXT2_BLOCK_SLOT_3INDIRECT:
+            inode->block_3indirect = block;
+            break;
+        default:
+            ASSERT(slot < 12);
+            inode->block_direct[slot] = block;
+    }
+}
 
-    if (block_num < num_direct_blocks) {
-        // Direct block
-        disk_block_num = inode->block_direct[block_num];
-    } else if (block_num < (num_1indirect_blocks + num_direct_blocks)) {
-        uint32_t* block_buffer = vmalloc(BLOCK_SIZE(fs->sb));
+static uint32_t ext2_read_block_ptr(ext2_fs_ctx_t* fs, const uint32_t block, const uint32_t idx) {
 
-        uint32_t block_idx = block_num - num_direct_blocks;
+    ext2_ind_cache_entry_t* entry = &fs->ind_cache.entries[block % EXT2_IND_CACHE_SLOTS];
+
+    if (entry->block == block) {
+        fs->ind_cache.num_hits++;
+    } else {
+        fs->ind_cache.num_misses++;
+
+        if (entry->ptrs == NULL) {
+            entry->ptrs = vmalloc(BLOCK_SIZE(fs->sb));
+            ASSERT(entry->ptrs != NULL);
+        }
 
-        ext2_read_block(fs, inode->block_1indirect, block_buffer);
+        ext2_read_block(fs, block, entry->ptrs);
+        entry->block = block;
+    }
 
-        disk_block_num = block_buffer[block_idx];
+    return entry->ptrs[idx];
+}
 
-        vfree(block_buffer);
-    } else if (block_num < num_2indirect_blocks) {
-        uint32_t* block_buffer_1 = vmalloc(BLOCK_SIZE(fs->sb));
-        uint32_t* block_buffer_2 = vmalloc(BLOCK_SIZE(fs->sb));
+static void ext2_write_block_ptr(ext2_fs_ctx_t* fs, const uint32_t block,
+                                 const uint32_t idx, const uint32_t ptr) {
 
-        uint32_t block_idx = block_num - num_1indirect_blocks;
+    ext2_ind_cache_entry_t* entry = &fs->ind_cache.entries[block % EXT2_IND_CACHE_SLOTS];
+    bool cached = entry->block == block;
 
-        uint32_t block_idx_1 = block_idx / num_1indirect_blocks;
-        uint32_t block_idx_2 = block_idx % num_1indirect_blocks;
+    ext2_disk_write(fs, (uint64_t)block * BLOCK_SIZE(fs->sb) + idx * sizeof(uint32_t),
+                    &ptr, sizeof(uint32_t));
 
-        console_log(LOG_DEBUG, "Read indirect2 block %d (%d %d %d)",
-                    block_num, block_idx, block_idx_1, block_idx_2);
+    // Keep the cached copy, which the write dropped, up to date
+    if (cached) {
+        entry->ptrs[idx] = ptr;
+        entry->block = block;
+    }
+}
 
-        ASSERT(block_idx_1 < (BLOCK_SIZE(fs->sb)/sizeof(uint32_t)));
-        ASSERT(block_idx_2 < (BLOCK_SIZE(fs->sb)/sizeof(uint32_t)));
+/*
+ * Returns the disk block holding a block of the file, 0 for a hole.
+ * Only the pointers on the path to the block are read
+ */
+uint32_t ext2_get_inode_block_num(ext2_fs_ctx_t* fs, const ext2_inode_t* inode, const uint64_t block_num) {
 
-        console_log(LOG_DEBUG, "Read indirect2 block %d", inode->block_2indirect);
-        ext2_read_block(fs, inode->block_2indirect, block_buffer_1);
+    uint32_t slot;
+    uint32_t idx[3];
+    uint32_t levels = ext2_block_path(fs, block_num, &slot, idx);
 
-        ext2_read_block(fs, block_buffer_1[block_idx_1], block_buffer_2);
+    uint32_t disk_block_num = ext2_get_inode_block_slot(inode, slot);
 
-        disk_block_num = block_buffer_2[block_idx_2];
+    for (uint32_t level = 0; level < levels && disk_block_num != 0; level++) {
+        disk_block_num = ext2_read_block_ptr(fs, disk_block_num, idx[level]);
+    }
 
-        vfree(block_buffer_1);
-        vfree(block_buffer_2);
+    return disk_block_num;
+}
 
-    } else if (block_num < num_3indirect_blocks) {
-        uint32_t* block_buffer_1 = vmalloc(BLOCK_SIZE(fs->sb));
-        uint32_t* block_buffer_2 = vmalloc(BLOCK_SIZE(fs->sb));
-        uint32_t* block_buffer_3 = vmalloc(BLOCK_SIZE(fs->sb));
+/*
+ * Point a block of the file at a disk block, allocating any missing
+ * indirect blocks on the way
+ */
+static void ext2_set_inode_block_num(ext2_fs_ctx_t* fs, ext2_inode_t* inode,
+                                     const uint64_t block_num, const uint32_t disk_block_num) {
 
-        uint32_t block_idx = block_num - num_2indirect_blocks;
+    const uint32_t block_size = BLOCK_SIZE(fs->sb);
 
-        uint32_t block_idx_1 = block_idx / num_2indirect_blocks;
-        uint32_t block_idx_2 = block_idx / num_1indirect_blocks;
-        uint32_t block_idx_3 = block_idx % num_1indirect_blocks;
+    uint32_t slot;
+    uint32_t idx[3];
+    uint32_t levels = ext2_block_path(fs, block_num, &slot, idx);
 
-        ext2_read_block(fs, inode->block_3indirect, block_buffer_1);
+    if (levels == 0) {
+        ext2_set_inode_block_slot(inode, slot, disk_block_num);
+        return;
+    }
 
-        ext2_read_block(fs, block_buffer_1[block_idx_1], block_buffer_2);
+    uint32_t ind_block = ext2_get_inode_block_slot(inode, slot);
+    if (ind_block == 0) {
+        ind_block = ext2_alloc_block(fs);
+        ASSERT(ind_block != 0);
+        ext2_zero_block(fs, ind_block);
+        inode->blocks += block_size / 512;
 
-        ext2_read_block(fs, block_buffer_2[block_idx_2], block_buffer_3);
+        ext2_set_inode_block_slot(inode, slot, ind_block);
+    }
 
-        disk_block_num = block_buffer_3[block_idx_3];
+    for (uint32_t level = 0; level < levels - 1; level++) {
+        uint32_t next_block = ext2_read_block_ptr(fs, ind_block, idx[level]);
+        if (next_block == 0) {
+            next_block = ext2_alloc_block(fs);
+            ASSERT(next_block != 0);
+            ext2_zero_block(fs, next_block);
+            inode->blocks += block_size / 512;
 
-        vfree(block_buffer_1);
-        vfree(block_buffer_2);
-        vfree(block_buffer_3);
-    } else {
-        ASSERT(0);
+            ext2_write_block_ptr(fs, ind_block, idx[level], next_block);
+        }
+        ind_block = next_block;
     }
 
-    return disk_block_num;
+    ext2_write_block_ptr(fs, ind_block, idx[levels - 1], disk_block_num);
 }
 
 void ext2_read_inode_block(ext2_fs_ctx_t* fs, const ext2_inode_t* inode,
@@ -202,7 +339,7 @@ uint32_t ext2_get_inode_in_dir(ext2_fs_ctx_t* fs, const ext2_inode_t* inode, con
     ext2_dir_entry_t* entry;
     while ((block_num * BLOCK_SIZE(fs->sb)) < (inode_size)) {
         uint32_t block_idx = 0;
-        ext2_read_inode_data(fs, inode, block_idx, 1, block_buffer);
+        ext2_read_inode_data(fs, inode, block_num, 1, block_buffer);
         while (block_idx < BLOCK_SIZE(fs->sb)) {
             entry = (ext2_dir_entry_t*)&block_buffer[block_idx];
             ASSERT(entry != NULL);
@@ -231,7 +368,31 @@ found_inode:
     return entry->inode;
 }
 
-uint32_t ext2_get_inode_for_path_rel(ext2_fs_ctx_t* fs, const ext2_inode_t* inode_start,
+/*
+ * Find a name in a directory, through the dcache
+ */
+uint32_t ext2_lookup_in_dir(ext2_fs_ctx_t* fs, const uint32_t dir_inode_num, const char* name) {
+
+    uint64_t name_len = strnlen(name, EXT2_NAME_MAX + 1);
+    if (name_len > EXT2_NAME_MAX) {
+        return 0;
+    }
+
+    ext2_dentry_t* dentry = ext2_dcache_get(&fs->dcache, dir_inode_num, name, name_len);
+    if (dentry != NULL) {
+        return dentry->inode;
+    }
+
+    ext2_inode_t dir_inode;
+    ext2_get_inode(fs, dir_inode_num, &dir_inode);
+
+    uint32_t inode_num = ext2_get_inode_in_dir(fs, &dir_inode, name);
+    ext2_dcache_add(&fs->dcache, dir_inode_num, name, name_len, inode_num);
+
+    return inode_num;
+}
+
+uint32_t ext2_get_inode_for_path_rel(ext2_fs_ctx_t* fs, const uint32_t inode_start_num,
                                  const char* path) {
 
     const uint32_t path_len = strnlen(path, 65536) + 1;
@@ -243,7 +404,7 @@ uint32_t ext2_get_inode_for_path_rel(ext2_fs_ctx_t* fs, const ext2_inode_t* inod
 
     bool last_path = false;
 
-    ext2_inode_t curr_inode = *inode_start;
+    uint32_t curr_inode_num = inode_start_num;
     uint32_t next_inode_num;
 
     while (!last_path) {
@@ -258,16 +419,16 @@ uint32_t ext2_get_inode_for_path_rel(ext2_fs_ctx_t* fs, const ext2_inode_t* inod
         path_copy[path_sep_idx] = '\0';
 
         // Do any of the inodes match the name?
-        next_inode_num = ext2_get_inode_in_dir(fs,
-                                               &curr_inode,
-                                               &path_copy[path_idx]);
+        next_inode_num = ext2_lookup_in_dir(fs,
+                                            curr_inode_num,
+                                            &path_copy[path_idx]);
 
         if (next_inode_num == 0 ||
             last_path) {
             break;
         }
 
-        ext2_get_inode(fs, next_inode_num, &curr_inode);
+        curr_inode_num = next_inode_num;
 
         path_idx = path_sep_idx + 1;
     }
@@ -279,20 +440,23 @@ uint32_t ext2_get_inode_for_path_rel(ext2_fs_ctx_t* fs, const ext2_inode_t* inod
 
 uint32_t ext2_get_inode_for_path(ext2_fs_ctx_t* fs, const char* path) {
 
-    // Find root inode
-    ext2_inode_t root_inode;
-    
-    ext2_get_inode(fs, EXT2_ROOT_INODE_NUM, &root_inode);
-
     if (path[0] == '/') {
         path += 1;
     }
 
-    return ext2_get_inode_for_path_rel(fs, &root_inode, path);
+    return ext2_get_inode_for_path_rel(fs, EXT2_ROOT_INODE_NUM, path);
 }
 
 void ext2_disk_write(ext2_fs_ctx_t* fs, const uint64_t offset, const void* buffer, uint64_t size) {
 
+    ext2_ind_cache_invalidate(fs, offset, size);
+
+    if (fs->bcache != NULL) {
+        int64_t res = bcache_write(fs->bcache, offset, buffer, size);
+        ASSERT(res == size);
+        return;
+    }
+
     int64_t res;
     uint64_t seek_args[2] = {offset, 0};
     res = fd_call_ioctl(fs->disk_fd_ctx, IOCTL_SEEK, seek_args, 2);
@@ -305,11 +469,21 @@ void ext2_disk_write(ext2_fs_ctx_t* fs, const uint64_t offset, const void* buffe
 
 void ext2_write_block(ext2_fs_ctx_t* fs, const uint64_t block, const void* buffer) {
 
+    // Block 0 marks a hole and is never written
+    ASSERT(block != 0);
+
     uint64_t block_offset = block * BLOCK_SIZE(fs->sb);
 
     ext2_disk_write(fs, block_offset, buffer, BLOCK_SIZE(fs->sb));
 }
 
+void ext2_zero_block(ext2_fs_ctx_t* fs, const uint64_t block) {
+
+    void* zero_buffer = vmalloc(BLOCK_SIZE(fs->sb));
+    ext2_write_block(fs, block, zero_buffer);
+    vfree(zero_buffer);
+}
+
 void ext2_write_blocks(ext2_fs_ctx_t* fs,
                        const uint64_t block_start,
                        const uint64_t num_blocks,
@@ -322,111 +496,216 @@ void ext2_write_blocks(ext2_fs_ctx_t* fs,
     }
 }
 
-static int64_t ext2_alloc_block_in_bitmap(uint8_t* bitmap_data, uint64_t block_size) {
+static uint32_t ext2_num_bgs(ext2_fs_ctx_t* fs) {
+    return fs->sb.blocks_count / fs->sb.blocks_per_group;
+}
 
-    for (int64_t idx = 0; idx < block_size; idx++) {
-        uint8_t byte_val = bitmap_data[idx];
-        int64_t bit_idx = 0;
-        if (byte_val != 0xFF) {
-            for (bit_idx = 0; bit_idx < 8; bit_idx++) {
-                if ((~byte_val) & (1 << bit_idx)) {
-                    break;
-                }
-            }
+static uint64_t* ext2_load_bitmap(ext2_fs_ctx_t* fs, const uint32_t block) {
+
+    uint64_t* bitmap = vmalloc(BLOCK_SIZE(fs->sb));
+    ASSERT(bitmap != NULL);
+    ext2_read_block(fs, block, bitmap);
+
+    return bitmap;
+}
 
-            bitmap_data[idx] |= (1 << bit_idx);
-            return idx * 8 + bit_idx;
+static uint64_t* ext2_get_block_bitmap(ext2_fs_ctx_t* fs, const uint32_t bg) {
+
+    ext2_bg_bitmaps_t* bitmaps = &fs->bitmaps[bg];
+    if (bitmaps->block_bitmap == NULL) {
+        bitmaps->block_bitmap = ext2_load_bitmap(fs, fs->bgs[bg].block_bitmap);
+    }
+
+    return bitmaps->block_bitmap;
+}
+
+static uint64_t* ext2_get_inode_bitmap(ext2_fs_ctx_t* fs, const uint32_t bg) {
+
+    ext2_bg_bitmaps_t* bitmaps = &fs->bitmaps[bg];
+    if (bitmaps->inode_bitmap == NULL) {
+        bitmaps->inode_bitmap = ext2_load_bitmap(fs, fs->bgs[bg].inode_bitmap);
+    }
+
+    return bitmaps->inode_bitmap;
+}
+
+void ext2_bitmaps_init(ext2_fs_ctx_t* fs) {
+
+    uint32_t num_bgs = ext2_num_bgs(fs);
+
+    fs->bitmaps = vmalloc(num_bgs * sizeof(ext2_bg_bitmaps_t));
+    ASSERT(fs->bitmaps != NULL);
+    memset(fs->bitmaps, 0, num_bgs * sizeof(ext2_bg_bitmaps_t));
+}
+
+/*
+ * Find the first clear bit at or after start. Bit n of an ext2 bitmap
+ * is bit n % 8 of byte n / 8, which is bit n % 64 of a little endian
+ * word, so a whole word of used entries is skipped at once.
+ * Returns -1 if there is none
+ */
+static int64_t ext2_bitmap_find_free(const uint64_t* bitmap, const uint64_t num_bits,
+                                     const uint64_t start) {
+
+    for (uint64_t word_idx = start / 64; word_idx * 64 < num_bits; word_idx++) {
+        uint64_t free_bits = ~bitmap[word_idx];
+        if (word_idx == start / 64) {
+            free_bits &= ~0UL << (start % 64);
+        }
+
+        if (free_bits != 0) {
+            uint64_t bit = (word_idx * 64) + __builtin_ctzl(free_bits);
+            return bit < num_bits ? (int64_t)bit : -1;
         }
     }
 
     return -1;
 }
 
-uint32_t ext2_alloc_block(ext2_fs_ctx_t* fs) {
-    
-    uint32_t block_size = BLOCK_SIZE(fs->sb);
-    uint32_t num_bgs = fs->sb.blocks_count / fs->sb.blocks_per_group;
+/*
+ * Count the clear bits starting at start, up to max_bits
+ */
+static uint64_t ext2_bitmap_free_run(const uint64_t* bitmap, const uint64_t num_bits,
+                                     const uint64_t start, const uint64_t max_bits) {
 
-    // Loop through each block group
-    uint64_t bg_idx = 0;
-    for (bg_idx = 0; bg_idx < num_bgs; bg_idx++) {
-        if (fs->bgs[bg_idx].free_blocks_count > 0) {
+    uint64_t len = 0;
+    while (len < max_bits && start + len < num_bits) {
+        uint64_t bit = start + len;
+        uint64_t used_bits = bitmap[bit / 64] >> (bit % 64);
+
+        uint64_t run = used_bits == 0 ? 64 - (bit % 64) : __builtin_ctzl(used_bits);
+        if (run == 0) {
             break;
         }
+        len += run;
     }
 
-    // Return 0 on a full disk
-    if (bg_idx >= num_bgs) {
-        return 0;
+    len = MIN(len, max_bits);
+    return MIN(len, num_bits - start);
+}
+
+static void ext2_bitmap_set_run(uint64_t* bitmap, const uint64_t start, const uint64_t len) {
+    for (uint64_t bit = start; bit < start + len; bit++) {
+        bitmap[bit / 64] |= 1UL << (bit % 64);
     }
+}
 
-    uint32_t num_bitmap_blocks = fs->sb.blocks_per_group;
-    uint8_t* b_bitmap_data = vmalloc(block_size);
-    int64_t new_block = -1;
+/*
+ * Allocate up to max_blocks contiguous blocks, as close after goal as
+ * possible. The search starts at the goal in its block group and moves
+ * on to the following groups. Returns the number of blocks allocated,
+ * 0 on a full disk
+ */
+uint32_t ext2_alloc_blocks(ext2_fs_ctx_t* fs, const uint32_t goal,
+                           const uint32_t max_blocks, uint32_t* first_out) {
+
+    ASSERT(max_blocks > 0);
+
+    const uint32_t num_bgs = ext2_num_bgs(fs);
+    const uint32_t blocks_per_group = fs->sb.blocks_per_group;
+
+    uint32_t goal_bg = 0;
+    uint32_t goal_bit = 0;
+    if (goal >= fs->sb.first_data_block) {
+        goal_bg = (goal - fs->sb.first_data_block) / blocks_per_group;
+        goal_bit = (goal - fs->sb.first_data_block) % blocks_per_group;
+    }
+    if (goal_bg >= num_bgs) {
+        goal_bg = 0;
+        goal_bit = 0;
+    }
 
-    for (uint64_t idx = 0; idx < num_bitmap_blocks; idx++) {
-        ext2_read_block(fs, fs->bgs[bg_idx].block_bitmap + idx, b_bitmap_data);
+    // The goal group is checked again from its start after all others
+    for (uint32_t idx = 0; idx <= num_bgs; idx++) {
+        uint32_t bg_idx = (goal_bg + idx) % num_bgs;
+        uint32_t start_bit = idx == 0 ? goal_bit : 0;
 
-        new_block = ext2_alloc_block_in_bitmap(b_bitmap_data, block_size);
+        if (fs->bgs[bg_idx].free_blocks_count == 0) {
+            continue;
+        }
 
-        if (new_block >= 0) {
-            new_block += idx*(8*block_size) + fs->sb.first_data_block;
+        uint64_t* bitmap = ext2_get_block_bitmap(fs, bg_idx);
 
-            ext2_write_block(fs, fs->bgs[bg_idx].block_bitmap + idx, b_bitmap_data);
-            break;
+        int64_t bit = ext2_bitmap_find_free(bitmap, blocks_per_group, start_bit);
+        if (bit < 0) {
+            continue;
         }
-    }
 
-    ASSERT(new_block > 0);
-    ASSERT(new_block <= UINT32_MAX);
+        uint64_t len = ext2_bitmap_free_run(bitmap, blocks_per_group, bit,
+                                            MIN(max_blocks, fs->bgs[bg_idx].free_blocks_count));
+        ASSERT(len > 0);
 
-    fs->bgs[bg_idx].free_blocks_count--;
-    fs->sb.free_blocks_count--;
-    fs->bgs_dirty = true;
-    fs->sb_dirty = true;
+        ext2_bitmap_set_run(bitmap, bit, len);
+        fs->bitmaps[bg_idx].block_dirty = true;
 
-    return (uint32_t)new_block;
-}
+        fs->bgs[bg_idx].free_blocks_count -= len;
+        fs->sb.free_blocks_count -= len;
+        fs->bgs_dirty = true;
+        fs->sb_dirty = true;
 
-uint32_t ext2_alloc_block_to_inode(ext2_fs_ctx_t* fs, ext2_inode_t* inode) {
+        *first_out = fs->sb.first_data_block + (bg_idx * blocks_per_group) + bit;
+        return len;
+    }
 
-    // Get a block
-    uint32_t new_block = ext2_alloc_block(fs);
+    return 0;
+}
 
-    uint32_t block_size = BLOCK_SIZE(fs->sb);
-    uint32_t blocks_div_512 = block_size / 512;
-    uint32_t inode_full_blocks = inode->blocks / blocks_div_512;
+uint32_t ext2_alloc_block(ext2_fs_ctx_t* fs) {
 
-    // Only support writing up to the 1st indirect block for now
-    ASSERT(inode_full_blocks < EXT2_BLOCK_2INDIRECT_MAX(fs));
+    uint32_t new_block;
+    if (ext2_alloc_blocks(fs, 0, 1, &new_block) == 0) {
+        return 0;
+    }
 
-    if (inode_full_blocks < EXT2_BLOCK_DIRECT_MAX(fs)) {
-        // Allocate to a direct block
-        inode->block_direct[inode_full_blocks] = new_block;
-    } else if (inode_full_blocks < EXT2_BLOCK_1INDIRECT_MAX(fs)) {
+    return new_block;
+}
 
-        uint32_t* ind_block_ptr = vmalloc(block_size);
-        if (inode->block_1indirect == 0) {
-            uint32_t indirect_block = ext2_alloc_block(fs);
-            inode->block_1indirect = indirect_block;
+/*
+ * Allocate blocks for num_blocks file blocks starting at block_num.
+ * Each run is placed right after the disk block before it in the file,
+ * so a file that grows at the end stays contiguous on disk. Returns the
+ * number of blocks allocated, fewer than asked for on a full disk
+ */
+uint64_t ext2_alloc_blocks_to_inode(ext2_fs_ctx_t* fs, ext2_inode_t* inode,
+                                    const uint64_t block_num, const uint64_t num_blocks,
+                                    uint32_t* blocks_out) {
+
+    uint32_t goal = 0;
+    if (block_num > 0) {
+        goal = ext2_get_inode_block_num(fs, inode, block_num - 1);
+        if (goal != 0) {
+            goal++;
+        }
+    }
 
-            memset(ind_block_ptr, 0, block_size);
-        } else {
-            ext2_read_block(fs, inode->block_1indirect, ind_block_ptr);
+    uint64_t num_done = 0;
+    while (num_done < num_blocks) {
+        uint32_t first_block;
+        uint32_t num_run = ext2_alloc_blocks(fs, goal, MIN(num_blocks - num_done, UINT32_MAX),
+                                             &first_block);
+        if (num_run == 0) {
+            break;
         }
 
-        uint32_t ind_block_offset = inode_full_blocks - EXT2_BLOCK_1INDIRECT_MAX(fs);
+        for (uint32_t idx = 0; idx < num_run; idx++) {
+            ext2_set_inode_block_num(fs, inode, block_num + num_done + idx, first_block + idx);
+            inode->blocks += BLOCK_SIZE(fs->sb) / 512;
+            blocks_out[num_done + idx] = first_block + idx;
+        }
 
-        ind_block_ptr[ind_block_offset] = new_block;
+        num_done += num_run;
+        goal = first_block + num_run;
+    }
 
-        ext2_write_block(fs, inode->block_1indirect, ind_block_ptr);
+    return num_done;
+}
 
-        vfree(ind_block_ptr);
-    } else {
-        ASSERT(0);
-    }
+uint32_t ext2_alloc_block_to_inode(ext2_fs_ctx_t* fs, ext2_inode_t* inode, const uint64_t block_num) {
 
-    inode->blocks *= blocks_div_512;
+    // Get a block
+    uint32_t new_block;
+    uint64_t num_alloc = ext2_alloc_blocks_to_inode(fs, inode, block_num, 1, &new_block);
+    ASSERT(num_alloc == 1);
 
     return new_block;
 }
@@ -461,6 +740,20 @@ void ext2_flush_inode(ext2_fs_ctx_t* fs, const uint32_t inode_num, const ext2_in
 
 void ext2_flush_fs(ext2_fs_ctx_t* fs) {
 
+    uint32_t num_bgs = ext2_num_bgs(fs);
+    for (uint32_t bg_idx = 0; bg_idx < num_bgs; bg_idx++) {
+        ext2_bg_bitmaps_t* bitmaps = &fs->bitmaps[bg_idx];
+
+        if (bitmaps->block_dirty) {
+            ext2_write_block(fs, fs->bgs[bg_idx].block_bitmap, bitmaps->block_bitmap);
+            bitmaps->block_dirty = false;
+        }
+        if (bitmaps->inode_dirty) {
+            ext2_write_block(fs, fs->bgs[bg_idx].inode_bitmap, bitmaps->inode_bitmap);
+            bitmaps->inode_dirty = false;
+        }
+    }
+
     if (fs->bgs_dirty) {
 
         uint32_t bg_block;
@@ -470,7 +763,6 @@ void ext2_flush_fs(ext2_fs_ctx_t* fs) {
             bg_block = 1;
         }
 
-        uint32_t num_bgs = fs->sb.blocks_count / fs->sb.blocks_per_group;
         uint32_t num_bgdisk_blocks = ((num_bgs * sizeof(ext2_blockgroup_t)) + BLOCK_SIZE(fs->sb) - 1) / BLOCK_SIZE(fs->sb);
 
         ext2_write_blocks(fs, bg_block, num_bgdisk_blocks, fs->bgs);
@@ -479,23 +771,9 @@ void ext2_flush_fs(ext2_fs_ctx_t* fs) {
     }
 
     if (fs->sb_dirty) {
-        
-        int64_t res;
-        uint64_t seek_args[2] = {1024, 0};
-        res = fd_call_ioctl(fs->disk_fd_ctx, IOCTL_SEEK, seek_args, 2);
-        ASSERT(res >= 0)
-
-        uint8_t* sb_buffer = vmalloc(1024);
-        res = fd_call_read(fs->disk_fd_ctx, sb_buffer, 1024, 0);
-        ASSERT(res >= 0)
-
-        memcpy(sb_buffer, &fs->sb, sizeof(ext2_superblock_t));
 
-        res = fd_call_ioctl(fs->disk_fd_ctx, IOCTL_SEEK, seek_args, 2);
-        ASSERT(res >= 0)
-
-        res = fd_call_write(fs->disk_fd_ctx, sb_buffer, 1024, 0);
-        ASSERT(res >= 0);
+        // The rest of the superblock area is left as it is on disk
+        ext2_disk_write(fs, 1024, &fs->sb, sizeof(ext2_superblock_t));
 
         fs->sb_dirty = false;
     }
@@ -531,7 +809,7 @@ const char* ext2_get_filename(const char* file) {
     return NULL;
 }
 
-ext2_inode_t* ext2_get_parent_dir_inode(ext2_fs_ctx_t* fs, const char* file) {
+ext2_inode_t* ext2_get_parent_dir_inode(ext2_fs_ctx_t* fs, const char* file, uint32_t* inode_num_out) {
 
     uint32_t new_inode_num;
     if (ext2_path_is_filename(file)) {
@@ -561,59 +839,55 @@ ext2_inode_t* ext2_get_parent_dir_inode(ext2_fs_ctx_t* fs, const char* file) {
     ext2_inode_t* new_inode = vmalloc(sizeof(ext2_inode_t));
     ext2_get_inode(fs, new_inode_num, new_inode);
 
+    *inode_num_out = new_inode_num;
     return new_inode;
 }
 
-uint32_t ext2_alloc_inode(ext2_fs_ctx_t* fs) {
+/*
+ * Allocate an inode, in the block group of goal_inode if it has room
+ * so that related inodes stay close. Returns 0 if there are no free
+ * inodes
+ */
+uint32_t ext2_alloc_inode(ext2_fs_ctx_t* fs, const uint32_t goal_inode) {
 
-    uint32_t block_size = BLOCK_SIZE(fs->sb);
-    uint32_t num_bgs = fs->sb.blocks_count / fs->sb.blocks_per_group;
+    const uint32_t num_bgs = ext2_num_bgs(fs);
+    const uint32_t inodes_per_group = fs->sb.inodes_per_group;
 
-    // Loop through each block group
-    uint64_t bg_idx = 0;
-    for (bg_idx = 0; bg_idx < num_bgs; bg_idx++) {
-        if (fs->bgs[bg_idx].free_inodes_count > 0) {
-            break;
-        }
+    uint32_t goal_bg = 0;
+    if (goal_inode > 0) {
+        goal_bg = ((goal_inode - 1) / inodes_per_group) % num_bgs;
     }
 
-    // Return 0 on a full disk
-    if (bg_idx >= num_bgs) {
-        return 0;
-    }
+    for (uint32_t idx = 0; idx < num_bgs; idx++) {
+        uint32_t bg_idx = (goal_bg + idx) % num_bgs;
 
-    uint32_t num_bitmap_blocks = fs->sb.blocks_per_group;
-    uint8_t* b_bitmap_data = vmalloc(block_size);
-    int64_t new_inode = -1;
+        if (fs->bgs[bg_idx].free_inodes_count == 0) {
+            continue;
+        }
 
-    for (uint64_t idx = 0; idx < num_bitmap_blocks; idx++) {
+        uint64_t* bitmap = ext2_get_inode_bitmap(fs, bg_idx);
 
-        ext2_read_block(fs, fs->bgs[bg_idx].inode_bitmap + idx, b_bitmap_data);
+        int64_t bit = ext2_bitmap_find_free(bitmap, inodes_per_group, 0);
+        if (bit < 0) {
+            continue;
+        }
 
-        new_inode = ext2_alloc_block_in_bitmap(b_bitmap_data, block_size);
+        ext2_bitmap_set_run(bitmap, bit, 1);
+        fs->bitmaps[bg_idx].inode_dirty = true;
 
-        if (new_inode >= 0) {
-            // TODO: This is wrong for other block groups
-            // Inode numbers start from 1
-            new_inode += idx*(8*block_size) + 1;
+        fs->bgs[bg_idx].free_inodes_count--;
+        fs->sb.free_inodes_count--;
+        fs->bgs_dirty = true;
+        fs->sb_dirty = true;
 
-            ext2_write_block(fs, fs->bgs[bg_idx].inode_bitmap + idx, b_bitmap_data);
-            break;
-        }
+        // Inode numbers start from 1
+        return (bg_idx * inodes_per_group) + bit + 1;
     }
 
-    ASSERT(new_inode > 0);
-    ASSERT(new_inode <= UINT32_MAX);
-
-    fs->bgs[bg_idx].free_inodes_count--;
-    fs->sb.free_inodes_count--;
-    fs->bgs_dirty = true;
-    fs->sb_dirty = true;
-
-    return (uint32_t)new_inode;
+    return 0;
 }
 
-void ext2_add_file_to_directory(ext2_fs_ctx_t* fs, ext2_inode_t* dir_inode, uint32_t new_inode_num, uint8_t new_inode_type, const char* filename) {
+void ext2_add_file_to_directory(ext2_fs_ctx_t* fs, uint32_t dir_inode_num, ext2_inode_t* dir_inode, uint32_t new_inode_num, uint8_t new_inode_type, const char* filename) {
 
     const uint32_t block_size = BLOCK_SIZE(fs->sb);
     uint8_t* block_buffer = vmalloc(block_size);
@@ -663,6 +937,9 @@ void ext2_add_file_to_directory(ext2_fs_ctx_t* fs, ext2_inode_t* dir_inode, uint
 
     ext2_write_block(fs, dir_block_num, block_buffer);
 
+    // Drops a negative entry left by the lookup before the create
+    ext2_dcache_drop(&fs->dcache, dir_inode_num, filename, entry->name_len);
+
     dir_inode->size += new_rec_len;
 
     vfree(block_buffer);
@@ -673,9 +950,10 @@ uint32_t ext2_create_inode_at_path(ext2_fs_ctx_t* fs, const char* file) {
 
     uint32_t block_size = BLOCK_SIZE(fs->sb);
 
-    ext2_inode_t* parent_inode = ext2_get_parent_dir_inode(fs, file);
+    uint32_t parent_inode_num;
+    ext2_inode_t* parent_inode = ext2_get_parent_dir_inode(fs, file, &parent_inode_num);
 
-    uint32_t new_inode_num = ext2_alloc_inode(fs);
+    uint32_t new_inode_num = ext2_alloc_inode(fs, parent_inode_num);
     ASSERT(new_inode_num > 0);
 
     console_log(LOG_INFO, "Creating new inode (%d) at (%s)\n", new_inode_num, file);
@@ -705,8 +983,13 @@ uint32_t ext2_create_inode_at_path(ext2_fs_ctx_t* fs, const char* file) {
     };
 
 
-    uint32_t first_block_num = ext2_alloc_block(fs);
-    ASSERT(first_block_num > 0);
+    // Start the file's data in the block group of its inode
+    uint32_t inode_bg = (new_inode_num - 1) / fs->sb.inodes_per_group;
+    uint32_t first_block_num;
+    uint32_t num_alloc = ext2_alloc_blocks(fs,
+                                           fs->sb.first_data_block + (inode_bg * fs->sb.blocks_per_group),
+                                           1, &first_block_num);
+    ASSERT(num_alloc == 1);
     new_inode.block_direct[0] = first_block_num;
 
     uint8_t* first_block_ptr = vmalloc(block_size);
@@ -720,7 +1003,7 @@ uint32_t ext2_create_inode_at_path(ext2_fs_ctx_t* fs, const char* file) {
 
     const char* filename = ext2_get_filename(file);
 
-    ext2_add_file_to_directory(fs, parent_inode, new_inode_num, 0, filename);
+    ext2_add_file_to_directory(fs, parent_inode_num, parent_inode, new_inode_num, 0, filename);
 
     ext2_flush_fs(fs);
 
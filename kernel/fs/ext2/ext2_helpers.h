@@ -6,7 +6,10 @@
 
 #include "kernel/lock/lock.h"
 #include "kernel/lib/hashmap.h"
+#include "kernel/lib/lstruct.h"
+#include "kernel/fs/bcache.h"
 
+#include "kernel/fs/ext2/ext2_dcache.h"
 #include "kernel/fs/ext2/ext2_structures.h"
 
 #define BLOCK_SIZE(sb) (1024 << (sb.log_block_size))
@@ -17,6 +20,37 @@ typedef struct {
     void* inodes;
 } ext2_inode_cache_t;
 
+/**
+ * The block and inode bitmaps of a block group, loaded on first use.
+ * Allocations only change the copy in memory, which is written back
+ * with the rest of the filesystem metadata.
+ */
+typedef struct {
+    uint64_t* block_bitmap;     /* NULL until loaded */
+    uint64_t* inode_bitmap;     /* NULL until loaded */
+    bool block_dirty;
+    bool inode_dirty;
+} ext2_bg_bitmaps_t;
+
+// Number of decoded indirect blocks kept per filesystem
+#define EXT2_IND_CACHE_SLOTS 64
+
+typedef struct {
+    uint32_t block;             /* 0 if the slot is unused */
+    uint32_t* ptrs;
+} ext2_ind_cache_entry_t;
+
+/**
+ * Indirect blocks are kept decoded in a direct-mapped table indexed by
+ * block number, so following a block pointer does not read or copy the
+ * block. A write to a cached block drops it from the table.
+ */
+typedef struct {
+    ext2_ind_cache_entry_t entries[EXT2_IND_CACHE_SLOTS];
+    uint64_t num_hits;
+    uint64_t num_misses;
+} ext2_ind_cache_t;
+
 typedef struct {
     ext2_superblock_t sb;
     ext2_superblock_extended_t sb_ext;
@@ -27,11 +61,15 @@ typedef struct {
     ext2_blockgroup_t* bgs;
 
     ext2_inode_cache_t* inodes;
+    ext2_bg_bitmaps_t* bitmaps;
+    ext2_ind_cache_t ind_cache;
+    ext2_dcache_t dcache;
 
     hashmap_ctx_t* filecache;
 
     int64_t disk_fd;
     fd_ctx_t* disk_fd_ctx;
+    bcache_dev_t* bcache;       /* NULL if the disk is not cached */
 
     lock_t fs_lock;
 
@@ -42,6 +80,9 @@ typedef struct {
 void ext2_find_inode(ext2_superblock_t* sb, const uint32_t inode,
                      uint32_t* bg_out, uint32_t* ino_idx_out);
 
+void ext2_ind_cache_init(ext2_fs_ctx_t* fs);
+void ext2_bitmaps_init(ext2_fs_ctx_t* fs);
+
 void ext2_disk_read(ext2_fs_ctx_t* fs, uint64_t offset, void* buffer, uint64_t size);
 
 void ext2_read_block(ext2_fs_ctx_t* fs, const uint64_t block, void* buffer);
@@ -53,10 +94,16 @@ void ext2_read_blocks(ext2_fs_ctx_t* fs,
 
 void ext2_write_block(ext2_fs_ctx_t* fs, const uint64_t block, const void* buffer);
 
+void ext2_zero_block(ext2_fs_ctx_t* fs, const uint64_t block);
+
+void ext2_disk_write(ext2_fs_ctx_t* fs, const uint64_t offset, const void* buffer, uint64_t size);
+
 void ext2_populate_inode_cache(ext2_fs_ctx_t* fs, const uint32_t bg);
 
 uint64_t ext2_get_inode_size(ext2_fs_ctx_t* fs, const ext2_inode_t* inode);
 
+uint32_t ext2_get_inode_block_num(ext2_fs_ctx_t* fs, const ext2_inode_t* inode, const uint64_t block_num);
+
 void ext2_read_inode_block(ext2_fs_ctx_t* fs, const ext2_inode_t* inode,
                            const uint32_t block_num, uint8_t* buffer);
 
@@ -68,14 +115,25 @@ void ext2_get_inode(ext2_fs_ctx_t* fs, const uint32_t inode_num, ext2_inode_t* i
 
 uint32_t ext2_get_inode_in_dir(ext2_fs_ctx_t* fs, const ext2_inode_t* inode, const char* name);
 
-uint32_t ext2_get_inode_for_path_rel(ext2_fs_ctx_t* fs, const ext2_inode_t* inode_start,
+uint32_t ext2_lookup_in_dir(ext2_fs_ctx_t* fs, const uint32_t dir_inode_num, const char* name);
+
+uint32_t ext2_get_inode_for_path_rel(ext2_fs_ctx_t* fs, const uint32_t inode_start_num,
                                  const char* path);
 
 uint32_t ext2_get_inode_for_path(ext2_fs_ctx_t* fs, const char* path);
 
+uint32_t ext2_alloc_blocks(ext2_fs_ctx_t* fs, const uint32_t goal,
+                           const uint32_t max_blocks, uint32_t* first_out);
+
 uint32_t ext2_alloc_block(ext2_fs_ctx_t* fs);
 
-uint32_t ext2_alloc_block_to_inode(ext2_fs_ctx_t* fs, ext2_inode_t* inode);
+uint32_t ext2_alloc_block_to_inode(ext2_fs_ctx_t* fs, ext2_inode_t* inode, const uint64_t block_num);
+
+uint64_t ext2_alloc_blocks_to_inode(ext2_fs_ctx_t* fs, ext2_inode_t* inode,
+                                    const uint64_t block_num, const uint64_t num_blocks,
+                                    uint32_t* blocks_out);
+
+uint32_t ext2_alloc_inode(ext2_fs_ctx_t* fs, const uint32_t goal_inode);
 void ext2_mark_sb_dirty(ext2_fs_ctx_t* fs);
 
 void ext2_flush_inode(ext2_fs_ctx_t* fs, const uint32_t inode_num, const ext2_inode_t* inode);
@@ -138,6 +138,11 @@ typedef struct __attribute__((__packed__)) {
 #define EXT2_BLOCK_DIRECT_MAX(fs) (12)
 #define EXT2_BLOCK_1INDIRECT_MAX(fs) (EXT2_BLOCK_DIRECT_MAX(fs) + EXT2_BLOCKS_PER_BLOCK(fs))
 #define EXT2_BLOCK_2INDIRECT_MAX(fs) (EXT2_BLOCK_1INDIRECT_MAX(fs) + EXT2_BLOCKS_PER_BLOCK(fs) * EXT2_BLOCKS_PER_BLOCK(fs))
+// Inode block pointers past the direct blocks
+#define EXT2_BLOCK_SLOT_1INDIRECT 12
+#define EXT2_BLOCK_SLOT_2INDIRECT 13
+#define EXT2_BLOCK_SLOT_3INDIRECT 14
+
 #define EXT2_BLOCK_3INDIRECT_MAX(fs) (EXT2_BLOCK_2INDIRECT_MAX(fs) + EXT2_BLOCKS_PER_BLOCK(fs) * EXT2_BLOCKS_PER_BLOCK(fs) * EXT2_BLOCKS_PER_BLOCK(fs))
 
 typedef struct __attribute__((__packed__)) {
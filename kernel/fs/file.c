@@ -7,12 +7,129 @@
 #include <kernel/fd.h>
 #include <kernel/lib/llist.h>
 #include <kernel/lib/vmalloc.h>
+#include <kernel/lib/slab.h>
 #include <kernel/fs/file.h>
 
 #include <include/k_ioctl_common.h>
 
 #include <stdlib/bitutils.h>
 
+static slab_cache_t s_file_data_entry_cache = SLAB_CACHE_INIT("file_data_entry", file_data_entry_t);
+
+file_data_entry_t* file_alloc_data_entry(void) {
+    return slab_alloc(&s_file_data_entry_cache);
+}
+
+void file_free_data_entry(file_data_entry_t* entry) {
+    slab_free(&s_file_data_entry_cache, entry);
+}
+
+// Initial size of the entry array. It doubles when full
+#define FILE_DATA_MIN_ENTRIES 16
+
+void file_data_init(file_data_t* file_data) {
+    file_data->entries = NULL;
+    file_data->num_entries = 0;
+    file_data->max_entries = 0;
+    file_data->map_op = NULL;
+    file_data->readahead_op = NULL;
+    file_data->sync_op = NULL;
+    file_data->get_page_op = NULL;
+}
+
+/*
+ * Free the entry array. The entries themselves belong to the owner
+ * of the file data
+ */
+void file_data_destroy(file_data_t* file_data) {
+    if (file_data->entries != NULL) {
+        vfree(file_data->entries);
+    }
+    file_data_init(file_data);
+}
+
+void file_data_append_entry(file_data_t* file_data, file_data_entry_t* entry) {
+
+    if (file_data->num_entries == file_data->max_entries) {
+        uint64_t new_max = file_data->max_entries * 2;
+        if (new_max < FILE_DATA_MIN_ENTRIES) {
+            new_max = FILE_DATA_MIN_ENTRIES;
+        }
+
+        file_data_entry_t** new_entries = vmalloc(new_max * sizeof(file_data_entry_t*));
+        ASSERT(new_entries != NULL);
+
+        if (file_data->entries != NULL) {
+            memcpy(new_entries, file_data->entries,
+                   file_data->num_entries * sizeof(file_data_entry_t*));
+            vfree(file_data->entries);
+        }
+
+        file_data->entries = new_entries;
+        file_data->max_entries = new_max;
+    }
+
+    if (file_data->num_entries == 0) {
+        entry->offset = 0;
+    } else {
+        file_data_entry_t* last = file_data->entries[file_data->num_entries - 1];
+        entry->offset = last->offset + last->len;
+    }
+
+    file_data->entries[file_data->num_entries] = entry;
+    file_data->num_entries++;
+}
+
+static bool file_data_entry_contains(file_data_entry_t* entry, uint64_t pos) {
+    return pos >= entry->offset && pos < entry->offset + entry->len;
+}
+
+/*
+ * Returns the index of the entry containing pos, or -1 if pos is past
+ * the last entry. The entry at hint and the one after it are checked
+ * before searching
+ */
+int64_t file_data_find_entry(file_data_t* file_data, uint64_t pos, uint64_t hint) {
+
+    for (uint64_t idx = hint; idx < hint + 2 && idx < file_data->num_entries; idx++) {
+        if (file_data_entry_contains(file_data->entries[idx], pos)) {
+            return idx;
+        }
+    }
+
+    // Find the last entry starting at or before pos
+    uint64_t low = 0;
+    uint64_t high = file_data->num_entries;
+    while (low < high) {
+        uint64_t mid = low + (high - low) / 2;
+        if (file_data->entries[mid]->offset <= pos) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    if (low > 0 && file_data_entry_contains(file_data->entries[low - 1], pos)) {
+        return low - 1;
+    }
+
+    // Add entries up to pos if the file data is mapped on demand
+    while (file_data->map_op != NULL) {
+        file_data_entry_t* entry = file_data->map_op(file_data->op_ctx, file_data->num_entries);
+        if (entry == NULL) {
+            break;
+        }
+
+        file_data_append_entry(file_data, entry);
+
+        if (file_data_entry_contains(entry, pos)) {
+            return file_data->num_entries - 1;
+        }
+    }
+
+    return -1;
+}
+
 void* file_create_ctx(file_ctx_t* file_ctx) {
 
     file_ctx_t* ctx_out = vmalloc(sizeof(file_ctx_t));
@@ -22,53 +139,113 @@ void* file_create_ctx(file_ctx_t* file_ctx) {
     return ctx_out;
 }
 
-int64_t file_read_op(void* ctx, uint8_t* buffer, const int64_t req_size, const uint64_t flags) {
-
-    file_ctx_t* file_ctx = ctx;
+/*
+ * Copy between buffer and the file entries starting at seek_idx until
+ * len bytes are copied or the entries run out. Returns the bytes copied
+ */
+static uint64_t file_copy_entries(file_ctx_t* file_ctx, uint8_t* buffer,
+                                  uint64_t len, bool write) {
 
-    uint64_t remaining = req_size;
+    file_data_t* file_data = file_ctx->file_data;
     uint64_t count = 0;
-    uint64_t data_idx = 0;
-    file_data_entry_t* entry;
 
-    if (req_size > (file_ctx->file_data->size - file_ctx->seek_idx)) {
-        remaining = file_ctx->file_data->size - file_ctx->seek_idx;
+    int64_t idx = file_data_find_entry(file_data, file_ctx->seek_idx, file_ctx->cursor);
+    if (idx < 0) {
+        return 0;
     }
 
-    uint64_t entry_count = 0;
-    uint64_t exp_read_size = remaining;
+    while (count < len) {
+        if (idx >= file_data->num_entries) {
+            idx = file_data_find_entry(file_data, file_ctx->seek_idx, idx);
+            if (idx < 0) {
+                break;
+            }
+        }
 
-    FOR_LLIST(file_ctx->file_data->data_list, entry)
-        if (remaining == 0) {
-            break;
+        file_data_entry_t* entry = file_data->entries[idx];
+
+        if (!entry->available) {
+            ASSERT(file_data->populate_op != NULL);
+            file_data->populate_op(file_data->op_ctx, entry);
+            ASSERT(entry->available);
         }
-        entry_count++;
-
-        uint64_t end_idx = data_idx + entry->len;
-        if (file_ctx->seek_idx >= data_idx &&
-            file_ctx->seek_idx < end_idx) {
-            
-            if (!entry->available) {
-                ASSERT(file_ctx->file_data->populate_op != NULL);
-                file_ctx->file_data->populate_op(file_ctx->file_data->op_ctx, entry);
-                ASSERT(entry->available);
-            }
 
-            uint64_t remaining_block = end_idx - file_ctx->seek_idx;
-            uint64_t entry_idx = file_ctx->seek_idx - data_idx;
-            uint64_t copy_len = remaining < remaining_block ? remaining : remaining_block;
+        uint64_t entry_idx = file_ctx->seek_idx - entry->offset;
+        uint64_t remaining_block = entry->len - entry_idx;
+        uint64_t copy_len = (len - count) < remaining_block ? (len - count) : remaining_block;
 
+        if (write) {
+            memcpy(&entry->data[entry_idx], &buffer[count], copy_len);
+            entry->dirty = 1;
+        } else {
             memcpy(&buffer[count], &entry->data[entry_idx], copy_len);
-            remaining -= copy_len;
-            count += copy_len;
-            file_ctx->seek_idx += copy_len;
         }
 
-        data_idx += entry->len;
-    END_FOR_LLIST()
+        count += copy_len;
+        file_ctx->seek_idx += copy_len;
+        file_ctx->cursor = idx;
 
-    console_log(LOG_DEBUG, "Read from %d of %d bytes from %d entries", count, exp_read_size, entry_count);
-    ASSERT(count == exp_read_size);
+        idx++;
+    }
+
+    return count;
+}
+
+/*
+ * Pass the entries of the next window to the readahead op when the
+ * file is being read sequentially
+ */
+static void file_readahead(file_ctx_t* file_ctx, uint64_t pos, uint64_t len) {
+
+    file_data_t* file_data = file_ctx->file_data;
+
+    if (file_data->readahead_op == NULL) {
+        return;
+    }
+
+    uint64_t ra_start;
+    uint64_t ra_len = bcache_ra_update(&file_ctx->ra, pos, len, &ra_start);
+
+    if (ra_len == 0 || ra_start >= file_data->size) {
+        return;
+    }
+    if (ra_len > file_data->size - ra_start) {
+        ra_len = file_data->size - ra_start;
+    }
+
+    int64_t first_idx = file_data_find_entry(file_data, ra_start, file_ctx->cursor);
+    if (first_idx < 0) {
+        return;
+    }
+
+    // Maps every entry in the window
+    int64_t last_idx = file_data_find_entry(file_data, ra_start + ra_len - 1, first_idx);
+    if (last_idx < 0) {
+        last_idx = file_data->num_entries - 1;
+    }
+
+    file_data->readahead_op(file_data->op_ctx,
+                            &file_data->entries[first_idx],
+                            last_idx - first_idx + 1);
+}
+
+int64_t file_read_op(void* ctx, uint8_t* buffer, const int64_t req_size, const uint64_t flags) {
+
+    file_ctx_t* file_ctx = ctx;
+
+    uint64_t remaining = req_size;
+
+    if (req_size > (file_ctx->file_data->size - file_ctx->seek_idx)) {
+        remaining = file_ctx->file_data->size - file_ctx->seek_idx;
+    }
+
+    uint64_t pos = file_ctx->seek_idx;
+    uint64_t count = file_copy_entries(file_ctx, buffer, remaining, false);
+
+    file_readahead(file_ctx, pos, count);
+
+    console_log(LOG_DEBUG, "Read from %d of %d bytes", count, remaining);
+    ASSERT(count == remaining);
 
     return count;
 }
@@ -78,78 +255,37 @@ int64_t file_write_op(void* ctx, const uint8_t* buffer, const int64_t size, cons
     file_ctx_t* file_ctx = ctx;
 
     if (file_ctx->can_write) {
-        
-        uint64_t remaining = size;
-        uint64_t count = 0;
-        uint64_t data_idx = 0;
-        file_data_entry_t* entry;
-
-        FOR_LLIST(file_ctx->file_data->data_list, entry)
-            if (remaining == 0) {
-                // NOTE: Still walks the entire list
-                break;
-            }
 
-            uint64_t end_idx = data_idx + entry->len;
-            if (file_ctx->seek_idx >= data_idx &&
-                file_ctx->seek_idx < end_idx) {
-
-                if (!entry->available) {
-                    ASSERT(file_ctx->file_data->populate_op != NULL);
-                    file_ctx->file_data->populate_op(file_ctx->file_data->op_ctx, entry);
-                    ASSERT(entry->available);
-                }
-
-                uint64_t remaining_block = end_idx - file_ctx->seek_idx;
-                uint64_t entry_idx = file_ctx->seek_idx - data_idx;
-                uint64_t copy_len = remaining < remaining_block ? remaining : remaining_block;
-
-                memcpy(&entry->data[entry_idx], &buffer[count], copy_len);
-                remaining -= copy_len;
-                count += copy_len;
-                entry->dirty = 1;
-                file_ctx->seek_idx += copy_len;
-            }
+        file_data_t* file_data = file_ctx->file_data;
 
-            data_idx += entry->len;
-        END_FOR_LLIST()
+        uint64_t count = file_copy_entries(file_ctx, (uint8_t*)buffer, size, true);
+        uint64_t remaining = size - count;
 
         // Need to allocate more entires for this file
-        if (remaining > 0 && file_ctx->file_data->new_data_op != NULL) {
+        if (remaining > 0 && file_data->new_data_op != NULL) {
             llist_head_t new_entries = llist_create();
+            file_data_entry_t* entry;
 
             // TODO: Assumes blocks can be obtained. The following
             //       code will assert if not all blocks are added
-            file_ctx->file_data->new_data_op(file_ctx->file_data->op_ctx, new_entries, remaining);
+            file_data->new_data_op(file_data->op_ctx, new_entries, remaining);
 
+            // Every new entry is already allocated to the file, so all
+            // of them are added even if the data does not fill them
             FOR_LLIST(new_entries, entry)
-                if (remaining == 0) {
-                    // NOTE: Still walks the entire list
-                    break;
-                }
-
                 ASSERT(entry->available);
-
-                uint64_t copy_len = remaining < entry->len ? remaining : entry->len;
-
-                memcpy(entry->data, &buffer[count], copy_len);
-                remaining -= copy_len;
-                count += copy_len;
-                entry->dirty = 1;
-                file_ctx->seek_idx += copy_len;
-
-                llist_append_ptr(file_ctx->file_data->data_list, entry);
-
+                file_data_append_entry(file_data, entry);
             END_FOR_LLIST()
 
-            ASSERT(remaining == 0);
-
             llist_free_all(new_entries);
+
+            count += file_copy_entries(file_ctx, (uint8_t*)&buffer[count], remaining, true);
+            ASSERT(count == size);
         }
 
         // Update file size
-        if (file_ctx->seek_idx > file_ctx->file_data->size) {
-            file_ctx->file_data->size = file_ctx->seek_idx;
+        if (file_ctx->seek_idx > file_data->size) {
+            file_data->size = file_ctx->seek_idx;
         }
 
         return count;
@@ -159,6 +295,116 @@ int64_t file_write_op(void* ctx, const uint8_t* buffer, const int64_t size, cons
     }
 }
 
+/*
+ * Hand every dirty entry back to the owner of the file data
+ */
+static void file_flush_entries(file_data_t* file_data) {
+
+    ASSERT(file_data->flush_data_op != NULL);
+    for (uint64_t idx = 0; idx < file_data->num_entries; idx++) {
+        file_data_entry_t* entry = file_data->entries[idx];
+        if (entry->dirty) {
+            file_data->flush_data_op(file_data->op_ctx, entry);
+        }
+    }
+}
+
+/*
+ * Read or write at an offset without moving the file position. Only
+ * data the file already has is copied
+ */
+uint64_t file_read_at(file_ctx_t* file_ctx, uint64_t offset, uint8_t* buffer, uint64_t len) {
+
+    uint64_t size = file_ctx->file_data->size;
+    if (offset >= size) {
+        return 0;
+    }
+    len = len < (size - offset) ? len : (size - offset);
+
+    int64_t seek_idx = file_ctx->seek_idx;
+    file_ctx->seek_idx = offset;
+    uint64_t count = file_copy_entries(file_ctx, buffer, len, false);
+    file_ctx->seek_idx = seek_idx;
+
+    return count;
+}
+
+uint64_t file_write_at(file_ctx_t* file_ctx, uint64_t offset, const uint8_t* buffer, uint64_t len) {
+
+    uint64_t size = file_ctx->file_data->size;
+    if (offset >= size) {
+        return 0;
+    }
+    len = len < (size - offset) ? len : (size - offset);
+
+    int64_t seek_idx = file_ctx->seek_idx;
+    file_ctx->seek_idx = offset;
+    uint64_t count = file_copy_entries(file_ctx, (uint8_t*)buffer, len, true);
+    file_ctx->seek_idx = seek_idx;
+
+    return count;
+}
+
+/*
+ * Mark the entry holding offset as changed outside of file writes
+ */
+void file_mark_dirty(file_ctx_t* file_ctx, uint64_t offset) {
+
+    int64_t idx = file_data_find_entry(file_ctx->file_data, offset, file_ctx->cursor);
+    if (idx >= 0) {
+        file_ctx->file_data->entries[idx]->dirty = 1;
+    }
+}
+
+/*
+ * Get the cache page holding the file page at offset, referenced for
+ * the caller. Returns NULL if the page cannot be shared, in which case
+ * the data has to be copied
+ */
+bcache_page_t* file_get_page(file_ctx_t* file_ctx, uint64_t offset) {
+
+    file_data_t* file_data = file_ctx->file_data;
+
+    if (file_data->get_page_op == NULL) {
+        return NULL;
+    }
+
+    int64_t idx = file_data_find_entry(file_data, offset, file_ctx->cursor);
+    if (idx < 0) {
+        return NULL;
+    }
+
+    file_data_entry_t* entry = file_data->entries[idx];
+    if (entry->offset != offset || entry->len != BCACHE_PAGE_SIZE) {
+        return NULL;
+    }
+
+    if (!entry->available) {
+        ASSERT(file_data->populate_op != NULL);
+        file_data->populate_op(file_data->op_ctx, entry);
+        ASSERT(entry->available);
+    }
+
+    return file_data->get_page_op(file_data->op_ctx, entry);
+}
+
+/*
+ * Hand dirty entries to the owner of the file data, and with durable
+ * set, wait until they are on the backing device
+ */
+int64_t file_sync(file_ctx_t* file_ctx, bool durable) {
+
+    if (file_ctx->can_write) {
+        file_flush_entries(file_ctx->file_data);
+    }
+
+    if (durable && file_ctx->file_data->sync_op != NULL) {
+        return file_ctx->file_data->sync_op(file_ctx->file_data->op_ctx);
+    }
+
+    return 0;
+}
+
 int64_t file_ioctl_op(void* ctx, const uint64_t ioctl, const uint64_t* args, const uint64_t arg_count) {
 
     file_ctx_t* file_ctx = ctx;
@@ -184,6 +430,16 @@ int64_t file_ioctl_op(void* ctx, const uint64_t ioctl, const uint64_t* args, con
         case BLK_IOCTL_SIZE:
             return file_ctx->file_data->size;
             break;
+        case IOCTL_FSYNC:
+            return file_sync(file_ctx, true);
+            break;
+        case FILE_IOCTL_GET_CTX:
+            if (arg_count != 1) {
+                return -1;
+            }
+            *(file_ctx_t**)args[0] = file_ctx;
+            return 0;
+            break;
         default:
             return -1;
     }
@@ -191,20 +447,36 @@ int64_t file_ioctl_op(void* ctx, const uint64_t ioctl, const uint64_t* args, con
     return -1;
 }
 
+/*
+ * A mapping keeps the file open after its fd is closed. The file is
+ * closed when the last mapping is removed
+ */
+void file_map_get(file_ctx_t* file_ctx) {
+    file_ctx->num_maps++;
+}
+
+void file_map_put(file_ctx_t* file_ctx) {
+
+    ASSERT(file_ctx->num_maps > 0);
+    file_ctx->num_maps--;
+
+    if (file_ctx->num_maps == 0 && file_ctx->close_pending) {
+        file_ctx->close_pending = 0;
+        file_close_op(file_ctx);
+    }
+}
+
 int64_t file_close_op(void* ctx) {
 
     file_ctx_t* file_ctx = ctx;
-    file_data_entry_t* entry;
+
+    if (file_ctx->num_maps > 0) {
+        file_ctx->close_pending = 1;
+        return 0;
+    }
+
     if (file_ctx->can_write) {
-        ASSERT(file_ctx->file_data->flush_data_op != NULL);
-        FOR_LLIST(file_ctx->file_data->data_list, entry)
-            if (entry->dirty) {
-                file_ctx->file_data->flush_data_op(file_ctx->file_data->op_ctx, entry);
-            }
-            if (entry->ctx != NULL) {
-                //vfree(entry->ctx);
-            }
-        END_FOR_LLIST()
+        file_flush_entries(file_ctx->file_data);
     }
 
     file_ctx->file_data->close_op(file_ctx->file_data);
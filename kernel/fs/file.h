@@ -3,15 +3,17 @@
 #define __FS_FILE_H__
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #include <kernel/fd.h>
+#include <kernel/fs/bcache.h>
 #include <kernel/lib/llist.h>
 #include <kernel/lock/mutex.h>
 
 typedef struct {
     uint8_t* data;
     uint64_t len;
-    uint64_t offset;
+    uint64_t offset;            /* Set when the entry is added to the file */
     void* ctx;
     uint64_t dirty:1;
     uint64_t available:1;
@@ -21,8 +23,33 @@ typedef void (*populate_data_fn)(void* ctx, file_data_entry_t* entry);
 typedef void (*new_data_fn)(void* ctx, llist_head_t new_entries, uint64_t len);
 typedef void (*flush_data_fn)(void* ctx, file_data_entry_t* entry);
 
+// Returns the entry at entry_idx for data the file already has, or NULL
+// past the end of the file
+typedef file_data_entry_t* (*map_data_fn)(void* ctx, uint64_t entry_idx);
+
+// Start loading entries that are about to be read. Entries that are
+// already available may be included
+typedef void (*readahead_fn)(void* ctx, file_data_entry_t** entries, uint64_t num_entries);
+
+// Make flushed entries and file metadata durable on the backing device
+typedef int64_t (*sync_data_fn)(void* ctx);
+
+// Take a reference on the cache page holding a page sized entry, so it
+// can be mapped into a task. Returns NULL if the entry is not a page of
+// its own
+typedef bcache_page_t* (*get_page_fn)(void* ctx, file_data_entry_t* entry);
+
+/**
+ * The entries of a file are kept in an array sorted by file offset.
+ * Entries are only ever added at the end, so an offset is found with a
+ * binary search, and each open file remembers the last entry it used
+ * so sequential access does not search at all. With a map_op, entries
+ * are added on demand as the file is accessed.
+ */
 typedef struct {
-    llist_head_t data_list;
+    file_data_entry_t** entries;
+    uint64_t num_entries;
+    uint64_t max_entries;
     int64_t size;
 
     uint64_t ref_count;
@@ -32,18 +59,43 @@ typedef struct {
     populate_data_fn populate_op;
     new_data_fn new_data_op;
     flush_data_fn flush_data_op;
+    map_data_fn map_op;         /* Optional */
+    readahead_fn readahead_op;  /* Optional */
+    sync_data_fn sync_op;       /* Optional */
+    get_page_fn get_page_op;    /* Optional */
     void* op_ctx;
 } file_data_t;
 
 typedef struct {
     file_data_t* file_data;
     int64_t seek_idx;
+    uint64_t cursor;            /* Index of the entry last used */
+    bcache_ra_t ra;
     int64_t can_write:1;
+    int64_t close_pending:1;    /* Closed while still mapped */
+    uint64_t num_maps;          /* Mappings keeping the file open */
     fd_ctx_t* fd_ctx;
 } file_ctx_t;
 
 void* file_create_ctx(file_ctx_t* file_ctx);
 
+file_data_entry_t* file_alloc_data_entry(void);
+void file_free_data_entry(file_data_entry_t* entry);
+
+void file_data_init(file_data_t* file_data);
+void file_data_destroy(file_data_t* file_data);
+void file_data_append_entry(file_data_t* file_data, file_data_entry_t* entry);
+int64_t file_data_find_entry(file_data_t* file_data, uint64_t pos, uint64_t hint);
+
+uint64_t file_read_at(file_ctx_t* file_ctx, uint64_t offset, uint8_t* buffer, uint64_t len);
+uint64_t file_write_at(file_ctx_t* file_ctx, uint64_t offset, const uint8_t* buffer, uint64_t len);
+void file_mark_dirty(file_ctx_t* file_ctx, uint64_t offset);
+bcache_page_t* file_get_page(file_ctx_t* file_ctx, uint64_t offset);
+int64_t file_sync(file_ctx_t* file_ctx, bool durable);
+
+void file_map_get(file_ctx_t* file_ctx);
+void file_map_put(file_ctx_t* file_ctx);
+
 int64_t file_read_op(void* ctx, uint8_t* buffer, const int64_t size, const uint64_t flags);
 int64_t file_write_op(void* ctx, const uint8_t* buffer, const int64_t size, const uint64_t flags);
 int64_t file_ioctl_op(void* ctx, const uint64_t ioctl, const uint64_t* args, const uint64_t arg_count);
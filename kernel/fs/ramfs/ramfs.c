@@ -11,11 +11,17 @@
 #include "kernel/lib/vmalloc.h"
 #include "kernel/lib/hashmap.h"
 #include "kernel/fs/file.h"
+#include "kernel/fs/bcache.h"
 
 #include "include/k_syscall.h"
 
 typedef struct {
     hashmap_ctx_t* file_entries;
+
+    // File pages live in the block cache. The device has no backing
+    // store, so the pages are never evicted
+    bcache_dev_t* bcache;
+    uint64_t next_page;
 } ramfs_ctx_t;
 
 typedef struct {
@@ -24,15 +30,7 @@ typedef struct {
 } ramfs_file_ctx_t;
 
 static uint64_t ramfs_file_hm_hash(void* key) {
-    uint8_t* path = key;
-    uint64_t hash = 0;
-    uint64_t p = 1;
-    while (*path) {
-        hash += ((uint64_t)*path) * p;
-        p *= 31;
-        path++;
-    }
-    return hash;
+    return hashmap_hash_str(key);
 }
 
 static bool ramfs_file_hm_cmp(void* key1, void* key2) {
@@ -54,19 +52,20 @@ static void ramfs_file_populate_data(void* ctx, file_data_entry_t* entry) {
 
 static void ramfs_file_new_data(void* ctx, llist_head_t new_entries, uint64_t len) {
     ramfs_file_ctx_t* ramfs_file_ctx = ctx;
-    (void)ramfs_file_ctx;
+    ramfs_ctx_t* ramfs_ctx = ramfs_file_ctx->ramfs_ctx;
 
     // Allocate pages to fill len
     int64_t pages = PAGE_CEIL(len) / VMEM_PAGE_SIZE;
 
     for (int idx = 0; idx < pages; idx++) {
-        file_data_entry_t* entry = vmalloc(sizeof(file_data_entry_t));
+        file_data_entry_t* entry = file_alloc_data_entry();
 
-        entry->data = PHY_TO_KSPACE_PTR(kmalloc_phy(VMEM_PAGE_SIZE));
-        memset(entry->data, 0, VMEM_PAGE_SIZE);
-        entry->len = VMEM_PAGE_SIZE;
-        entry->offset = 0;
-        entry->ctx = NULL;
+        bcache_page_t* page = bcache_get_nofill(ramfs_ctx->bcache, ramfs_ctx->next_page);
+        ramfs_ctx->next_page++;
+
+        entry->data = page->data;
+        entry->len = BCACHE_PAGE_SIZE;
+        entry->ctx = page;
         entry->dirty = 0;
         entry->available = 1;
 
@@ -81,6 +80,10 @@ static void ramfs_file_flush_data(void* ctx, file_data_entry_t* entry) {
     // No-op
 }
 
+static bcache_page_t* ramfs_file_get_page(void* ctx, file_data_entry_t* entry) {
+    return bcache_ref(entry->ctx);
+}
+
 static int64_t ramfs_file_close(void* ctx) {
     ramfs_file_ctx_t* ramfs_file_ctx = ctx;
     (void)ramfs_file_ctx;
@@ -98,6 +101,14 @@ static int64_t ramfs_mount(int64_t disk_fd, void** ctx_out) {
                                             9,
                                             ramfs_ctx);
 
+    bcache_dev_ops_t bcache_ops = {
+        .read_pages = NULL,
+        .write_pages = NULL,
+        .flush = NULL
+    };
+    ramfs_ctx->bcache = bcache_register_dev("ramfs", &bcache_ops, ramfs_ctx, UINT64_MAX);
+    ramfs_ctx->next_page = 0;
+
     *ctx_out = ramfs_ctx;
 
     return 0;
@@ -118,7 +129,7 @@ static int64_t ramfs_open(void* ctx, const char* path, const uint64_t flags, voi
     ramfs_file_ctx_t* ramfs_file_ctx = NULL;
     if (flags & SYSCALL_OPEN_CREATE) {
         file_data_t* file_data = vmalloc(sizeof(file_data_t));
-        file_data->data_list = llist_create();
+        file_data_init(file_data);
         file_data->size = 0;
         file_data->ref_count = 0;
         mutex_init(&file_data->ref_lock, 16);
@@ -126,11 +137,13 @@ static int64_t ramfs_open(void* ctx, const char* path, const uint64_t flags, voi
         file_data->populate_op = ramfs_file_populate_data;
         file_data->new_data_op = ramfs_file_new_data;
         file_data->flush_data_op = ramfs_file_flush_data;
-        file_data->op_ctx = ramfs_file_ctx;
+        file_data->get_page_op = ramfs_file_get_page;
 
         ramfs_file_ctx = vmalloc(sizeof(ramfs_file_ctx_t));
         ramfs_file_ctx->file_data = file_data;
         ramfs_file_ctx->ramfs_ctx = ramfs_ctx;
+
+        file_data->op_ctx = ramfs_file_ctx;
     } else {
         ramfs_file_ctx = hashmap_get(ramfs_ctx->file_entries, (void*)path);
 
@@ -143,7 +156,11 @@ static int64_t ramfs_open(void* ctx, const char* path, const uint64_t flags, voi
     file_ctx_t* file_ctx = vmalloc(sizeof(file_ctx_t));
     file_ctx->file_data = ramfs_file_ctx->file_data;
     file_ctx->seek_idx = 0;
+    file_ctx->cursor = 0;
+    memset(&file_ctx->ra, 0, sizeof(bcache_ra_t));
     file_ctx->can_write = (flags & SYSCALL_OPEN_WRITE) != 0;
+    file_ctx->close_pending = 0;
+    file_ctx->num_maps = 0;
     file_ctx->fd_ctx = fd_ctx;
 
     fd_ctx->ctx = file_ctx;
@@ -2,6 +2,7 @@
 #include <stdint.h>
 #include <string.h>
 
+#include <kernel/assert.h>
 #include <kernel/lib/llist.h>
 #include <kernel/lib/vmalloc.h>
 #include <kernel/fd.h>
@@ -39,6 +40,10 @@ int64_t sysfs_ro_file_close(void* ctx) {
 
     file_data_t* file_ctx = ctx;
 
+    ASSERT(file_ctx->num_entries == 1);
+    file_free_data_entry(file_ctx->entries[0]);
+    file_data_destroy(file_ctx);
+
     vfree(file_ctx->op_ctx);
     vfree(file_ctx);
     return 0;
@@ -47,16 +52,16 @@ int64_t sysfs_ro_file_close(void* ctx) {
 void sysfs_ro_file_helper(void* data_str, uint64_t data_str_len, file_ctx_t* file_ctx_out) {
 
     file_data_t* file_data = vmalloc(sizeof(file_data_t));
-    file_data->data_list = llist_create();
-    
-    file_data_entry_t* data_entry = vmalloc(sizeof(file_data_entry_t));
+    file_data_init(file_data);
+
+    file_data_entry_t* data_entry = file_alloc_data_entry();
     data_entry->data = data_str;
     data_entry->len = data_str_len;
     data_entry->ctx = NULL;
     data_entry->dirty = 0;
     data_entry->available = 1;
 
-    llist_append_ptr(file_data->data_list, data_entry);
+    file_data_append_entry(file_data, data_entry);
 
     file_data->size = data_str_len;
     file_data->ref_count = 1;
@@ -176,5 +181,11 @@ void sysfs_register() {
     sysfs_task_init();
     sysfs_time_init();
     sysfs_vmalloc_init();
+    sysfs_kmalloc_init();
+    sysfs_slab_init();
+    sysfs_heap_check_init();
+    sysfs_sched_init();
     sysfs_profile_init();
+    sysfs_bcache_init();
+    sysfs_ext2_init();
 }
\ No newline at end of file
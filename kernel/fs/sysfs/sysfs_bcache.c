@@ -0,0 +1,84 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <kernel/assert.h>
+#include <kernel/fs/sysfs/sysfs.h>
+#include <kernel/fs/bcache.h>
+#include <kernel/fs/file.h>
+#include <kernel/fd.h>
+#include <kernel/lib/vmalloc.h>
+
+#include <stdlib/bitutils.h>
+#include <stdlib/printf.h>
+
+void* sysfs_bcache_stat_open(void) {
+
+    char* data_str = vmalloc(4096);
+    uint64_t data_str_len = 0;
+
+    bcache_stat_t stat;
+    bcache_get_stat(&stat);
+
+    data_str_len += snprintf(data_str, 4096,
+                             "%u %u %u %u %u %u %u\n",
+                             stat.num_pages,
+                             stat.max_pages,
+                             stat.num_dirty,
+                             stat.num_hits,
+                             stat.num_misses,
+                             stat.num_evicted,
+                             stat.num_writeback);
+
+    file_ctx_t file_ctx_in;
+
+    sysfs_ro_file_helper(data_str, data_str_len, &file_ctx_in);
+
+    void* file_ctx = file_create_ctx(&file_ctx_in);
+
+    return file_ctx;
+}
+
+void* sysfs_bcache_dev_open(void) {
+
+    char* data_str = vmalloc(4096);
+    uint64_t data_str_len = 0;
+
+    // One line per cached device
+    bcache_dev_t* dev;
+    for (uint64_t dev_idx = 0; (dev = bcache_get_dev(dev_idx)) != NULL; dev_idx++) {
+        data_str_len += snprintf(&data_str[data_str_len], 4096 - data_str_len,
+                                 "%s %u %u %u %u %u %u %u %u %u %u\n",
+                                 dev->name,
+                                 dev->num_cached,
+                                 dev->num_dirty,
+                                 dev->num_hits,
+                                 dev->num_misses,
+                                 dev->num_writeback,
+                                 dev->num_flush,
+                                 dev->ra_window,
+                                 dev->num_ra_pages,
+                                 dev->num_ra_hits,
+                                 dev->num_io_errors);
+    }
+
+    file_ctx_t file_ctx_in;
+
+    sysfs_ro_file_helper(data_str, data_str_len, &file_ctx_in);
+
+    void* file_ctx = file_create_ctx(&file_ctx_in);
+
+    return file_ctx;
+}
+
+void sysfs_bcache_init(void) {
+
+    fd_ops_t ops = {
+        .read = file_read_op,
+        .write = file_write_op,
+        .ioctl = file_ioctl_op,
+        .close = file_close_op
+    };
+
+    sysfs_create_file("bcache_stat", sysfs_bcache_stat_open, &ops);
+    sysfs_create_file("bcache_dev", sysfs_bcache_dev_open, &ops);
+}
@@ -0,0 +1,52 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <kernel/assert.h>
+#include <kernel/fs/sysfs/sysfs.h>
+#include <kernel/fs/ext2/ext2.h>
+#include <kernel/fs/file.h>
+#include <kernel/fd.h>
+#include <kernel/lib/vmalloc.h>
+
+#include <stdlib/bitutils.h>
+#include <stdlib/printf.h>
+
+void* sysfs_ext2_stat_open(void) {
+
+    char* data_str = vmalloc(4096);
+    uint64_t data_str_len = 0;
+
+    // One line per mounted filesystem
+    ext2_stat_t stat;
+    for (uint64_t mount_idx = 0; ext2_get_stat(mount_idx, &stat); mount_idx++) {
+        data_str_len += snprintf(&data_str[data_str_len], 4096 - data_str_len,
+                                 "%u %u %u %u %u %u %u\n",
+                                 mount_idx,
+                                 stat.disk_fd,
+                                 stat.num_ind_hits,
+                                 stat.num_ind_misses,
+                                 stat.num_dcache_entries,
+                                 stat.num_dcache_hits,
+                                 stat.num_dcache_misses);
+    }
+
+    file_ctx_t file_ctx_in;
+
+    sysfs_ro_file_helper(data_str, data_str_len, &file_ctx_in);
+
+    void* file_ctx = file_create_ctx(&file_ctx_in);
+
+    return file_ctx;
+}
+
+void sysfs_ext2_init(void) {
+
+    fd_ops_t ops = {
+        .read = file_read_op,
+        .write = file_write_op,
+        .ioctl = file_ioctl_op,
+        .close = file_close_op
+    };
+
+    sysfs_create_file("ext2_stat", sysfs_ext2_stat_open, &ops);
+}
@@ -0,0 +1,78 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <kernel/assert.h>
+#include <kernel/fs/sysfs/sysfs.h>
+#include <kernel/fs/file.h>
+#include <kernel/fd.h>
+#include <kernel/kmalloc.h>
+#include <kernel/lib/vmalloc.h>
+#include <kernel/lib/slab.h>
+
+#include <stdlib/bitutils.h>
+#include <stdlib/printf.h>
+#include <stdlib/malloc.h>
+
+void* sysfs_heap_check_open(void) {
+
+    char* data_str = vmalloc(4096);
+    uint64_t data_str_len = 0;
+
+    kmalloc_stat_t kmalloc_stat;
+    kmalloc_calc_stat(&kmalloc_stat);
+
+    malloc_stat_t vmalloc_stat;
+    vmalloc_calc_stat(&vmalloc_stat);
+
+    data_str_len = snprintf(data_str, 4096, "kmalloc %s %u\nvmalloc %s %u\nsample_period %u\n",
+                            malloc_check_mode_name(kmalloc_stat.check_mode),
+                            kmalloc_stat.num_checks,
+                            malloc_check_mode_name(vmalloc_stat.check_mode),
+                            vmalloc_stat.num_checks,
+                            MALLOC_CHECK_SAMPLE_PERIOD);
+
+    file_ctx_t file_ctx_in;
+
+    sysfs_ro_file_helper(data_str, data_str_len, &file_ctx_in);
+
+    void* file_ctx = file_create_ctx(&file_ctx_in);
+
+    return file_ctx;
+}
+
+// Writing "release", "sampled" or "full" switches the mode of both heaps
+// and of the slab caches
+int64_t sysfs_heap_check_write(void* ctx, const uint8_t* buffer, const int64_t size, const uint64_t flags) {
+
+    const malloc_check_mode_t modes[] = {
+        MALLOC_CHECK_RELEASE,
+        MALLOC_CHECK_SAMPLED,
+        MALLOC_CHECK_FULL
+    };
+
+    for (uint64_t idx = 0; idx < ARR_ELEMENTS(modes); idx++) {
+        const char* name = malloc_check_mode_name(modes[idx]);
+        uint64_t name_len = strlen(name);
+
+        if (size >= name_len && strncmp((const char*)buffer, name, name_len) == 0) {
+            kmalloc_set_check_mode(modes[idx]);
+            vmalloc_set_check_mode(modes[idx]);
+            slab_set_check_mode(modes[idx]);
+            return size;
+        }
+    }
+
+    return -1;
+}
+
+void sysfs_heap_check_init(void) {
+
+    fd_ops_t ops = {
+        .read = file_read_op,
+        .write = sysfs_heap_check_write,
+        .ioctl = file_ioctl_op,
+        .close = file_close_op
+    };
+
+    sysfs_create_file("heap_check", sysfs_heap_check_open, &ops);
+}
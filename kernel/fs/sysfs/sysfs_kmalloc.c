@@ -0,0 +1,55 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <kernel/assert.h>
+#include <kernel/fs/sysfs/sysfs.h>
+#include <kernel/fs/file.h>
+#include <kernel/fd.h>
+#include <kernel/kmalloc.h>
+#include <kernel/lib/vmalloc.h>
+
+#include <stdlib/bitutils.h>
+#include <stdlib/printf.h>
+
+void* sysfs_kmalloc_stat_open(void) {
+
+    char* data_str = vmalloc(4096);
+    uint64_t data_str_len = 0;
+
+    kmalloc_stat_t kmalloc_stat;
+    kmalloc_calc_stat(&kmalloc_stat);
+
+    data_str_len = snprintf(data_str, 4096, "%u %u %u %u %u %u\n",
+                            kmalloc_stat.total_mem,
+                            kmalloc_stat.avail_mem,
+                            kmalloc_stat.largest_chunk,
+                            kmalloc_stat.num_regions,
+                            kmalloc_stat.zero_pool_pages,
+                            kmalloc_stat.zero_pool_hits);
+
+    for (uint64_t order = 0; order <= KMALLOC_MAX_ORDER; order++) {
+        data_str_len += snprintf(&data_str[data_str_len], 4096 - data_str_len,
+                                 "%u%s", kmalloc_stat.free_blocks[order],
+                                 order == KMALLOC_MAX_ORDER ? "\n" : " ");
+    }
+
+    file_ctx_t file_ctx_in;
+
+    sysfs_ro_file_helper(data_str, data_str_len, &file_ctx_in);
+
+    void* file_ctx = file_create_ctx(&file_ctx_in);
+
+    return file_ctx;
+}
+
+void sysfs_kmalloc_init(void) {
+
+    fd_ops_t ops = {
+        .read = file_read_op,
+        .write = file_write_op,
+        .ioctl = file_ioctl_op,
+        .close = file_close_op
+    };
+
+    sysfs_create_file("kmalloc_stat", sysfs_kmalloc_stat_open, &ops);
+}
@@ -0,0 +1,87 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <kernel/assert.h>
+#include <kernel/fs/sysfs/sysfs.h>
+#include <kernel/fs/file.h>
+#include <kernel/fd.h>
+#include <kernel/lib/vmalloc.h>
+#include <kernel/schedule.h>
+#include <kernel/smp.h>
+
+#include <stdlib/bitutils.h>
+#include <stdlib/printf.h>
+
+void* sysfs_sched_stat_open(void) {
+
+    char* data_str = vmalloc(4096);
+    uint64_t data_str_len = 0;
+
+    schedule_prio_stat_t stat[TASK_NUM_PRIORITIES];
+    schedule_get_stat(stat);
+
+    // One line per priority, highest first
+    for (uint64_t prio = 0; prio < TASK_NUM_PRIORITIES; prio++) {
+        data_str_len += snprintf(&data_str[data_str_len], 4096 - data_str_len,
+                                 "%u %u %u %u %u\n",
+                                 prio,
+                                 stat[prio].num_runable,
+                                 stat[prio].num_scheduled,
+                                 stat[prio].num_preempt,
+                                 stat[prio].run_time_us);
+    }
+
+    file_ctx_t file_ctx_in;
+
+    sysfs_ro_file_helper(data_str, data_str_len, &file_ctx_in);
+
+    void* file_ctx = file_create_ctx(&file_ctx_in);
+
+    return file_ctx;
+}
+
+void* sysfs_sched_cpu_open(void) {
+
+    char* data_str = vmalloc(4096);
+    uint64_t data_str_len = 0;
+
+    // One line per CPU
+    for (uint64_t cpu_idx = 0; cpu_idx < smp_num_cpus(); cpu_idx++) {
+        smp_cpu_stat_t cpu_stat;
+        schedule_cpu_stat_t sched_stat;
+        smp_get_cpu_stat(cpu_idx, &cpu_stat);
+        schedule_get_cpu_stat(cpu_idx, &sched_stat);
+
+        data_str_len += snprintf(&data_str[data_str_len], 4096 - data_str_len,
+                                 "%u %x %u %u %u %u %u %u\n",
+                                 cpu_idx,
+                                 cpu_stat.mpidr,
+                                 cpu_stat.online,
+                                 sched_stat.active_tid,
+                                 sched_stat.num_runable,
+                                 sched_stat.num_scheduled,
+                                 sched_stat.num_stolen,
+                                 cpu_stat.num_ipi);
+    }
+
+    file_ctx_t file_ctx_in;
+
+    sysfs_ro_file_helper(data_str, data_str_len, &file_ctx_in);
+
+    void* file_ctx = file_create_ctx(&file_ctx_in);
+
+    return file_ctx;
+}
+
+void sysfs_sched_init(void) {
+
+    fd_ops_t ops = {
+        .read = file_read_op,
+        .write = file_write_op,
+        .ioctl = file_ioctl_op,
+        .close = file_close_op
+    };
+
+    sysfs_create_file("sched_stat", sysfs_sched_stat_open, &ops);
+    sysfs_create_file("sched_cpu", sysfs_sched_cpu_open, &ops);
+}
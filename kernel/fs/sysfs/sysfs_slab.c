@@ -0,0 +1,53 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <kernel/assert.h>
+#include <kernel/fs/sysfs/sysfs.h>
+#include <kernel/fs/file.h>
+#include <kernel/fd.h>
+#include <kernel/lib/vmalloc.h>
+#include <kernel/lib/slab.h>
+
+#include <stdlib/bitutils.h>
+#include <stdlib/printf.h>
+
+void* sysfs_slab_stat_open(void) {
+
+    char* data_str = vmalloc(4096);
+    uint64_t data_str_len = 0;
+
+    slab_cache_t* cache = slab_get_caches();
+    while (cache != NULL && data_str_len < 4096) {
+        data_str_len += snprintf(&data_str[data_str_len], 4096 - data_str_len,
+                                 "%s %u %u %u %u %u %u\n",
+                                 cache->name,
+                                 cache->obj_size,
+                                 cache->num_slabs,
+                                 cache->num_inuse,
+                                 cache->num_hits,
+                                 cache->num_misses,
+                                 cache->num_frees);
+        cache = cache->next;
+    }
+    data_str_len = MIN(data_str_len, 4095);
+
+    file_ctx_t file_ctx_in;
+
+    sysfs_ro_file_helper(data_str, data_str_len, &file_ctx_in);
+
+    void* file_ctx = file_create_ctx(&file_ctx_in);
+
+    return file_ctx;
+}
+
+void sysfs_slab_init(void) {
+
+    fd_ops_t ops = {
+        .read = file_read_op,
+        .write = file_write_op,
+        .ioctl = file_ioctl_op,
+        .close = file_close_op
+    };
+
+    sysfs_create_file("slab_stat", sysfs_slab_stat_open, &ops);
+}
@@ -12,16 +12,12 @@
 #include <stdlib/bitutils.h>
 #include <stdlib/printf.h>
 
-typedef struct {
-    llist_head_t data_list;
-} sysfs_task_ctx_t;
-
 int64_t sysfs_task_close(void*);
 
 void* sysfs_task_open(void) {
 
     file_data_t* file_data = vmalloc(sizeof(file_data_t));
-    file_data->data_list = llist_create();
+    file_data_init(file_data);
 
     uint64_t task_size = 0;
     uint64_t task_idx = 0;
@@ -42,14 +38,14 @@ void* sysfs_task_open(void) {
                 elapsedtimer_get_us(&task->profile_time)
             );
             ASSERT(written < 4096);
-            file_data_entry_t* data_entry = vmalloc(sizeof(file_data_entry_t));
+            file_data_entry_t* data_entry = file_alloc_data_entry();
             data_entry->data = data_str;
             data_entry->len = written;
             data_entry->ctx = NULL;
             data_entry->dirty = 0;
             data_entry->available = 1;
 
-            llist_append_ptr(file_data->data_list, data_entry);
+            file_data_append_entry(file_data, data_entry);
 
             task_size += written;
         }
@@ -78,14 +74,14 @@ void* sysfs_task_open(void) {
 int64_t sysfs_task_close(void* ctx) {
 
     file_data_t* file_ctx = ctx;
-    file_data_entry_t* entry;
 
-    FOR_LLIST(file_ctx->data_list, entry)
+    for (uint64_t idx = 0; idx < file_ctx->num_entries; idx++) {
+        file_data_entry_t* entry = file_ctx->entries[idx];
         vfree(entry->data);
-        vfree(entry);
-    END_FOR_LLIST()
+        file_free_data_entry(entry);
+    }
 
-    llist_free(file_ctx->data_list);
+    file_data_destroy(file_ctx);
     vfree(file_ctx);
 
     return 0;
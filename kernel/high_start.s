@@ -7,8 +7,10 @@
 .section .text
 
 .global _high_start
+.global _high_secondary_start
 
 .extern main
+.extern smp_secondary_main
 
 _high_start:
 
@@ -48,3 +50,21 @@ _high_start:
 .loop:
     b .loop
 
+# Secondary CPUs enter here from the bootstrap with the MMU enabled
+# x0: Physical address of the top of this CPU's stack
+_high_secondary_start:
+
+    mov x19, x0
+    orr x0, x0, #0xFFFF000000000000
+    mov sp, x0
+
+    // Setup a dummy stackframe
+    stp xzr, xzr, [sp, #-16]
+    mov x29, sp
+    sub x29, x29, #16
+
+    mov x0, x19
+    b smp_secondary_main
+
+.secondary_loop:
+    b .secondary_loop
@@ -17,6 +17,7 @@ typedef struct {
     void* ctx;
     uint64_t awaiter_tid;
     bool awaited;
+    wait_queue_t await_queue;
     uint64_t intid;
     elapsedtimer_t profile_time;
 } intc_irq_handler_ctx_t;
@@ -48,6 +49,7 @@ void interrupt_register_controller(intc_funcs_t* funcs, void* ctx, uint64_t num_
         s_interrupt_ctx.handlers[idx].fn = NULL;
         s_interrupt_ctx.handlers[idx].awaiter_tid = 0;
         s_interrupt_ctx.handlers[idx].awaited = false;
+        s_interrupt_ctx.handlers[idx].await_queue.head = NULL;
         elapsedtimer_clear(&s_interrupt_ctx.handlers[idx].profile_time);
     }
 }
@@ -98,6 +100,27 @@ void interrupt_get_msi(uint64_t* intid_out, uint64_t* data_out, uintptr_t* addr_
     s_interrupt_ctx.intc_fn.get_msi(s_interrupt_ctx.intc_ctx, intid_out, data_out, addr_out);
 }
 
+bool interrupt_smp_capable(void) {
+    return s_interrupt_ctx.registered &&
+           s_interrupt_ctx.intc_fn.enable_cpu != NULL &&
+           s_interrupt_ctx.intc_fn.send_sgi != NULL;
+}
+
+/*
+ * Called on a secondary CPU to setup its CPU interface
+ */
+void interrupt_enable_cpu(uint64_t mpidr) {
+    ASSERT(interrupt_smp_capable());
+
+    s_interrupt_ctx.intc_fn.enable_cpu(s_interrupt_ctx.intc_ctx, mpidr);
+}
+
+void interrupt_send_sgi(uint64_t irq, uint64_t mpidr) {
+    ASSERT(interrupt_smp_capable());
+
+    s_interrupt_ctx.intc_fn.send_sgi(s_interrupt_ctx.intc_ctx, irq, mpidr);
+}
+
 void interrupt_register_irq_handler(uint64_t irq, irq_handler fn, void* ctx) {
     ASSERT(s_interrupt_ctx.registered);
     ASSERT(irq < s_interrupt_ctx.num_handlers);
@@ -156,6 +179,7 @@ bool interrupt_await(uint64_t irq) {
         .irqnotify = {
             .irq = irq
         },
+        .queue = &s_interrupt_ctx.handlers[irq].await_queue,
         .wake_at = 0
     };
 
@@ -169,6 +193,7 @@ bool interrupt_await(uint64_t irq) {
  */
 void interrupt_notify_awaiters(uint64_t irq) {
     s_interrupt_ctx.handlers[irq].awaited = true;
+    wait_queue_signal(&s_interrupt_ctx.handlers[irq].await_queue);
 }
 
 /*
@@ -56,6 +56,8 @@ typedef void (*intc_disable_irq_fn)(void* ctx, uint64_t irq);
 typedef void (*intc_irq_trigger_fn)(void* ctx, uint64_t irq, interrupt_trigger_type_t type);
 typedef void (*intc_get_msi_fn)(void* ctx, uint64_t* intid_out, uint64_t* data_out, uintptr_t* addr_out);
 typedef void (*intc_irq_handler_fn)(void* ctx);
+typedef void (*intc_enable_cpu_fn)(void* ctx, uint64_t mpidr);
+typedef void (*intc_send_sgi_fn)(void* ctx, uint64_t irq, uint64_t mpidr);
 
 typedef struct {
     intc_enable_fn enable;
@@ -65,6 +67,10 @@ typedef struct {
     intc_irq_trigger_fn set_irq_trigger;
     intc_get_msi_fn get_msi;
     intc_irq_handler_fn irq_handler;
+
+    // Optional. Needed to run on more than one CPU
+    intc_enable_cpu_fn enable_cpu;
+    intc_send_sgi_fn send_sgi;
 } intc_funcs_t;
 
 typedef void (*intc_dtb_get_intid_list_fn)(void* ctx, dt_prop_ints_t* ints_prop, uint64_t* intids);
@@ -85,6 +91,9 @@ void interrupt_get_msi(uint64_t* intid_out, uint64_t* data_out, uintptr_t* addr_
 void interrupt_register_irq_handler(uint64_t irq, irq_handler fn, void* ctx);
 bool interrupt_await_reset(uint64_t irq);
 bool interrupt_await(uint64_t irq);
+bool interrupt_smp_capable(void);
+void interrupt_enable_cpu(uint64_t mpidr);
+void interrupt_send_sgi(uint64_t irq, uint64_t mpidr);
 void interrupt_get_intid_ctx(void* intid_ctx, void* intids_out, uint64_t* num_intids);
 
 void interrupt_handle_irq_entry(uint64_t vector);
@@ -7,6 +7,8 @@
 #include "kernel/kmalloc.h"
 #include "kernel/assert.h"
 #include "kernel/console.h"
+#include "kernel/mmap.h"
+#include "kernel/task.h"
 #include "kernel/lib/vmalloc.h"
 
 static memory_space_t s_kernelspace;
@@ -142,6 +144,10 @@ void memspace_update_kernel_vmem(void) {
     s_kernelspace_vmem = kernel_vmem_table;
 }
 
+_vmem_table* memspace_get_kernel_vmem(void) {
+    return s_kernelspace_vmem;
+}
+
 void* memspace_alloc_kernel_virt(uint64_t len, uint64_t align) {
     if (align < VMEM_PAGE_SIZE) {
         align = VMEM_PAGE_SIZE;
@@ -156,13 +162,37 @@ memory_entry_t* memspace_get_entry_at_addr_kernel(void* addr_ptr) {
     return memspace_get_entry_at_addr(&s_kernelspace, addr_ptr);
 }
 
-void* get_userspace_ptr(_vmem_table* table_ptr, uintptr_t userptr) {
+/*
+ * Returns a kernel pointer to len bytes of user memory. Pages of mapped
+ * files are not contiguous in physical memory, so NULL is returned for a
+ * buffer that spans pages which are not; such buffers are copied with
+ * mmap_copy_user instead
+ */
+void* get_userspace_ptr(_vmem_table* table_ptr, uintptr_t userptr, uint64_t len) {
     bool walk_ok;
     uint64_t phy_addr;
+
+    // Pages of mapped files may not be populated yet
+    task_t* task = get_active_task();
+    if (task->low_vm_table == table_ptr &&
+        !mmap_user_access(task, userptr, len, false)) {
+        return NULL;
+    }
+
     walk_ok = vmem_walk_table(table_ptr, userptr, &phy_addr);
     if (!walk_ok) {
         return NULL;
     }
+
+    for (uintptr_t addr = PAGE_FLOOR(userptr) + VMEM_PAGE_SIZE; addr < userptr + len; addr += VMEM_PAGE_SIZE) {
+        uint64_t page_phy;
+        walk_ok = vmem_walk_table(table_ptr, addr, &page_phy);
+        if (!walk_ok ||
+            page_phy != PAGE_FLOOR(phy_addr) + (addr - PAGE_FLOOR(userptr))) {
+            return NULL;
+        }
+    }
+
     return PHY_TO_KSPACE_PTR(phy_addr);
 }
 
@@ -33,12 +33,13 @@ void memspace_map_device_kernel(void* phy_addr, void* virt_addr, uint64_t len, u
 void memspace_unmap_kernel(memory_entry_t* entry);
 
 void memspace_update_kernel_vmem(void);
+_vmem_table* memspace_get_kernel_vmem(void);
 
 void* memspace_alloc_kernel_virt(uint64_t len, uint64_t align);
 
 memory_entry_t* memspace_get_entry_at_addr_kernel(void* addr_ptr);
 
-void* get_userspace_ptr(_vmem_table* table_ptr, uintptr_t userptr);
+void* get_userspace_ptr(_vmem_table* table_ptr, uintptr_t userptr, uint64_t len);
 
 bool kspace_vmem_walk_table(uint64_t vmem_addr, uint64_t* phy_addr);
 
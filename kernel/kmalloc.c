@@ -7,31 +7,79 @@
 #include "kernel/kmalloc.h"
 #include "kernel/kernelspace.h"
 #include "kernel/dtb.h"
+#include "kernel/smp.h"
+#include "kernel/interrupt/interrupt.h"
 
 #include "stdlib/bitutils.h"
+#include "stdlib/malloc.h"
 
 #include "kernel/console.h"
 
-#define MEM_SIZE (1024*1024*1024)
 #define PAGE_SIZE (4*1024)
-#define NUM_MEM_BLOCKS (4096*256)
-
-#define MEMBLOCK_FLAG_ALLOCATED (1 << 0)
-#define MEMBLOCK_MAGIC (0xABAB1234)
 
 #define PAGES(X) (((X) + PAGE_SIZE - 1)/PAGE_SIZE)
 #define PAGEMEM(X) (PAGES((X)) * PAGE_SIZE)
 
-typedef struct {
-    uintptr_t ptr;
-    uint64_t size;
-    uint64_t magic;
+#define KMALLOC_MAX_REGIONS 32
+
+#define KPAGE_FLAG_FREE (1 << 0)
+#define KPAGE_FLAG_ALLOCATED (1 << 1)
+#define KPAGE_MAGIC (0xA5)
+
+#define KMALLOC_ZERO_POOL_PAGES 256
+#define KMALLOC_ZERO_POOL_MIN_FREE (4 * KMALLOC_ZERO_POOL_PAGES)
+
+/**
+ * Physical memory layout
+ *
+ * Every region handed to kmalloc_add_phy_memory is managed as an
+ * independent buddy allocator. The first pages of each region hold
+ * an array of kmalloc_page_t descriptors, one per allocatable page.
+ * Descriptors are used instead of headers in the free pages so that
+ * free memory is never touched by the allocator.
+ *
+ * Only the first page of a block has meaningful flags. A free block
+ * of 2^order pages is linked into s_free_lists[order]. An allocated
+ * block stores the number of pages requested by the caller. Pages beyond
+ * the request are trimmed back to the free lists at allocation time, so
+ * non power-of-two requests do not waste memory.
+ */
+
+typedef struct _kmalloc_page_t {
+    struct _kmalloc_page_t* next;
+    struct _kmalloc_page_t* prev;
+    uint32_t alloc_pages;
+    uint8_t order;
     uint8_t flags;
-} memblock_t;
+    uint8_t region;
+    uint8_t magic;
+} kmalloc_page_t;
+
+typedef struct {
+    uintptr_t base;             /* Physical address of the first allocatable page */
+    uint64_t num_pages;         /* Number of allocatable pages */
+    kmalloc_page_t* pages;      /* Kernel pointer to the page descriptor array */
+} kmalloc_region_t;
+
+typedef struct {
+    kmalloc_page_t* head;
+    uint64_t count;
+} kmalloc_freelist_t;
+
+static kmalloc_region_t s_regions[KMALLOC_MAX_REGIONS];
+static uint64_t s_num_regions = 0;
+
+static kmalloc_freelist_t s_free_lists[KMALLOC_MAX_ORDER + 1];
 
-static memblock_t s_memblocks[NUM_MEM_BLOCKS] = {0};
+static uint64_t s_total_pages = 0;
+static uint64_t s_free_pages = 0;
 
-static uint64_t s_last_memblock = 0;
+// Single pages zeroed ahead of time by the idle task. Linked
+// through the page descriptors so the pages stay zero
+static kmalloc_page_t* s_zero_pool = NULL;
+static kmalloc_page_t* s_zero_pool_pending[SMP_MAX_CPUS] = {0};
+static uint64_t s_zero_pool_count = 0;
+static uint64_t s_zero_pool_hits = 0;
 
 extern uint8_t _data_start;
 extern uint8_t _bss_end;
@@ -40,20 +88,145 @@ extern uint8_t _heap_limit;
 
 static uint64_t kmalloc_op_num = 0;
 
-void kmalloc_add_phy_memory(uintptr_t base_phy, uintptr_t len) {
+static malloc_check_mode_t s_check_mode = MALLOC_CHECK_MODE_DEFAULT;
+static uint64_t s_num_checks = 0;
+
+static void kmalloc_freelist_push(uint8_t order, kmalloc_page_t* page) {
+
+    kmalloc_freelist_t* list = &s_free_lists[order];
+
+    page->order = order;
+    page->flags = KPAGE_FLAG_FREE;
+    page->prev = NULL;
+    page->next = list->head;
+    if (list->head != NULL) {
+        list->head->prev = page;
+    }
+    list->head = page;
+    list->count++;
+}
+
+static void kmalloc_freelist_remove(uint8_t order, kmalloc_page_t* page) {
+
+    kmalloc_freelist_t* list = &s_free_lists[order];
+
+    if (page->prev != NULL) {
+        page->prev->next = page->next;
+    } else {
+        list->head = page->next;
+    }
+    if (page->next != NULL) {
+        page->next->prev = page->prev;
+    }
+    page->next = NULL;
+    page->prev = NULL;
+    page->flags = 0;
+    list->count--;
+}
+
+static uint8_t kmalloc_order_for_pages(uint64_t num_pages) {
+
+    uint8_t order = 0;
+    while (BIT(order) < num_pages) {
+        order++;
+    }
+    return order;
+}
+
+static void kmalloc_free_block(kmalloc_region_t* region, uint64_t page_idx, uint8_t order) {
+
+    // Merge with the buddy block for as long as it is free and the same size
+    while (order < KMALLOC_MAX_ORDER) {
+        uint64_t buddy_idx = page_idx ^ BIT(order);
+        if (buddy_idx + BIT(order) > region->num_pages) {
+            break;
+        }
+
+        kmalloc_page_t* buddy = &region->pages[buddy_idx];
+        if (!(buddy->flags & KPAGE_FLAG_FREE) ||
+            buddy->order != order) {
+            break;
+        }
 
+        kmalloc_freelist_remove(order, buddy);
+        page_idx &= ~BIT(order);
+        order++;
+    }
+
+    kmalloc_freelist_push(order, &region->pages[page_idx]);
+}
+
+static void kmalloc_free_range(kmalloc_region_t* region, uint64_t page_idx, uint64_t num_pages) {
+
+    // Break the range into the largest naturally aligned blocks
+    while (num_pages > 0) {
+        uint8_t order = KMALLOC_MAX_ORDER;
+        while (order > 0 &&
+               ((page_idx & (BIT(order) - 1)) != 0 ||
+                BIT(order) > num_pages)) {
+            order--;
+        }
+
+        kmalloc_free_block(region, page_idx, order);
+        s_free_pages += BIT(order);
+
+        page_idx += BIT(order);
+        num_pages -= BIT(order);
+    }
+}
+
+static kmalloc_region_t* kmalloc_region_for_phy(uintptr_t phy) {
+
+    for (uint64_t idx = 0; idx < s_num_regions; idx++) {
+        kmalloc_region_t* region = &s_regions[idx];
+        if (phy >= region->base &&
+            phy < (region->base + region->num_pages * PAGE_SIZE)) {
+            return region;
+        }
+    }
+    return NULL;
+}
+
+static void kmalloc_add_region(uintptr_t base_phy, uintptr_t len) {
+
+    ASSERT((base_phy & (PAGE_SIZE-1)) == 0);
     ASSERT((len & (PAGE_SIZE-1)) == 0);
+    ASSERT(s_num_regions < KMALLOC_MAX_REGIONS);
+
+    uint64_t region_pages = len / PAGE_SIZE;
+    uint64_t desc_pages = PAGES(region_pages * sizeof(kmalloc_page_t));
+    if (region_pages <= desc_pages) {
+        return;
+    }
+
+    kmalloc_region_t* region = &s_regions[s_num_regions];
+    region->pages = PHY_TO_KSPACE_PTR(base_phy);
+    region->base = base_phy + (desc_pages * PAGE_SIZE);
+    region->num_pages = region_pages - desc_pages;
+
+    for (uint64_t idx = 0; idx < region->num_pages; idx++) {
+        kmalloc_page_t* page = &region->pages[idx];
+        page->next = NULL;
+        page->prev = NULL;
+        page->alloc_pages = 0;
+        page->order = 0;
+        page->flags = 0;
+        page->region = s_num_regions;
+        page->magic = KPAGE_MAGIC;
+    }
+
+    s_num_regions++;
+    s_total_pages += region->num_pages;
+
+    kmalloc_free_range(region, 0, region->num_pages);
+}
+
+void kmalloc_add_phy_memory(uintptr_t base_phy, uintptr_t len) {
 
     console_log(LOG_DEBUG, "Adding PHY memory [%16x, %16x] (%d KB)",
                 base_phy, base_phy + len, len / 1024);
 
-    s_last_memblock++;
-    ASSERT(s_last_memblock < NUM_MEM_BLOCKS);
-
-    s_memblocks[s_last_memblock].ptr = base_phy;
-    s_memblocks[s_last_memblock].size = len;
-    s_memblocks[s_last_memblock].magic = MEMBLOCK_MAGIC;
-    s_memblocks[s_last_memblock].flags = 0;
+    kmalloc_add_region(base_phy, len);
 }
 
 void kmalloc_init(void) {
@@ -61,150 +234,281 @@ void kmalloc_init(void) {
     uintptr_t heap_base_phy = KSPACE_TO_PHY(&_heap_base);
     uintptr_t heap_limit_phy = KSPACE_TO_PHY(&_heap_limit);
 
-    s_memblocks[0].ptr = heap_base_phy;
-    s_memblocks[0].size = heap_limit_phy - heap_base_phy;
-    s_memblocks[0].magic = MEMBLOCK_MAGIC;
-    s_memblocks[0].flags = 0;
-
-
-    s_last_memblock = 0;
+    kmalloc_add_region(heap_base_phy, heap_limit_phy - heap_base_phy);
 }
 
 void kmalloc_check_structure(void) {
 
-    uint64_t idx;
-    //uintptr_t exp_ptr = KSPACE_TO_PHY(&_heap_base);
- 
-    for (idx = 0; idx <= s_last_memblock; idx++) {
-        memblock_t* this_block = &s_memblocks[idx];
-        ASSERT(this_block->magic == MEMBLOCK_MAGIC);
-        //ASSERT(exp_ptr == this_block->ptr);
-
-        //exp_ptr += this_block->size;
-        //uintptr_t heap_limit_phy = KSPACE_TO_PHY(&_heap_limit);
-        //ASSERT(exp_ptr <= heap_limit_phy);
+    uint64_t free_pages = 0;
+
+    for (uint64_t order = 0; order <= KMALLOC_MAX_ORDER; order++) {
+        uint64_t count = 0;
+        kmalloc_page_t* page = s_free_lists[order].head;
+        while (page != NULL) {
+            ASSERT(page->magic == KPAGE_MAGIC);
+            ASSERT(page->flags == KPAGE_FLAG_FREE);
+            ASSERT(page->order == order);
+            ASSERT(page->region < s_num_regions);
+            if (page->next != NULL) {
+                ASSERT(page->next->prev == page);
+            }
+            count++;
+            page = page->next;
+        }
+        ASSERT(count == s_free_lists[order].count);
+        free_pages += count * BIT(order);
+    }
+
+    ASSERT(free_pages == s_free_pages);
+    s_num_checks++;
+}
+
+// Called after every allocation and free
+static void kmalloc_check_op(void) {
+    switch (s_check_mode) {
+        case MALLOC_CHECK_FULL:
+            kmalloc_check_structure();
+            break;
+        case MALLOC_CHECK_SAMPLED:
+            if ((kmalloc_op_num % MALLOC_CHECK_SAMPLE_PERIOD) == 0) {
+                kmalloc_check_structure();
+            }
+            break;
+        case MALLOC_CHECK_RELEASE:
+        default:
+            break;
     }
 }
 
-void* kmalloc_phy(uint64_t bytes) {
+void kmalloc_set_check_mode(malloc_check_mode_t mode) {
+    s_check_mode = mode;
+}
 
-    uint64_t pagebytes = PAGEMEM(bytes);
-    uint64_t idx = 0;
-    bool found_mem = false;
+static uintptr_t kmalloc_page_to_phy(kmalloc_page_t* page) {
 
-    kmalloc_op_num++;
-    //console_log(LOG_DEBUG, "kmalloc_phy: %u", kmalloc_op_num);
+    kmalloc_region_t* region = &s_regions[page->region];
+    return region->base + ((page - region->pages) * PAGE_SIZE);
+}
 
-    while (!found_mem) {
-        if (pagebytes <= s_memblocks[idx].size &&
-            !(s_memblocks[idx].flags & MEMBLOCK_FLAG_ALLOCATED)) {
-            found_mem = true;
-        } else {
-            idx++;
-        }
+static void kmalloc_zero_pool_drain(void) {
 
-        if (idx > s_last_memblock) {
-            print_kmalloc_debug(pagebytes);
-        }
-        ASSERT(idx <= s_last_memblock)
+    while (s_zero_pool != NULL) {
+        kmalloc_page_t* page = s_zero_pool;
+        s_zero_pool = page->next;
+        s_zero_pool_count--;
+
+        kmalloc_region_t* region = &s_regions[page->region];
+        page->next = NULL;
+        page->flags = 0;
+        page->alloc_pages = 0;
+        kmalloc_free_range(region, page - region->pages, 1);
     }
+}
 
-    if (pagebytes != s_memblocks[idx].size) {
-        uint64_t leftover_pagebytes = s_memblocks[idx].size - pagebytes;
+/*
+ * Returns NULL for a request larger than the biggest buddy block
+ */
+static kmalloc_page_t* kmalloc_alloc_pages(uint64_t num_pages) {
 
-        s_memblocks[idx].size = pagebytes;
+    ASSERT(num_pages > 0);
 
-        memblock_t new_block = {
-            .ptr = s_memblocks[idx].ptr + pagebytes,
-            .size = leftover_pagebytes,
-            .magic = MEMBLOCK_MAGIC,
-            .flags = 0
-        };
+    if (num_pages > BIT(KMALLOC_MAX_ORDER)) {
+        console_log(LOG_WARN, "kmalloc request of %u pages is too large", num_pages);
+        return NULL;
+    }
 
-        s_last_memblock++;
-        ASSERT(s_last_memblock < NUM_MEM_BLOCKS)
+    uint8_t order = kmalloc_order_for_pages(num_pages);
 
-        uint64_t shift_idx = s_last_memblock;
+    uint8_t found_order = order;
+    while (found_order <= KMALLOC_MAX_ORDER &&
+           s_free_lists[found_order].head == NULL) {
+        found_order++;
+    }
 
-        while (shift_idx > idx) {
-            s_memblocks[shift_idx] = s_memblocks[shift_idx-1];
-            shift_idx--;
+    if (found_order > KMALLOC_MAX_ORDER) {
+        if (s_zero_pool != NULL) {
+            // Give the pre-zeroed pages back and try again
+            kmalloc_zero_pool_drain();
+            return kmalloc_alloc_pages(num_pages);
         }
-        s_memblocks[idx+1] = new_block;
-    } 
+        print_kmalloc_debug(num_pages * PAGE_SIZE);
+    }
+    ASSERT(found_order <= KMALLOC_MAX_ORDER);
 
-    s_memblocks[idx].flags |= MEMBLOCK_FLAG_ALLOCATED;
-    MEM_DMB();
+    kmalloc_page_t* page = s_free_lists[found_order].head;
+    ASSERT(page->magic == KPAGE_MAGIC);
+    kmalloc_freelist_remove(found_order, page);
+
+    kmalloc_region_t* region = &s_regions[page->region];
+    uint64_t page_idx = page - region->pages;
 
-    kmalloc_check_structure();
+    // Split the block down to the requested order
+    while (found_order > order) {
+        found_order--;
+        kmalloc_freelist_push(found_order, &region->pages[page_idx + BIT(found_order)]);
+    }
 
-    memset(PHY_TO_KSPACE_PTR(s_memblocks[idx].ptr), 0, pagebytes);
+    page->flags = KPAGE_FLAG_ALLOCATED;
+    page->order = order;
+    page->alloc_pages = num_pages;
+    s_free_pages -= BIT(order);
 
-    return (void*)s_memblocks[idx].ptr;
+    // Return unused pages at the end of the block
+    if (BIT(order) > num_pages) {
+        kmalloc_free_range(region, page_idx + num_pages, BIT(order) - num_pages);
+    }
+
+    MEM_DMB();
+
+    return page;
 }
 
-void kfree_phy(void* ptr) {
+void* kmalloc_phy(uint64_t bytes) {
+
+    uint64_t num_pages = PAGES(bytes);
 
     kmalloc_op_num++;
+    //console_log(LOG_DEBUG, "kmalloc_phy: %u", kmalloc_op_num);
 
-    //console_log(LOG_DEBUG, "kfree_phy: %u", kmalloc_op_num);
+    // Single pages are taken from the pre-zeroed pool when possible
+    if (num_pages == 1 && s_zero_pool != NULL) {
+        kmalloc_page_t* page = s_zero_pool;
+        s_zero_pool = page->next;
+        s_zero_pool_count--;
+        s_zero_pool_hits++;
+        page->next = NULL;
+        MEM_DMB();
+
+        kmalloc_check_op();
+        return (void*)kmalloc_page_to_phy(page);
+    }
 
-    uint64_t idx;
-    for (idx = 0; idx <= s_last_memblock; idx++) {
-        if (s_memblocks[idx].ptr == (uintptr_t)ptr) {
-            break;
-        }
+    kmalloc_page_t* page = kmalloc_alloc_pages(num_pages);
+    if (page == NULL) {
+        return NULL;
     }
+    uintptr_t phy_addr = kmalloc_page_to_phy(page);
 
-    ASSERT(idx <= s_last_memblock)
+    memset(PHY_TO_KSPACE_PTR(phy_addr), 0, num_pages * PAGE_SIZE);
 
-    s_memblocks[idx].flags &= ~(MEMBLOCK_FLAG_ALLOCATED);
+    kmalloc_check_op();
+    return (void*)phy_addr;
+}
 
-    uint64_t idx_left = idx - 1;
-    uint64_t idx_right = idx + 1;
-    bool merged_blocks = false;
-    uint64_t merge_idx = 0;
+void* kmalloc_phy_nozero(uint64_t bytes) {
 
-    // Check for an adjacent free block
-    if (idx > 0) {
-        if (!(s_memblocks[idx_left].flags & MEMBLOCK_FLAG_ALLOCATED)) {
-            // Left is unallocated. Merge the two blocks
-            s_memblocks[idx_left].size += s_memblocks[idx].size;
-            merged_blocks = true;
-            merge_idx = idx;
-        }
+    kmalloc_op_num++;
+
+    kmalloc_page_t* page = kmalloc_alloc_pages(PAGES(bytes));
+    if (page == NULL) {
+        return NULL;
     }
 
-    if (idx_right <= s_last_memblock && !merged_blocks) {
-        if (!(s_memblocks[idx_right].flags & MEMBLOCK_FLAG_ALLOCATED)) {
-            // Right is unallocated. Merge the two blocks
-            s_memblocks[idx].size += s_memblocks[idx_right].size;
-            merged_blocks = true;
-            merge_idx = idx_right;
+    kmalloc_check_op();
+    return (void*)kmalloc_page_to_phy(page);
+}
+
+void kmalloc_zero_pool_refill(void) {
+
+    uint64_t daif;
+
+    // Called from the idle task without the kernel lock. The lock is
+    // only taken, with interrupts masked, to move one page at a time in
+    // and out of the pool. The memset runs with neither, so other CPUs
+    // and interrupts are never held up by it.
+    //
+    // May be interrupted and abandoned at any point. The page being
+    // zeroed is claimed for this CPU in s_zero_pool_pending, which no
+    // other CPU touches, so the next call on this CPU picks it up again
+    // instead of leaking it.
+    kmalloc_page_t** pending = &s_zero_pool_pending[smp_cpu_idx()];
+
+    while (true) {
+        BEGIN_CRITICAL(daif);
+        smp_kernel_lock();
+        if (*pending == NULL) {
+            if (s_zero_pool_count >= KMALLOC_ZERO_POOL_PAGES ||
+                s_free_pages < KMALLOC_ZERO_POOL_MIN_FREE) {
+                smp_kernel_unlock();
+                END_CRITICAL(daif);
+                return;
+            }
+            *pending = kmalloc_alloc_pages(1);
         }
+        kmalloc_page_t* page = *pending;
+        smp_kernel_unlock();
+        END_CRITICAL(daif);
+
+        memset(PHY_TO_KSPACE_PTR(kmalloc_page_to_phy(page)), 0, PAGE_SIZE);
+
+        BEGIN_CRITICAL(daif);
+        smp_kernel_lock();
+        *pending = NULL;
+        page->next = s_zero_pool;
+        s_zero_pool = page;
+        s_zero_pool_count++;
+        smp_kernel_unlock();
+        END_CRITICAL(daif);
     }
+}
 
-    // If two free blocks were found, shift the reset of the blocks
-    // to prevent holes in the structure
-    if (merged_blocks) {
-        ASSERT(merge_idx <= s_last_memblock);
-        while ((merge_idx + 1) <= s_last_memblock) {
-            s_memblocks[merge_idx] = s_memblocks[merge_idx+1];
-            merge_idx++;
-        }
-        s_last_memblock--;
+bool kmalloc_phy_is_allocated(uintptr_t phy) {
+
+    kmalloc_region_t* region = kmalloc_region_for_phy(phy);
+    if (region == NULL) {
+        return false;
     }
 
-    kmalloc_check_structure();
+    kmalloc_page_t* page = &region->pages[(phy - region->base) / PAGE_SIZE];
+    return page->magic == KPAGE_MAGIC && page->flags == KPAGE_FLAG_ALLOCATED;
+}
 
-    // Ensure the memblock structure is consistent before continuing
+void kfree_phy(void* ptr) {
+
+    kmalloc_op_num++;
+
+    //console_log(LOG_DEBUG, "kfree_phy: %u", kmalloc_op_num);
+
+    kmalloc_region_t* region = kmalloc_region_for_phy((uintptr_t)ptr);
+    ASSERT(region != NULL);
+    ASSERT((((uintptr_t)ptr) & (PAGE_SIZE-1)) == 0);
+
+    uint64_t page_idx = ((uintptr_t)ptr - region->base) / PAGE_SIZE;
+    kmalloc_page_t* page = &region->pages[page_idx];
+
+    ASSERT(page->magic == KPAGE_MAGIC);
+    ASSERT(page->flags == KPAGE_FLAG_ALLOCATED);
+
+    uint64_t num_pages = page->alloc_pages;
+    page->flags = 0;
+    page->alloc_pages = 0;
+
+    kmalloc_free_range(region, page_idx, num_pages);
+
+    // Ensure the free lists are consistent before continuing
     MEM_DMB();
+
+    kmalloc_check_op();
 }
 
-void print_kmalloc_memblock(memblock_t* memblock) {
-    //console_log(LOG_DEBUG, "Ptr: %16x", memblock->ptr);
-    //console_log(LOG_DEBUG, "Size: %d", memblock->size);
-    //console_log(LOG_DEBUG, "In Use: %c", (memblock->flags & MEMBLOCK_FLAG_ALLOCATED) ? 'Y' : 'N');
+void kmalloc_calc_stat(kmalloc_stat_t* stat_out) {
+
+    uint64_t largest_order = 0;
+    for (uint64_t order = 0; order <= KMALLOC_MAX_ORDER; order++) {
+        stat_out->free_blocks[order] = s_free_lists[order].count;
+        if (s_free_lists[order].count > 0) {
+            largest_order = order;
+        }
+    }
+
+    stat_out->total_mem = s_total_pages * PAGE_SIZE;
+    stat_out->avail_mem = s_free_pages * PAGE_SIZE;
+    stat_out->largest_chunk = s_free_pages > 0 ? BIT(largest_order) * PAGE_SIZE : 0;
+    stat_out->num_regions = s_num_regions;
+    stat_out->zero_pool_pages = s_zero_pool_count;
+    stat_out->zero_pool_hits = s_zero_pool_hits;
+    stat_out->check_mode = s_check_mode;
+    stat_out->num_checks = s_num_checks;
 }
 
 void print_kmalloc_debug(uint64_t alloc_size) {
@@ -3,17 +3,50 @@
 
 #include <stdint.h>
 
+#include <stdlib/malloc.h>
+
 typedef struct {
     uintptr_t start;
     uintptr_t end;
 } mask_range_t;
 
+#define KMALLOC_MAX_ORDER 18
+
+typedef struct {
+    uint64_t total_mem;
+    uint64_t avail_mem;
+    uint64_t largest_chunk;
+    uint64_t num_regions;
+    uint64_t zero_pool_pages;
+    uint64_t zero_pool_hits;
+    malloc_check_mode_t check_mode;
+    uint64_t num_checks;
+    uint64_t free_blocks[KMALLOC_MAX_ORDER + 1];
+} kmalloc_stat_t;
+
 void kmalloc_init(void);
 
+// Returns NULL if bytes is larger than the biggest block the allocator
+// manages (2^KMALLOC_MAX_ORDER pages)
 void* kmalloc_phy(uint64_t bytes);
 
+// Same as kmalloc_phy, but the memory is not cleared. Only for
+// callers that fully initialize the allocation themselves
+void* kmalloc_phy_nozero(uint64_t bytes);
+
 void kfree_phy(void* ptr);
 
+// True if phy is the first page of a live kmalloc_phy allocation
+bool kmalloc_phy_is_allocated(uintptr_t phy);
+
+void kmalloc_add_phy_memory(uintptr_t base_phy, uintptr_t len);
+
+void kmalloc_calc_stat(kmalloc_stat_t* stat_out);
+void kmalloc_check_structure(void);
+void kmalloc_set_check_mode(malloc_check_mode_t mode);
+
+void kmalloc_zero_pool_refill(void);
+
 void print_kmalloc_debug(uint64_t alloc_size);
 
 void discover_phy_mem_dtb(mask_range_t* mask_ranges, uint64_t num_ranges);
@@ -0,0 +1,30 @@
+
+#ifndef __LIB_CHECKSUM_H__
+#define __LIB_CHECKSUM_H__
+
+#include <stdint.h>
+
+/**
+ * One's complement sums as used by the IPv4, TCP and UDP checksums. The
+ * sums are of big endian 16 bit words and are kept unfolded, so a sum can
+ * be carried from one call to the next and folded once at the end. Every
+ * call starts its data on a word boundary.
+ *
+ * checksum_add is the general path. checksum_add_neon is faster on large
+ * buffers but may only be called between BEGIN_FPSIMD and END_FPSIMD.
+ * checksum_add_16 is the plain word at a time loop, kept as a reference.
+ */
+uint64_t checksum_add(uint64_t sum, const void* data, uint64_t len);
+uint64_t checksum_add_neon(uint64_t sum, const void* data, uint64_t len);
+uint64_t checksum_add_16(uint64_t sum, const void* data, uint64_t len);
+uint16_t checksum_fold(uint64_t sum);
+
+/**
+ * The CRC-32 used for the Ethernet FCS. crc32_calc uses the ARMv8 CRC32
+ * instructions when the target has them, crc32_calc_table is the bytewise
+ * table lookup they replace
+ */
+uint32_t crc32_calc(const void* data, uint64_t len);
+uint32_t crc32_calc_table(const void* data, uint64_t len);
+
+#endif
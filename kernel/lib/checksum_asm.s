@@ -0,0 +1,38 @@
+
+.arch armv8-a
+
+.text
+
+.global checksum_neon_blocks
+
+# Sum 64 byte blocks as little endian 16 bit words. Only called with
+# FP/SIMD enabled, see BEGIN_FPSIMD
+#  x0: data
+#  x1: number of blocks, at most 32768 so the 32 bit lanes can't overflow
+# Returns the unfolded sum in x0
+checksum_neon_blocks:
+    movi v0.4s, #0
+    movi v1.4s, #0
+    movi v2.4s, #0
+    movi v3.4s, #0
+    cbz x1, 2f
+
+1:
+    ld1 {v4.16b, v5.16b, v6.16b, v7.16b}, [x0], #64
+    uadalp v0.4s, v4.8h
+    uadalp v1.4s, v5.8h
+    uadalp v2.4s, v6.8h
+    uadalp v3.4s, v7.8h
+    subs x1, x1, #1
+    b.ne 1b
+
+2:
+    # Widen to 64 bit lanes before combining the accumulators
+    uaddlp v0.2d, v0.4s
+    uadalp v0.2d, v1.4s
+    uadalp v0.2d, v2.4s
+    uadalp v0.2d, v3.4s
+    addp d0, v0.2d
+    fmov x0, d0
+
+    ret
@@ -6,6 +6,7 @@
 #include "kernel/lib/vmalloc.h"
 #include "kernel/assert.h"
 #include "kernel/lib/llist.h"
+#include "kernel/lib/slab.h"
 
 #include "kernel/lib/hashmap.h"
 
@@ -14,6 +15,8 @@ typedef struct {
     void* dataptr;
 } hashmap_list_entry_t;
 
+static slab_cache_t s_hashmap_entry_cache = SLAB_CACHE_INIT("hashmap_entry", hashmap_list_entry_t);
+
 hashmap_ctx_t* hashmap_alloc(hashmap_hash_fn hash_op,
                              hashmap_cmp_fn cmp_op,
                              hashmap_free_fn free_op,
@@ -47,7 +50,7 @@ void hashmap_dealloc(hashmap_ctx_t* ctx) {
                 if (ctx->free_op) {
                     ctx->free_op(ctx->op_ctx, entry->key, entry->dataptr);
                 }
-                vfree(entry);
+                slab_free(&s_hashmap_entry_cache, entry);
             END_FOR_LLIST()
             llist_free_all(head);
         }
@@ -119,9 +122,10 @@ void* hashmap_del(hashmap_ctx_t* ctx, void* key) {
     
     if (delentry != NULL) {
         if (ctx->free_op) {
-            ctx->free_op(ctx->op_ctx, entry->key, entry->dataptr);
+            ctx->free_op(ctx->op_ctx, delentry->key, delentry->dataptr);
         }
         llist_delete_ptr(keylist, delentry);
+        slab_free(&s_hashmap_entry_cache, delentry);
 
         if (llist_empty(keylist)) {
             llist_free_all(keylist);
@@ -147,7 +151,7 @@ void hashmap_add(hashmap_ctx_t* ctx, void* key, void* dataptr) {
         ctx->hashtable[keyhash] = keylist;
     }
 
-    hashmap_list_entry_t* entry = vmalloc(sizeof(hashmap_list_entry_t));
+    hashmap_list_entry_t* entry = slab_alloc(&s_hashmap_entry_cache);
     entry->key = key;
     entry->dataptr = dataptr;
 
@@ -180,3 +184,31 @@ void hashmap_forall(hashmap_ctx_t* ctx, hashmap_forall_fn forall_fn, void* foral
     }
 
 }
+
+#define HASHMAP_FNV_OFFSET 0xCBF29CE484222325UL
+#define HASHMAP_FNV_PRIME 0x100000001B3UL
+
+/*
+ * FNV-1a over the bytes, then a final mix. Buckets are picked with the
+ * low bits of the hash, and FNV alone leaves those weakly mixed
+ */
+uint64_t hashmap_hash_bytes(const void* data, uint64_t len, uint64_t seed) {
+
+    const uint8_t* bytes = data;
+    uint64_t hash = HASHMAP_FNV_OFFSET ^ seed;
+
+    for (uint64_t idx = 0; idx < len; idx++) {
+        hash ^= bytes[idx];
+        hash *= HASHMAP_FNV_PRIME;
+    }
+
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDUL;
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+uint64_t hashmap_hash_str(const char* str) {
+    return hashmap_hash_bytes(str, strlen(str), 0);
+}
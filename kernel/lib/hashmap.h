@@ -44,5 +44,8 @@ void hashmap_rehash(hashmap_ctx_t* ctx, uint64_t newlen);
 
 void hashmap_forall(hashmap_ctx_t* ctx, hashmap_forall_fn fn, void* forall_ctx);
 
+uint64_t hashmap_hash_bytes(const void* data, uint64_t len, uint64_t seed);
+uint64_t hashmap_hash_str(const char* str);
+
 
 #endif
\ No newline at end of file
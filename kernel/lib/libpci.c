@@ -183,6 +183,21 @@ pci_msix_vector_ctx_t* pci_get_msix_entry(pci_device_ctx_t* device_ctx, uint32_t
     return NULL;
 }
 
+/*
+ * Size of the device's MSI-X table, 0 without MSI-X
+ */
+uint64_t pci_num_msix_vectors(pci_device_ctx_t* device_ctx) {
+
+    if (device_ctx->msix_cap == NULL) {
+        return 0;
+    }
+
+    return (PCI_READCAP16_DEV(device_ctx,
+                              device_ctx->msix_cap,
+                              PCI_CAP_MSIX_MSG_CTRL)
+            & PCI_MSIX_CTRL_SIZE_MASK) + 1;
+}
+
 void print_pci_header(pci_device_ctx_t* device_ctx) {
     uint8_t header_mem[4096];
     device_ctx->pci_ctx->header_ops.read(device_ctx->pci_ctx,
@@ -65,7 +65,10 @@ void virtio_set_status(pci_virtio_common_cfg_t* cfg, uint8_t status) {
 
 int64_t virtio_malloc_add_mem(bool initialize, uint64_t req_size, void* ctx, malloc_state_t* state) {
 
-    ASSERT(initialize == true);
+    if (!initialize) {
+        // The buffer pool is fixed size
+        return 0;
+    }
 
     virtio_virtq_ctx_t* queue_ctx = ctx;
 
@@ -84,6 +87,15 @@ void virtio_alloc_queue(pci_virtio_common_cfg_t* cfg,
     ASSERT(cfg != NULL);
     ASSERT(queue_out != NULL);
 
+    cfg->queue_select = queue_num;
+    MEM_DSB();
+    queue_out->queue_notify_off = cfg->queue_notify_off;
+
+    // The device reports the largest queue it supports
+    if (cfg->queue_size != 0 && queue_size > cfg->queue_size) {
+        queue_size = cfg->queue_size;
+    }
+
     queue_out->queue_num = queue_num;
     queue_out->queue_size = queue_size;
 
@@ -104,16 +116,19 @@ void virtio_alloc_queue(pci_virtio_common_cfg_t* cfg,
     queue_out->used_ptr->idx = 0;
     queue_out->last_used_idx = 0;
 
+    // Chain all descriptors into the free list
+    for (uint64_t desc_idx = 0; desc_idx < queue_size; desc_idx++) {
+        queue_out->desc_ptr[desc_idx].next = desc_idx + 1;
+    }
+    queue_out->free_head = 0;
+    queue_out->num_free = queue_size;
+
     queue_out->buffer_pool = vmalloc(pool_size);
     queue_out->buffer_pool_phy = KSPACE_TO_PHY(queue_out->buffer_pool);
     queue_out->buffer_pool_size = pool_size;
 
     malloc_init_p(&queue_out->buffer_malloc_state, virtio_malloc_add_mem, queue_out);
 
-    cfg->queue_select = queue_num;
-    MEM_DSB();
-    queue_out->queue_notify_off = cfg->queue_notify_off;
-
     cfg->queue_size = queue_size;
     cfg->queue_desc = queue_out->desc_phy;
     cfg->queue_driver = queue_out->avail_phy;
@@ -146,6 +161,114 @@ void virtio_return_buffer(virtio_virtq_ctx_t* queue_ctx, void* buffer_ptr) {
     free_p(buffer_ptr, &queue_ctx->buffer_malloc_state);
 }
 
+uintptr_t virtio_buffer_phy(virtio_virtq_ctx_t* queue_ctx, void* buffer_ptr) {
+    return queue_ctx->buffer_pool_phy + (buffer_ptr - queue_ctx->buffer_pool);
+}
+
+/*
+ * Take a descriptor chain from the free list and make it available to
+ * the device. Returns the head descriptor index, which the device
+ * reports back as the used element id, or -1 if there are not enough
+ * free descriptors. The device is not notified, so several chains can
+ * be submitted with a single notify
+ */
+int64_t virtio_virtq_submit(virtio_virtq_ctx_t* queue_ctx,
+                            virtio_virtq_seg_t* segs,
+                            uint64_t num_segs) {
+
+    ASSERT(queue_ctx != NULL);
+    ASSERT(num_segs > 0);
+
+    if (num_segs > queue_ctx->num_free) {
+        return -1;
+    }
+
+    virtio_virtq_desc_t* virtq_desc = queue_ctx->desc_ptr;
+
+    uint16_t head_idx = queue_ctx->free_head;
+    uint16_t desc_idx = head_idx;
+    uint16_t last_idx = head_idx;
+
+    for (uint64_t seg_idx = 0; seg_idx < num_segs; seg_idx++) {
+        last_idx = desc_idx;
+        virtq_desc[desc_idx].addr = segs[seg_idx].phy;
+        virtq_desc[desc_idx].len = segs[seg_idx].len;
+        virtq_desc[desc_idx].flags = VIRTQ_DESC_F_NEXT;
+        if (segs[seg_idx].device_write) {
+            virtq_desc[desc_idx].flags |= VIRTQ_DESC_F_WRITE;
+        }
+        desc_idx = virtq_desc[desc_idx].next;
+    }
+
+    virtq_desc[last_idx].flags &= ~(VIRTQ_DESC_F_NEXT);
+
+    queue_ctx->free_head = desc_idx;
+    queue_ctx->num_free -= num_segs;
+
+    volatile virtio_virtq_avail_t* virtq_avail = queue_ctx->avail_ptr;
+    uint16_t avail_idx = virtq_avail->idx;
+
+    virtq_avail->ring[avail_idx % queue_ctx->queue_size] = head_idx;
+
+    // The descriptors and ring entry must be visible before the index
+    MEM_DMB();
+    virtq_avail->idx = avail_idx + 1;
+
+    return head_idx;
+}
+
+/*
+ * Pop the next used element and return its descriptor chain to the
+ * free list. Returns false if the device has not used any more chains
+ */
+bool virtio_virtq_next_used(virtio_virtq_ctx_t* queue_ctx, uint16_t* id_out, uint32_t* len_out) {
+
+    ASSERT(queue_ctx != NULL);
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Waddress-of-packed-member"
+    volatile uint16_t* used_idx_ptr = &queue_ctx->used_ptr->idx;
+#pragma GCC diagnostic pop
+
+    if (*used_idx_ptr == queue_ctx->last_used_idx) {
+        return false;
+    }
+
+    // Read the ring entry and buffers only after seeing the index
+    MEM_DMB();
+
+    volatile virtio_virtq_used_elem_t* used_elem;
+    used_elem = &queue_ctx->used_ptr->ring[queue_ctx->last_used_idx % queue_ctx->queue_size];
+    uint16_t head_idx = used_elem->id;
+    uint32_t len = used_elem->len;
+
+    queue_ctx->last_used_idx++;
+
+    ASSERT(head_idx < queue_ctx->queue_size);
+
+    // Walk to the end of the chain and put it back on the free list
+    virtio_virtq_desc_t* virtq_desc = queue_ctx->desc_ptr;
+    uint16_t desc_idx = head_idx;
+    uint16_t num_desc = 1;
+    while (virtq_desc[desc_idx].flags & VIRTQ_DESC_F_NEXT) {
+        desc_idx = virtq_desc[desc_idx].next;
+        num_desc++;
+    }
+
+    virtq_desc[desc_idx].next = queue_ctx->free_head;
+    queue_ctx->free_head = head_idx;
+    queue_ctx->num_free += num_desc;
+
+    if (id_out != NULL) {
+        *id_out = head_idx;
+    }
+    if (len_out != NULL) {
+        *len_out = len;
+    }
+
+    return true;
+}
+
 bool virtio_virtq_send(virtio_virtq_ctx_t* queue_ctx,
                        virtio_virtq_buffer_t* write_buffers,
                        uint64_t num_write_buffers,
@@ -253,6 +376,14 @@ void virtio_add_irq_to_ctx(virtio_virtq_ctx_t* queue_ctx, virtio_virtq_shared_ir
         interrupt_await_reset(irq_ctx->intid);
     }
 
+    // Several tasks may wait on the same queue
+    virtio_virtq_ctx_t* waiting_ctx;
+    FOR_LLIST(irq_ctx->wait_queue, waiting_ctx)
+        if (waiting_ctx == queue_ctx) {
+            return;
+        }
+    END_FOR_LLIST()
+
     llist_append_ptr(irq_ctx->wait_queue, queue_ctx);
 }
 
@@ -268,14 +399,16 @@ void virtio_wait_irq(virtio_virtq_ctx_t* queue_ctx, virtio_virtq_shared_irq_ctx_
 
     wait_ctx_t wait_ctx = {
         .virtioirq = {
-            .ctx = irq_ctx
+            .ctx = queue_ctx
         },
+        .queue = &irq_ctx->wake_queue,
         .wake_at = 0
     };
 
-    if (llist_at(irq_ctx->wait_queue, 0) == queue_ctx) {
-        // Do an irq wait
-        interrupt_await(irq_ctx->intid);
+    // Only the task that reset the irq can await it
+    if (llist_at(irq_ctx->wait_queue, 0) == queue_ctx &&
+        interrupt_await(irq_ctx->intid)) {
+        // Did an irq wait
     } else {
         // Wait for a signal from the irq handler
         task_wait_kernel(get_active_task(), WAIT_VIRTIOIRQ, &wait_ctx, TASK_WAIT_WAKEUP, virtio_wakeup_irq);
@@ -304,6 +437,32 @@ uint64_t virtio_poll_virtq_irq(virtio_virtq_ctx_t* queue_ctx, virtio_virtq_share
     return 0;
 }
 
+/*
+ * Wait for the device to use a chain that has not been popped with
+ * virtio_virtq_next_used. Nothing is consumed, and the wait may end
+ * early if another queue on the same irq is signalled, so callers
+ * should check their own completions and wait again
+ */
+void virtio_wait_virtq_used(virtio_virtq_ctx_t* queue_ctx, virtio_virtq_shared_irq_ctx_t* irq_ctx) {
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Waddress-of-packed-member"
+    volatile uint16_t* used_idx_ptr = &queue_ctx->used_ptr->idx;
+#pragma GCC diagnostic pop
+
+    uint64_t crit_ctx;
+    BEGIN_CRITICAL(crit_ctx);
+
+    if (*used_idx_ptr != queue_ctx->last_used_idx) {
+        END_CRITICAL(crit_ctx);
+        return;
+    }
+    virtio_add_irq_to_ctx(queue_ctx, irq_ctx);
+    END_CRITICAL(crit_ctx);
+
+    virtio_wait_irq(queue_ctx, irq_ctx);
+}
+
 void virtio_handle_irq(virtio_virtq_shared_irq_ctx_t* irq_ctx) {
     
     virtio_virtq_ctx_t* queue_ctx;
@@ -312,6 +471,8 @@ void virtio_handle_irq(virtio_virtq_shared_irq_ctx_t* irq_ctx) {
     END_FOR_LLIST()
 
     llist_free_all(irq_ctx->wait_queue);
+
+    wait_queue_signal(&irq_ctx->wake_queue);
 }
 
 
@@ -343,7 +504,9 @@ void virtio_virtq_notify(pci_device_ctx_t* ctx, virtio_virtq_ctx_t* queue_ctx) {
 
     uint16_t* notify_addr = ctx->bar[bar_num].vmem + bar_off +
                                 (queue_ctx->queue_notify_off * not_off_mul);
-    
+
+    // The avail index must reach memory before the device is notified
+    MEM_DSB();
     *notify_addr = queue_ctx->queue_num;
     MEM_DSB();
 }
@@ -511,6 +674,16 @@ void virtio_init_pci_caps(pci_device_ctx_t* device_ctx) {
 }
 
 bool virtio_init_with_features(pci_device_ctx_t* device_ctx, uint64_t features_req) {
+    return virtio_init_with_opt_features(device_ctx, features_req, 0, NULL);
+}
+
+/*
+ * Negotiate every feature in features_req, failing if the device lacks
+ * any of them, and whichever of opt_features the device offers. The
+ * negotiated set is returned in features_out if it is not NULL
+ */
+bool virtio_init_with_opt_features(pci_device_ctx_t* device_ctx, uint64_t features_req,
+                                   uint64_t opt_features, uint64_t* features_out) {
 
     pci_cap_t* cap = virtio_get_capability(device_ctx, VIRTIO_PCI_CAP_COMMON_CFG);
     ASSERT(cap != NULL);
@@ -526,8 +699,13 @@ bool virtio_init_with_features(pci_device_ctx_t* device_ctx, uint64_t features_r
         return false;
     }
 
+    features_req |= features & opt_features;
     virtio_set_features(common_cfg, features_req);
 
+    if (features_out != NULL) {
+        *features_out = features_req;
+    }
+
     virtio_set_status(common_cfg, VIRTIO_STATUS_FEATURES_OK);
     uint8_t device_status = virtio_get_status(common_cfg);
 
@@ -6,6 +6,7 @@
 #include <stdbool.h>
 
 #include "kernel/lib/libpci.h"
+#include "kernel/task.h"
 #include "stdlib/malloc.h"
 
 #define VIRTIO_PCI_CAP_TYPE (3)
@@ -142,6 +143,7 @@ enum {
     VIRTIO_NET_F_GUEST_ANNOUNCE = 21,
     VIRTIO_NET_F_MQ = 22,
     VIRTIO_NET_F_CTRL_MAC_ADDRR = 23,
+    VIRTIO_NET_F_RSS = 60,
     VIRTIO_NET_F_RSC_EXT = 61,
     VIRTIO_NET_F_STANDBY = 62
 };
@@ -196,6 +198,7 @@ typedef struct __attribute__((__packed__)) {
 
 typedef struct {
     llist_head_t wait_queue;
+    wait_queue_t wake_queue;    /* Tasks waiting for a signal from the irq handler */
     int32_t intid;
 } virtio_virtq_shared_irq_ctx_t;
 
@@ -212,6 +215,9 @@ typedef struct {
     uint16_t queue_notify_off;
     uint16_t last_used_idx;
 
+    uint16_t free_head;         /* First descriptor on the free list */
+    uint16_t num_free;          /* Descriptors on the free list */
+
     void* buffer_pool;
     uintptr_t buffer_pool_phy;
     uint64_t buffer_pool_size;
@@ -225,19 +231,83 @@ typedef struct {
     uint64_t len;
 } virtio_virtq_buffer_t;
 
+/**
+ * One segment of a descriptor chain given by its physical address.
+ * Device readable segments must come before device writable ones
+ */
+typedef struct {
+    uintptr_t phy;
+    uint32_t len;
+    bool device_write;          /* The device writes into this segment */
+} virtio_virtq_seg_t;
+
 typedef struct {
     uint8_t mac[6];
     uint16_t status;
     uint16_t max_virtqueue_pairs;
     uint16_t mtu;
+    uint32_t speed;
+    uint8_t duplex;
+    uint8_t rss_max_key_size;
+    uint16_t rss_max_indirection_table_length;
+    uint32_t supported_hash_types;
 } virtio_net_config_t;
 
+// Queue pair N uses receiveq 2N and transmitq 2N+1, and the control queue
+// follows the last pair the device supports
+#define VIRTIO_QUEUE_NET_RECEIVEQ(pair) (2 * (pair))
+#define VIRTIO_QUEUE_NET_TRANSMITQ(pair) (2 * (pair) + 1)
+#define VIRTIO_QUEUE_NET_CONTROLQ(max_pairs) (2 * (max_pairs))
+
+enum {
+    VIRTIO_NET_CTRL_MQ = 4
+};
+
+enum {
+    VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET = 0,
+    VIRTIO_NET_CTRL_MQ_RSS_CONFIG = 1
+};
+
+enum {
+    VIRTIO_NET_OK = 0,
+    VIRTIO_NET_ERR = 1
+};
+
+enum {
+    VIRTIO_NET_HASH_TYPE_IPV4 = 1 << 0,
+    VIRTIO_NET_HASH_TYPE_TCPV4 = 1 << 1,
+    VIRTIO_NET_HASH_TYPE_UDPV4 = 1 << 5
+};
+
+typedef struct __attribute__((__packed__)) {
+    uint8_t class;
+    uint8_t command;
+} virtio_net_ctrl_hdr_t;
+
+/*
+ * Followed by max_tx_vq (16 bits), hash_key_length (8 bits) and the key
+ */
+typedef struct __attribute__((__packed__)) {
+    uint32_t hash_types;
+    uint16_t indirection_table_mask;
+    uint16_t unclassified_queue;
+    uint16_t indirection_table[];
+} virtio_net_rss_config_t;
+
 enum {
     VIRTIO_NET_HDR_F_NEEDS_CSUM = 1,
     VIRTIO_NET_HDR_F_DATA_VALID = 2,
     VIRTIO_NET_HDR_F_RSC_INFO = 3
 };
 
+enum {
+    VIRTIO_NET_HDR_GSO_NONE = 0,
+    VIRTIO_NET_HDR_GSO_TCPV4 = 1,
+    VIRTIO_NET_HDR_GSO_UDP = 3,
+    VIRTIO_NET_HDR_GSO_TCPV6 = 4,
+    VIRTIO_NET_HDR_GSO_ECN = 0x80
+};
+
 typedef struct __attribute__((__packed__)) {
     uint8_t flags;
     uint8_t gso_type;
@@ -269,6 +339,14 @@ bool virtio_virtq_send(virtio_virtq_ctx_t* queue_ctx,
                        virtio_virtq_buffer_t* read_buffers,
                        uint64_t num_read_buffers);
                     
+uintptr_t virtio_buffer_phy(virtio_virtq_ctx_t* queue_ctx, void* buffer_ptr);
+
+int64_t virtio_virtq_submit(virtio_virtq_ctx_t* queue_ctx,
+                            virtio_virtq_seg_t* segs,
+                            uint64_t num_segs);
+bool virtio_virtq_next_used(virtio_virtq_ctx_t* queue_ctx, uint16_t* id_out, uint32_t* len_out);
+void virtio_wait_virtq_used(virtio_virtq_ctx_t* queue_ctx, virtio_virtq_shared_irq_ctx_t* irq_ctx);
+
 bool virtio_poll_virtq(virtio_virtq_ctx_t* queue_ctx, bool block);
 uint64_t virtio_poll_virtq_irq(virtio_virtq_ctx_t* queue_ctx, virtio_virtq_shared_irq_ctx_t* irq_ctx);
 void virtio_handle_irq(virtio_virtq_shared_irq_ctx_t* irq_ctx);
@@ -285,6 +363,8 @@ void print_virtio_feature_bits(uint32_t feat_low, uint32_t feat_high, uint64_t d
 
 void virtio_init_pci_caps(pci_device_ctx_t* pci_ctx);
 bool virtio_init_with_features(pci_device_ctx_t* pci_ctx, uint64_t features);
+bool virtio_init_with_opt_features(pci_device_ctx_t* pci_ctx, uint64_t features,
+                                   uint64_t opt_features, uint64_t* features_out);
 
 uint64_t virtio_poll_virtq_block(virtio_virtq_ctx_t* queue_ctx);
 
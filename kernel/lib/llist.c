@@ -10,6 +10,7 @@
 #include "kernel/lib/vmalloc.h"
 
 #include "kernel/lib/llist.h"
+#include "kernel/lib/slab.h"
 
 // llist structure
 //
@@ -22,10 +23,10 @@
 // | dataptr -> NULL  |   | dataptr -> item1 |  | dataptr -> item2 |
 // \------------------/   \------------------/  \------------------/
 
-
+static slab_cache_t s_llist_cache = SLAB_CACHE_INIT("llist", llist_t);
 
 llist_head_t llist_create() {
-    llist_t* l = vmalloc(sizeof(llist_t));
+    llist_t* l = slab_alloc(&s_llist_cache);
     l->n = NULL;
     l->p = NULL;
     l->dataptr = NULL;
@@ -34,7 +35,7 @@ llist_head_t llist_create() {
 }
 
 void llist_free(llist_head_t head) {
-    vfree(head);
+    slab_free(&s_llist_cache, head);
 }
 
 void llist_free_all(llist_head_t head) {
@@ -42,7 +43,7 @@ void llist_free_all(llist_head_t head) {
     llist_t* item = head->n;
     while (item != NULL) {
         llist_t* n = item->n;
-        vfree(item);
+        slab_free(&s_llist_cache, item);
         item = n;
     }
 
@@ -74,7 +75,7 @@ void llist_append_ptr(llist_head_t head, void* newitem) {
         item = item->n;
     }
 
-    item->n = vmalloc(sizeof(llist_t));
+    item->n = slab_alloc(&s_llist_cache);
     item->n->dataptr = newitem;
     item->n->n = NULL;
     item->n->p = item;
@@ -99,7 +100,7 @@ void llist_delete_ptr(llist_head_t head, void* delitem) {
         item->p->n = item->n;
 
         item->dataptr = NULL;
-        vfree(item);
+        slab_free(&s_llist_cache, item);
     }
 }
 
@@ -0,0 +1,227 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "kernel/assert.h"
+#include "kernel/kmalloc.h"
+#include "kernel/kernelspace.h"
+#include "kernel/vmem.h"
+
+#include "kernel/lib/slab.h"
+
+#include "stdlib/bitutils.h"
+#include "stdlib/malloc.h"
+
+#define SLAB_MAGIC (0x51AB51AB5A5A5A5AULL)
+#define SLAB_OBJ_ALIGN 16
+
+/**
+ * Slab layout
+ *
+ * Each slab is a single physical page accessed through the kernel
+ * linear map. A slab_page_t header sits at the start of the page and
+ * the rest of the page is split into equal sized objects. Free objects
+ * are linked through their first word.
+ *
+ * Caches keep a list of partial slabs. Allocation takes from the first
+ * partial slab and free pushes back onto the owning slab, so both are
+ * O(1). A slab that becomes completely free is returned to kmalloc_phy
+ * unless it is the only partial slab in the cache.
+ */
+
+typedef struct _slab_obj_t {
+    struct _slab_obj_t* next;
+} slab_obj_t;
+
+typedef struct _slab_page_t {
+    uint64_t magic;
+    slab_cache_t* cache;
+    struct _slab_page_t* next;
+    struct _slab_page_t* prev;
+    slab_obj_t* free_list;
+    uint64_t inuse;
+} slab_page_t;
+
+#define SLAB_HEADER_SIZE ((sizeof(slab_page_t) + SLAB_OBJ_ALIGN - 1) & ~(SLAB_OBJ_ALIGN - 1))
+
+static slab_cache_t* s_slab_caches = NULL;
+static malloc_check_mode_t s_check_mode = MALLOC_CHECK_MODE_DEFAULT;
+
+static void slab_cache_setup(slab_cache_t* cache) {
+
+    uint64_t obj_size = MAX(cache->obj_size, sizeof(slab_obj_t));
+    obj_size = (obj_size + SLAB_OBJ_ALIGN - 1) & ~(SLAB_OBJ_ALIGN - 1);
+
+    cache->obj_size = obj_size;
+    cache->objs_per_slab = (VMEM_PAGE_SIZE - SLAB_HEADER_SIZE) / obj_size;
+    ASSERT(cache->objs_per_slab > 1);
+
+    cache->partial = NULL;
+    cache->num_slabs = 0;
+    cache->num_inuse = 0;
+    cache->num_hits = 0;
+    cache->num_misses = 0;
+    cache->num_frees = 0;
+
+    cache->next = s_slab_caches;
+    s_slab_caches = cache;
+
+    cache->magic = SLAB_MAGIC;
+}
+
+static void slab_partial_add(slab_cache_t* cache, slab_page_t* slab) {
+
+    slab->prev = NULL;
+    slab->next = cache->partial;
+    if (cache->partial != NULL) {
+        cache->partial->prev = slab;
+    }
+    cache->partial = slab;
+}
+
+static void slab_partial_remove(slab_cache_t* cache, slab_page_t* slab) {
+
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        cache->partial = slab->next;
+    }
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
+    }
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+static void slab_grow(slab_cache_t* cache) {
+
+    slab_page_t* slab = PHY_TO_KSPACE_PTR(kmalloc_phy_nozero(VMEM_PAGE_SIZE));
+    ASSERT(slab != NULL);
+
+    slab->magic = SLAB_MAGIC;
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->free_list = NULL;
+
+    uint8_t* obj_base = ((uint8_t*)slab) + SLAB_HEADER_SIZE;
+    for (int64_t idx = cache->objs_per_slab - 1; idx >= 0; idx--) {
+        slab_obj_t* obj = (slab_obj_t*)(obj_base + (idx * cache->obj_size));
+        obj->next = slab->free_list;
+        slab->free_list = obj;
+    }
+
+    slab_partial_add(cache, slab);
+    cache->num_slabs++;
+}
+
+void* slab_alloc(slab_cache_t* cache) {
+
+    if (cache->magic != SLAB_MAGIC) {
+        slab_cache_setup(cache);
+    }
+
+    if (cache->partial == NULL) {
+        cache->num_misses++;
+        slab_grow(cache);
+    } else {
+        cache->num_hits++;
+    }
+
+    slab_page_t* slab = cache->partial;
+    ASSERT(slab->magic == SLAB_MAGIC);
+
+    slab_obj_t* obj = slab->free_list;
+    slab->free_list = obj->next;
+    slab->inuse++;
+    cache->num_inuse++;
+
+    if (slab->free_list == NULL) {
+        slab_partial_remove(cache, slab);
+    }
+
+    memset(obj, 0, cache->obj_size);
+
+    return obj;
+}
+
+void slab_free(slab_cache_t* cache, const void* obj) {
+
+    ASSERT(obj != NULL);
+
+    slab_page_t* slab = (slab_page_t*)PAGE_FLOOR((uintptr_t)obj);
+    ASSERT(slab->magic == SLAB_MAGIC);
+    ASSERT(slab->cache == cache);
+    ASSERT(slab->inuse > 0);
+
+    // Must be the start of an object that is not already free
+    uintptr_t obj_offset = (uintptr_t)obj - (uintptr_t)slab - SLAB_HEADER_SIZE;
+    ASSERT((uintptr_t)obj >= (uintptr_t)slab + SLAB_HEADER_SIZE);
+    ASSERT(obj_offset % cache->obj_size == 0);
+    ASSERT(obj_offset / cache->obj_size < cache->objs_per_slab);
+
+    // Walking the free list to catch a double free is O(objs_per_slab),
+    // so it is only done as often as the heap checks
+    if (s_check_mode == MALLOC_CHECK_FULL ||
+        (s_check_mode == MALLOC_CHECK_SAMPLED &&
+         (cache->num_frees % MALLOC_CHECK_SAMPLE_PERIOD) == 0)) {
+        for (slab_obj_t* free_obj = slab->free_list; free_obj != NULL; free_obj = free_obj->next) {
+            ASSERT(free_obj != obj);
+        }
+    }
+
+    bool was_full = slab->free_list == NULL;
+
+    slab_obj_t* free_obj = (slab_obj_t*)obj;
+    free_obj->next = slab->free_list;
+    slab->free_list = free_obj;
+    slab->inuse--;
+
+    cache->num_inuse--;
+    cache->num_frees++;
+
+    if (was_full) {
+        slab_partial_add(cache, slab);
+    }
+
+    // Keep a single empty slab around to avoid thrashing kmalloc
+    if (slab->inuse == 0 &&
+        (cache->partial != slab || slab->next != NULL)) {
+        slab_partial_remove(cache, slab);
+        slab->magic = 0;
+        cache->num_slabs--;
+        kfree_phy(KSPACE_TO_PHY_PTR(slab));
+    }
+}
+
+bool slab_owns_ptr(const void* obj) {
+
+    if (obj == NULL || !IS_KSPACE_PTR(obj)) {
+        return false;
+    }
+
+    // Only look at the header once the page is known to be a live
+    // allocation, so an arbitrary pointer can't fault here
+    uintptr_t page = PAGE_FLOOR((uintptr_t)obj);
+    if (!kmalloc_phy_is_allocated(KSPACE_TO_PHY(page))) {
+        return false;
+    }
+
+    slab_page_t* slab = (slab_page_t*)page;
+    return slab->magic == SLAB_MAGIC;
+}
+
+void slab_free_ptr(const void* obj) {
+
+    slab_page_t* slab = (slab_page_t*)PAGE_FLOOR((uintptr_t)obj);
+    ASSERT(slab->magic == SLAB_MAGIC);
+
+    slab_free(slab->cache, obj);
+}
+
+void slab_set_check_mode(malloc_check_mode_t mode) {
+    s_check_mode = mode;
+}
+
+slab_cache_t* slab_get_caches(void) {
+    return s_slab_caches;
+}
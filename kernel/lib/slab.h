@@ -0,0 +1,49 @@
+
+#ifndef __LIB_SLAB_H__
+#define __LIB_SLAB_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "stdlib/malloc.h"
+
+struct _slab_page_t;
+
+typedef struct _slab_cache_t {
+    const char* name;
+    uint64_t obj_size;
+
+    uint64_t magic;
+    uint64_t objs_per_slab;
+    struct _slab_page_t* partial;   /* Slabs with at least one free object */
+
+    uint64_t num_slabs;
+    uint64_t num_inuse;
+    uint64_t num_hits;
+    uint64_t num_misses;
+    uint64_t num_frees;
+
+    struct _slab_cache_t* next;
+} slab_cache_t;
+
+// Statically defines a cache for objects of (type). The cache
+// is set up on the first allocation
+#define SLAB_CACHE_INIT(cache_name, type) \
+    { .name = cache_name, .obj_size = sizeof(type) }
+
+void* slab_alloc(slab_cache_t* cache);
+void slab_free(slab_cache_t* cache, const void* obj);
+
+// Free an object without knowing its cache. The cache is
+// found through the slab header
+void slab_free_ptr(const void* obj);
+
+// True if obj is inside a page owned by a slab cache
+bool slab_owns_ptr(const void* obj);
+
+// Double frees are looked for as often as the heaps are checked
+void slab_set_check_mode(malloc_check_mode_t mode);
+
+slab_cache_t* slab_get_caches(void);
+
+#endif
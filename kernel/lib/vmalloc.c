@@ -6,6 +6,7 @@
 #include "kernel/kmalloc.h"
 #include "kernel/kernelspace.h"
 #include "kernel/assert.h"
+#include "kernel/lib/slab.h"
 
 #include "stdlib/malloc.h"
 #include "stdlib/linalloc.h"
@@ -36,6 +37,13 @@ void* vmalloc(uint64_t size) {
 
 void vfree(const void* mem) {
     memory_entry_t* entry = memspace_get_entry_at_addr_kernel(mem);
+    if (entry == NULL) {
+        // Objects allocated from a slab cache may be freed with vfree.
+        // Anything else is a bad pointer or a double free
+        ASSERT(slab_owns_ptr(mem));
+        slab_free_ptr(mem);
+        return;
+    }
     ASSERT(entry->type == MEMSPACE_PHY);
     uint64_t mem_phy = ((memory_entry_phy_t*)entry)->phy_addr;
     memspace_unmap_kernel(mem);
@@ -47,6 +55,15 @@ void vmalloc_calc_stat(malloc_stat_t* stat_out) {
     stat_out->total_mem = 0;
     stat_out->avail_mem = 0;
     stat_out->largest_chunk = 0;
+    stat_out->check_mode = MALLOC_CHECK_RELEASE;
+    stat_out->num_checks = 0;
+}
+
+void vmalloc_check_structure(void) {
+}
+
+void vmalloc_set_check_mode(malloc_check_mode_t mode) {
+    (void)mode;
 }
 
 #else
@@ -73,7 +90,7 @@ int64_t vmalloc_add_mem(bool initialize, uint64_t req_size, void* ctx, malloc_st
 }
 
 void vmalloc_init(uint64_t size) {
-    s_vmalloc_mem_phy = kmalloc_phy(size);
+    s_vmalloc_mem_phy = kmalloc_phy_nozero(size);
     ASSERT(s_vmalloc_mem_phy != NULL);
     
     s_vmalloc_ctx.mem = PHY_TO_KSPACE(s_vmalloc_mem_phy);
@@ -84,11 +101,21 @@ void vmalloc_init(uint64_t size) {
 
 void* vmalloc(uint64_t size) {
     void* ret = malloc_p(size, &s_vmalloc_state);
+    ASSERT(ret != NULL);
     memset(ret, 0, size);
     return ret;
 }
 
 void vfree(const void* mem) {
+    if ((uintptr_t)mem < s_vmalloc_ctx.mem ||
+        (uintptr_t)mem >= (s_vmalloc_ctx.mem + s_vmalloc_ctx.len)) {
+        // Objects allocated from a slab cache may be freed with vfree.
+        // Anything else is a bad pointer or a double free
+        ASSERT(slab_owns_ptr(mem));
+        slab_free_ptr(mem);
+        return;
+    }
+
     free_p(mem, &s_vmalloc_state);
 }
 
@@ -100,4 +127,8 @@ void vmalloc_check_structure(void) {
     malloc_check_structure_p(&s_vmalloc_state);
 }
 
+void vmalloc_set_check_mode(malloc_check_mode_t mode) {
+    malloc_set_check_mode(&s_vmalloc_state, mode);
+}
+
 #endif
\ No newline at end of file
@@ -14,5 +14,6 @@ void vfree(const void* mem);
 
 void vmalloc_calc_stat(malloc_stat_t* stat_out);
 void vmalloc_check_structure(void);
+void vmalloc_set_check_mode(malloc_check_mode_t mode);
 
 #endif
\ No newline at end of file
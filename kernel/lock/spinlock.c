@@ -0,0 +1,60 @@
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "kernel/lock/spinlock.h"
+#include "kernel/assert.h"
+
+void spinlock_init(spinlock_t* lock) {
+    ASSERT(lock != NULL);
+    lock->locked = 0;
+}
+
+void spinlock_acquire(spinlock_t* lock) {
+    uint32_t val;
+    uint32_t fail;
+
+    // Sleep in WFE while the lock is held. Releasing the lock clears
+    // the exclusive monitor and sends an event to wake the waiters
+    asm volatile (
+        "   sevl\n"
+        "1: wfe\n"
+        "2: ldaxr %w[val], [%[lock]]\n"
+        "   cbnz %w[val], 1b\n"
+        "   stxr %w[fail], %w[one], [%[lock]]\n"
+        "   cbnz %w[fail], 2b\n"
+        : [val] "=&r" (val), [fail] "=&r" (fail)
+        : [lock] "r" (&lock->locked), [one] "r" (1)
+        : "memory");
+}
+
+bool spinlock_try_acquire(spinlock_t* lock) {
+    uint32_t val;
+    uint32_t fail;
+
+    asm volatile (
+        "1: ldaxr %w[val], [%[lock]]\n"
+        "   cbnz %w[val], 2f\n"
+        "   stxr %w[fail], %w[one], [%[lock]]\n"
+        "   cbnz %w[fail], 1b\n"
+        "   b 3f\n"
+        "2: clrex\n"
+        "3:\n"
+        : [val] "=&r" (val), [fail] "=&r" (fail)
+        : [lock] "r" (&lock->locked), [one] "r" (1)
+        : "memory");
+
+    return val == 0;
+}
+
+void spinlock_release(spinlock_t* lock) {
+    ASSERT(lock->locked != 0);
+
+    asm volatile (
+        "stlr wzr, [%[lock]]\n"
+        "sev\n"
+        :
+        : [lock] "r" (&lock->locked)
+        : "memory");
+}
@@ -0,0 +1,21 @@
+#ifndef __SPINLOCK_H__
+#define __SPINLOCK_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Busy waiting lock built on the exclusive load/store instructions.
+ * Callers are responsible for masking interrupts if the lock may also
+ * be taken from an interrupt handler on the same CPU.
+ */
+typedef struct {
+    volatile uint32_t locked;
+} spinlock_t;
+
+void spinlock_init(spinlock_t* lock);
+void spinlock_acquire(spinlock_t* lock);
+bool spinlock_try_acquire(spinlock_t* lock);
+void spinlock_release(spinlock_t* lock);
+
+#endif
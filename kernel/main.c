@@ -13,12 +13,14 @@
 #include "kernel/interrupt/interrupt.h"
 #include "kernel/task.h"
 #include "kernel/schedule.h"
+#include "kernel/smp.h"
 #include "kernel/syscall.h"
 #include "kernel/memoryspace.h"
 #include "kernel/kernelspace.h"
 #include "kernel/elf.h"
 #include "kernel/drivers.h"
 #include "kernel/sys_device.h"
+#include "kernel/fs/bcache.h"
 #include "kernel/fs/ext2/ext2.h"
 #include "kernel/fs/sysfs/sysfs.h"
 #include "kernel/fs/ramfs/ramfs.h"
@@ -57,6 +59,7 @@ void main() {
     console_write("Kernel Main\n");
 
     gtimer_early_init();
+    smp_init();
 
     kmalloc_init();
 
@@ -117,6 +120,7 @@ void main() {
     net_tcp_socket_init();
     net_tcp_bind_init();
 
+    bcache_init();
     ext2_register();
     sysfs_register();
     ramfs_register();
@@ -145,6 +149,11 @@ void kernel_init_lower_thread(void* ctx) {
     driver_run_late_init();
     interrupt_enable();
 
+    smp_start_cpus();
+
+    bcache_start_writeback();
+    bcache_start_readahead();
+
     board_discover_devices();
 
     net_start_task();
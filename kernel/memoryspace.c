@@ -225,6 +225,41 @@ static bool memspace_vmem_add_cache(_vmem_table* table, memory_entry_cache_t* en
     return true;
 }
 
+/*
+ * Private writable entries map shared pages read only, so the first
+ * write faults and makes a copy
+ */
+static _vmem_ap_flags memspace_file_page_flags(memory_entry_file_t* entry, memfile_page_t* page) {
+
+    uint32_t flags = entry->flags;
+    if ((flags & MEMSPACE_FLAG_PRIVATE) &&
+        (flags & MEMSPACE_FLAG_PERM_MASK) == MEMSPACE_FLAG_PERM_URW &&
+        page->ctx != NULL) {
+        flags = (flags & ~MEMSPACE_FLAG_PERM_MASK) | MEMSPACE_FLAG_PERM_URO;
+    }
+
+    return memspace_vmem_get_vmem_flags(flags);
+}
+
+static bool memspace_vmem_add_file(_vmem_table* table, memory_entry_file_t* entry) {
+
+    ASSERT(entry->start < entry->end);
+
+    memfile_page_t* page;
+    FOR_LLIST(entry->page_list, page)
+        ASSERT(entry->start + page->offset < entry->end);
+        vmem_map_address_range(table,
+                               page->phy_addr,
+                               entry->start + page->offset,
+                               VMEM_PAGE_SIZE,
+                               memspace_file_page_flags(entry, page),
+                               VMEM_ATTR_MEM,
+                               false);
+    END_FOR_LLIST()
+
+    return true;
+}
+
 static void memspace_vmem_del_entry(_vmem_table* table, memory_entry_t* entry) {
 
     vmem_unmap_address_range(table, entry->start, entry->end - entry->start);
@@ -269,6 +304,9 @@ _vmem_table* memspace_build_vmem(memory_space_t* space) {
             case MEMSPACE_CACHE:
                 memspace_vmem_add_cache(space->l0_table, (memory_entry_cache_t*)entry);
                 break;
+            case MEMSPACE_FILE:
+                memspace_vmem_add_file(space->l0_table, (memory_entry_file_t*)entry);
+                break;
             default:
                 ASSERT(0);
         }
@@ -297,6 +335,44 @@ void memspace_update_cache(memory_space_t* space, memory_entry_cache_t* entry) {
     llist_append_ptr(space->update_cache_entries, entry);
 }
 
+/*
+ * Map one more page of a file entry. The entry must already be in the
+ * memory space, so the page is added to the table directly
+ */
+void memspace_map_file_page(memory_space_t* space, memory_entry_file_t* entry, memfile_page_t* page) {
+
+    ASSERT(entry->type == MEMSPACE_FILE);
+    ASSERT(entry->start + page->offset < entry->end);
+
+    llist_append_ptr(entry->page_list, page);
+
+    vmem_map_address_range(space->l0_table,
+                           page->phy_addr,
+                           entry->start + page->offset,
+                           VMEM_PAGE_SIZE,
+                           memspace_file_page_flags(entry, page),
+                           VMEM_ATTR_MEM,
+                           true);
+}
+
+/*
+ * Replace the mapping of a page already in the entry, after its
+ * physical page or sharing changed
+ */
+void memspace_remap_file_page(memory_space_t* space, memory_entry_file_t* entry, memfile_page_t* page) {
+
+    ASSERT(entry->type == MEMSPACE_FILE);
+    ASSERT(entry->start + page->offset < entry->end);
+
+    vmem_map_address_range(space->l0_table,
+                           page->phy_addr,
+                           entry->start + page->offset,
+                           VMEM_PAGE_SIZE,
+                           memspace_file_page_flags(entry, page),
+                           VMEM_ATTR_MEM,
+                           false);
+}
+
 bool memspace_alloc_space(memory_space_t* space, uint64_t len, memory_entry_t* entry_out) {
     ASSERT(space != NULL);
     ASSERT(entry_out != NULL);
@@ -94,16 +94,25 @@ typedef struct __attribute__((packed)) {
     uint64_t res[1];
 } memory_entry_cache_t;
 
-/*
+typedef struct {
+    uint64_t offset;    // Offset of the page from the start of the entry
+    uintptr_t phy_addr;
+    void* ctx;          // Owner's handle on the page. NULL for a private copy
+} memfile_page_t;
+
+// MEMSPACE_FILE
+// A range of a file. Pages are mapped as they are first accessed
 typedef struct __attribute__((packed)) {
-    uint64_t start;
-    uint64_t end;
-    uint32_t type;
-    uint32_t flags;
-    uint64_t callsite;
-    file_ctx_t* file_ctx;
+    uint64_t start;      // VMEM allocated start
+    uint64_t end;        // VMEM allocated end
+    uint32_t type;       // MEMSPACE_FILE
+    uint32_t flags;      // Permissions and MEMSPACE_FLAG_PRIVATE
+    uint64_t callsite;  // Pointer to the callsite that allocated this object
+    void* file_ctx;      // Open file, held open while it is mapped
+    uint64_t offset;     // File offset of start
+    llist_t* page_list;  // llist of memfile_page_t mapped so far
+    uint64_t file_len;   // Bytes from start backed by the file. The rest reads as zero
 } memory_entry_file_t;
-*/
 
 
 
@@ -134,12 +143,16 @@ typedef struct {
 // User No Permission. Kernel Read Execute
 #define MEMSPACE_FLAG_PERM_KRE (5)
 #define MEMSPACE_FLAG_IGNORE_DUPS BIT(4)
+// File entries only. Writes go to private copies and never reach the file
+#define MEMSPACE_FLAG_PRIVATE BIT(5)
 
 memory_entry_t* memspace_get_entry_at_addr(memory_space_t* space, void* addr_ptr);
 bool memspace_add_entry_to_memory(memory_space_t* space, memory_entry_t* entry);
 void memspace_remove_entry_from_memory(memory_space_t* space, memory_entry_t* entry);
 _vmem_table* memspace_build_vmem(memory_space_t* space);
 void memspace_update_cache(memory_space_t* space, memory_entry_cache_t* entry);
+void memspace_map_file_page(memory_space_t* space, memory_entry_file_t* entry, memfile_page_t* page);
+void memspace_remap_file_page(memory_space_t* space, memory_entry_file_t* entry, memfile_page_t* page);
 bool memspace_alloc_space(memory_space_t* space, uint64_t len, memory_entry_t* entry_out);
 void* memspace_alloc_entry(void);
 bool memspace_alloc(memory_space_t* space, memory_valloc_ctx_t* ctx);
@@ -8,6 +8,7 @@
 #include <kernel/assert.h>
 #include <kernel/task.h>
 #include <kernel/kernelspace.h>
+#include <kernel/mmap.h>
 #include <kernel/vmem.h>
 #include <stdlib/bitutils.h>
 #include <kernel/syscall.h>
@@ -75,21 +76,17 @@ static int64_t msg_translate_pointers(system_msg_memory_t* msg, task_t* src_task
     ASSERT(src_task != NULL);
     ASSERT(dst_task != NULL);
 
-    // Get the physical address of the pointer data in
-    // the source address space
-    uint64_t src_phy_addr;
-    bool walk_ok;
-    walk_ok = vmem_walk_table(src_task->low_vm_table, msg->ptr, &src_phy_addr);
-    if (!walk_ok) {
-        return SYSCALL_ERROR_BADARG;
-    }
-
     // Allocate physical memory for the message
-    uint8_t* dst_phy_ptr = kmalloc_phy(msg->len);
+    uint8_t* dst_phy_ptr = kmalloc_phy_nozero(msg->len);
     ASSERT(dst_phy_ptr != NULL);
 
-    // Copy pointer data from the source to destination physical memory
-    memcpy((void*)PHY_TO_KSPACE(dst_phy_ptr), (void*)PHY_TO_KSPACE(src_phy_addr), msg->len);
+    // Copy pointer data from the source address space to destination
+    // physical memory. The source pages need not be contiguous
+    if (!mmap_copy_user(src_task, msg->ptr, PHY_TO_KSPACE_PTR(dst_phy_ptr), msg->len, false)) {
+        kfree_phy(dst_phy_ptr);
+        return SYSCALL_ERROR_BADARG;
+    }
+    memset((void*)PHY_TO_KSPACE(dst_phy_ptr + msg->len), 0, PAGE_CEIL(msg->len) - msg->len);
 
     // Allocate virtual memory space in the destination space
     memory_entry_phy_t dst_phy_entry;
@@ -152,9 +149,7 @@ int64_t syscall_getmsgs(uint64_t msg_buffer,
 
     task_t* active_task = get_active_task();
 
-    uint64_t phy_addr;
-    bool res = vmem_walk_table(active_task->low_vm_table, msg_buffer, &phy_addr);
-    if (!res) {
+    if (!mmap_user_access(active_task, msg_buffer, msg_buffer_size, true)) {
         return SYSCALL_ERROR_BADARG;
     }
 
@@ -173,10 +168,9 @@ int64_t syscall_getmsgs(uint64_t msg_buffer,
     bool have_msg = msg_queue_pop(msgs, &msg);
     ASSERT(have_msg);
 
-    // Pointer to msg_buffer in memory mapped in kernel space
-    msg_placeholder_t* msg_buffer_kmem = (msg_placeholder_t*)PHY_TO_KSPACE(phy_addr);
-
-    *msg_buffer_kmem = msg;
+    if (!mmap_copy_user(active_task, msg_buffer, &msg, sizeof(msg_placeholder_t), true)) {
+        return SYSCALL_ERROR_BADARG;
+    }
 
     return 1;
 }
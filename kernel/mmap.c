@@ -0,0 +1,457 @@
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "kernel/mmap.h"
+#include "kernel/assert.h"
+#include "kernel/fd.h"
+#include "kernel/kernelspace.h"
+#include "kernel/kmalloc.h"
+#include "kernel/task.h"
+#include "kernel/vmem.h"
+#include "kernel/fs/bcache.h"
+#include "kernel/fs/file.h"
+#include "kernel/lib/vmalloc.h"
+
+#include "include/k_syscall.h"
+
+/**
+ * Files are mapped without populating any pages. The first access to a
+ * page faults and maps it. Where the file system keeps a page of the
+ * file in its own cache page, that page is mapped directly, so every
+ * task mapping the file shares it. Otherwise the task gets a private
+ * copy which is written back to the file on msync and unmap.
+ *
+ * Private mappings (MEMSPACE_FLAG_PRIVATE) are never written back.
+ * Their shared pages are mapped read only and copied on the first write.
+ *
+ * Accesses are not tracked, so every page of a writable mapping is
+ * considered dirty when it is synced
+ */
+
+static memory_entry_file_t* mmap_get_entry(task_t* task, uintptr_t addr) {
+
+    memory_entry_t* entry = memspace_get_entry_at_addr(&task->memory, (void*)addr);
+    if (entry == NULL || entry->type != MEMSPACE_FILE) {
+        return NULL;
+    }
+
+    return (memory_entry_file_t*)entry;
+}
+
+static void mmap_writeback(memory_entry_file_t* entry) {
+
+    if ((entry->flags & MEMSPACE_FLAG_PERM_MASK) != MEMSPACE_FLAG_PERM_URW ||
+        (entry->flags & MEMSPACE_FLAG_PRIVATE)) {
+        return;
+    }
+
+    file_ctx_t* file_ctx = entry->file_ctx;
+
+    memfile_page_t* page;
+    FOR_LLIST(entry->page_list, page)
+        uint64_t file_offset = entry->offset + page->offset;
+        if (page->ctx != NULL) {
+            file_mark_dirty(file_ctx, file_offset);
+        } else if (page->offset < entry->file_len) {
+            // The end of the last page is past the end of the file
+            uint64_t len = entry->file_len - page->offset;
+            len = len < VMEM_PAGE_SIZE ? len : VMEM_PAGE_SIZE;
+            file_write_at(file_ctx, file_offset,
+                          PHY_TO_KSPACE_PTR(page->phy_addr),
+                          len);
+        }
+    END_FOR_LLIST()
+}
+
+/*
+ * Instructions are fetched without going through the data cache, so
+ * code written by the kernel has to be cleaned to the point of
+ * unification before it is executed
+ */
+static void mmap_sync_icache(void* kptr) {
+
+    uint64_t ctr;
+    READ_SYS_REG(CTR_EL0, ctr);
+    uint64_t line = 4UL << ((ctr >> 16) & 0xF);
+
+    for (uintptr_t addr = (uintptr_t)kptr; addr < (uintptr_t)kptr + VMEM_PAGE_SIZE; addr += line) {
+        asm volatile("DC CVAU, %0" : : "r" (addr) : "memory");
+    }
+    asm volatile("DSB ISH");
+    asm volatile("IC IALLUIS");
+    asm volatile("DSB ISH");
+    asm volatile("ISB");
+}
+
+/*
+ * Give a private mapping its own copy of a shared page on first write
+ */
+static bool mmap_copy_page(task_t* task, memory_entry_file_t* entry, memfile_page_t* page) {
+
+    bcache_page_t* bcache_page = page->ctx;
+
+    void* copy_phy = kmalloc_phy_nozero(VMEM_PAGE_SIZE);
+    if (copy_phy == NULL) {
+        return false;
+    }
+    memcpy(PHY_TO_KSPACE_PTR(copy_phy), bcache_page->data, VMEM_PAGE_SIZE);
+    bcache_put(bcache_page);
+
+    page->phy_addr = (uintptr_t)copy_phy;
+    page->ctx = NULL;
+
+    memspace_remap_file_page(&task->memory, entry, page);
+    vmem_flush_tlb();
+
+    return true;
+}
+
+/*
+ * Make the page at addr available for an access. A page that is
+ * already mapped is left alone unless it has to be copied
+ */
+static bool mmap_populate(task_t* task, memory_entry_file_t* entry, uintptr_t addr,
+                          mmap_access_t access, bool fault) {
+
+    uint32_t perm = entry->flags & MEMSPACE_FLAG_PERM_MASK;
+    bool private = (entry->flags & MEMSPACE_FLAG_PRIVATE) != 0;
+
+    if ((access == MMAP_ACCESS_WRITE && perm != MEMSPACE_FLAG_PERM_URW) ||
+        (access == MMAP_ACCESS_EXEC && perm != MEMSPACE_FLAG_PERM_URE)) {
+        return false;
+    }
+
+    uint64_t page_offset = PAGE_FLOOR(addr) - entry->start;
+
+    memfile_page_t* page;
+    FOR_LLIST(entry->page_list, page)
+        if (page->offset == page_offset) {
+            if (access == MMAP_ACCESS_WRITE && private && page->ctx != NULL) {
+                return mmap_copy_page(task, entry, page);
+            }
+
+            // Already mapped, a fault came from a stale TLB entry
+            if (fault) {
+                vmem_flush_tlb();
+            }
+            return true;
+        }
+    END_FOR_LLIST()
+
+    file_ctx_t* file_ctx = entry->file_ctx;
+    uint64_t file_offset = entry->offset + page_offset;
+
+    // Pages only partly backed by the file are copied so the rest
+    // can be cleared
+    bcache_page_t* bcache_page = NULL;
+    if (!(private && access == MMAP_ACCESS_WRITE) &&
+        page_offset + VMEM_PAGE_SIZE <= entry->file_len) {
+        bcache_page = file_get_page(file_ctx, file_offset);
+    }
+
+    page = vmalloc(sizeof(memfile_page_t));
+    page->offset = page_offset;
+
+    void* page_kptr;
+    if (bcache_page != NULL) {
+        page->phy_addr = bcache_page->phy;
+        page->ctx = bcache_page;
+        page_kptr = bcache_page->data;
+    } else {
+        void* copy_phy = kmalloc_phy(VMEM_PAGE_SIZE);
+        if (copy_phy == NULL) {
+            vfree(page);
+            return false;
+        }
+        page_kptr = PHY_TO_KSPACE_PTR(copy_phy);
+        if (page_offset < entry->file_len) {
+            uint64_t len = entry->file_len - page_offset;
+            len = len < VMEM_PAGE_SIZE ? len : VMEM_PAGE_SIZE;
+            file_read_at(file_ctx, file_offset, page_kptr, len);
+        }
+        page->phy_addr = (uintptr_t)copy_phy;
+        page->ctx = NULL;
+    }
+
+    if (perm == MEMSPACE_FLAG_PERM_URE) {
+        mmap_sync_icache(page_kptr);
+    }
+
+    memspace_map_file_page(&task->memory, entry, page);
+    vmem_flush_tlb();
+
+    return true;
+}
+
+bool mmap_handle_fault(task_t* task, uintptr_t addr, mmap_access_t access) {
+
+    memory_entry_file_t* entry = mmap_get_entry(task, addr);
+    if (entry == NULL) {
+        return false;
+    }
+
+    return mmap_populate(task, entry, addr, access, true);
+}
+
+/*
+ * Prepare a user buffer for access by the kernel. Pages of mapped files
+ * are faulted in. The kernel writes through its own mapping of the
+ * page, so for a write, read only pages are refused and shared pages of
+ * private mappings are copied first
+ */
+bool mmap_user_access(task_t* task, uintptr_t addr, uint64_t len, bool write) {
+
+    if (task->tid & TASK_TID_KERNEL) {
+        return true;
+    }
+
+    mmap_access_t access = write ? MMAP_ACCESS_WRITE : MMAP_ACCESS_READ;
+
+    uintptr_t end = addr + (len > 0 ? len : 1);
+    for (uintptr_t page_addr = PAGE_FLOOR(addr); page_addr < end; page_addr += VMEM_PAGE_SIZE) {
+        memory_entry_file_t* entry = mmap_get_entry(task, page_addr);
+        if (entry != NULL && !mmap_populate(task, entry, page_addr, access, false)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Copy between a user buffer and the kernel one page at a time. Pages of
+ * mapped files are not contiguous in physical memory, so a buffer that
+ * may span several pages cannot be used through a single kernel pointer
+ */
+bool mmap_copy_user(task_t* task, uintptr_t addr, void* kbuffer, uint64_t len, bool to_user) {
+
+    if (!mmap_user_access(task, addr, len, to_user)) {
+        return false;
+    }
+
+    uint8_t* kbuffer_bytes = kbuffer;
+    uint64_t copied = 0;
+    while (copied < len) {
+        uint64_t phy;
+        if (!vmem_walk_table(task->low_vm_table, addr, &phy)) {
+            return false;
+        }
+
+        uint64_t count = VMEM_PAGE_SIZE - (addr & (VMEM_PAGE_SIZE - 1));
+        count = count < (len - copied) ? count : (len - copied);
+
+        if (to_user) {
+            memcpy(PHY_TO_KSPACE_PTR(phy), &kbuffer_bytes[copied], count);
+        } else {
+            memcpy(&kbuffer_bytes[copied], PHY_TO_KSPACE_PTR(phy), count);
+        }
+
+        addr += count;
+        copied += count;
+    }
+
+    return true;
+}
+
+/*
+ * Copy a NUL terminated string from a user buffer. Fails if the string
+ * including its terminator does not fit in max_len bytes
+ */
+bool mmap_copy_user_str(task_t* task, uintptr_t addr, char* kbuffer, uint64_t max_len) {
+
+    uint64_t copied = 0;
+    while (copied < max_len) {
+        if (!mmap_user_access(task, addr, 1, false)) {
+            return false;
+        }
+
+        uint64_t phy;
+        if (!vmem_walk_table(task->low_vm_table, addr, &phy)) {
+            return false;
+        }
+
+        uint64_t count = VMEM_PAGE_SIZE - (addr & (VMEM_PAGE_SIZE - 1));
+        count = count < (max_len - copied) ? count : (max_len - copied);
+
+        const char* page_str = PHY_TO_KSPACE_PTR(phy);
+        for (uint64_t idx = 0; idx < count; idx++) {
+            kbuffer[copied + idx] = page_str[idx];
+            if (page_str[idx] == '\0') {
+                return true;
+            }
+        }
+
+        addr += count;
+        copied += count;
+    }
+
+    return false;
+}
+
+/*
+ * Adds a private mapping of a file range to a memory space that is
+ * being built. file_len bytes from start come from the file at offset
+ */
+bool mmap_add_private(memory_space_t* memspace, file_ctx_t* file_ctx,
+                      uintptr_t start, uintptr_t end, uint32_t flags,
+                      uint64_t offset, uint64_t file_len) {
+
+    ASSERT(start == PAGE_FLOOR(start));
+    ASSERT(offset == PAGE_FLOOR(offset));
+
+    memory_entry_file_t file_entry = {
+        .start = start,
+        .end = PAGE_CEIL(end),
+        .type = MEMSPACE_FILE,
+        .flags = flags | MEMSPACE_FLAG_PRIVATE,
+        .file_ctx = file_ctx,
+        .offset = offset,
+        .page_list = llist_create(),
+        .file_len = file_len
+    };
+
+    if (!memspace_add_entry_to_memory(memspace, (memory_entry_t*)&file_entry)) {
+        llist_free(file_entry.page_list);
+        return false;
+    }
+
+    file_map_get(file_ctx);
+
+    return true;
+}
+
+/*
+ * Writes back and drops the pages of a mapping. The entry itself is
+ * removed by the caller
+ */
+void mmap_release(memory_entry_file_t* entry) {
+
+    ASSERT(entry->type == MEMSPACE_FILE);
+
+    mmap_writeback(entry);
+
+    memfile_page_t* page;
+    FOR_LLIST(entry->page_list, page)
+        if (page->ctx != NULL) {
+            bcache_put(page->ctx);
+        } else {
+            kfree_phy((void*)page->phy_addr);
+        }
+        vfree(page);
+    END_FOR_LLIST()
+
+    llist_free_all(entry->page_list);
+    llist_free(entry->page_list);
+    entry->page_list = NULL;
+
+    file_map_put(entry->file_ctx);
+}
+
+/**
+ * mmap(int64_t fd, uint64_t offset, uint64_t len, uint64_t flags)
+ *
+ * Maps len bytes of an open file starting at offset, which must be
+ * page aligned. Returns the address of the mapping
+ */
+int64_t syscall_mmap(uint64_t fd, uint64_t offset, uint64_t len, uint64_t flags) {
+
+    task_t* task = get_active_task();
+    memory_space_t* memspace = &task->memory;
+
+    if (fd >= MAX_TASK_FDS || !task->fds[fd].valid ||
+        task->fds[fd].ops.ioctl == NULL) {
+        return SYSCALL_ERROR_BADARG;
+    }
+
+    file_ctx_t* file_ctx = NULL;
+    int64_t ret = fd_call_ioctl_ptr(&task->fds[fd], FILE_IOCTL_GET_CTX, &file_ctx);
+    if (ret != 0 || file_ctx == NULL) {
+        return SYSCALL_ERROR_BADARG;
+    }
+
+    uint64_t size = file_ctx->file_data->size;
+    if (len == 0 ||
+        offset != PAGE_FLOOR(offset) ||
+        offset >= size ||
+        len > PAGE_CEIL(size) - offset) {
+        return SYSCALL_ERROR_BADARG;
+    }
+
+    bool write = (flags & SYSCALL_MMAP_WRITE) != 0;
+    if (write && !file_ctx->can_write) {
+        return SYSCALL_ERROR_BADARG;
+    }
+
+    memory_entry_file_t file_entry;
+    if (!memspace_alloc_space(memspace, len, (memory_entry_t*)&file_entry)) {
+        return SYSCALL_ERROR_NOSPACE;
+    }
+
+    file_entry.type = MEMSPACE_FILE;
+    file_entry.flags = write ? MEMSPACE_FLAG_PERM_URW : MEMSPACE_FLAG_PERM_URO;
+    file_entry.file_ctx = file_ctx;
+    file_entry.offset = offset;
+    file_entry.page_list = llist_create();
+    // The last page is only partly in the file. It gets a copy with the
+    // rest cleared, rather than exposing the cache page past the end
+    file_entry.file_len = file_entry.end - file_entry.start;
+    if (file_entry.file_len > size - offset) {
+        file_entry.file_len = size - offset;
+    }
+
+    bool add_ok;
+    add_ok = memspace_add_entry_to_memory(memspace, (memory_entry_t*)&file_entry);
+    ASSERT(add_ok);
+
+    file_map_get(file_ctx);
+
+    task->low_vm_table = memspace_build_vmem(memspace);
+    vmem_flush_tlb();
+
+    return file_entry.start;
+}
+
+/**
+ * munmap(uintptr_t addr)
+ *
+ * Removes the whole mapping containing addr
+ */
+int64_t syscall_munmap(uint64_t addr, uint64_t x1, uint64_t x2, uint64_t x3) {
+
+    task_t* task = get_active_task();
+
+    memory_entry_file_t* entry = mmap_get_entry(task, addr);
+    if (entry == NULL) {
+        return SYSCALL_ERROR_BADARG;
+    }
+
+    mmap_release(entry);
+
+    memspace_remove_entry_from_memory(&task->memory, (memory_entry_t*)entry);
+    task->low_vm_table = memspace_build_vmem(&task->memory);
+    vmem_flush_tlb();
+
+    return SYSCALL_ERROR_OK;
+}
+
+/**
+ * msync(uintptr_t addr, uint64_t flags)
+ *
+ * Writes the mapping containing addr back to the file. With
+ * SYSCALL_MSYNC_SYNC, waits until it is on the backing device
+ */
+int64_t syscall_msync(uint64_t addr, uint64_t flags, uint64_t x2, uint64_t x3) {
+
+    task_t* task = get_active_task();
+
+    memory_entry_file_t* entry = mmap_get_entry(task, addr);
+    if (entry == NULL) {
+        return SYSCALL_ERROR_BADARG;
+    }
+
+    mmap_writeback(entry);
+
+    return file_sync(entry->file_ctx, (flags & SYSCALL_MSYNC_SYNC) != 0);
+}
@@ -0,0 +1,31 @@
+
+#ifndef __MMAP_H__
+#define __MMAP_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "kernel/task.h"
+#include "kernel/memoryspace.h"
+#include "kernel/fs/file.h"
+
+typedef enum {
+    MMAP_ACCESS_READ,
+    MMAP_ACCESS_WRITE,
+    MMAP_ACCESS_EXEC
+} mmap_access_t;
+
+bool mmap_handle_fault(task_t* task, uintptr_t addr, mmap_access_t access);
+bool mmap_user_access(task_t* task, uintptr_t addr, uint64_t len, bool write);
+bool mmap_copy_user(task_t* task, uintptr_t addr, void* kbuffer, uint64_t len, bool to_user);
+bool mmap_copy_user_str(task_t* task, uintptr_t addr, char* kbuffer, uint64_t max_len);
+bool mmap_add_private(memory_space_t* memspace, file_ctx_t* file_ctx,
+                      uintptr_t start, uintptr_t end, uint32_t flags,
+                      uint64_t offset, uint64_t file_len);
+void mmap_release(memory_entry_file_t* entry);
+
+int64_t syscall_mmap(uint64_t fd, uint64_t offset, uint64_t len, uint64_t flags);
+int64_t syscall_munmap(uint64_t addr, uint64_t x1, uint64_t x2, uint64_t x3);
+int64_t syscall_msync(uint64_t addr, uint64_t flags, uint64_t x2, uint64_t x3);
+
+#endif
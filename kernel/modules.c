@@ -12,6 +12,7 @@
 #include "kernel/assert.h"
 #include "kernel/syscall.h"
 #include "kernel/kernelspace.h"
+#include "kernel/mmap.h"
 
 #define MAX_MODULES_NUM 64
 
@@ -334,14 +335,14 @@ int64_t syscall_startmod(uint64_t startmod_struct,
     task_t* this_task = get_active_task();
 
     // Find the structure in kernel space
-    uint64_t startmod_phy;
-    bool walk_ok;
-    walk_ok = vmem_walk_table(this_task->low_vm_table, startmod_struct, &startmod_phy);
-    if (!walk_ok) {
+    if (!mmap_user_access(this_task, startmod_struct, sizeof(module_startmod_t), false)) {
         return SYSCALL_ERROR_BADARG;
     }
 
-    module_startmod_t* startmod = (module_startmod_t*)(PHY_TO_KSPACE(startmod_phy));
+    module_startmod_t* startmod = get_userspace_ptr(this_task->low_vm_table, startmod_struct, sizeof(module_startmod_t));
+    if (startmod == NULL) {
+        return SYSCALL_ERROR_BADARG;
+    }
 
     // Find the module index specificed by the structure
     int64_t mod_idx;
@@ -62,13 +62,31 @@ void net_arp_update_table(ipv4_t* ipv4, mac_t* mac) {
                 mac->d[0], mac->d[1], mac->d[2],
                 mac->d[3], mac->d[4], mac->d[5]);
 
+    // Frames that were waiting on this address go out in batches
+    net_send_buffer_t* batch[NET_SEND_BATCH_MAX];
+    uint64_t batch_len = 0;
+
     net_send_buffer_t* pkt;
     FOREACH_NETQUEUE_SEND(s_arp_waiters, pkt) {
         if (memcmp(&pkt->arp_wait_ctx.via_ip, ipv4, sizeof(ipv4_t)) == 0) {
             lstruct_remove(&pkt->queue);
-            ethernet_send_packet(pkt->dev, pkt, mac, pkt->arp_wait_ctx.ethertype);
+
+            if (batch_len > 0 &&
+                (batch_len == NET_SEND_BATCH_MAX ||
+                 batch[0]->dev != pkt->dev ||
+                 batch[0]->arp_wait_ctx.ethertype != pkt->arp_wait_ctx.ethertype)) {
+                ethernet_send_packets(batch[0]->dev, batch, batch_len, mac, batch[0]->arp_wait_ctx.ethertype);
+                batch_len = 0;
+            }
+
+            batch[batch_len] = pkt;
+            batch_len++;
         }
     }
+
+    if (batch_len > 0) {
+        ethernet_send_packets(batch[0]->dev, batch, batch_len, mac, batch[0]->arp_wait_ctx.ethertype);
+    }
 }
 
 bool net_arp_get_mac_for_ipv4(net_dev_t* net_dev, ipv4_t* ipv4, mac_t* dest_mac) {
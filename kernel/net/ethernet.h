@@ -29,5 +29,6 @@ int64_t ethernet_parse_l2_frame(struct net_packet* packet, ethernet_l2_frame_t*
 
 void ethernet_get_packet_overhead(uint64_t* overhead_out, uint64_t* offset_out);
 void ethernet_send_packet(struct net_dev* net_dev, struct net_send_buffer* send_buffer, mac_t* dest_mac, uint16_t ethertype);
+void ethernet_send_packets(struct net_dev* net_dev, struct net_send_buffer** send_buffers, uint64_t num_buffers, mac_t* dest_mac, uint16_t ethertype);
 
 #endif
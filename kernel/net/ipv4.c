@@ -4,6 +4,8 @@
 
 #include "kernel/console.h"
 #include "kernel/assert.h"
+#include "kernel/fpsimd.h"
+#include "kernel/lib/checksum.h"
 #include "kernel/lib/vmalloc.h"
 
 #include "kernel/net/net.h"
@@ -17,7 +19,66 @@
 
 #include "stdlib/bitutils.h"
 
+// Smallest payload summed with NEON. Not measured on hardware; chosen so
+// that saving and restoring the FP state is a small part of the sum
+#define NET_IPV4_NEON_CHECKSUM_MIN 1024
+
+/*
+ * Sum a TCP or UDP payload. Large payloads are summed with NEON, which
+ * is only worth enabling FP for once the buffer is big enough
+ */
+static uint64_t net_ipv4_checksum_payload(uint64_t sum, const uint8_t* data, uint64_t len) {
+
+    if (len < NET_IPV4_NEON_CHECKSUM_MIN) {
+        return checksum_add(sum, data, len);
+    }
+
+    fpsimd_state_t fp_state;
+    BEGIN_FPSIMD(fp_state);
+    sum = checksum_add_neon(sum, data, len);
+    END_FPSIMD(fp_state);
+
+    return sum;
+}
+
+/*
+ * Sum of the TCP and UDP pseudo header
+ */
+static uint64_t net_ipv4_pseudo_header_sum(const ipv4_t* src_ip, const ipv4_t* dst_ip,
+                                           uint8_t protocol, uint64_t len) {
+    uint64_t sum = 0;
+    sum = checksum_add(sum, src_ip->d, sizeof(ipv4_t));
+    sum = checksum_add(sum, dst_ip->d, sizeof(ipv4_t));
+    sum += protocol;
+    sum += len;
+    return sum;
+}
+
+bool net_ipv4_l4_checksum_ok(net_packet_t* packet, net_ipv4_hdr_t* ipv4_header) {
+
+    if (packet->csum_valid) {
+        return true;
+    }
+
+    uint64_t sum = net_ipv4_pseudo_header_sum(&ipv4_header->src_ip, &ipv4_header->dst_ip,
+                                              ipv4_header->protocol, ipv4_header->payload_len);
+    sum = net_ipv4_checksum_payload(sum, ipv4_header->payload, ipv4_header->payload_len);
+
+    return checksum_fold(sum) == 0xFFFF;
+}
+
 int64_t net_ipv4_send_packet(ipv4_t* dest_ip, uint16_t protocol, void* payload, uint64_t payload_len) {
+    return net_ipv4_send_packet_gso(dest_ip, protocol, payload, payload_len, 0);
+}
+
+/*
+ * Send a datagram. The TCP and UDP checksums are filled in here, or left
+ * to the NIC when it can do them. A TCP payload longer than one segment
+ * is sent with gso_size set to the segment size, which only a NIC with
+ * NET_DEV_F_TSO4 accepts
+ */
+int64_t net_ipv4_send_packet_gso(ipv4_t* dest_ip, uint16_t protocol, void* payload, uint64_t payload_len,
+                                 uint16_t gso_size) {
 
     net_dev_t* net_dev = NULL;
     ipv4_t via_ip;
@@ -29,8 +90,14 @@ int64_t net_ipv4_send_packet(ipv4_t* dest_ip, uint16_t protocol, void* payload,
         return -1;
     }
 
-    // Support fragmentation later
-    ASSERT(payload_len < 1400);
+    if (gso_size != 0) {
+        ASSERT(protocol == NET_IPV4_PROTO_TCP);
+        ASSERT(net_dev->features & NET_DEV_F_TSO4);
+        ASSERT(NET_IPV4_HEADER_LEN + payload_len <= UINT16_MAX);
+    } else {
+        // Support fragmentation later
+        ASSERT(payload_len < 1400);
+    }
 
     static uint16_t ipv4_id_counter = 0;
 
@@ -85,37 +152,49 @@ int64_t net_ipv4_send_packet(ipv4_t* dest_ip, uint16_t protocol, void* payload,
         memcpy(&ipv4_payload[20], payload, payload_len);
     }
 
-    uint64_t checksum = 0;
+    // The TCP and UDP layers leave their checksum field zeroed
+    uint64_t csum_offset = 0;
     switch (protocol) {
         case NET_IPV4_PROTO_UDP:
+            csum_offset = 6;
+            break;
         case NET_IPV4_PROTO_TCP:
+            csum_offset = 16;
+            break;
+    }
 
-            // Source and Destination IP
-            for (uint64_t idx = 0; idx < 4; idx++) {
-                uint16_t* ipv4_u16 = (uint16_t*)&ipv4_payload[12 + idx*2];
-                checksum += en_swap_16(*ipv4_u16);
-            }
-
-            checksum += ipv4_header.protocol;
-
-            checksum += (uint16_t)payload_len;
-
-            if (protocol == NET_IPV4_PROTO_UDP) {
-                net_udp_update_checksum(&ipv4_payload[20], checksum);
-            } else if (protocol == NET_IPV4_PROTO_TCP) {
-                net_tcp_update_checksum(&ipv4_payload[20], checksum);
+    if (csum_offset != 0) {
+        uint64_t checksum = net_ipv4_pseudo_header_sum(&ipv4_header.src_ip, &ipv4_header.dst_ip,
+                                                       protocol, payload_len);
+        uint16_t* l4_checksum = (uint16_t*)&ipv4_payload[20 + csum_offset];
+
+        if (net_dev->features & NET_DEV_F_TX_CSUM) {
+            // The NIC sums the segment starting from the pseudo header sum
+            *l4_checksum = en_swap_16(checksum_fold(checksum));
+            send_buffer->csum_start = eth_offset + NET_IPV4_HEADER_LEN;
+            send_buffer->csum_offset = csum_offset;
+        } else {
+            checksum = net_ipv4_checksum_payload(checksum, &ipv4_payload[20], payload_len);
+            uint16_t checksum16 = ~checksum_fold(checksum);
+
+            // A zero UDP checksum means there is none
+            if (checksum16 == 0 && protocol == NET_IPV4_PROTO_UDP) {
+                checksum16 = 0xFFFF;
             }
-            break;
+            *l4_checksum = en_swap_16(checksum16);
+        }
     }
 
-    checksum = 0;
-    for (uint64_t idx = 0; idx < 10; idx++) {
-        uint16_t* ipv4_u16 = (uint16_t*)&ipv4_payload[idx*2];
-        checksum += *ipv4_u16;
+    if (gso_size != 0) {
+        uint64_t tcp_header_len = ((ipv4_payload[20 + 12] >> 4) & 0xF) * 4;
+
+        send_buffer->gso_size = gso_size;
+        send_buffer->hdr_len = eth_offset + NET_IPV4_HEADER_LEN + tcp_header_len;
     }
 
-    ipv4_header.checksum = (uint16_t)~((checksum & 0xFFFF) + (checksum >> 16));
-    *(uint16_t*)&ipv4_payload[10] = ipv4_header.checksum;
+    uint64_t checksum = checksum_add(0, ipv4_payload, NET_IPV4_HEADER_LEN);
+    ipv4_header.checksum = ~checksum_fold(checksum);
+    *(uint16_t*)&ipv4_payload[10] = en_swap_16(ipv4_header.checksum);
 
     bool arp_ok;
     mac_t dest_mac;
@@ -165,8 +244,14 @@ int64_t net_ipv4_parse_packet(net_packet_t* packet, ethernet_l2_frame_t* frame,
     memcpy(&ipv4_header->src_ip, &frame->payload[12], sizeof(ipv4_t));
     memcpy(&ipv4_header->dst_ip, &frame->payload[16], sizeof(ipv4_t));
 
+    if (ipv4_header->ihl < 5 || ipv4_header->total_len < ipv4_header->ihl * 4 ||
+        ipv4_header->total_len > frame->payload_len) {
+        return -1;
+    }
+
+    // Anything past total_len is link layer padding
     ipv4_header->payload = frame->payload + ipv4_header->ihl * 4;
-    ipv4_header->payload_len = frame->payload_len - ipv4_header->ihl * 4;
+    ipv4_header->payload_len = ipv4_header->total_len - ipv4_header->ihl * 4;
 
     //TODO: Handle options
 
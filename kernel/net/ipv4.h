@@ -3,6 +3,7 @@
 #define __NET_IPV4_H__
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #include "kernel/net/net.h"
 
@@ -44,6 +45,10 @@ typedef struct {
 } net_ipv4_hdr_t;
 
 int64_t net_ipv4_send_packet(ipv4_t* dest_ip, uint16_t protocol, void* payload, uint64_t payload_len);
+int64_t net_ipv4_send_packet_gso(ipv4_t* dest_ip, uint16_t protocol, void* payload, uint64_t payload_len,
+                                 uint16_t gso_size);
+
+bool net_ipv4_l4_checksum_ok(net_packet_t* packet, net_ipv4_hdr_t* ipv4_header);
 
 void net_ipv4_init();
 
@@ -4,6 +4,7 @@
 
 #include "kernel/console.h"
 #include "kernel/assert.h"
+#include "kernel/lib/checksum.h"
 #include "kernel/lib/vmalloc.h"
 
 #include "kernel/net/net.h"
@@ -47,14 +48,9 @@ void net_ipv4_icmp_send_packet(ipv4_t* dest_ip, net_ipv4_icmp_hdr_t* icmp_msg) {
 
     memcpy(&icmp_send_buffer[icmp_msg_len - icmp_msg->payload_len], icmp_msg->payload, icmp_msg->payload_len);
 
-    uint64_t checksum = 0;
-    for (uint64_t idx = 0; idx < icmp_msg_len/2; idx++) {
-        uint16_t* ipv4_u16 = (uint16_t*)&icmp_send_buffer[idx*2];
-        checksum += *ipv4_u16;
-    }
-
-    uint16_t checksum16 = (uint16_t)~((checksum & 0xFFFF) + (checksum >> 16));
-    *(uint16_t*)&icmp_send_buffer[2] = checksum16;
+    uint64_t checksum = checksum_add(0, icmp_send_buffer, icmp_msg_len);
+    uint16_t checksum16 = ~checksum_fold(checksum);
+    *(uint16_t*)&icmp_send_buffer[2] = en_swap_16(checksum16);
 
     net_ipv4_send_packet(dest_ip, NET_IPV4_PROTO_ICMP, icmp_send_buffer, icmp_msg_len);
 
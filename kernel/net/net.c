@@ -8,6 +8,7 @@
 #include "kernel/lib/vmalloc.h"
 #include "kernel/lib/intmap.h"
 #include "kernel/lib/hashmap.h"
+#include "kernel/lib/slab.h"
 #include "kernel/drivers.h"
 #include "kernel/fd.h"
 #include "kernel/sys_device.h"
@@ -15,6 +16,7 @@
 #include "kernel/memoryspace.h"
 #include "kernel/select.h"
 #include "kernel/task.h"
+#include "kernel/schedule.h"
 
 #include "kernel/net/net.h"
 #include "kernel/net/nic_ops.h"
@@ -103,10 +105,66 @@ fd_ops_t s_net_fd_ops = {
 
 static hashmap_ctx_t* s_ethertype_handlers = NULL;
 
+static slab_cache_t s_net_packet_cache = SLAB_CACHE_INIT("net_packet", net_packet_t);
+static slab_cache_t s_net_l2_frame_cache = SLAB_CACHE_INIT("ethernet_l2_frame", ethernet_l2_frame_t);
+
 static lstruct_head_t s_net_input_queue;
 static int64_t s_net_waiter_fd = -1;
 static fd_ctx_t* s_net_waiter_fd_ctx = NULL;
 
+net_packet_t* net_alloc_packet(void) {
+    net_packet_t* packet = slab_alloc(&s_net_packet_cache);
+    packet->ref_count = 1;
+    packet->csum_valid = false;
+    return packet;
+}
+
+void net_free_packet(net_packet_t* packet) {
+    slab_free(&s_net_packet_cache, packet);
+}
+
+net_packet_t* net_packet_ref(net_packet_t* packet) {
+    ASSERT(packet->ref_count > 0);
+    packet->ref_count++;
+    return packet;
+}
+
+void net_packet_put(net_packet_t* packet) {
+    ASSERT(packet->ref_count > 0);
+    packet->ref_count--;
+
+    if (packet->ref_count == 0) {
+        packet->dev->ops->return_packet(packet);
+    }
+}
+
+/*
+ * Take a reference for data that is kept until a reader gets to it, if
+ * the NIC can spare the receive buffer. Returns false when the caller
+ * has to copy the data instead
+ */
+bool net_packet_pin(net_packet_t* packet) {
+
+    net_dev_t* dev = packet->dev;
+    if (dev->rx_pinned >= dev->rx_pin_max) {
+        return false;
+    }
+
+    dev->rx_pinned++;
+    net_packet_ref(packet);
+    return true;
+}
+
+void net_packet_unpin(net_packet_t* packet) {
+
+    ASSERT(packet->dev->rx_pinned > 0);
+    packet->dev->rx_pinned--;
+    net_packet_put(packet);
+}
+
+/*
+ * Takes over the driver's reference to the packet
+ */
 void net_recv_packet(net_packet_t* packet) {
 
     if (s_net_waiter_fd_ctx != NULL) {
@@ -121,23 +179,25 @@ void net_recv_packet(net_packet_t* packet) {
 
         s_net_waiter_fd_ctx->ready = FD_READY_GEN_ATTENTION;
         select_task_wakeup(s_net_waiter_fd_ctx->task);
+    } else {
+        net_packet_put(packet);
     }
 }
 
 static void net_process_packet(net_packet_t* packet) {
 
     int64_t res;
-    ethernet_l2_frame_t* frame_ptr = vmalloc(sizeof(ethernet_l2_frame_t));
+    ethernet_l2_frame_t* frame_ptr = slab_alloc(&s_net_l2_frame_cache);
     res = ethernet_parse_l2_frame(packet, frame_ptr);
 
     if (res != 0) {
-        vfree(frame_ptr);
+        slab_free(&s_net_l2_frame_cache, frame_ptr);
         return;
     }
 
     if (memcmp(&packet->dev->mac, &frame_ptr->dest, sizeof(mac_t)) != 0 && 
         memcmp("\xff\xff\xff\xff\xff\xff", &frame_ptr->dest, sizeof(mac_t)) != 0) {
-        vfree(frame_ptr);
+        slab_free(&s_net_l2_frame_cache, frame_ptr);
         return;
     }
 
@@ -148,13 +208,28 @@ static void net_process_packet(net_packet_t* packet) {
     net_l2_packet_fn l2_packet_handler = hashmap_get(s_ethertype_handlers, &ethertype);
     
     if (l2_packet_handler == NULL) {
-        vfree(frame_ptr);
+        slab_free(&s_net_l2_frame_cache, frame_ptr);
         return;
     }
 
     l2_packet_handler(packet, frame_ptr);
 
-    vfree(frame_ptr);
+    slab_free(&s_net_l2_frame_cache, frame_ptr);
+}
+
+/*
+ * Process a packet in the calling task and release it. Lets drivers that
+ * receive on several queues, each with its own task, handle packets
+ * without funneling them all through the net task
+ */
+void net_input_packet(net_packet_t* packet) {
+
+    // Nothing can handle the packet before the protocols register
+    if (s_ethertype_handlers != NULL) {
+        net_process_packet(packet);
+    }
+
+    net_packet_put(packet);
 }
 
 static void net_task(void* ctx) {
@@ -184,13 +259,27 @@ static void net_task(void* ctx) {
             lstruct_remove(&pkt->queue);
 
             // console_log(LOG_DEBUG, "NET got packet");
-            net_process_packet(pkt);
-
-            pkt->dev->ops->return_packet(pkt);
+            net_input_packet(pkt);
         }
     }
 }
 
+/*
+ * Send a batch of ready frames. NICs without send_buffers get them one
+ * at a time
+ */
+void net_send_buffers(net_dev_t* dev, net_send_buffer_t** buffers, uint64_t num_buffers) {
+
+    if (dev->ops->send_buffers != NULL) {
+        dev->ops->send_buffers(dev, buffers, num_buffers);
+        return;
+    }
+
+    for (uint64_t idx = 0; idx < num_buffers; idx++) {
+        dev->ops->send_buffer(dev, buffers[idx]);
+    }
+}
+
 void net_device_register(net_dev_t* dev) {
 
     sys_device_register(&s_net_fd_ops, net_fd_open_op, dev, dev->name);
@@ -231,5 +320,6 @@ void net_init(void) {
 }
 
 void net_start_task(void) {
-    create_kernel_task(4096, net_task, NULL, "net");
+    uint64_t tid = create_kernel_task(4096, net_task, NULL, "net");
+    task_set_priority(get_task_for_tid(tid), TASK_PRIORITY_HIGH);
 }
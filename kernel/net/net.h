@@ -7,6 +7,9 @@
 
 #define NET_MTU 1514
 
+// Most frames handed to a NIC in a single send_buffers call
+#define NET_SEND_BATCH_MAX 16
+
 #define LOG_IPV4_ADDR(x) (uint64_t)(x).d[0], (uint64_t)(x).d[1], (uint64_t)(x).d[2], (uint64_t)(x).d[3]
 
 typedef struct {
@@ -19,11 +22,25 @@ typedef struct {
 
 #include "kernel/net/ethernet.h"
 
+// Offloads a NIC can do on frames it sends or receives
+enum {
+    NET_DEV_F_TX_CSUM = (1 << 0),   /* Fills in TCP and UDP checksums */
+    NET_DEV_F_RX_CSUM = (1 << 1),   /* Marks received frames with checked checksums */
+    NET_DEV_F_TSO4 = (1 << 2)       /* Splits large IPv4 TCP sends into segments */
+};
+
 typedef struct net_dev {
     nic_ops_t* ops;
     void* nic_ctx;
 
     char* name;
+    uint64_t features;              /* NET_DEV_F_* */
+
+    // Received packets that may be held past their handler. Beyond the
+    // limit, data that has to be kept is copied so the receive buffer
+    // goes straight back to the NIC
+    uint32_t rx_pin_max;            /* 0 if receive buffers are never held */
+    uint32_t rx_pinned;
 
     mac_t mac;
     ipv4_t ipv4;
@@ -33,6 +50,12 @@ typedef struct net_dev {
 #define FOREACH_NETQUEUE(head, ptr) FOREACH_LSTRUCT(head, ptr, queue)
 #define NETQUEUE_AT(head, idx) LSTRUCT_AT(head, idx, net_packet_t, queue)
 
+/**
+ * A received frame. The data stays in the NIC's receive buffer and is
+ * handed back to the NIC with return_packet once the last reference is
+ * dropped, so anything that keeps the data past its handler takes a
+ * reference with net_packet_ref
+ */
 typedef struct net_packet {
     net_dev_t* dev;
 
@@ -40,6 +63,8 @@ typedef struct net_packet {
     uint64_t len;
 
     void* nic_pkt_ctx;
+    uint32_t ref_count;
+    bool csum_valid;                /* The NIC has checked the TCP or UDP checksum */
 
     lstruct_t queue;
 } net_packet_t;
@@ -55,6 +80,12 @@ typedef struct net_send_buffer {
 
     void* nic_buffer_ctx;
 
+    // Offloads asked of a NIC that supports them. Offsets are from data
+    uint16_t csum_start;            /* 0 when the frame is complete */
+    uint16_t csum_offset;           /* Where the checksum goes, from csum_start */
+    uint16_t gso_size;              /* TCP segment size, 0 when sent as is */
+    uint16_t hdr_len;               /* Headers copied into each segment */
+
     lstruct_t queue;
 
     union {
@@ -70,6 +101,14 @@ typedef void (*net_l2_packet_fn)(net_packet_t* packet, ethernet_l2_frame_t* fram
 void net_init(void);
 void net_start_task(void);
 void net_recv_packet(net_packet_t* packet);
+void net_input_packet(net_packet_t* packet);
+net_packet_t* net_alloc_packet(void);
+void net_free_packet(net_packet_t* packet);
+net_packet_t* net_packet_ref(net_packet_t* packet);
+void net_packet_put(net_packet_t* packet);
+bool net_packet_pin(net_packet_t* packet);
+void net_packet_unpin(net_packet_t* packet);
+void net_send_buffers(net_dev_t* dev, net_send_buffer_t** buffers, uint64_t num_buffers);
 void net_device_register(net_dev_t* dev);
 void net_register_l2_handler(uint64_t ethertype, net_l2_packet_fn handler);
 
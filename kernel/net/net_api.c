@@ -12,6 +12,7 @@
 #include "kernel/messages.h"
 #include "kernel/modules.h"
 #include "kernel/kmalloc.h"
+#include "kernel/mmap.h"
 #include "kernel/exec.h"
 #include "kernel/lib/vmalloc.h"
 #include "kernel/net/net_api.h"
@@ -28,14 +29,14 @@ int64_t syscall_socket(uint64_t socket_struct_ptr,
 
     task_t* task = get_active_task();
 
-    uint64_t socket_struct_phy;
-    bool walk_ok;
-    walk_ok = vmem_walk_table(task->low_vm_table, socket_struct_ptr, &socket_struct_phy);
-    if (!walk_ok) {
+    if (!mmap_user_access(task, socket_struct_ptr, sizeof(k_create_socket_t), false)) {
         return SYSCALL_ERROR_BADARG;
     }
 
-    k_create_socket_t* create_socket_ctx = (k_create_socket_t*)(PHY_TO_KSPACE(socket_struct_phy));
+    k_create_socket_t* create_socket_ctx = get_userspace_ptr(task->low_vm_table, socket_struct_ptr, sizeof(k_create_socket_t));
+    if (create_socket_ctx == NULL) {
+        return SYSCALL_ERROR_BADARG;
+    }
 
     int64_t fd_num = find_open_fd(task);
     if (fd_num < 0) {
@@ -71,14 +72,14 @@ int64_t syscall_bind(uint64_t bind_struct_ptr,
 
     task_t* task = get_active_task();
 
-    uint64_t bind_struct_phy;
-    bool walk_ok;
-    walk_ok = vmem_walk_table(task->low_vm_table, bind_struct_ptr, &bind_struct_phy);
-    if (!walk_ok) {
+    if (!mmap_user_access(task, bind_struct_ptr, sizeof(k_bind_port_t), false)) {
         return SYSCALL_ERROR_BADARG;
     }
 
-    k_bind_port_t* bind_port_ctx = (k_bind_port_t*)(PHY_TO_KSPACE(bind_struct_phy));
+    k_bind_port_t* bind_port_ctx = get_userspace_ptr(task->low_vm_table, bind_struct_ptr, sizeof(k_bind_port_t));
+    if (bind_port_ctx == NULL) {
+        return SYSCALL_ERROR_BADARG;
+    }
 
     int64_t fd_num = find_open_fd(task);
     if (fd_num < 0) {
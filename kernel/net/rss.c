@@ -0,0 +1,104 @@
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "kernel/net/rss.h"
+#include "kernel/net/net.h"
+#include "kernel/net/ethernet.h"
+#include "kernel/net/ipv4.h"
+
+#include "stdlib/bitutils.h"
+
+// The default key from the RSS specification
+const uint8_t net_rss_key[NET_RSS_KEY_LEN] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa
+};
+
+/*
+ * Toeplitz hash. For every set bit of the input, the 32 bits of the key
+ * starting at that bit position are xored into the result. The key must
+ * be at least 4 bytes longer than the input
+ */
+uint32_t net_rss_toeplitz(const uint8_t* key, uint64_t key_len, const uint8_t* data, uint64_t len) {
+
+    uint32_t hash = 0;
+    uint32_t window = ((uint32_t)key[0] << 24) | ((uint32_t)key[1] << 16) |
+                      ((uint32_t)key[2] << 8) | key[3];
+
+    for (uint64_t idx = 0; idx < len; idx++) {
+        uint8_t next_key = (idx + 4 < key_len) ? key[idx + 4] : 0;
+
+        for (int64_t bit = 7; bit >= 0; bit--) {
+            if (data[idx] & BIT(bit)) {
+                hash ^= window;
+            }
+            window = (window << 1) | ((next_key >> bit) & 1);
+        }
+    }
+
+    return hash;
+}
+
+/*
+ * RSS hash of an Ethernet frame, the way a NIC hashing hash_types
+ * computes it. TCP and UDP over IPv4 hash the source and destination
+ * addresses and ports, other IPv4 traffic just the addresses. The hash
+ * is not symmetric, so with swap the source and destination are
+ * exchanged to get the hash of the frames coming back on the same
+ * flow. Returns false if the NIC would not classify the frame
+ */
+bool net_rss_hash_frame(const uint8_t* frame, uint64_t len, uint32_t hash_types,
+                        bool swap, uint32_t* hash_out) {
+
+    const uint64_t eth_hdr_len = 2*sizeof(mac_t) + 2;
+
+    if (len < eth_hdr_len + NET_IPV4_HEADER_LEN) {
+        return false;
+    }
+
+    uint16_t ethertype = ((uint16_t)frame[12] << 8) | frame[13];
+    if (ethertype != NET_ETHERTYPE_IPV4) {
+        return false;
+    }
+
+    const uint8_t* ipv4 = &frame[eth_hdr_len];
+    uint64_t ihl = (ipv4[0] & 0xF) * 4;
+
+    uint8_t protocol = ipv4[9];
+    bool has_ports = len >= eth_hdr_len + ihl + 4 &&
+                     ((protocol == NET_IPV4_PROTO_TCP && (hash_types & NET_RSS_HASH_TCPV4)) ||
+                      (protocol == NET_IPV4_PROTO_UDP && (hash_types & NET_RSS_HASH_UDPV4)));
+
+    if (!has_ports && !(hash_types & NET_RSS_HASH_IPV4)) {
+        return false;
+    }
+
+    // Addresses and ports in network order, as they are on the wire
+    const uint8_t* src_ip = &ipv4[12];
+    const uint8_t* dst_ip = &ipv4[16];
+    const uint8_t* src_port = &ipv4[ihl];
+    const uint8_t* dst_port = &ipv4[ihl + 2];
+    if (swap) {
+        src_ip = &ipv4[16];
+        dst_ip = &ipv4[12];
+        src_port = &ipv4[ihl + 2];
+        dst_port = &ipv4[ihl];
+    }
+
+    uint8_t tuple[12];
+    memcpy(&tuple[0], src_ip, 4);
+    memcpy(&tuple[4], dst_ip, 4);
+
+    if (has_ports) {
+        memcpy(&tuple[8], src_port, 2);
+        memcpy(&tuple[10], dst_port, 2);
+    }
+
+    *hash_out = net_rss_toeplitz(net_rss_key, NET_RSS_KEY_LEN, tuple, has_ports ? 12 : 8);
+    return true;
+}
@@ -0,0 +1,25 @@
+
+#ifndef __NET_RSS_H__
+#define __NET_RSS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define NET_RSS_KEY_LEN 40
+
+// Traffic a NIC classifies by hash. Anything else goes to a default queue
+enum {
+    NET_RSS_HASH_IPV4 = (1 << 0),   /* Addresses of any IPv4 packet */
+    NET_RSS_HASH_TCPV4 = (1 << 1),  /* Addresses and ports of TCP */
+    NET_RSS_HASH_UDPV4 = (1 << 2)   /* Addresses and ports of UDP */
+};
+
+// Key every NIC is programmed with, so software and hardware agree on
+// which flow goes to which queue
+extern const uint8_t net_rss_key[NET_RSS_KEY_LEN];
+
+uint32_t net_rss_toeplitz(const uint8_t* key, uint64_t key_len, const uint8_t* data, uint64_t len);
+bool net_rss_hash_frame(const uint8_t* frame, uint64_t len, uint32_t hash_types,
+                        bool swap, uint32_t* hash_out);
+
+#endif
@@ -48,17 +48,7 @@ void net_tcp_send_packet(ipv4_t* dest_ip, net_tcp_hdr_t* tcp_header) {
 
     memcpy(&tcp_buffer[20], tcp_header->payload, tcp_header->payload_len);
 
-    uint64_t checksum = 0;
-    for (uint64_t idx = 0; idx < tcp_buffer_len/2; idx++) {
-        checksum += en_swap_16(*(uint16_t*)&tcp_buffer[idx*2]);
-    }
-    
-    if (tcp_buffer_len % 2 != 0) {
-        checksum += ((uint64_t)tcp_buffer[tcp_buffer_len - 1]) << 8;
-    }
-
-    checksum = (checksum & 0xFFFF) + (checksum >> 16);
-    *(uint16_t*)&tcp_buffer[16] = checksum;
+    // The checksum is filled in by the IPv4 layer or the NIC
 
     //console_log(LOG_DEBUG, "Net TCP sending packet");
     //net_tcp_print_packet(NULL, dest_ip, tcp_header);
@@ -69,26 +59,12 @@ void net_tcp_send_packet(ipv4_t* dest_ip, net_tcp_hdr_t* tcp_header) {
         }
     }
 
-    net_ipv4_send_packet(dest_ip, NET_IPV4_PROTO_TCP, tcp_buffer, tcp_buffer_len);
+    net_ipv4_send_packet_gso(dest_ip, NET_IPV4_PROTO_TCP, tcp_buffer, tcp_buffer_len,
+                             tcp_header->gso_size);
 
     vfree(tcp_buffer);
 }
 
-void net_tcp_update_checksum(uint8_t* tcp_payload, uint64_t pseudo_header_checksum) {
-
-    uint64_t old_checksum = *(uint16_t*)&tcp_payload[16];
-
-    uint64_t new_checksum = old_checksum + pseudo_header_checksum;
-    new_checksum = (new_checksum & 0xFFFF) + (new_checksum >> 16);
-    new_checksum = new_checksum ^ 0xFFFF;
-
-    if (new_checksum == 0) {
-        new_checksum = 0xFFFF;
-    }
-
-    *(uint16_t*)&tcp_payload[16] = en_swap_16(new_checksum);
-}
-
 static void net_tcp_parse_packet(net_ipv4_hdr_t* ipv4_header, net_tcp_hdr_t* tcp_header) {
 
     uint8_t* packet = ipv4_header->payload;
@@ -124,6 +100,11 @@ void net_tcp_handle_packet(net_packet_t* packet, ethernet_l2_frame_t* frame, net
         return;
     }
 
+    if (!net_ipv4_l4_checksum_ok(packet, ipv4_header)) {
+        console_log(LOG_DEBUG, "Net TCP dropping packet with bad checksum");
+        return;
+    }
+
     net_tcp_hdr_t tcp_header;
     net_tcp_parse_packet(ipv4_header, &tcp_header);
 
@@ -29,10 +29,11 @@ typedef struct {
 
     const void* payload;
     uint64_t payload_len;
+
+    uint16_t gso_size;      /* Send only, segment size when the payload spans several */
 } net_tcp_hdr_t;
 
 void net_tcp_send_packet(ipv4_t* dest_ip, net_tcp_hdr_t* tcp_header);
-void net_tcp_update_checksum(uint8_t* tcp_payload, uint64_t pseudo_header_checksum);
 
 void net_tcp_handle_packet(net_packet_t* packet, ethernet_l2_frame_t* frame, net_ipv4_hdr_t* ipv4_header);
 
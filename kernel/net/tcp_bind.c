@@ -5,6 +5,7 @@
 #include "kernel/console.h"
 #include "kernel/assert.h"
 #include "kernel/task.h"
+#include "kernel/select.h"
 #include "kernel/lib/vmalloc.h"
 #include "kernel/lib/intmap.h"
 #include "kernel/lib/hashmap.h"
@@ -39,6 +40,7 @@ typedef struct {
     llist_head_t incoming_connections;
 
     bool canwake;
+    wait_queue_t canwake_queue;
 
     fd_ctx_t* fd_ctx;
 } net_tcp_bind_ctx_t;
@@ -68,8 +70,10 @@ void* net_tcp_bind_new_connection(void* ctx, void* tcp_ctx, ipv4_t* their_addr,
     llist_append_ptr(bind_ctx->incoming_connections, new_socket);
 
     bind_ctx->canwake = true;
+    wait_queue_signal(&bind_ctx->canwake_queue);
     if (bind_ctx->fd_ctx != NULL) {
         bind_ctx->fd_ctx->ready |= FD_READY_BIND_NEWCONN;
+        select_task_wakeup(bind_ctx->fd_ctx->task);
     }
 
     return new_socket->socket_ctx;
@@ -80,6 +84,7 @@ static int64_t net_tcp_bind_get_incoming(net_tcp_bind_ctx_t* bind_ctx) {
     while (llist_empty(bind_ctx->incoming_connections)) {
         wait_ctx_t wake_ctx = {
             .signal.trywake = &bind_ctx->canwake,
+            .queue = &bind_ctx->canwake_queue,
             .wake_at = 0
         };
         bind_ctx->canwake = false;
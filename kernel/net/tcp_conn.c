@@ -6,11 +6,13 @@
 #include "kernel/assert.h"
 #include "kernel/gtimer.h"
 #include "kernel/task.h"
+#include "kernel/schedule.h"
 #include "kernel/lib/vmalloc.h"
 #include "kernel/lib/hashmap.h"
 
 #include "kernel/net/net.h"
 #include "kernel/net/ipv4.h"
+#include "kernel/net/ipv4_route.h"
 #include "kernel/net/tcp.h"
 #include "kernel/net/tcp_conn.h"
 #include "kernel/net/tcp_socket.h"
@@ -160,7 +162,8 @@ void net_tcp_send_std(net_tcp_conn_ctx_t* tcp_ctx, uint8_t* payload, uint64_t pa
         .checksum = 0,
         .urgent_pointer = 0,
         .payload = payload,
-        .payload_len = payload_len
+        .payload_len = payload_len,
+        .gso_size = payload_len > tcp_ctx->mss ? tcp_ctx->mss : 0
     };
 
     net_tcp_send_packet(&tcp_ctx->their_ip, &resp_header);
@@ -214,7 +217,7 @@ void* net_tcp_conn_create_client(ipv4_t* our_addr, ipv4_t* their_addr, uint16_t
 
     new_ctx->their_ip = new_key->their_ip;
     new_ctx->their_port = new_key->their_port;
-    new_ctx->send_buffer = circbuffer_create(4096);
+    new_ctx->send_buffer = circbuffer_create(NET_TCP_SEND_BUFFER_SIZE);
     new_ctx->send_window = 0;
     new_ctx->seq_index = net_tcp_conn_random();
     new_ctx->sent_index = new_ctx->seq_index;
@@ -258,7 +261,7 @@ void net_tcp_handle_new_connection(net_ipv4_hdr_t* ipv4_header, net_tcp_hdr_t* t
 
     new_ctx->their_ip = new_key->their_ip;
     new_ctx->their_port = new_key->their_port;
-    new_ctx->send_buffer = circbuffer_create(4096);
+    new_ctx->send_buffer = circbuffer_create(NET_TCP_SEND_BUFFER_SIZE);
     new_ctx->send_window = 0;
     new_ctx->seq_index = net_tcp_conn_random();
     new_ctx->sent_index = new_ctx->seq_index;
@@ -288,6 +291,22 @@ uint32_t net_tcp_32wrap_diff(uint32_t num1, uint32_t num2) {
     }
 }
 
+/*
+ * Largest payload to hand down in one send. A NIC that segments TCP
+ * itself takes up to a full IPv4 datagram, otherwise it's one segment
+ */
+static uint64_t net_tcp_conn_max_send(net_tcp_conn_ctx_t* tcp_ctx) {
+
+    net_dev_t* net_dev = NULL;
+    ipv4_t via_ip;
+    net_route_get_nic_for_ipv4(&tcp_ctx->their_ip, &net_dev, &via_ip);
+
+    if (net_dev != NULL && (net_dev->features & NET_DEV_F_TSO4)) {
+        return NET_TCP_GSO_MAX;
+    }
+    return tcp_ctx->mss;
+}
+
 void net_tcp_conn_send_segment(net_tcp_conn_ctx_t* tcp_ctx) {
 
     if (tcp_ctx->conn_state != NET_TCP_CONN_SM_ESTABLISHED) {
@@ -306,16 +325,24 @@ void net_tcp_conn_send_segment(net_tcp_conn_ctx_t* tcp_ctx) {
 
     if (window_room > 0) {
         uint64_t max_send_size = send_buffer_len > window_room ? window_room : send_buffer_len;
-        uint64_t send_offset = net_tcp_32wrap_diff(tcp_ctx->sent_index, tcp_ctx->seq_index);
+        uint64_t max_segment = net_tcp_conn_max_send(tcp_ctx);
+        if (max_send_size > max_segment) {
+            max_send_size = max_segment;
+        }
 
-        ASSERT(tcp_ctx->send_buffer != NULL);
         uint8_t* buffer = vmalloc(max_send_size);
 
-        ASSERT(tcp_ctx->send_buffer != NULL);
-        uint64_t send_size = circbuffer_peek_idx(tcp_ctx->send_buffer, buffer, max_send_size, send_offset);
+        while (window_room > 0) {
+            uint64_t send_offset = net_tcp_32wrap_diff(tcp_ctx->sent_index, tcp_ctx->seq_index);
+            uint64_t send_size = window_room > max_send_size ? max_send_size : window_room;
+
+            send_size = circbuffer_peek_idx(tcp_ctx->send_buffer, buffer, send_size, send_offset);
+            if (send_size == 0) {
+                break;
+            }
 
-        if (send_size > 0) {
             tcp_ctx->sent_index += send_size;
+            window_room -= send_size;
             net_tcp_send_std(tcp_ctx, buffer, send_size);
         }
 
@@ -325,9 +352,10 @@ void net_tcp_conn_send_segment(net_tcp_conn_ctx_t* tcp_ctx) {
     }
 }
 
-void net_tcp_conn_recv_segment(net_tcp_hdr_t* tcp_header, net_tcp_conn_ctx_t* tcp_ctx) {
+void net_tcp_conn_recv_segment(net_packet_t* packet, net_tcp_hdr_t* tcp_header, net_tcp_conn_ctx_t* tcp_ctx) {
 
     int64_t recv_len = net_tcp_socket_recv(tcp_ctx->socket_ctx,
+                                           packet,
                                            tcp_header->payload,
                                            tcp_header->payload_len);
 
@@ -442,7 +470,7 @@ void net_tcp_handle_conn_time_wait(net_tcp_hdr_t* tcp_header, net_tcp_conn_ctx_t
     // Ignore any messages
 }
 
-void net_tcp_handle_conn_established(net_tcp_hdr_t* tcp_header, net_tcp_conn_ctx_t* tcp_ctx) {
+void net_tcp_handle_conn_established(net_packet_t* packet, net_tcp_hdr_t* tcp_header, net_tcp_conn_ctx_t* tcp_ctx) {
 
     tcp_ctx->send_window = tcp_header->window_size;
 
@@ -455,7 +483,7 @@ void net_tcp_handle_conn_established(net_tcp_hdr_t* tcp_header, net_tcp_conn_ctx
     }
 
     if (tcp_header->payload_len > 0) {
-        net_tcp_conn_recv_segment(tcp_header, tcp_ctx);
+        net_tcp_conn_recv_segment(packet, tcp_header, tcp_ctx);
     }
 
     if (tcp_header->f_fin && tcp_header->f_ack) { 
@@ -570,7 +598,7 @@ void net_tcp_handle_connection(net_packet_t* packet, net_ipv4_hdr_t* ipv4_header
                     net_tcp_handle_conn_syn_received(tcp_header, conn_ctx);
                     break;
                 case NET_TCP_CONN_SM_ESTABLISHED:
-                    net_tcp_handle_conn_established(tcp_header, conn_ctx);
+                    net_tcp_handle_conn_established(packet, tcp_header, conn_ctx);
                     break;
                 case NET_TCP_CONN_SM_FIN_WAIT_1:
                     net_tcp_handle_conn_fin_wait_1(tcp_header, conn_ctx);
@@ -808,7 +836,8 @@ void net_tcp_conn_init(void) {
                                        256,
                                        NULL);
                                 
-    create_kernel_task(256*1024, net_tcp_timeout_thread, NULL, "tcpconn");
+    uint64_t tid = create_kernel_task(256*1024, net_tcp_timeout_thread, NULL, "tcpconn");
+    task_set_priority(get_task_for_tid(tid), TASK_PRIORITY_HIGH);
 }
 
 void net_tcp_conn_start_timeout_thread(void) {
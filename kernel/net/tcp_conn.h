@@ -29,6 +29,12 @@ enum {
 #define NET_TCP_CLOSE_TIMEOUT (60 * 1000 * 1000 * 1000)
 #define NET_TCP_WINDOW 4095
 
+// Unacknowledged and unsent data kept per connection
+#define NET_TCP_SEND_BUFFER_SIZE (64 * 1024)
+
+// Largest payload sent as one buffer to a NIC that segments TCP
+#define NET_TCP_GSO_MAX (UINT16_MAX - NET_IPV4_HEADER_LEN - NET_TCP_HEADER_LEN)
+
 typedef struct {
     uint64_t conn_state; // Connection State
     uint64_t mss; // Maximum Segment Size
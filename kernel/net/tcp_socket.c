@@ -5,11 +5,11 @@
 #include "kernel/console.h"
 #include "kernel/assert.h"
 #include "kernel/task.h"
+#include "kernel/select.h"
 #include "kernel/lib/vmalloc.h"
 #include "kernel/lib/intmap.h"
 #include "kernel/lib/hashmap.h"
 #include "kernel/lib/llist.h"
-#include "kernel/lib/circbuffer.h"
 
 #include "kernel/net/net.h"
 #include "kernel/net/arp.h"
@@ -26,13 +26,27 @@
 
 #include "stdlib/bitutils.h"
 
+// Received data is queued in place in the packets it arrived in while
+// the NIC can spare them, and copied otherwise. Bounded in bytes like
+// the advertised window, and in segments
+#define NET_TCP_SOCKET_RECV_SIZE 4096
+#define NET_TCP_SOCKET_MAX_SEGS 16
+
+typedef struct {
+    net_packet_t* packet;       /* NULL if the data was copied */
+    const uint8_t* data;
+    uint64_t len;
+    uint8_t copy[];
+} net_tcp_socket_seg_t;
+
 typedef struct {
 
     task_t* task;
 
     bool should_close;
     void* tcp_conn_ctx;
-    circbuffer_t* recv_buffer;
+    llist_head_t recv_segs;
+    uint64_t recv_len;
 
     ipv4_t our_ip;
     uint16_t our_port;
@@ -40,6 +54,7 @@ typedef struct {
     uint16_t their_port;
 
     bool canwake;
+    wait_queue_t canwake_queue;
 
     fd_ctx_t* fd_ctx;
 } net_tcp_socket_ctx_t;
@@ -47,33 +62,56 @@ typedef struct {
 hashmap_ctx_t* s_tcp_socket_map = NULL;
 
 
-int64_t net_tcp_socket_recv(void* ctx, const uint8_t* payload, uint64_t payload_len) {
+int64_t net_tcp_socket_recv(void* ctx, net_packet_t* packet, const uint8_t* payload, uint64_t payload_len) {
 
     net_tcp_socket_ctx_t* socket_ctx = ctx;
 
-    int64_t space_avail = circbuffer_space(socket_ctx->recv_buffer);
-    if (space_avail < payload_len) {
+    if (socket_ctx->recv_len + payload_len > NET_TCP_SOCKET_RECV_SIZE ||
+        llist_len(socket_ctx->recv_segs) >= NET_TCP_SOCKET_MAX_SEGS) {
         return -1;
     }
 
-    circbuffer_add(socket_ctx->recv_buffer, payload, payload_len);
+    net_tcp_socket_seg_t* seg;
+    if (net_packet_pin(packet)) {
+        seg = vmalloc(sizeof(net_tcp_socket_seg_t));
+        seg->packet = packet;
+        seg->data = payload;
+    } else {
+        seg = vmalloc(sizeof(net_tcp_socket_seg_t) + payload_len);
+        seg->packet = NULL;
+        memcpy(seg->copy, payload, payload_len);
+        seg->data = seg->copy;
+    }
+    seg->len = payload_len;
+
+    llist_append_ptr(socket_ctx->recv_segs, seg);
+    socket_ctx->recv_len += payload_len;
 
     socket_ctx->canwake = true;
+    wait_queue_signal(&socket_ctx->canwake_queue);
 
     if (socket_ctx->fd_ctx != NULL) {
         socket_ctx->fd_ctx->ready |= FD_READY_GEN_READ;
+        select_task_wakeup(socket_ctx->fd_ctx->task);
     }
 
     return payload_len;
 }
 
+static void net_tcp_socket_free_seg(net_tcp_socket_seg_t* seg) {
+    if (seg->packet != NULL) {
+        net_packet_unpin(seg->packet);
+    }
+    vfree(seg);
+}
+
 void net_tcp_socket_pass_fd_ctx(void* ctx, fd_ctx_t* fd_ctx) {
     net_tcp_socket_ctx_t* socket_ctx = ctx;
 
     socket_ctx->fd_ctx = fd_ctx;
 
     if (fd_ctx != NULL) {
-        fd_ctx->ready = circbuffer_len(socket_ctx->recv_buffer) > 0 ? FD_READY_GEN_READ : 0;
+        fd_ctx->ready = socket_ctx->recv_len > 0 ? FD_READY_GEN_READ : 0;
     }
 }
 
@@ -82,9 +120,11 @@ void net_tcp_socket_close(void* ctx, bool dontreply) {
 
     socket_ctx->should_close = true;
     socket_ctx->canwake = true;
+    wait_queue_signal(&socket_ctx->canwake_queue);
 
     if (socket_ctx->fd_ctx) {
         socket_ctx->fd_ctx->ready |= FD_READY_GEN_CLOSE;
+        select_task_wakeup(socket_ctx->fd_ctx->task);
     }
 
     if (dontreply) {
@@ -92,22 +132,48 @@ void net_tcp_socket_close(void* ctx, bool dontreply) {
     }
 }
 
-static int64_t net_tcp_socket_read_fn(void* ctx, uint8_t* buffer, const int64_t size, const uint64_t flags) {
+/*
+ * Copy queued data out, releasing each packet once all of its data has
+ * been read
+ */
+static int64_t net_tcp_socket_get(net_tcp_socket_ctx_t* socket_ctx, uint8_t* buffer, int64_t size) {
 
-    net_tcp_socket_ctx_t* socket_ctx = ctx;
+    int64_t bytes_read = 0;
+    while (bytes_read < size && !llist_empty(socket_ctx->recv_segs)) {
+        net_tcp_socket_seg_t* seg = llist_at(socket_ctx->recv_segs, 0);
 
-    int64_t bytes_avail = circbuffer_len(socket_ctx->recv_buffer);
-    int64_t bytes_read = (bytes_avail < size) ? bytes_avail : size;
+        uint64_t copy_len = size - bytes_read;
+        if (copy_len > seg->len) {
+            copy_len = seg->len;
+        }
 
-    if (bytes_read > 0) {
-        circbuffer_get(socket_ctx->recv_buffer, buffer, bytes_read);
+        memcpy(&buffer[bytes_read], seg->data, copy_len);
+        bytes_read += copy_len;
+        seg->data += copy_len;
+        seg->len -= copy_len;
 
-        if (socket_ctx->fd_ctx != NULL &&
-            circbuffer_len(socket_ctx->recv_buffer) == 0) {
-            socket_ctx->fd_ctx->ready &= ~FD_READY_GEN_READ;
+        if (seg->len == 0) {
+            llist_delete_ptr(socket_ctx->recv_segs, seg);
+            net_tcp_socket_free_seg(seg);
         }
+    }
 
-        return bytes_read;
+    socket_ctx->recv_len -= bytes_read;
+
+    if (socket_ctx->fd_ctx != NULL &&
+        socket_ctx->recv_len == 0) {
+        socket_ctx->fd_ctx->ready &= ~FD_READY_GEN_READ;
+    }
+
+    return bytes_read;
+}
+
+static int64_t net_tcp_socket_read_fn(void* ctx, uint8_t* buffer, const int64_t size, const uint64_t flags) {
+
+    net_tcp_socket_ctx_t* socket_ctx = ctx;
+
+    if (socket_ctx->recv_len > 0 && size > 0) {
+        return net_tcp_socket_get(socket_ctx, buffer, size);
     } else {
 
         if (socket_ctx->should_close) {
@@ -120,6 +186,7 @@ static int64_t net_tcp_socket_read_fn(void* ctx, uint8_t* buffer, const int64_t
 
             wait_ctx_t wake_ctx = {
                 .signal.trywake = &socket_ctx->canwake,
+                .queue = &socket_ctx->canwake_queue,
                 .wake_at = 0
             };
 
@@ -130,18 +197,9 @@ static int64_t net_tcp_socket_read_fn(void* ctx, uint8_t* buffer, const int64_t
 
                 socket_ctx->canwake = false;
                 task_wait_kernel(get_active_task(), WAIT_SIGNAL, &wake_ctx, TASK_WAIT_WAKEUP, signal_wakeup_fn);
-                bytes_avail = circbuffer_len(socket_ctx->recv_buffer);
-                bytes_read = (bytes_avail < size) ? bytes_avail : size;
-            } while (bytes_read == 0);
+            } while (socket_ctx->recv_len == 0 || size == 0);
 
-            circbuffer_get(socket_ctx->recv_buffer, buffer, bytes_read);
-
-            if (socket_ctx->fd_ctx != NULL &&
-                circbuffer_len(socket_ctx->recv_buffer) == 0) {
-                socket_ctx->fd_ctx->ready &= ~FD_READY_GEN_READ;
-            }
-
-            return bytes_read;
+            return net_tcp_socket_get(socket_ctx, buffer, size);
         }
     }
 }
@@ -171,7 +229,13 @@ int64_t net_tcp_socket_close_fn(void* ctx) {
     }
 
 
-    circbuffer_destroy(socket_ctx->recv_buffer);
+    net_tcp_socket_seg_t* seg;
+    FOR_LLIST(socket_ctx->recv_segs, seg)
+        net_tcp_socket_free_seg(seg);
+    END_FOR_LLIST()
+
+    llist_free_all(socket_ctx->recv_segs);
+    llist_free(socket_ctx->recv_segs);
 
     vfree(socket_ctx);
 
@@ -194,7 +258,8 @@ void* net_tcp_socket_create_from_conn(task_t* task, void* tcp_ctx, ipv4_t* our_i
     socket_ctx->task = task;
     socket_ctx->should_close = false;
     socket_ctx->tcp_conn_ctx = tcp_ctx;
-    socket_ctx->recv_buffer = circbuffer_create(4096);
+    socket_ctx->recv_segs = llist_create();
+    socket_ctx->recv_len = 0;
     socket_ctx->our_ip = *our_ip;
     socket_ctx->our_port = our_port;
     socket_ctx->their_ip = *their_ip;
@@ -252,7 +317,8 @@ int64_t net_tcp_create_socket(k_create_socket_t* create_socket_ctx) {
     }
 
     socket_ctx->our_ip = net_dev->ipv4;
-    socket_ctx->recv_buffer = circbuffer_create(4096);
+    socket_ctx->recv_segs = llist_create();
+    socket_ctx->recv_len = 0;
     socket_ctx->fd_ctx = fd_ctx;
 
     if (fd_ctx != NULL) {
@@ -12,7 +12,7 @@
 #define TCP_EPHIMERAL_START 32768
 #define TCP_EPHIMERAL_END 65536
 
-int64_t net_tcp_socket_recv(void* ctx, const uint8_t* payload, uint64_t payload_len);
+int64_t net_tcp_socket_recv(void* ctx, net_packet_t* packet, const uint8_t* payload, uint64_t payload_len);
 
 int64_t net_tcp_create_socket(k_create_socket_t* create_socket_ctx);
 void* net_tcp_socket_create_from_conn(task_t* task, void* tcp_ctx, ipv4_t* our_ip, uint16_t our_port, ipv4_t* their_ip, uint16_t their_port, fd_ops_t* ops);
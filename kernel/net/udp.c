@@ -40,20 +40,7 @@ int64_t net_udp_send_packet(ipv4_t* dest_ip, uint64_t dest_port, uint64_t source
 
     memcpy(&udp_buffer[8], udp_header.payload, udp_header.payload_len);
 
-    uint64_t checksum = 0;
-
-    for (uint64_t idx = 0; idx < udp_header.len/2; idx++) {
-        uint16_t* tmp = (uint16_t*)&udp_buffer[idx*2];
-        checksum += en_swap_16(*tmp);
-    }
-
-    if (udp_header.len % 2 != 0) {
-        checksum += ((uint64_t)udp_buffer[udp_header.len - 1]) << 8;
-    }
-
-    checksum = (checksum & 0xFFFF) + (checksum >> 16);
-
-    *(uint16_t*)&udp_buffer[6] = (uint16_t)checksum;
+    // The checksum is filled in by the IPv4 layer or the NIC
 
     int64_t ip_ret;
     ip_ret = net_ipv4_send_packet(dest_ip, NET_IPV4_PROTO_UDP, udp_buffer, udp_header.len);
@@ -63,22 +50,6 @@ int64_t net_udp_send_packet(ipv4_t* dest_ip, uint64_t dest_port, uint64_t source
     return ip_ret;
 }
 
-void net_udp_update_checksum(uint8_t* udp_payload, uint64_t pseudo_header_checksum) {
-
-    uint64_t old_checksum = *(uint16_t*)&udp_payload[6];
-
-    uint64_t new_checksum = old_checksum + pseudo_header_checksum;
-    new_checksum = (new_checksum & 0xFFFF) + (new_checksum >> 16);
-    new_checksum = new_checksum ^ 0xFFFF;
-
-    if (new_checksum == 0) {
-        new_checksum = 0xFFFF;
-    }
-
-    // *(uint16_t*)&udp_payload[6] = en_swap_16(new_checksum);
-    *(uint16_t*)&udp_payload[6] = 0;
-}
-
 void net_udp_handle_packet(net_packet_t* packet, ethernet_l2_frame_t* frame, net_ipv4_hdr_t* ipv4_header) {
     
     net_udp_hdr_t udp_header;
@@ -91,6 +62,16 @@ void net_udp_handle_packet(net_packet_t* packet, ethernet_l2_frame_t* frame, net
     udp_header.len = en_swap_16(*(uint16_t*)&ipv4_header->payload[4]);
     udp_header.checksum = en_swap_16(*(uint16_t*)&ipv4_header->payload[6]);
 
+    if (udp_header.len < 8 || udp_header.len > ipv4_header->payload_len) {
+        return;
+    }
+
+    // A zero checksum means the sender didn't compute one
+    if (udp_header.checksum != 0 && !net_ipv4_l4_checksum_ok(packet, ipv4_header)) {
+        console_log(LOG_DEBUG, "Net UDP dropping packet with bad checksum");
+        return;
+    }
+
     udp_header.payload = ipv4_header->payload + 8;
     udp_header.payload_len = udp_header.len - 8;
 
@@ -26,9 +26,15 @@
 
 #include "stdlib/bitutils.h"
 
+// Datagrams are queued in place in the received packet while the NIC
+// can spare it, and copied otherwise
+#define NET_UDP_SOCKET_MAX_QUEUED 16
+
 typedef struct {
     net_udp_hdr_t udp_msg;
     ipv4_t sender_ip;
+    net_packet_t* packet;       /* NULL if the payload was copied */
+    uint8_t copy[];
 } net_udp_socket_packet_t;
 
 typedef struct {
@@ -54,13 +60,23 @@ void net_udp_socket_recv_packet(net_packet_t* packet, net_ipv4_hdr_t* ipv4_heade
         return;
     }
 
-    net_udp_socket_packet_t* socket_packet = vmalloc(sizeof(net_udp_socket_packet_t));
-    uint8_t* payload_buffer = vmalloc(udp_msg->payload_len);
-    memcpy(payload_buffer, udp_msg->payload, udp_msg->payload_len);
-
-    socket_packet->udp_msg = *udp_msg;
-    socket_packet->udp_msg.payload = payload_buffer;
+    if (llist_len(port_ctx->incoming_packets) >= NET_UDP_SOCKET_MAX_QUEUED) {
+        console_log(LOG_DEBUG, "UDP port %d queue full", dest_port64);
+        return;
+    }
 
+    net_udp_socket_packet_t* socket_packet;
+    if (net_packet_pin(packet)) {
+        socket_packet = vmalloc(sizeof(net_udp_socket_packet_t));
+        socket_packet->udp_msg = *udp_msg;
+        socket_packet->packet = packet;
+    } else {
+        socket_packet = vmalloc(sizeof(net_udp_socket_packet_t) + udp_msg->payload_len);
+        socket_packet->udp_msg = *udp_msg;
+        socket_packet->packet = NULL;
+        memcpy(socket_packet->copy, udp_msg->payload, udp_msg->payload_len);
+        socket_packet->udp_msg.payload = socket_packet->copy;
+    }
     socket_packet->sender_ip = ipv4_header->src_ip;
 
     llist_append_ptr(port_ctx->incoming_packets, socket_packet);
@@ -70,7 +86,9 @@ void net_udp_socket_recv_packet(net_packet_t* packet, net_ipv4_hdr_t* ipv4_heade
 }
 
 static void net_udp_free_socket_packet(net_udp_socket_packet_t* socket_packet) {
-    vfree(socket_packet->udp_msg.payload);
+    if (socket_packet->packet != NULL) {
+        net_packet_unpin(socket_packet->packet);
+    }
     vfree(socket_packet);
 }
 
@@ -130,7 +148,7 @@ static int64_t net_udp_socket_ioctl_fn(void* ctx, const uint64_t ioctl, const ui
                 return -1;
             }
             info_raw_ptr = args[0];
-            k_socket_info_t* socket_info = get_kptr_for_ptr(info_raw_ptr);
+            k_socket_info_t* socket_info = get_kptr_for_ptr(info_raw_ptr, sizeof(k_socket_info_t));
             if (socket_info == NULL) {
                 return -1;
             }
@@ -151,7 +169,7 @@ static int64_t net_udp_socket_ioctl_fn(void* ctx, const uint64_t ioctl, const ui
                 return -1;
             }
             info_raw_ptr = args[0];
-            k_socket_msginfo_t* msg_info = get_kptr_for_ptr(info_raw_ptr);
+            k_socket_msginfo_t* msg_info = get_kptr_for_ptr(info_raw_ptr, sizeof(k_socket_msginfo_t));
             if (msg_info == NULL) {
                 console_log(LOG_INFO, "Bad ptr %16x %16x", info_raw_ptr, msg_info);
                 return -1;
@@ -172,7 +190,7 @@ static int64_t net_udp_socket_ioctl_fn(void* ctx, const uint64_t ioctl, const ui
                 return -1;
             }
             info_raw_ptr = args[0];
-            k_socket_config_t* socket_cfg = get_kptr_for_ptr(info_raw_ptr);
+            k_socket_config_t* socket_cfg = get_kptr_for_ptr(info_raw_ptr, sizeof(k_socket_config_t));
             if (socket_cfg == NULL) {
                 console_log(LOG_INFO, "Bad ptr %16x %16x", info_raw_ptr, socket_cfg);
                 return -1;
@@ -203,12 +221,14 @@ static int64_t net_udp_socket_close_fn(void* ctx) {
 
     uint64_t source_port64 = socket_ctx->source_port;
 
-    // net_udp_socket_packet_t* entry;
-    // FOR_LLIST(socket_ctx->incoming_packets, entry)
-    //     net_udp_free_socket_packet(entry);
-    // END_FOR_LLIST()
+    // Queued datagrams hold receive buffers, so give them back
+    net_udp_socket_packet_t* entry;
+    FOR_LLIST(socket_ctx->incoming_packets, entry)
+        net_udp_free_socket_packet(entry);
+    END_FOR_LLIST()
 
-    //llist_free_all(socket_ctx->incoming_packets);
+    llist_free_all(socket_ctx->incoming_packets);
+    llist_free(socket_ctx->incoming_packets);
 
     void* old_key;
     old_key = hashmap_del(s_udp_source_port_map, &source_port64);
@@ -2,8 +2,10 @@
 #include <stdint.h>
 
 #include "kernel/exception.h"
+#include "kernel/mmap.h"
 #include "kernel/pagefault.h"
 #include "kernel/panic.h"
+#include "kernel/schedule.h"
 #include "kernel/task.h"
 #include "kernel/kernelspace.h"
 #include "kernel/lib/vmalloc.h"
@@ -77,10 +79,52 @@ void pagefault_print_kernel_backtrace(task_t* task, irq_stackframe_t* frame) {
     console_printf("\n");
 }
 
+/*
+ * Faults from userspace may be a page of a mapped file that has not
+ * been accessed yet, or the first write to a copy-on-write page
+ */
+static bool pagefault_handle_user(uint32_t ec, uint32_t esr) {
+
+    if (ec != EC_DATA_ABORT_LOWER && ec != EC_INST_ABORT_LOWER) {
+        return false;
+    }
+
+    uint32_t fsc = esr & ESR_FSC_MASK;
+    bool translation = fsc >= ESR_FSC_TRANSLATION_L0 && fsc <= ESR_FSC_TRANSLATION_L3;
+    bool permission = fsc >= ESR_FSC_PERMISSION_L0 && fsc <= ESR_FSC_PERMISSION_L3;
+    if ((!translation && !permission) || (esr & ESR_FNV) != 0) {
+        return false;
+    }
+
+    mmap_access_t access;
+    if (ec == EC_INST_ABORT_LOWER) {
+        access = MMAP_ACCESS_EXEC;
+    } else if (esr & ESR_WNR) {
+        access = MMAP_ACCESS_WRITE;
+    } else {
+        access = MMAP_ACCESS_READ;
+    }
+
+    // Only a write to a page mapped read only is resolved
+    if (permission && access != MMAP_ACCESS_WRITE) {
+        return false;
+    }
+
+    uint64_t far;
+    READ_SYS_REG(FAR_EL1, far);
+
+    return mmap_handle_fault(get_active_task(), far, access);
+}
+
 void pagefault_handler(uint64_t vector, uint32_t esr) {
 
     uint32_t ec = esr >> 26;
 
+    if (pagefault_handle_user(ec, esr)) {
+        schedule();
+        return;
+    }
+
     console_printf("Pagefault in vector %u\n", vector);
 
     console_printf("ESR %x\n", esr);
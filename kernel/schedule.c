@@ -4,9 +4,11 @@
 #include <string.h>
 
 #include "kernel/task.h"
+#include "kernel/schedule.h"
 #include "kernel/assert.h"
 #include "kernel/console.h"
 #include "kernel/gtimer.h"
+#include "kernel/smp.h"
 #include "kernel/lib/lstruct.h"
 
 #include "kernel/interrupt/interrupt.h"
@@ -14,63 +16,371 @@
 #define TASKQ_FOREACH(head, ptr) FOREACH_LSTRUCT(head, ptr, schedule_queue)
 #define TASKQ_AT(head, idx) LSTRUCT_AT(head, idx, task_t, schedule_queue)
 
+/**
+ * Waiting tasks with a non-zero wake_at are also kept in a binary
+ * min-heap keyed on wake_at. Expired timeouts are popped from the top
+ * of the heap and the next deadline is always the heap root, so the
+ * scheduler never has to walk the wait lists looking for timeouts.
+ */
 typedef struct {
-    lstruct_head_t proc_runable;
+    task_t* tasks[MAX_NUM_TASKS];
+    uint64_t count;
+} timeout_heap_t;
+
+/**
+ * Each CPU has its own run queues and active task. A runnable task sits
+ * on the run queue of the CPU in task->cpu and only moves when a CPU
+ * with nothing of its own to run steals it.
+ */
+typedef struct {
+    lstruct_head_t proc_runable[TASK_NUM_PRIORITIES];
+
+    task_t* active_task;
+    uint64_t slice_start_us;
+
+    // Set when a task with a higher priority than the active task
+    // becomes runnable or is signalled
+    bool preempt;
+
+    uint64_t num_scheduled[TASK_NUM_PRIORITIES];
+    uint64_t num_preempt[TASK_NUM_PRIORITIES];
+    elapsedtimer_t run_time[TASK_NUM_PRIORITIES];
+    uint64_t num_stolen;
+} schedule_ctx_t;
+
+/**
+ * Waiting and completed tasks are shared by all CPUs.
+ *
+ * TASK_WAIT_WAKEUP tasks are split in two lists. proc_wakeup_pending
+ * holds tasks that have just started waiting or whose wait queue has
+ * been signalled. Only these have their wakeup function polled, after
+ * which tasks that can't wake yet are parked in proc_wait_wakeup until
+ * they are signalled again.
+ */
+typedef struct {
+    lstruct_head_t proc_wakeup_pending;
     lstruct_head_t proc_wait_wakeup;
     lstruct_head_t proc_wait;
     lstruct_head_t proc_complete;
 
-    task_t* active_task;
-} schedule_ctx_t;
+    timeout_heap_t timeouts;
+} schedule_wait_ctx_t;
+
+schedule_ctx_t s_schedule_ctx[SMP_MAX_CPUS];
+
+static schedule_wait_ctx_t s_wait_ctx;
+
+static void timeout_heap_set(timeout_heap_t* heap, uint64_t idx, task_t* task) {
+    heap->tasks[idx] = task;
+    task->timeout_slot = idx + 1;
+}
+
+static void timeout_heap_sift_up(timeout_heap_t* heap, uint64_t idx) {
+    task_t* task = heap->tasks[idx];
+
+    while (idx > 0) {
+        uint64_t parent = (idx - 1) / 2;
+        if (heap->tasks[parent]->wait_ctx.wake_at <= task->wait_ctx.wake_at) {
+            break;
+        }
+        timeout_heap_set(heap, idx, heap->tasks[parent]);
+        idx = parent;
+    }
+    timeout_heap_set(heap, idx, task);
+}
+
+static void timeout_heap_sift_down(timeout_heap_t* heap, uint64_t idx) {
+    task_t* task = heap->tasks[idx];
+
+    while (true) {
+        uint64_t child = 2 * idx + 1;
+        if (child >= heap->count) {
+            break;
+        }
+        if (child + 1 < heap->count &&
+            heap->tasks[child + 1]->wait_ctx.wake_at < heap->tasks[child]->wait_ctx.wake_at) {
+            child++;
+        }
+        if (task->wait_ctx.wake_at <= heap->tasks[child]->wait_ctx.wake_at) {
+            break;
+        }
+        timeout_heap_set(heap, idx, heap->tasks[child]);
+        idx = child;
+    }
+    timeout_heap_set(heap, idx, task);
+}
+
+static void timeout_heap_insert(timeout_heap_t* heap, task_t* task) {
+    ASSERT(task->timeout_slot == 0);
+    ASSERT(heap->count < MAX_NUM_TASKS);
+
+    timeout_heap_set(heap, heap->count, task);
+    heap->count++;
+    timeout_heap_sift_up(heap, heap->count - 1);
+}
+
+static void timeout_heap_remove(timeout_heap_t* heap, task_t* task) {
+    ASSERT(task->timeout_slot != 0);
 
-schedule_ctx_t s_schedule_ctx;
+    uint64_t idx = task->timeout_slot - 1;
+    ASSERT(idx < heap->count && heap->tasks[idx] == task);
+
+    task->timeout_slot = 0;
+    heap->count--;
+
+    if (idx != heap->count) {
+        // Move the last entry into the hole and restore the heap order
+        task_t* moved = heap->tasks[heap->count];
+        timeout_heap_set(heap, idx, moved);
+        timeout_heap_sift_up(heap, idx);
+        timeout_heap_sift_down(heap, moved->timeout_slot - 1);
+    }
+    heap->tasks[heap->count] = NULL;
+}
+
+static task_t* timeout_heap_peek(timeout_heap_t* heap) {
+    return heap->count > 0 ? heap->tasks[0] : NULL;
+}
+
+static schedule_ctx_t* schedule_get_ctx(void) {
+    return &s_schedule_ctx[smp_cpu_idx()];
+}
 
 task_t* get_active_task(void) {
-    return s_schedule_ctx.active_task;
+    return schedule_get_ctx()->active_task;
 }
 
 void schedule_init(void) {
-    lstruct_init_head(&s_schedule_ctx.proc_runable);
-    lstruct_init_head(&s_schedule_ctx.proc_wait_wakeup);
-    lstruct_init_head(&s_schedule_ctx.proc_wait);
-    lstruct_init_head(&s_schedule_ctx.proc_complete);
+    for (uint64_t cpu_idx = 0; cpu_idx < SMP_MAX_CPUS; cpu_idx++) {
+        schedule_ctx_t* ctx = &s_schedule_ctx[cpu_idx];
+        for (uint64_t prio = 0; prio < TASK_NUM_PRIORITIES; prio++) {
+            lstruct_init_head(&ctx->proc_runable[prio]);
+            elapsedtimer_clear(&ctx->run_time[prio]);
+        }
+    }
+    lstruct_init_head(&s_wait_ctx.proc_wakeup_pending);
+    lstruct_init_head(&s_wait_ctx.proc_wait_wakeup);
+    lstruct_init_head(&s_wait_ctx.proc_wait);
+    lstruct_init_head(&s_wait_ctx.proc_complete);
+    s_wait_ctx.timeouts.count = 0;
 }
 
 static void wait_timer_setup(uint64_t now_us, uint64_t max_sleep_time);
 
+/*
+ * Make sure some CPU looks at a task that may be able to run. The
+ * task's own CPU is preempted if it is running something of a lower
+ * priority, otherwise an idle CPU is woken so it can steal the task
+ */
+static void schedule_kick(task_t* task) {
+    schedule_ctx_t* ctx = &s_schedule_ctx[task->cpu];
+
+    if (ctx->active_task == task) {
+        return;
+    }
+
+    if (ctx->active_task == NULL) {
+        smp_send_reschedule(task->cpu);
+        return;
+    }
+
+    if (task->priority < ctx->active_task->priority) {
+        ctx->preempt = true;
+        smp_send_reschedule(task->cpu);
+        return;
+    }
+
+    for (uint64_t cpu_idx = 0; cpu_idx < smp_num_cpus(); cpu_idx++) {
+        if (smp_cpu_online(cpu_idx) &&
+            s_schedule_ctx[cpu_idx].active_task == NULL) {
+            smp_send_reschedule(cpu_idx);
+            return;
+        }
+    }
+}
+
 void task_requeue(task_t* task) {
     if (task->schedule_queue.p != NULL) {
         lstruct_remove(&task->schedule_queue);
     }
+    if (task->timeout_slot != 0) {
+        timeout_heap_remove(&s_wait_ctx.timeouts, task);
+    }
+    wait_queue_remove(task);
+
+    ASSERT(task->priority < TASK_NUM_PRIORITIES);
+    ASSERT(task->cpu < SMP_MAX_CPUS);
 
     switch (task->run_state) {
         case TASK_RUNABLE:
         case TASK_AWAKE:
-            lstruct_prepend(s_schedule_ctx.proc_runable, &task->schedule_queue);
+            lstruct_prepend(s_schedule_ctx[task->cpu].proc_runable[task->priority], &task->schedule_queue);
+            schedule_kick(task);
             break;
         case TASK_WAIT:
-            lstruct_prepend(s_schedule_ctx.proc_wait, &task->schedule_queue);
+            lstruct_prepend(s_wait_ctx.proc_wait, &task->schedule_queue);
+            if (task->wait_ctx.wake_at != 0) {
+                timeout_heap_insert(&s_wait_ctx.timeouts, task);
+            }
             break;
         case TASK_WAIT_WAKEUP:
-            lstruct_prepend(s_schedule_ctx.proc_wait_wakeup, &task->schedule_queue);
+            lstruct_prepend(s_wait_ctx.proc_wakeup_pending, &task->schedule_queue);
+            if (task->wait_ctx.queue != NULL) {
+                wait_queue_add(task->wait_ctx.queue, task);
+            }
+            if (task->wait_ctx.wake_at != 0) {
+                timeout_heap_insert(&s_wait_ctx.timeouts, task);
+            }
+            schedule_kick(task);
             break;
         case TASK_COMPLETE:
-            lstruct_prepend(s_schedule_ctx.proc_complete, &task->schedule_queue);
+            lstruct_prepend(s_wait_ctx.proc_complete, &task->schedule_queue);
             break;
         default:
             ASSERT(0);
     }
 }
 
+void task_set_priority(task_t* task, task_priority_t priority) {
+    ASSERT(priority < TASK_NUM_PRIORITIES);
+
+    uint64_t irq_state;
+    BEGIN_CRITICAL(irq_state);
+
+    task->priority = priority;
+    if (task->schedule_queue.p != NULL &&
+        (task->run_state == TASK_RUNABLE || task->run_state == TASK_AWAKE)) {
+        task_requeue(task);
+    }
+
+    END_CRITICAL(irq_state);
+}
+
+/*
+ * IRQ Context
+ * Whether the interrupted task should give up the CPU. True if a
+ * higher priority task may be able to run, a timeout has expired or
+ * the time slice is used up
+ */
+bool schedule_should_preempt(void) {
+
+    schedule_ctx_t* ctx = schedule_get_ctx();
+
+    if (ctx->active_task == NULL || ctx->preempt) {
+        return true;
+    }
+
+    uint64_t now_us = gtimer_get_count_us();
+
+    task_t* timeout_task = timeout_heap_peek(&s_wait_ctx.timeouts);
+    if (timeout_task != NULL && timeout_task->wait_ctx.wake_at <= now_us) {
+        return true;
+    }
+
+    return (now_us - ctx->slice_start_us) >= TASK_MAX_PROC_TIME_US;
+}
+
+void schedule_get_stat(schedule_prio_stat_t stat_out[TASK_NUM_PRIORITIES]) {
+    for (uint64_t prio = 0; prio < TASK_NUM_PRIORITIES; prio++) {
+        stat_out[prio].num_runable = 0;
+        stat_out[prio].num_scheduled = 0;
+        stat_out[prio].num_preempt = 0;
+        stat_out[prio].run_time_us = 0;
+
+        for (uint64_t cpu_idx = 0; cpu_idx < smp_num_cpus(); cpu_idx++) {
+            schedule_ctx_t* ctx = &s_schedule_ctx[cpu_idx];
+            stat_out[prio].num_runable += lstruct_len(ctx->proc_runable[prio]);
+            stat_out[prio].num_scheduled += ctx->num_scheduled[prio];
+            stat_out[prio].num_preempt += ctx->num_preempt[prio];
+            stat_out[prio].run_time_us += elapsedtimer_get_us(&ctx->run_time[prio]);
+        }
+    }
+}
+
+void schedule_get_cpu_stat(uint64_t cpu_idx, schedule_cpu_stat_t* stat_out) {
+    ASSERT(cpu_idx < SMP_MAX_CPUS);
+
+    schedule_ctx_t* ctx = &s_schedule_ctx[cpu_idx];
+
+    stat_out->num_runable = 0;
+    stat_out->num_scheduled = 0;
+    for (uint64_t prio = 0; prio < TASK_NUM_PRIORITIES; prio++) {
+        stat_out->num_runable += lstruct_len(ctx->proc_runable[prio]);
+        stat_out->num_scheduled += ctx->num_scheduled[prio];
+    }
+    stat_out->num_stolen = ctx->num_stolen;
+    stat_out->active_tid = ctx->active_task != NULL ? ctx->active_task->tid : 0;
+}
+
+/*
+ * Take a runnable task from another CPU, never one that is running on
+ * its CPU. The victim is the CPU with the highest priority waiting
+ * task, with ties going to the CPU with the most waiting tasks
+ */
+static task_t* schedule_steal_task(schedule_ctx_t* this_ctx) {
+
+    uint64_t this_cpu = smp_cpu_idx();
+
+    task_t* steal_task = NULL;
+    uint64_t steal_load = 0;
+
+    for (uint64_t cpu_idx = 0; cpu_idx < smp_num_cpus(); cpu_idx++) {
+        if (cpu_idx == this_cpu || !smp_cpu_online(cpu_idx)) {
+            continue;
+        }
+
+        schedule_ctx_t* ctx = &s_schedule_ctx[cpu_idx];
+        task_t* candidate = NULL;
+        uint64_t load = 0;
+
+        for (uint64_t prio = 0; prio < TASK_NUM_PRIORITIES; prio++) {
+            task_t* task;
+            TASKQ_FOREACH(ctx->proc_runable[prio], task) {
+                if (task == ctx->active_task) {
+                    continue;
+                }
+                if (candidate == NULL) {
+                    candidate = task;
+                }
+                load++;
+            }
+        }
+
+        if (candidate == NULL) {
+            continue;
+        }
+
+        if (steal_task == NULL ||
+            candidate->priority < steal_task->priority ||
+            (candidate->priority == steal_task->priority && load > steal_load)) {
+            steal_task = candidate;
+            steal_load = load;
+        }
+    }
+
+    if (steal_task != NULL) {
+        lstruct_remove(&steal_task->schedule_queue);
+        steal_task->cpu = this_cpu;
+        lstruct_prepend(this_ctx->proc_runable[steal_task->priority], &steal_task->schedule_queue);
+        this_ctx->num_stolen++;
+    }
+
+    return steal_task;
+}
+
 void schedule(void) {
 
     DISABLE_IRQ();
+    smp_kernel_lock();
 
-    task_t* active_task = get_active_task();
+    schedule_ctx_t* ctx = schedule_get_ctx();
+    task_t* active_task = ctx->active_task;
 
     if (active_task != NULL) {
         elapsedtimer_stop(&active_task->profile_time);
+        elapsedtimer_stop(&ctx->run_time[active_task->priority]);
     }
+    ctx->preempt = false;
 
     //while (gic_try_irq_handler());
 
@@ -78,60 +388,83 @@ void schedule(void) {
 
     uint64_t now_us = gtimer_get_count_us();
 
-    // Check for task timeouts
-    // TODO: This could be done with a separate timeout list
+    // Expire task timeouts. Waking a task requeues it, which removes
+    // it from the timeout heap
     task_t* wait_task;
-    TASKQ_FOREACH(s_schedule_ctx.proc_wait, wait_task) {
-        ASSERT(wait_task->run_state == TASK_WAIT);
+    while ((wait_task = timeout_heap_peek(&s_wait_ctx.timeouts)) != NULL &&
+           wait_task->wait_ctx.wake_at <= now_us) {
 
-        if (wait_task->wait_ctx.wake_at != 0 &&
-            wait_task->wait_ctx.wake_at <= now_us) {
+        ASSERT(wait_task->run_state == TASK_WAIT ||
+               wait_task->run_state == TASK_WAIT_WAKEUP);
 
-            int64_t task_ret;
-            bool awoke = wait_task->wait_wakeup_fn(wait_task, true, &task_ret);
-            ASSERT(awoke);
-            // console_log(LOG_DEBUG, "Wokeup WAIT %s", wait_task->name);
-            wait_task->run_state = TASK_AWAKE;
-            task_requeue(wait_task);
-            wait_task->wait_return = task_ret;
-        }
+        int64_t task_ret;
+        bool awoke = wait_task->wait_wakeup_fn(wait_task, true, &task_ret);
+        ASSERT(awoke);
+        // console_log(LOG_DEBUG, "Wokeup timeout %s", wait_task->name);
+        wait_task->run_state = TASK_AWAKE;
+        task_requeue(wait_task);
+        wait_task->wait_return = task_ret;
     }
 
-    // Attempt to wakeup all tasks
-    TASKQ_FOREACH(s_schedule_ctx.proc_wait_wakeup, wait_task) {
+    // Attempt to wakeup signalled tasks. Any expired timeouts have
+    // already been handled above
+    TASKQ_FOREACH(s_wait_ctx.proc_wakeup_pending, wait_task) {
         ASSERT(wait_task->run_state == TASK_WAIT_WAKEUP);
 
-        bool timeout = wait_task->wait_ctx.wake_at != 0 &&
-                       wait_task->wait_ctx.wake_at <= now_us;
-
         int64_t task_ret;
-        bool awoke = wait_task->wait_wakeup_fn(wait_task, timeout, &task_ret);
-        if (timeout) {
-            ASSERT(awoke);
-        }
+        bool awoke = wait_task->wait_wakeup_fn(wait_task, false, &task_ret);
 
         if (awoke) {
             // console_log(LOG_DEBUG, "Wokeup WAIT_WAKEUP %s", wait_task->name);
             wait_task->run_state = TASK_AWAKE;
             task_requeue(wait_task);
             wait_task->wait_return = task_ret;
+        } else {
+            // Stays on its wait queue and timeout heap
+            lstruct_remove(&wait_task->schedule_queue);
+            lstruct_prepend(s_wait_ctx.proc_wait_wakeup, &wait_task->schedule_queue);
         }
     }
 
-    task_t* run_task = TASKQ_AT(s_schedule_ctx.proc_runable, 0);
+    // Run the next task of the highest priority with a runnable task
+    task_t* run_task = NULL;
+    uint64_t run_prio;
+    for (run_prio = 0; run_prio < TASK_NUM_PRIORITIES; run_prio++) {
+        run_task = TASKQ_AT(ctx->proc_runable[run_prio], 0);
+        if (run_task != NULL) {
+            break;
+        }
+    }
 
-    wait_timer_setup(now_us, TASK_MAX_PROC_TIME_US);
-    (void)now_us;
+    // Other CPUs' queues are only scanned when this CPU would otherwise
+    // go idle
+    if (run_task == NULL) {
+        run_task = schedule_steal_task(ctx);
+        if (run_task != NULL) {
+            run_prio = run_task->priority;
+        }
+    }
 
+    wait_timer_setup(now_us, TASK_MAX_PROC_TIME_US);
 
     if (run_task != NULL) {
-        s_schedule_ctx.active_task = run_task;
+        if (active_task != NULL &&
+            active_task != run_task &&
+            active_task->run_state == TASK_RUNABLE &&
+            run_task->priority < active_task->priority) {
+            ctx->num_preempt[run_prio]++;
+        }
+
+        ctx->active_task = run_task;
+        ctx->slice_start_us = now_us;
+        ctx->num_scheduled[run_prio]++;
 
         lstruct_remove(&run_task->schedule_queue);
-        lstruct_append(s_schedule_ctx.proc_runable, &run_task->schedule_queue);
+        lstruct_append(ctx->proc_runable[run_prio], &run_task->schedule_queue);
 
         stop_idle_timer();
         elapsedtimer_start(&run_task->profile_time);
+        elapsedtimer_start(&ctx->run_time[run_prio]);
 
         switch (run_task->run_state) {
             case TASK_RUNABLE:
@@ -147,7 +480,7 @@ void schedule(void) {
         }
     } else {
         // Schedule idle task
-        s_schedule_ctx.active_task = NULL;
+        ctx->active_task = NULL;
         restore_context_idle();
     }
 
@@ -158,13 +491,9 @@ static void wait_timer_setup(uint64_t now_us, uint64_t max_sleep_time) {
 
     uint64_t timer_fire_time = now_us + max_sleep_time;
 
-    task_t* check_task = NULL;
-    TASKQ_FOREACH(s_schedule_ctx.proc_wait, check_task) {
-        ASSERT (check_task->run_state == TASK_WAIT)
-
-        if (check_task->wait_ctx.wake_at == 0) {
-            continue;
-        }
+    // The earliest deadline is always at the root of the timeout heap
+    task_t* check_task = timeout_heap_peek(&s_wait_ctx.timeouts);
+    if (check_task != NULL) {
         uint64_t wake_time_us = check_task->wait_ctx.wake_at;
 
         // Should be handled in the schedule function
@@ -175,33 +504,11 @@ static void wait_timer_setup(uint64_t now_us, uint64_t max_sleep_time) {
         }
         ASSERT(wake_time_us > now_us);
 
-        if (timer_fire_time == 0) {
-            timer_fire_time = wake_time_us;
-        } else if (timer_fire_time > wake_time_us) {
-            timer_fire_time = wake_time_us;
-        }
-    }
-
-    TASKQ_FOREACH(s_schedule_ctx.proc_wait_wakeup, check_task) {
-
-        ASSERT (check_task->run_state == TASK_WAIT_WAKEUP);
-
-        if (check_task->wait_ctx.wake_at == 0) {
-            continue;
-        }
-        uint64_t wake_time_us = check_task->wait_ctx.wake_at;
-        ASSERT(wake_time_us > now_us);
-
-        if (timer_fire_time == 0) {
-            timer_fire_time = wake_time_us;
-        } else if (timer_fire_time > wake_time_us) {
+        if (timer_fire_time > wake_time_us) {
             timer_fire_time = wake_time_us;
         }
     }
 
-    uint64_t downcount;
-    READ_SYS_REG(CNTP_TVAL_EL0, downcount);
-
     if (now_us >= timer_fire_time) {
         timer_fire_time = now_us + 1;
     }
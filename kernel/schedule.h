@@ -11,5 +11,25 @@ void schedule_init(void);
 void schedule(void);
 
 void task_requeue(task_t* task);
+void task_set_priority(task_t* task, task_priority_t priority);
+bool schedule_should_preempt(void);
+
+typedef struct {
+    uint64_t num_runable;       /* Tasks currently runnable */
+    uint64_t num_scheduled;     /* Times a task of this priority was picked */
+    uint64_t num_preempt;       /* Times a task of this priority preempted a lower one */
+    uint64_t run_time_us;       /* Total time spent running tasks of this priority */
+} schedule_prio_stat_t;
+
+void schedule_get_stat(schedule_prio_stat_t stat_out[TASK_NUM_PRIORITIES]);
+
+typedef struct {
+    uint64_t num_runable;       /* Tasks on this CPU's run queues */
+    uint64_t num_scheduled;     /* Times this CPU picked a task */
+    uint64_t num_stolen;        /* Tasks taken from other CPUs' run queues */
+    uint64_t active_tid;        /* Running task, 0 when idle */
+} schedule_cpu_stat_t;
+
+void schedule_get_cpu_stat(uint64_t cpu_idx, schedule_cpu_stat_t* stat_out);
 
 #endif
\ No newline at end of file
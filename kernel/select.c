@@ -9,7 +9,9 @@
 #include "kernel/assert.h"
 #include "kernel/console.h"
 #include "kernel/gtimer.h"
+#include "kernel/mmap.h"
 #include "kernel/select.h"
+#include "kernel/lib/vmalloc.h"
 
 #define SELECT_VOLATILE_BITS (0xFFFFFFFF00000000ULL)
 
@@ -57,8 +59,15 @@ int64_t poll_select(task_t* task, syscall_select_ctx_t* select_arr, uint64_t sel
     return -1;
 }
 
+/*
+ * Must be called after setting ready bits on an fd so that a task
+ * blocked in select re-polls its fds. May be called from an interrupt
+ * context
+ */
 void select_task_wakeup(task_t* task) {
-    task_wakeup(task, WAIT_SELECT);
+    if (task != NULL) {
+        task_wakeup(task, WAIT_SELECT);
+    }
 }
 
 static bool select_wakeup(task_t* task, bool timeout, int64_t* ret) {
@@ -91,18 +100,36 @@ int64_t syscall_select(uint64_t select_arr_ptr, uint64_t select_len, uint64_t ti
     
     task_t* task = get_active_task();
 
-    syscall_select_ctx_t* select_arr_kptr = get_userspace_ptr(task->low_vm_table, select_arr_ptr);
+    // The array is copied as it may span pages which are not contiguous,
+    // and is used by select_wakeup while the task waits
+    syscall_select_ctx_t* select_arr_kptr = NULL;
+    if (select_len > 0) {
+        select_arr_kptr = vmalloc(select_len * sizeof(syscall_select_ctx_t));
+        if (!mmap_copy_user(task, select_arr_ptr, select_arr_kptr,
+                            select_len * sizeof(syscall_select_ctx_t), false)) {
+            vfree(select_arr_kptr);
+            return -1;
+        }
+    }
 
-    if (select_arr_kptr == NULL) {
-        return -1;
+    int64_t ret = -1;
+    uint64_t ready_mask;
+    if (ready_mask_ptr == 0 ||
+        mmap_user_access(task, ready_mask_ptr, sizeof(uint64_t), true)) {
+        ret = select_wait(select_arr_kptr, select_len, timeout_us,
+                          ready_mask_ptr != 0 ? &ready_mask : NULL);
     }
 
-    uint64_t* ready_mask_out = NULL;
-    if (ready_mask_ptr != 0) {
-        ready_mask_out = get_userspace_ptr(task->low_vm_table, ready_mask_ptr);
+    if (select_arr_kptr != NULL) {
+        vfree(select_arr_kptr);
+    }
+
+    if (ret >= 0 && ready_mask_ptr != 0 &&
+        !mmap_copy_user(task, ready_mask_ptr, &ready_mask, sizeof(uint64_t), true)) {
+        return -1;
     }
 
-    return select_wait(select_arr_kptr, select_len, timeout_us, ready_mask_out);
+    return ret;
 }
 
 int64_t select_wait(syscall_select_ctx_t* select_arr, uint64_t select_len, uint64_t timeout_us, uint64_t* ready_mask_out) {
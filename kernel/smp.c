@@ -0,0 +1,321 @@
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "kernel/smp.h"
+#include "kernel/assert.h"
+#include "kernel/console.h"
+#include "kernel/dtb.h"
+#include "kernel/exception.h"
+#include "kernel/gtimer.h"
+#include "kernel/kernelspace.h"
+#include "kernel/kmalloc.h"
+#include "kernel/schedule.h"
+#include "kernel/vmem.h"
+#include "kernel/lock/spinlock.h"
+
+#include "kernel/interrupt/interrupt.h"
+
+#include "stdlib/bitutils.h"
+
+#define SMP_LOCK_FREE UINT64_MAX
+#define SMP_CPU_START_TIMEOUT_US (100 * 1000)
+
+/**
+ * The kernel is not reentrant across CPUs, so it is protected by a
+ * single kernel lock. A CPU takes the lock whenever it enters the kernel
+ * from an exception or while it runs a kernel task, and drops it when
+ * it returns to a user task or goes idle. User tasks on different CPUs
+ * run in parallel.
+ */
+typedef struct {
+    smp_cpu_t cpus[SMP_MAX_CPUS];
+    uint64_t num_cpus;
+
+    spinlock_t kernel_lock;
+    volatile uint64_t kernel_lock_owner;
+
+    bool psci_hvc;
+    _vmem_table* boot_kernel_vmem;
+    _vmem_table* dummy_user_table;
+} smp_ctx_t;
+
+static smp_ctx_t s_smp_ctx;
+
+extern uint8_t _stack_base;
+
+void _bootstrap_secondary_start(void);
+
+int64_t smp_psci_call_hvc(uint64_t fn, uint64_t arg0, uint64_t arg1, uint64_t arg2);
+int64_t smp_psci_call_smc(uint64_t fn, uint64_t arg0, uint64_t arg1, uint64_t arg2);
+
+static uint64_t smp_read_mpidr(void) {
+    uint64_t mpidr;
+    READ_SYS_REG(MPIDR_EL1, mpidr);
+    return mpidr & SMP_MPIDR_AFF_MASK;
+}
+
+void smp_init(void) {
+
+    uint64_t cpu_idx = 0;
+    WRITE_SYS_REG(TPIDR_EL1, cpu_idx);
+
+    smp_cpu_t* cpu = &s_smp_ctx.cpus[0];
+    cpu->mpidr = smp_read_mpidr();
+    cpu->online = true;
+    cpu->stack_base = (uintptr_t)&_stack_base;
+    cpu->kernel_vmem = NULL;
+    cpu->num_ipi = 0;
+
+    s_smp_ctx.num_cpus = 1;
+
+    spinlock_init(&s_smp_ctx.kernel_lock);
+    s_smp_ctx.kernel_lock_owner = SMP_LOCK_FREE;
+}
+
+uint64_t smp_cpu_idx(void) {
+    uint64_t cpu_idx;
+    READ_SYS_REG(TPIDR_EL1, cpu_idx);
+    return cpu_idx;
+}
+
+uint64_t smp_num_cpus(void) {
+    return s_smp_ctx.num_cpus;
+}
+
+bool smp_cpu_online(uint64_t cpu_idx) {
+    return cpu_idx < s_smp_ctx.num_cpus && s_smp_ctx.cpus[cpu_idx].online;
+}
+
+uintptr_t smp_cpu_stack_base(void) {
+    return s_smp_ctx.cpus[smp_cpu_idx()].stack_base;
+}
+
+/*
+ * The kernel table is rebuilt when kernel mappings change, but only the
+ * CPU making the change loads the new table. Every other CPU picks it
+ * up the next time it enters the kernel
+ */
+static void smp_sync_kernel_vmem(smp_cpu_t* cpu) {
+    _vmem_table* kernel_vmem = memspace_get_kernel_vmem();
+
+    if (kernel_vmem != NULL && kernel_vmem != cpu->kernel_vmem) {
+        vmem_set_kernel_table(kernel_vmem);
+        vmem_flush_tlb();
+        cpu->kernel_vmem = kernel_vmem;
+    }
+}
+
+void smp_kernel_lock(void) {
+    uint64_t cpu_idx = smp_cpu_idx();
+
+    // Only this CPU can set or clear its own ownership
+    if (s_smp_ctx.kernel_lock_owner == cpu_idx) {
+        return;
+    }
+
+    uint64_t irq_state;
+    BEGIN_CRITICAL(irq_state);
+    spinlock_acquire(&s_smp_ctx.kernel_lock);
+    s_smp_ctx.kernel_lock_owner = cpu_idx;
+    END_CRITICAL(irq_state);
+
+    smp_sync_kernel_vmem(&s_smp_ctx.cpus[cpu_idx]);
+}
+
+void smp_kernel_unlock(void) {
+    ASSERT(s_smp_ctx.kernel_lock_owner == smp_cpu_idx());
+
+    s_smp_ctx.kernel_lock_owner = SMP_LOCK_FREE;
+    spinlock_release(&s_smp_ctx.kernel_lock);
+}
+
+void smp_send_reschedule(uint64_t cpu_idx) {
+    if (cpu_idx == smp_cpu_idx() || !smp_cpu_online(cpu_idx)) {
+        return;
+    }
+
+    interrupt_send_sgi(SMP_IPI_RESCHEDULE, s_smp_ctx.cpus[cpu_idx].mpidr);
+}
+
+/*
+ * IRQ Context
+ * The sender has already updated the scheduler state for this CPU.
+ * Taking the interrupt is enough to run the scheduler when idle or
+ * to check for preemption when returning to a user task
+ */
+static void smp_ipi_handler(uint32_t intid, void* ctx) {
+    s_smp_ctx.cpus[smp_cpu_idx()].num_ipi++;
+}
+
+void smp_get_cpu_stat(uint64_t cpu_idx, smp_cpu_stat_t* stat_out) {
+    ASSERT(cpu_idx < s_smp_ctx.num_cpus);
+
+    stat_out->mpidr = s_smp_ctx.cpus[cpu_idx].mpidr;
+    stat_out->online = s_smp_ctx.cpus[cpu_idx].online;
+    stat_out->num_ipi = s_smp_ctx.cpus[cpu_idx].num_ipi;
+}
+
+static int64_t smp_psci_call(uint64_t fn, uint64_t arg0, uint64_t arg1, uint64_t arg2) {
+    if (s_smp_ctx.psci_hvc) {
+        return smp_psci_call_hvc(fn, arg0, arg1, arg2);
+    } else {
+        return smp_psci_call_smc(fn, arg0, arg1, arg2);
+    }
+}
+
+static bool smp_find_psci(void) {
+    discovery_dtb_ctx_t psci_ctx;
+    if (dtb_query_name("psci", &psci_ctx) != 0) {
+        return false;
+    }
+
+    dt_prop_generic_t* prop;
+    dt_prop_generic_t* method = NULL;
+    FOR_LLIST(psci_ctx.dt_node->properties, prop)
+        if (strcmp(prop->name, "method") == 0) {
+            method = prop;
+        }
+    END_FOR_LLIST()
+
+    if (method == NULL) {
+        return false;
+    }
+
+    s_smp_ctx.psci_hvc = strncmp((char*)method->data, "hvc", method->data_len) == 0;
+    return true;
+}
+
+static void smp_start_cpu(uint64_t mpidr) {
+
+    uint64_t cpu_idx = s_smp_ctx.num_cpus;
+    smp_cpu_t* cpu = &s_smp_ctx.cpus[cpu_idx];
+
+    uint8_t* stack_phy = kmalloc_phy(SMP_CPU_STACK_SIZE);
+    ASSERT(stack_phy != NULL);
+    uintptr_t stack_base_phy = (uintptr_t)stack_phy + SMP_CPU_STACK_SIZE;
+
+    cpu->mpidr = mpidr;
+    cpu->online = false;
+    cpu->stack_base = PHY_TO_KSPACE(stack_base_phy);
+    cpu->kernel_vmem = s_smp_ctx.boot_kernel_vmem;
+    cpu->num_ipi = 0;
+
+    // Counted before starting so the new CPU can find its own entry
+    s_smp_ctx.num_cpus++;
+
+    // The CPU starts with the MMU off, so pass physical addresses
+    int64_t ret = smp_psci_call(PSCI_FN_CPU_ON, mpidr,
+                                (uintptr_t)_bootstrap_secondary_start,
+                                stack_base_phy);
+    if (ret != PSCI_SUCCESS) {
+        console_log(LOG_WARN, "Failed to start CPU %x: %d", mpidr, ret);
+        s_smp_ctx.num_cpus--;
+        kfree_phy(stack_phy);
+        return;
+    }
+
+    // The new CPU marks itself online before it waits on the kernel lock
+    uint64_t start_us = gtimer_get_count_us();
+    while (!cpu->online &&
+           (gtimer_get_count_us() - start_us) < SMP_CPU_START_TIMEOUT_US);
+
+    if (!cpu->online) {
+        console_log(LOG_WARN, "CPU %x did not come online", mpidr);
+    }
+}
+
+void smp_start_cpus(void) {
+
+    if (!smp_find_psci()) {
+        console_log(LOG_INFO, "No PSCI. Running on a single CPU");
+        return;
+    }
+
+    if (!interrupt_smp_capable()) {
+        console_log(LOG_INFO, "Interrupt controller has no SMP support. Running on a single CPU");
+        return;
+    }
+
+    discovery_dtb_ctx_t cpus_ctx;
+    if (dtb_query_name("cpus", &cpus_ctx) != 0) {
+        return;
+    }
+
+    interrupt_register_irq_handler(SMP_IPI_RESCHEDULE, smp_ipi_handler, NULL);
+    interrupt_enable_irq(SMP_IPI_RESCHEDULE);
+
+    uint64_t ttbr1;
+    READ_SYS_REG(TTBR1_EL1, ttbr1);
+    s_smp_ctx.boot_kernel_vmem = (_vmem_table*)ttbr1;
+    s_smp_ctx.cpus[0].kernel_vmem = s_smp_ctx.boot_kernel_vmem;
+    s_smp_ctx.dummy_user_table = KSPACE_TO_PHY_PTR(vmem_allocate_empty_table());
+
+    dt_node_t* cpu_node;
+    FOR_LLIST(cpus_ctx.dt_node->children, cpu_node)
+        if (strcmp(cpu_node->name, "cpu") != 0 ||
+            cpu_node->prop_reg == NULL ||
+            s_smp_ctx.num_cpus >= SMP_MAX_CPUS) {
+            continue;
+        }
+
+        dt_prop_reg_entry_t* reg = &cpu_node->prop_reg->reg_entries[0];
+        uint64_t mpidr = reg->addr_ptr[0];
+        if (reg->addr_size == 2) {
+            mpidr = (mpidr << 32) | reg->addr_ptr[1];
+        }
+
+        if (mpidr != s_smp_ctx.cpus[0].mpidr) {
+            smp_start_cpu(mpidr & SMP_MPIDR_AFF_MASK);
+        }
+    END_FOR_LLIST()
+
+    console_log(LOG_INFO, "%u CPUs started", s_smp_ctx.num_cpus);
+}
+
+/*
+ * Entered from _high_secondary_start on the CPU's own stack, with the
+ * bootstrap tables still loaded
+ */
+void smp_secondary_main(uintptr_t stack_base_phy) {
+
+    uint64_t mpidr = smp_read_mpidr();
+
+    uint64_t cpu_idx;
+    for (cpu_idx = 1; cpu_idx < s_smp_ctx.num_cpus; cpu_idx++) {
+        if (s_smp_ctx.cpus[cpu_idx].mpidr == mpidr) {
+            break;
+        }
+    }
+    ASSERT(cpu_idx < s_smp_ctx.num_cpus);
+
+    smp_cpu_t* cpu = &s_smp_ctx.cpus[cpu_idx];
+    ASSERT(cpu->stack_base == PHY_TO_KSPACE(stack_base_phy));
+
+    WRITE_SYS_REG(TPIDR_EL1, cpu_idx);
+
+    // Same translation setup as the boot CPU
+    vmem_initialize();
+    vmem_set_tables(cpu->kernel_vmem, s_smp_ctx.dummy_user_table);
+    vmem_flush_tlb();
+    vmem_enable_translations();
+
+    // FP is enabled per task when it is first used
+    uint64_t cpacr = 0;
+    WRITE_SYS_REG(CPACR_EL1, cpacr);
+
+    exception_init();
+    DISABLE_IRQ();
+
+    gtimer_early_init();
+    interrupt_enable_cpu(cpu->mpidr);
+
+    cpu->online = true;
+
+    smp_kernel_lock();
+
+    console_log(LOG_INFO, "CPU %u online (MPIDR %x)", cpu_idx, mpidr);
+
+    schedule();
+}
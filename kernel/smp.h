@@ -0,0 +1,52 @@
+#ifndef __SMP_H__
+#define __SMP_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "kernel/vmem.h"
+
+#define SMP_MAX_CPUS 8
+#define SMP_CPU_STACK_SIZE (4 * 4096)
+
+// SGI used to ask another CPU to run its scheduler
+#define SMP_IPI_RESCHEDULE 1
+
+#define SMP_MPIDR_AFF_MASK 0xFF00FFFFFFUL
+
+#define PSCI_FN_CPU_ON 0xC4000003
+#define PSCI_SUCCESS 0
+#define PSCI_ALREADY_ON (-4)
+
+typedef struct {
+    uint64_t mpidr;
+    volatile bool online;
+
+    uintptr_t stack_base;       /* Top of the per-CPU exception stack */
+    _vmem_table* kernel_vmem;   /* Kernel table currently loaded in TTBR1 */
+
+    uint64_t num_ipi;
+} smp_cpu_t;
+
+typedef struct {
+    uint64_t mpidr;
+    bool online;
+    uint64_t num_ipi;
+} smp_cpu_stat_t;
+
+void smp_init(void);
+void smp_start_cpus(void);
+
+uint64_t smp_cpu_idx(void);
+uint64_t smp_num_cpus(void);
+bool smp_cpu_online(uint64_t cpu_idx);
+uintptr_t smp_cpu_stack_base(void);
+
+void smp_kernel_lock(void);
+void smp_kernel_unlock(void);
+
+void smp_send_reschedule(uint64_t cpu_idx);
+
+void smp_get_cpu_stat(uint64_t cpu_idx, smp_cpu_stat_t* stat_out);
+
+#endif
@@ -0,0 +1,18 @@
+.arch armv8-a
+
+.text
+
+.global smp_psci_call_hvc
+.global smp_psci_call_smc
+
+# Call into PSCI firmware. Arguments and the return value are
+# passed in x0-x3 following the SMC calling convention
+# x0: Function ID
+# x1-x3: Function arguments
+smp_psci_call_hvc:
+    hvc #0
+    ret
+
+smp_psci_call_smc:
+    smc #0
+    ret
@@ -20,6 +20,7 @@
 #include "kernel/net/net_api.h"
 #include "kernel/select.h"
 #include "kernel/taskctrl.h"
+#include "kernel/mmap.h"
 
 typedef int64_t (*syscall_handler)(uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3);
 
@@ -51,13 +52,14 @@ static int64_t syscall_mapdev(uint64_t phy_addr,
 
     memory_space_t* memspace = &task->memory;
 
-    uint64_t ctx_phy;
-    bool walk_ok;
-    walk_ok = vmem_walk_table(task->low_vm_table, ctx, &ctx_phy);
-    if (!walk_ok) {
+    if (!mmap_user_access(task, ctx, sizeof(syscall_mapdev_ctx_t), true)) {
+        return SYSCALL_ERROR_BADARG;
+    }
+
+    syscall_mapdev_ctx_t* return_ctx = get_userspace_ptr(task->low_vm_table, ctx, sizeof(syscall_mapdev_ctx_t));
+    if (return_ctx == NULL) {
         return SYSCALL_ERROR_BADARG;
     }
-    syscall_mapdev_ctx_t* return_ctx = (syscall_mapdev_ctx_t*)(PHY_TO_KSPACE(ctx_phy));
     return_ctx->virt_addr = 0;
     return_ctx->phy_addr = 0;
 
@@ -160,12 +162,14 @@ static int64_t syscall_sbrk(uint64_t amount_unsigned,
 
             // Basically realloc. Eventually we could just add pages
             void* old_phy = (void*)entry->phy_addr;
-            void* new_phy = kmalloc_phy(new_amount);
+            void* new_phy = kmalloc_phy_nozero(new_amount);
             if (new_phy == NULL) {
                 return SYSCALL_ERROR_NOSPACE;
             }
 
+            // Only the newly added pages need to be cleared
             memcpy((void*)PHY_TO_KSPACE(new_phy), (void*)PHY_TO_KSPACE(old_phy), old_amount);
+            memset((void*)(PHY_TO_KSPACE(new_phy) + old_amount), 0, new_amount - old_amount);
 
             kfree_phy(old_phy);
 
@@ -241,50 +245,58 @@ int64_t syscall_exit(uint64_t ret_val, uint64_t arg1, uint64_t arg2, uint64_t ar
     return (int64_t)ret_val;
 }
 
+/*
+ * Strings and the argv array are copied one page at a time, as they may
+ * span pages which are not contiguous in physical memory
+ */
 int64_t syscall_exec(uint64_t device_arg, uint64_t path_arg, uint64_t task_name_arg, uint64_t argv_arg) {
 
     task_t* task = get_active_task();
 
-    void* device_kptr = get_userspace_ptr(task->low_vm_table, device_arg);
-    void* path_kptr = get_userspace_ptr(task->low_vm_table, path_arg);
-    void* task_name_kptr = get_userspace_ptr(task->low_vm_table, task_name_arg);
-    void* argv_kptr = get_userspace_ptr(task->low_vm_table, argv_arg);
+    char* device_kstr = vmalloc(SYSCALL_PATH_MAXLEN);
+    char* path_kstr = vmalloc(SYSCALL_PATH_MAXLEN);
+    char* task_name_kstr = vmalloc(SYSCALL_PATH_MAXLEN);
+    char** exec_argv = NULL;
 
-    if (device_kptr == NULL ||
-        path_kptr == NULL ||
-        task_name_kptr == NULL) {
-            
-        return -1;
-    }
+    int64_t ret = -1;
 
-    char** exec_argv = NULL;
+    if (!mmap_copy_user_str(task, device_arg, device_kstr, SYSCALL_PATH_MAXLEN) ||
+        !mmap_copy_user_str(task, path_arg, path_kstr, SYSCALL_PATH_MAXLEN) ||
+        !mmap_copy_user_str(task, task_name_arg, task_name_kstr, SYSCALL_PATH_MAXLEN)) {
+        goto done;
+    }
 
-    if (argv_kptr != NULL) {
-        char** argv = argv_kptr;
+    if (argv_arg != 0) {
         uint64_t exec_argc = 0;
+        uint64_t arg_ptr;
 
-        while (*argv != NULL) {
+        do {
+            if (!mmap_copy_user(task, argv_arg + exec_argc * sizeof(uint64_t),
+                                &arg_ptr, sizeof(uint64_t), false)) {
+                goto done;
+            }
             exec_argc++;
-            argv++;
-        }
+        } while (arg_ptr != 0);
+
+        exec_argv = vmalloc(exec_argc * sizeof(char*));
+        memset(exec_argv, 0, exec_argc * sizeof(char*));
 
-        exec_argv = vmalloc((exec_argc + 1) * sizeof(char*));
+        for (uint64_t idx = 0; idx + 1 < exec_argc; idx++) {
+            mmap_copy_user(task, argv_arg + idx * sizeof(uint64_t),
+                           &arg_ptr, sizeof(uint64_t), false);
 
-        argv = argv_kptr;
-        uint64_t idx;
-        for (idx = 0; idx < exec_argc; idx++) {
-            argv_kptr = get_userspace_ptr(task->low_vm_table, (uintptr_t)argv[idx]);
-            uint64_t arglen = strnlen(argv_kptr, EXEC_ARGV_ARG_MAXLEN);
-            char* exec_arg = vmalloc(arglen);
-            strncpy(exec_arg, argv[idx], EXEC_ARGV_ARG_MAXLEN);
+            char* exec_arg = vmalloc(EXEC_ARGV_ARG_MAXLEN);
             exec_argv[idx] = exec_arg;
+            if (!mmap_copy_user_str(task, arg_ptr, exec_arg, EXEC_ARGV_ARG_MAXLEN)) {
+                goto done;
+            }
         }
-
-        exec_argv[idx] = NULL;
     }
 
-    uint64_t exec_res = exec_user_task(device_kptr, path_kptr, task_name_kptr, exec_argv);
+    uint64_t exec_res = exec_user_task(device_kstr, path_kstr, task_name_kstr, exec_argv);
+    ret = exec_res != 0 ? (int64_t)exec_res : -1;
 
+done:
     if (exec_argv != NULL) {
         uint64_t idx = 0;
         while (exec_argv[idx] != NULL) {
@@ -295,7 +307,11 @@ int64_t syscall_exec(uint64_t device_arg, uint64_t path_arg, uint64_t task_name_
         vfree(exec_argv);
     }
 
-    return exec_res != 0 ? (int64_t)exec_res : -1;
+    vfree(device_kstr);
+    vfree(path_kstr);
+    vfree(task_name_kstr);
+
+    return ret;
 }
 
 void syscall_init(void) {
@@ -317,6 +333,9 @@ void syscall_init(void) {
     s_syscall_table[SYSCALL_BIND] = syscall_bind;
     s_syscall_table[SYSCALL_SELECT] = syscall_select;
     s_syscall_table[SYSCALL_TASKCTRL] = syscall_taskctrl;
+    s_syscall_table[SYSCALL_MMAP] = syscall_mmap;
+    s_syscall_table[SYSCALL_MUNMAP] = syscall_munmap;
+    s_syscall_table[SYSCALL_MSYNC] = syscall_msync;
 
     set_sync_handler(EC_SVC, syscall_sync_handler);
 }
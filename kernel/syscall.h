@@ -4,6 +4,9 @@
 
 #include "include/k_syscall.h"
 
+// Longest device name or path, including its terminator, taken from a task
+#define SYSCALL_PATH_MAXLEN 1024
+
 void syscall_init(void);
 
 extern const char* syscall_print_table[MAX_SYSCALL_NUM];
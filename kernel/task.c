@@ -11,9 +11,11 @@
 #include "kernel/vmem.h"
 #include "kernel/exception.h"
 #include "kernel/memoryspace.h"
+#include "kernel/mmap.h"
 #include "kernel/kernelspace.h"
 #include "kernel/console.h"
 #include "kernel/gtimer.h"
+#include "kernel/smp.h"
 #include "kernel/lib/vmalloc.h"
 
 #include "kernel/interrupt/interrupt.h"
@@ -29,11 +31,13 @@ static uint64_t s_max_tid;
 
 static _vmem_table* s_dummy_user_table;
 
-static elapsedtimer_t s_idletime;
+static elapsedtimer_t s_idletime[SMP_MAX_CPUS];
 
 static uint64_t* s_exstack;
 
-extern uint8_t _stack_base;
+// Registers of the user task being restored on each CPU. Copied out
+// of the task so the kernel lock can be dropped before returning
+static task_reg_t s_restore_reg[SMP_MAX_CPUS];
 
 void switch_to_kernel_task_stack_asm(uint64_t vector,
                                      uint64_t cpu_sp,
@@ -50,7 +54,9 @@ void task_init(uint64_t* exstack) {
     s_dummy_user_table = vmem_allocate_empty_table();
     s_exstack = exstack;
 
-    elapsedtimer_clear(&s_idletime);
+    for (uint64_t cpu_idx = 0; cpu_idx < SMP_MAX_CPUS; cpu_idx++) {
+        elapsedtimer_clear(&s_idletime[cpu_idx]);
+    }
 
     set_sync_handler(EC_FP_ACCESS, enable_task_fp);
 }
@@ -68,15 +74,19 @@ task_t* get_task_at_idx(int64_t idx) {
 }
 
 uint64_t get_schedule_profile_time(void) {
-    return elapsedtimer_get_us(&s_idletime);
+    uint64_t idle_us = 0;
+    for (uint64_t cpu_idx = 0; cpu_idx < smp_num_cpus(); cpu_idx++) {
+        idle_us += elapsedtimer_get_us(&s_idletime[cpu_idx]);
+    }
+    return idle_us;
 }
 
 void start_idle_timer(void) {
-    elapsedtimer_start(&s_idletime);
+    elapsedtimer_start(&s_idletime[smp_cpu_idx()]);
 }
 
 void stop_idle_timer(void) {
-    elapsedtimer_stop(&s_idletime);
+    elapsedtimer_stop(&s_idletime[smp_cpu_idx()]);
 }
 
 void bad_task_return(void) {
@@ -106,6 +116,8 @@ void save_context(task_reg_t* state_fp,
     ASSERT(state_fp != NULL);
     ASSERT(func != NULL);
 
+    smp_kernel_lock();
+
     uint64_t task_tid;
     READ_SYS_REG(TPIDR_EL0, task_tid);
 
@@ -124,7 +136,7 @@ void save_context(task_reg_t* state_fp,
     WRITE_SYS_REG(CPACR_EL1, cpacr);
     asm ("ISB");
 
-    void* cpu_stack_base = &_stack_base;
+    uintptr_t cpu_stack_base = smp_cpu_stack_base();
 
     switch_to_kernel_task_stack_asm(vector,
                                     (uint64_t)cpu_stack_base,
@@ -141,10 +153,12 @@ void restore_context(uint64_t tid) {
     WRITE_SYS_REG(TPIDR_EL0, tid);
 
     uint64_t sp0t = task->reg.sp;
-    uint64_t cpu_stack_base = (uint64_t)&_stack_base;
+    uint64_t cpu_stack_base = smp_cpu_stack_base();
     uint64_t currSP = 0;
     READ_SYS_REG(SPSel, currSP);
 
+    task_reg_t* reg = &task->reg;
+
     if (IS_USER_TASK(tid)) {
         vmem_set_user_table((_vmem_table*)KSPACE_TO_PHY(task->low_vm_table), tid);
         // uint64_t asid = tid << 48;
@@ -158,9 +172,14 @@ void restore_context(uint64_t tid) {
 
             restore_fp_reg(task->fp_reg);
         }
+
+        // User tasks run without the kernel lock
+        reg = &s_restore_reg[smp_cpu_idx()];
+        *reg = task->reg;
+        smp_kernel_unlock();
     }
 
-    restore_context_asm(&task->reg, sp0t, cpu_stack_base, currSP);
+    restore_context_asm(reg, sp0t, cpu_stack_base, currSP);
 
     ASSERT(1); // Should not reach
 }
@@ -168,6 +187,9 @@ void restore_context(uint64_t tid) {
 void idle_task(void) {
 
     while (true) {
+        // Takes the kernel lock for each page it moves, not for the memset
+        kmalloc_zero_pool_refill();
+
         asm ("wfi");
         schedule();
     }
@@ -180,7 +202,7 @@ void restore_context_idle(void) {
     uint64_t tid = 0;
     WRITE_SYS_REG(TPIDR_EL0, tid);
 
-    uint64_t sp0t = (uint64_t)&_stack_base;
+    uint64_t sp0t = smp_cpu_stack_base();
     uint64_t spsr = TASK_SPSR_M(4);
     task_reg_t reg = {
         .spsr = spsr,
@@ -194,6 +216,9 @@ void restore_context_idle(void) {
 
     vmem_set_user_table(KSPACE_TO_PHY_PTR(s_dummy_user_table), 0);
 
+    // The idle loop only takes the kernel lock when it needs it
+    smp_kernel_unlock();
+
     restore_context_asm(&reg, sp0t, sp0t, currSP);
 
     ASSERT(1);
@@ -217,8 +242,8 @@ void restore_context_kernel(uint64_t tid, uint64_t x0, void* sp) {
 
 void schedule_from_irq() {
     switch_to_kernel_task_stack_asm(0,
-                                    (uint64_t)&_stack_base,
-                                    (uint64_t)&_stack_base,
+                                    smp_cpu_stack_base(),
+                                    smp_cpu_stack_base(),
                                     (exception_handler)schedule);
 }
 
@@ -262,9 +287,13 @@ uint64_t create_task(uint64_t* user_stack_base,
     ASSERT(idx < MAX_NUM_TASKS);
 
     task_t* task = &s_task_list[idx];
+    task_t* parent_task = get_active_task();
 
     task->tid = tid;
+    task->parent_tid = parent_task != NULL ? parent_task->tid : 0;
     task->asid = 0;
+    task->priority = TASK_PRIORITY_NORMAL;
+    task->cpu = smp_cpu_idx();
     elapsedtimer_clear(&task->profile_time);
 
     task->user_stack_base = user_stack_base;
@@ -315,6 +344,7 @@ uint64_t create_task(uint64_t* user_stack_base,
 
     } else {
         task->wait_wakeup_fn = create_task_wakeup_f;
+        task->wait_ctx.queue = NULL;
         task->wait_ctx.wake_at = 0;
         task->wait_ctx.init_thread.x0 = task->reg.gp[TASK_REG(1)];
         task->run_state = TASK_WAIT_WAKEUP;
@@ -439,13 +469,73 @@ void task_wait_kernel_final(task_t* task,
 void task_wakeup(task_t* task, wait_reason_t reason) {
     ASSERT(task != NULL);
 
-    if ((task->run_state == TASK_RUNABLE) ||
+    uint64_t irq_state;
+    BEGIN_CRITICAL(irq_state);
+
+    if ((task->run_state != TASK_WAIT && task->run_state != TASK_WAIT_WAKEUP) ||
         (task->wait_reason != reason)) {
+        END_CRITICAL(irq_state);
         return;
     }
 
+    // Requeueing a waiting task marks it to be polled on the next schedule
     task->run_state = TASK_WAIT_WAKEUP;
     task_requeue(task);
+
+    END_CRITICAL(irq_state);
+}
+
+void wait_queue_add(wait_queue_t* queue, task_t* task) {
+    ASSERT(task->wait_queue == NULL);
+
+    task->wait_queue = queue;
+    task->wait_queue_prev = NULL;
+    task->wait_queue_next = queue->head;
+    if (queue->head != NULL) {
+        queue->head->wait_queue_prev = task;
+    }
+    queue->head = task;
+}
+
+void wait_queue_remove(task_t* task) {
+    wait_queue_t* queue = task->wait_queue;
+    if (queue == NULL) {
+        return;
+    }
+
+    if (task->wait_queue_prev != NULL) {
+        task->wait_queue_prev->wait_queue_next = task->wait_queue_next;
+    } else {
+        ASSERT(queue->head == task);
+        queue->head = task->wait_queue_next;
+    }
+    if (task->wait_queue_next != NULL) {
+        task->wait_queue_next->wait_queue_prev = task->wait_queue_prev;
+    }
+
+    task->wait_queue = NULL;
+    task->wait_queue_next = NULL;
+    task->wait_queue_prev = NULL;
+}
+
+/*
+ * This may be called from an interrupt context
+ */
+void wait_queue_signal(wait_queue_t* queue) {
+
+    uint64_t irq_state;
+    BEGIN_CRITICAL(irq_state);
+
+    // Waking a task relinks it at the head of the queue, so walk
+    // with the next pointer saved
+    task_t* task = queue->head;
+    while (task != NULL) {
+        task_t* next = task->wait_queue_next;
+        task_wakeup(task, task->wait_reason);
+        task = next;
+    }
+
+    END_CRITICAL(irq_state);
 }
 
 void task_cleanup(task_t* task, int64_t ret_val) {
@@ -470,6 +560,9 @@ void task_cleanup(task_t* task, int64_t ret_val) {
             case MEMSPACE_STACK:
                 kfree_phy((void*)((memory_entry_stack_t*)entry)->phy_addr);
                 break;
+            case MEMSPACE_FILE:
+                mmap_release((memory_entry_file_t*)entry);
+                break;
             case MEMSPACE_DEVICE:
             case MEMSPACE_CACHE:
             default:
@@ -487,6 +580,7 @@ void task_cleanup(task_t* task, int64_t ret_val) {
         task_t* waiter;
         FOR_LLIST(task->waiters, waiter)
             waiter->wait_ctx.wait.complete = true;
+            task_wakeup(waiter, WAIT_WAIT);
         END_FOR_LLIST()
     }
 
@@ -601,22 +695,20 @@ void task_wait_timer_in(uint64_t delay_us) {
     task_wait_timer_at(gtimer_get_count_us() + delay_us);
 }
 
-void* get_kptr_for_task_ptr(uint64_t raw_ptr, task_t* task) {
+void* get_kptr_for_task_ptr(uint64_t raw_ptr, uint64_t len, task_t* task) {
     if (task->tid & TASK_TID_KERNEL) {
         return (void*)raw_ptr;
     } else {
-        uint64_t args_phy;
-        bool walk_ok;
-        walk_ok = vmem_walk_table(task->low_vm_table, raw_ptr, &args_phy);
-        if (!walk_ok) {
+        if (!mmap_user_access(task, raw_ptr, len, false)) {
             return NULL;
         }
-        return PHY_TO_KSPACE_PTR(args_phy);
+
+        return get_userspace_ptr(task->low_vm_table, raw_ptr, len);
     }
 }
 
-void* get_kptr_for_ptr(uint64_t raw_ptr) {
-    return get_kptr_for_task_ptr(raw_ptr, get_active_task());
+void* get_kptr_for_ptr(uint64_t raw_ptr, uint64_t len) {
+    return get_kptr_for_task_ptr(raw_ptr, len, get_active_task());
 }
 
 void enable_task_fp(uint64_t vector, uint32_t esr) {
@@ -16,6 +16,7 @@
 #include "kernel/lib/lstruct.h"
 
 #include "include/k_syscall.h"
+#include "include/k_ioctl_common.h"
 
 #define MAX_NUM_TASKS 128
 
@@ -62,6 +63,16 @@ typedef enum {
     TASK_COMPLETE
 } run_state_t;
 
+// Runnable tasks of a higher priority always run before lower ones.
+// Tasks of the same priority are scheduled round robin
+typedef enum {
+    TASK_PRIORITY_HIGH = TASKCTRL_PRIORITY_HIGH,
+    TASK_PRIORITY_NORMAL = TASKCTRL_PRIORITY_NORMAL,
+    TASK_PRIORITY_LOW = TASKCTRL_PRIORITY_LOW,
+} task_priority_t;
+
+#define TASK_NUM_PRIORITIES 3
+
 typedef enum {
     WAIT_LOCK = 1,
     WAIT_GETMSGS = 2,
@@ -70,9 +81,21 @@ typedef enum {
     WAIT_SIGNAL = 5,
     WAIT_TIMER = 6,
     WAIT_SELECT = 7,
-    WAIT_WAIT = 7
+    WAIT_WAIT = 8
 } wait_reason_t;
 
+struct task_t_;
+
+/**
+ * A wait queue is attached to an object that tasks block on. Tasks
+ * waiting with wait_ctx.queue set are linked into the queue and are
+ * only polled by the scheduler after the queue has been signalled.
+ * A zero initialized wait_queue_t is an empty queue.
+ */
+typedef struct {
+    struct task_t_* head;
+} wait_queue_t;
+
 typedef struct {
     lock_t* lock_ptr;
 } wait_lock_t;
@@ -126,6 +149,7 @@ typedef struct {
         wait_select_t select;
         wait_wait_t wait;
     };
+    wait_queue_t* queue;        /* Optional queue signalled when the wait may complete */
     uint64_t wake_at;
 } wait_ctx_t;
 
@@ -148,16 +172,24 @@ typedef bool (*task_wakeup_f)(struct task_t_*, bool timeout, int64_t* ret);
 typedef struct task_t_ {
 
     uint32_t tid;
+    uint32_t parent_tid;        /* Task that was active when the task was created, 0 if none */
     uint8_t asid;
     char name[MAX_TASK_NAME_LEN];
 
     lstruct_t schedule_queue;
+    uint32_t timeout_slot;      /* 1-based index in the scheduler timeout heap, 0 if not present */
+    task_priority_t priority;
+    uint32_t cpu;               /* CPU whose run queue holds the task */
     run_state_t run_state;
     wait_reason_t wait_reason;
     wait_ctx_t wait_ctx;
     task_wakeup_f wait_wakeup_fn;
     int64_t wait_return;
 
+    wait_queue_t* wait_queue;   /* Queue the task is linked into, or NULL */
+    struct task_t_* wait_queue_next;
+    struct task_t_* wait_queue_prev;
+
     int64_t ret_val;
     llist_head_t waiters;
 
@@ -229,6 +261,10 @@ void restore_context_asm(task_reg_t* reg,
 // void task_wait(task_t* task, wait_reason_t reason, wait_ctx_t ctx, task_wakeup_f wakeup_fun);
 void task_wakeup(task_t* task, wait_reason_t reason);
 
+void wait_queue_add(wait_queue_t* queue, task_t* task);
+void wait_queue_remove(task_t* task);
+void wait_queue_signal(wait_queue_t* queue);
+
 void task_cleanup(task_t* task, int64_t ret_val);
 void task_final_cleanup(task_t* task);
 uint64_t task_await(task_t* task, task_t* target_task);
@@ -260,8 +296,8 @@ void stop_idle_timer(void);
 void task_wait_timer_at(uint64_t wake_time_us);
 void task_wait_timer_in(uint64_t delay_us);
 
-void* get_kptr_for_task_ptr(uint64_t raw_ptr, task_t* task);
-void* get_kptr_for_ptr(uint64_t raw_ptr);
+void* get_kptr_for_task_ptr(uint64_t raw_ptr, uint64_t len, task_t* task);
+void* get_kptr_for_ptr(uint64_t raw_ptr, uint64_t len);
 
 void enable_task_fp(uint64_t vector, uint32_t esr);
 
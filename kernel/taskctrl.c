@@ -4,6 +4,8 @@
 
 #include "kernel/task.h"
 #include "kernel/fd.h"
+#include "kernel/select.h"
+#include "kernel/schedule.h"
 #include "kernel/lib/vmalloc.h"
 
 #include "k_ioctl_common.h"
@@ -37,6 +39,7 @@ void task_ops_tid_validate(task_ops_ctx_t* task_ctx) {
 void task_ops_waited(task_t* task, task_t* target_task, void* ctx) {
     task_ops_ctx_t* task_ctx = ctx;
     task_ctx->fd_ctx->ready = task_ops_calculate_ready(target_task);
+    select_task_wakeup(task);
 }
 
 bool task_ops_wait_wakeup_fn(task_t* task, bool timeout, int64_t* ret) {
@@ -80,6 +83,28 @@ int64_t task_ops_ioctl_fn(void* ctx, const uint64_t ioctl, const uint64_t* args,
                                        task_ops_wait_wakeup_fn);
         }
         break;
+    case TASKCTRL_IOCTL_SET_PRIORITY:
+        if (arg_count != 1 || args[0] >= TASK_NUM_PRIORITIES) {
+            ret_val = -1;
+            break;
+        }
+        // Only kernel tasks may be raised above the normal priority
+        if (args[0] < TASK_PRIORITY_NORMAL && IS_USER_TASK(target_task->tid)) {
+            ret_val = -1;
+            break;
+        }
+        // User tasks may only change their own priority or their children's
+        if (IS_USER_TASK(task->tid) &&
+            (!IS_USER_TASK(target_task->tid) ||
+             (target_task != task && target_task->parent_tid != task->tid))) {
+            ret_val = -1;
+            break;
+        }
+        task_set_priority(target_task, args[0]);
+        break;
+    case TASKCTRL_IOCTL_GET_PRIORITY:
+        ret_val = target_task->priority;
+        break;
     default:
         ret_val = -1;
         break;
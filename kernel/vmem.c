@@ -598,8 +598,10 @@ void vmem_print_l0_table(_vmem_table* table_ptr) {
 }
 
 void vmem_flush_tlb(void) {
-    asm volatile("TLBI VMALLE1");
-    // asm volatile("DSB ISH");
+    // Broadcast to the TLBs of all CPUs in the inner shareable domain
+    asm volatile("DSB ISHST");
+    asm volatile("TLBI VMALLE1IS");
+    asm volatile("DSB ISH");
     asm volatile("ISB");
 }
 
@@ -31,28 +31,134 @@ malloc_state_t s_malloc_state;
  * 
  * malloc_state_t contains pointers to the memory region
  * owned by malloc. The malloc state also contains a pointer
- * to the first malloc_entry_t. malloc_entry_t structs contain
+ * to the first and last malloc_entry_t. malloc_entry_t structs contain
  * metadata about the proceeding chunk. It is assumed that this
- * chunk likes immediately after the entry in memory. The final
- * chunk is designated with a NULL next pointer
+ * chunk lies immediately after the entry in memory, so the next
+ * entry is found by adding the chunk size. Each entry also records
+ * the physically previous entry so that free can coalesce in both
+ * directions without walking the heap.
+ *
+ * Free entries are additionally kept in doubly linked bins segregated
+ * by power of two size. bin_map has a bit set for every non-empty bin,
+ * so finding a large enough chunk in a higher bin is a single ctz.
  */
 
-void malloc_check_structure_p(malloc_state_t* state) {
-    return;
+static malloc_entry_t* malloc_entry_next(malloc_state_t* state, malloc_entry_t* entry) {
+    if (entry == state->last_entry) {
+        return NULL;
+    }
+    return (malloc_entry_t*)((uintptr_t)(entry + 1) + entry->size);
+}
+
+static uint64_t malloc_bin_idx(uint64_t size) {
+    // Bin 0 holds chunks of 8-15 bytes, bin 1 16-31 bytes, etc.
+    if (size < 8) {
+        return 0;
+    }
+    uint64_t idx = (63 - __builtin_clzll(size)) - 3;
+    return MIN(idx, MALLOC_NUM_BINS - 1);
+}
+
+static void malloc_bin_insert(malloc_state_t* state, malloc_entry_t* entry) {
+    uint64_t idx = malloc_bin_idx(entry->size);
+
+    entry->prev_free = NULL;
+    entry->next_free = state->bins[idx];
+    if (entry->next_free != NULL) {
+        entry->next_free->prev_free = entry;
+    }
+    state->bins[idx] = entry;
+    state->bin_map |= BIT(idx);
+}
+
+static void malloc_bin_remove(malloc_state_t* state, malloc_entry_t* entry) {
+    uint64_t idx = malloc_bin_idx(entry->size);
+
+    if (entry->prev_free != NULL) {
+        entry->prev_free->next_free = entry->next_free;
+    } else {
+        SYS_ASSERT(state->bins[idx] == entry);
+        state->bins[idx] = entry->next_free;
+        if (state->bins[idx] == NULL) {
+            state->bin_map &= ~BIT(idx);
+        }
+    }
+    if (entry->next_free != NULL) {
+        entry->next_free->prev_free = entry->prev_free;
+    }
+    entry->next_free = NULL;
+    entry->prev_free = NULL;
+}
 
+void malloc_check_structure_p(malloc_state_t* state) {
     SYS_ASSERT(state->magic == MALLOC_MAGIC);
+    state->num_checks++;
 
+    uint64_t num_free = 0;
+    malloc_entry_t* prev_entry = NULL;
     malloc_entry_t* curr_entry = state->first_entry;
     do {
         SYS_ASSERT(curr_entry->magic == MALLOC_MAGIC);
-        if (curr_entry->next != NULL) {
-            SYS_ASSERT(curr_entry->next == (curr_entry->chunk_start + curr_entry->size));
-        } else {
-            SYS_ASSERT(state->limit == (uintptr_t)(curr_entry->chunk_start + curr_entry->size));
+        SYS_ASSERT(curr_entry->prev == prev_entry);
+        if (!curr_entry->inuse) {
+            num_free++;
+            // Free neighbours should always have been coalesced
+            SYS_ASSERT(prev_entry == NULL || prev_entry->inuse);
+        }
+        if (curr_entry == state->last_entry) {
+            SYS_ASSERT(state->limit == (uintptr_t)(curr_entry + 1) + curr_entry->size);
         }
 
-        curr_entry = curr_entry->next;
+        prev_entry = curr_entry;
+        curr_entry = malloc_entry_next(state, curr_entry);
     } while(curr_entry != NULL);
+
+    for (uint64_t idx = 0; idx < MALLOC_NUM_BINS; idx++) {
+        SYS_ASSERT(((state->bin_map & BIT(idx)) != 0) == (state->bins[idx] != NULL));
+        for (malloc_entry_t* entry = state->bins[idx]; entry != NULL; entry = entry->next_free) {
+            SYS_ASSERT(entry->magic == MALLOC_MAGIC);
+            SYS_ASSERT(!entry->inuse);
+            SYS_ASSERT(malloc_bin_idx(entry->size) == idx);
+            SYS_ASSERT(num_free > 0);
+            num_free--;
+        }
+    }
+    SYS_ASSERT(num_free == 0);
+}
+
+// Called after every malloc_p and free_p
+static void malloc_check_op(malloc_state_t* state) {
+    switch (state->check_mode) {
+        case MALLOC_CHECK_FULL:
+            malloc_check_structure_p(state);
+            break;
+        case MALLOC_CHECK_SAMPLED:
+            if ((state->num_malloc_ops % MALLOC_CHECK_SAMPLE_PERIOD) == 0) {
+                malloc_check_structure_p(state);
+            }
+            break;
+        case MALLOC_CHECK_RELEASE:
+        default:
+            break;
+    }
+}
+
+void malloc_set_check_mode(malloc_state_t* state, malloc_check_mode_t mode) {
+    SYS_ASSERT(state->magic == MALLOC_MAGIC);
+    state->check_mode = mode;
+}
+
+const char* malloc_check_mode_name(malloc_check_mode_t mode) {
+    switch (mode) {
+        case MALLOC_CHECK_RELEASE:
+            return "release";
+        case MALLOC_CHECK_SAMPLED:
+            return "sampled";
+        case MALLOC_CHECK_FULL:
+            return "full";
+        default:
+            return "unknown";
+    }
 }
 
 void malloc_init_p(malloc_state_t* state, malloc_add_mem_func add_mem_func, void* ctx) {
@@ -60,34 +166,79 @@ void malloc_init_p(malloc_state_t* state, malloc_add_mem_func add_mem_func, void
 
     int64_t ret = add_mem_func(true, 0, ctx, state);
     SYS_ASSERT(ret > 0);
-    // if (add_mem_func != NULL) {
-    //     // SYSCALL_CALL_RET(SYSCALL_SBRK, 0, 0, 0, 0, base);
-    //     // SYS_ASSERT(base > 0);
-
-    //     // SYSCALL_CALL_RET(SYSCALL_SBRK, MIN_MALLOC_SBRK_SIZE, 0, 0, 0, limit);
-    //     // SYS_ASSERT(limit > 0);
-    //     SYS_ASSERT(0);
-    // } else {
-    //     base = (uint64_t)mem;
-    //     limit = base + len;
-    // }
-    // state->base = base;
-    // state->limit = limit;
 
     malloc_entry_t* first_entry = (malloc_entry_t*)state->base;
     first_entry->magic = MALLOC_MAGIC;
-    first_entry->next = NULL;
+    first_entry->prev = NULL;
     first_entry->size = (state->limit - state->base) - sizeof(malloc_entry_t);
     first_entry->inuse = false;
-    first_entry->chunk_start = first_entry + 1;
 
     state->first_entry = first_entry;
-    state->last_checked_entry = first_entry;
+    state->last_entry = first_entry;
     state->add_mem_func = add_mem_func;
+    state->add_mem_ctx = ctx;
     state->num_malloc_ops = 0;
+    state->check_mode = MALLOC_CHECK_MODE_DEFAULT;
+    state->num_checks = 0;
+    state->bin_map = 0;
+    for (uint64_t idx = 0; idx < MALLOC_NUM_BINS; idx++) {
+        state->bins[idx] = NULL;
+    }
     state->magic = MALLOC_MAGIC;
+
+    malloc_bin_insert(state, first_entry);
+}
+
+static malloc_entry_t* malloc_find_free(malloc_state_t* state, uint64_t size) {
+    uint64_t idx = malloc_bin_idx(size);
+
+    // Chunks in the request's own bin may still be too small
+    for (malloc_entry_t* entry = state->bins[idx]; entry != NULL; entry = entry->next_free) {
+        SYS_ASSERT(entry->magic == MALLOC_MAGIC);
+        if (entry->size >= size) {
+            return entry;
+        }
+    }
+
+    // Any chunk in a higher bin is large enough
+    if (idx + 1 >= MALLOC_NUM_BINS) {
+        return NULL;
+    }
+    uint64_t higher = state->bin_map & ~(BIT(idx + 1) - 1);
+    if (higher == 0) {
+        return NULL;
+    }
+    return state->bins[__builtin_ctzll(higher)];
 }
 
+static bool malloc_grow(malloc_state_t* state, uint64_t size) {
+    uintptr_t old_limit = state->limit;
+
+    int64_t increase;
+    increase = state->add_mem_func(false, size + sizeof(malloc_entry_t),
+                                   state->add_mem_ctx, state);
+    if (increase <= 0) {
+        return false;
+    }
+    SYS_ASSERT(state->limit == old_limit + increase);
+
+    malloc_entry_t* last_entry = state->last_entry;
+    if (!last_entry->inuse) {
+        malloc_bin_remove(state, last_entry);
+        last_entry->size += increase;
+        malloc_bin_insert(state, last_entry);
+    } else {
+        SYS_ASSERT(increase > sizeof(malloc_entry_t));
+        malloc_entry_t* new_entry = (malloc_entry_t*)old_limit;
+        new_entry->magic = MALLOC_MAGIC;
+        new_entry->prev = last_entry;
+        new_entry->size = increase - sizeof(malloc_entry_t);
+        new_entry->inuse = false;
+        state->last_entry = new_entry;
+        malloc_bin_insert(state, new_entry);
+    }
+    return true;
+}
 
 void* malloc_p(uint64_t size, malloc_state_t* state) {
     SYS_ASSERT(state != NULL);
@@ -96,94 +247,47 @@ void* malloc_p(uint64_t size, malloc_state_t* state) {
 
     uint64_t size_align = (size + sizeof(uint64_t) - 1) & (~(sizeof(uint64_t) - 1));
 
-    malloc_check_structure_p(state);
-    malloc_entry_t* curr_entry = state->last_checked_entry;
-
-    do {
-        // Basic protection from buffer overflow
-        SYS_ASSERT(curr_entry->magic == MALLOC_MAGIC);
+    malloc_entry_t* curr_entry = malloc_find_free(state, size_align);
 
-        if ((!curr_entry->inuse) &&
-            (curr_entry->size >= size_align)) {
-            break;
+    while (curr_entry == NULL) {
+        // Add memory. The new memory is appended to the tail entry, so
+        // retry the search until the tail is large enough
+        if (!malloc_grow(state, size_align)) {
+            return NULL;
         }
-
-        curr_entry = curr_entry->next;
-    } while (curr_entry != NULL);
-
-    if (curr_entry == NULL) {
-        curr_entry = state->first_entry;
-        do {
-            // Basic protection from buffer overflow
-            SYS_ASSERT(curr_entry->magic == MALLOC_MAGIC);
-
-            if ((!curr_entry->inuse) &&
-                (curr_entry->size >= size_align)) {
-                break;
-            }
-
-            curr_entry = curr_entry->next;
-            if (curr_entry == state->last_checked_entry) {
-                curr_entry = NULL;
-            }
-        } while (curr_entry != NULL);
+        curr_entry = malloc_find_free(state, size_align);
     }
 
-    if (curr_entry == NULL) {
-        // Add memory
-        int64_t increase;
-        increase = state->add_mem_func(false, size_align, state->add_mem_ctx, state);
-        SYS_ASSERT(increase > 0);
+    SYS_ASSERT(curr_entry->magic == MALLOC_MAGIC);
+    SYS_ASSERT(!curr_entry->inuse);
+    malloc_bin_remove(state, curr_entry);
+    curr_entry->inuse = true;
 
-        malloc_entry_t* last_entry = state->first_entry;
-        while (last_entry->next != NULL) {
-            last_entry = last_entry->next;
-        }
+    uint64_t leftover = curr_entry->size - size_align;
+    if (leftover >= sizeof(malloc_entry_t) + MIN_LEFTOVER_SIZE) {
+        // Need to split the chunk into two. Don't fragment the memory
+        // space too much: if we have less than MIN_LEFTOVER_SIZE bytes
+        // left in the entry, just use the entire entry
+        malloc_entry_t* new_entry = (malloc_entry_t*)((uintptr_t)(curr_entry + 1) + size_align);
 
-        if (last_entry->inuse) {
-            malloc_entry_t* new_entry = (malloc_entry_t*)(last_entry->chunk_start + last_entry->size);
-            new_entry->magic = MALLOC_MAGIC;
-            new_entry->next = NULL;
-            new_entry->size = increase - sizeof(malloc_entry_t);
-            new_entry->inuse = false;
-            new_entry->chunk_start = new_entry + 1;
-            last_entry->next = new_entry;
-        } else {
-            last_entry->size += increase;
-        }
+        new_entry->magic = MALLOC_MAGIC;
+        new_entry->prev = curr_entry;
+        new_entry->size = leftover - sizeof(malloc_entry_t);
+        new_entry->inuse = false;
 
-        // Re-run malloc. This should return valid memory
-        return malloc_p(size_align, state);
-    } else {
-        uint64_t leftover = curr_entry->size - size_align;
-        curr_entry->inuse = true;
+        curr_entry->size = size_align;
 
-        if (leftover < MIN_LEFTOVER_SIZE) {
-            // Don't fragment the memory space too much. If we have less than
-            // MIN_LEFTOVER_SIZE bytes left in the entry, just use the entire entry
-            malloc_check_structure_p(state);
-            return curr_entry->chunk_start;
+        if (curr_entry == state->last_entry) {
+            state->last_entry = new_entry;
         } else {
-            // Need to split the chunk into two
-            void* chunk_start = curr_entry->chunk_start;
-
-            malloc_entry_t* new_entry = chunk_start + size_align;
-
-            new_entry->magic = MALLOC_MAGIC;
-            new_entry->next = curr_entry->next;
-            new_entry->size = leftover - sizeof(malloc_entry_t);
-            new_entry->inuse = false;
-            new_entry->chunk_start = new_entry + 1;
-
-            curr_entry->size = size_align;
-            curr_entry->next = new_entry;
+            malloc_entry_t* next_entry = malloc_entry_next(state, new_entry);
+            next_entry->prev = new_entry;
         }
-
-        state->last_checked_entry = curr_entry;
-
-        malloc_check_structure_p(state);
-        return curr_entry->chunk_start;
+        malloc_bin_insert(state, new_entry);
     }
+
+    malloc_check_op(state);
+    return curr_entry + 1;
 }
 
 void free_p(const void* mem, malloc_state_t* state) {
@@ -193,37 +297,72 @@ void free_p(const void* mem, malloc_state_t* state) {
 
     malloc_entry_t* entry = ((malloc_entry_t*)mem) - 1;
 
-    if (entry->magic == MALLOC_MAGIC &&
-        entry->inuse == true &&
-        entry->chunk_start == mem) {
-
-        // Entry seems valid. Free the entry
-        entry->inuse = false;
-    
-        if (entry->next != NULL &&
-            entry->next->inuse == false) {
+    if ((uintptr_t)entry < state->base ||
+        (uintptr_t)mem > state->limit ||
+        entry->magic != MALLOC_MAGIC ||
+        entry->inuse != true) {
 
-            entry->size = entry->size + entry->next->size + sizeof(malloc_entry_t);
-            entry->next = entry->next->next;
-       }
-    } else {
         // Something is wrong with the entry. Give up
         console_log(LOG_DEBUG, "Bad malloc entry at free");
-        if (entry->magic != MALLOC_MAGIC) {
-            console_log(LOG_DEBUG, "Bad magic. %16x vs. %16x",
-                        entry->magic, MALLOC_MAGIC);
+        if ((uintptr_t)entry < state->base || (uintptr_t)mem > state->limit) {
+            console_log(LOG_DEBUG, "Out of range. %16x", mem);
+        } else {
+            if (entry->magic != MALLOC_MAGIC) {
+                console_log(LOG_DEBUG, "Bad magic. %16x vs. %16x",
+                            entry->magic, MALLOC_MAGIC);
+            }
+            if (!entry->inuse) {
+                console_log(LOG_DEBUG, "Not inuse");
+            }
         }
-        if (!entry->inuse) {
-            console_log(LOG_DEBUG, "Not inuse");
+        SYS_ASSERT(false);
+        return;
+    }
+
+    // Entry seems valid. Free the entry
+    entry->inuse = false;
+
+    // Merge with the following entry. The boundary tags of both
+    // neighbours are checked, which catches most overruns of this chunk
+    malloc_entry_t* next_entry = malloc_entry_next(state, entry);
+    if (next_entry != NULL) {
+        SYS_ASSERT(next_entry->magic == MALLOC_MAGIC);
+        SYS_ASSERT(next_entry->prev == entry);
+    }
+    if (next_entry != NULL && !next_entry->inuse) {
+        malloc_bin_remove(state, next_entry);
+
+        entry->size += next_entry->size + sizeof(malloc_entry_t);
+        if (next_entry == state->last_entry) {
+            state->last_entry = entry;
         }
-        if (entry->chunk_start != mem) {
-            console_log(LOG_DEBUG, "Bad chunk start or mem. %16x vs. %16x",
-                        entry->chunk_start, mem);
+        next_entry->magic = 0;
+    }
+
+    // Merge with the preceding entry
+    malloc_entry_t* prev_entry = entry->prev;
+    if (prev_entry != NULL) {
+        SYS_ASSERT(prev_entry->magic == MALLOC_MAGIC);
+    }
+    if (prev_entry != NULL && !prev_entry->inuse) {
+        malloc_bin_remove(state, prev_entry);
+
+        prev_entry->size += entry->size + sizeof(malloc_entry_t);
+        if (entry == state->last_entry) {
+            state->last_entry = prev_entry;
         }
-        SYS_ASSERT(false);
+        entry->magic = 0;
+        entry = prev_entry;
     }
 
-    malloc_check_structure_p(state);
+    next_entry = malloc_entry_next(state, entry);
+    if (next_entry != NULL) {
+        SYS_ASSERT(next_entry->magic == MALLOC_MAGIC);
+        next_entry->prev = entry;
+    }
+    malloc_bin_insert(state, entry);
+
+    malloc_check_op(state);
 }
 
 void malloc_calc_stat(malloc_state_t* state, malloc_stat_t* stat_out) {
@@ -233,24 +372,21 @@ void malloc_calc_stat(malloc_state_t* state, malloc_stat_t* stat_out) {
     uint64_t avail_mem = 0;
     uint64_t largest_chunk = 0;
 
-    malloc_entry_t* entry = state->first_entry;
-    while (entry != NULL) {
-
-        if (!entry->inuse) {
+    for (uint64_t idx = 0; idx < MALLOC_NUM_BINS; idx++) {
+        for (malloc_entry_t* entry = state->bins[idx]; entry != NULL; entry = entry->next_free) {
             avail_mem += entry->size;
 
             if (entry->size > largest_chunk) {
                 largest_chunk = entry->size;
             }
         }
-
-        entry = entry->next;
     }
 
-
     stat_out->total_mem = total_mem;
     stat_out->avail_mem = avail_mem;
     stat_out->largest_chunk = largest_chunk;
+    stat_out->check_mode = state->check_mode;
+    stat_out->num_checks = state->num_checks;
 }
 
 // void malloc_init(void) {
@@ -5,12 +5,40 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#define MALLOC_NUM_BINS 48
+
+/**
+ * Heap integrity checking
+ *
+ * MALLOC_CHECK_FULL validates the whole heap on every operation,
+ * MALLOC_CHECK_SAMPLED every MALLOC_CHECK_SAMPLE_PERIOD operations and
+ * MALLOC_CHECK_RELEASE only the headers touched by the operation.
+ * The default is selected at build time with HEAP_CHECK_DEBUG or
+ * HEAP_CHECK_CHECKED and may be changed at runtime.
+ */
+typedef enum {
+    MALLOC_CHECK_RELEASE = 0,
+    MALLOC_CHECK_SAMPLED = 1,
+    MALLOC_CHECK_FULL = 2,
+} malloc_check_mode_t;
+
+#if defined(HEAP_CHECK_DEBUG)
+#define MALLOC_CHECK_MODE_DEFAULT MALLOC_CHECK_FULL
+#elif defined(HEAP_CHECK_CHECKED)
+#define MALLOC_CHECK_MODE_DEFAULT MALLOC_CHECK_SAMPLED
+#else
+#define MALLOC_CHECK_MODE_DEFAULT MALLOC_CHECK_RELEASE
+#endif
+
+#define MALLOC_CHECK_SAMPLE_PERIOD 1024
+
 typedef struct _malloc_entry_t {
-    uint64_t magic;                 /* Equal to MALLOC_MAGIC */
-    struct _malloc_entry_t* next;   /* Pointer to the next malloc_entry, or NULL if the last entry */
-    uint64_t size;                  /* Size of the associated chunk */
-    bool inuse;                     /* Is the chunk currently allocated? */
-    void* chunk_start;              /* Pointer to the beginnning of chunk memory */
+    uint64_t magic;                     /* Equal to MALLOC_MAGIC */
+    struct _malloc_entry_t* prev;       /* Physically previous entry, or NULL if the first entry */
+    uint64_t size;                      /* Size of the associated chunk */
+    bool inuse;                         /* Is the chunk currently allocated? */
+    struct _malloc_entry_t* next_free;  /* Next free entry in the same bin. Only valid when free */
+    struct _malloc_entry_t* prev_free;  /* Previous free entry in the same bin. Only valid when free */
 } malloc_entry_t;
 
 struct _malloc_state_t;
@@ -22,22 +50,30 @@ typedef struct _malloc_state_t{
     uintptr_t limit;                /* Limit address of malloc's memory */
     malloc_entry_t* first_entry;    /* First entry. Should be the same as the base pointer */
     uint64_t magic;                 /* Equal to MALLOC_MAGIC */
-    malloc_entry_t* last_checked_entry;
+    malloc_entry_t* last_entry;     /* Last entry. Ends at the limit pointer */
     malloc_add_mem_func add_mem_func;
     uint64_t num_malloc_ops;
     void* add_mem_ctx;
+    malloc_check_mode_t check_mode;
+    uint64_t num_checks;            /* Number of full structure checks run */
+    uint64_t bin_map;               /* Bit set for each non-empty bin */
+    malloc_entry_t* bins[MALLOC_NUM_BINS]; /* Free entries segregated by size */
 } malloc_state_t;
 
 typedef struct {
     uint64_t total_mem;
     uint64_t avail_mem;
     uint64_t largest_chunk;
+    malloc_check_mode_t check_mode;
+    uint64_t num_checks;
 } malloc_stat_t;
 
 void malloc_init_p(malloc_state_t* state, malloc_add_mem_func add_mem_func, void* ctx);
 void* malloc_p(uint64_t size, malloc_state_t* state);
 void free_p(const void* mem, malloc_state_t* state);
 void malloc_check_structure_p(malloc_state_t* state);
+void malloc_set_check_mode(malloc_state_t* state, malloc_check_mode_t mode);
+const char* malloc_check_mode_name(malloc_check_mode_t mode);
 
 void malloc_calc_stat(malloc_state_t* state, malloc_stat_t* stat_out);
 
@@ -67,4 +67,22 @@ int64_t system_taskctrl(uint64_t tid) {
     int64_t ret;
     SYSCALL_CALL_RET(SYSCALL_TASKCTRL, tid, 0, 0, 0, ret);
     return ret;
+}
+
+void* system_mmap(int64_t fd, uint64_t offset, uint64_t len, uint64_t flags) {
+    int64_t ret;
+    SYSCALL_CALL_RET(SYSCALL_MMAP, fd, offset, len, flags, ret);
+    return ret < 0 ? NULL : (void*)ret;
+}
+
+int64_t system_munmap(void* addr) {
+    int64_t ret;
+    SYSCALL_CALL_RET(SYSCALL_MUNMAP, (uintptr_t)addr, 0, 0, 0, ret);
+    return ret;
+}
+
+int64_t system_msync(void* addr, uint64_t flags) {
+    int64_t ret;
+    SYSCALL_CALL_RET(SYSCALL_MSYNC, (uintptr_t)addr, flags, 0, 0, ret);
+    return ret;
 }
\ No newline at end of file
@@ -50,4 +50,8 @@ int64_t system_exec(const char* device, const char* path, const char* name, char
 int64_t system_select(syscall_select_ctx_t* select_arr, uint64_t select_len, uint64_t timeout_us, uint64_t* ready_mask_out);
 int64_t system_taskctrl(uint64_t tid);
 
+void* system_mmap(int64_t fd, uint64_t offset, uint64_t len, uint64_t flags);
+int64_t system_munmap(void* addr);
+int64_t system_msync(void* addr, uint64_t flags);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,96 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "kernel/lib/checksum.h"
+
+// Bytes processed per measurement, whatever the buffer size
+#define BENCH_BYTES (256 * 1024 * 1024)
+
+typedef uint64_t (*checksum_fn)(uint64_t sum, const void* data, uint64_t len);
+typedef uint32_t (*crc32_fn)(const void* data, uint64_t len);
+
+static volatile uint64_t s_sink;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void report(const char* name, uint64_t len, uint64_t iters, uint64_t elapsed_ns) {
+    double ns_per_buffer = (double)elapsed_ns / iters;
+    double mb_per_s = ((double)len * iters) / ((double)elapsed_ns / 1e9) / (1024 * 1024);
+    printf("  %-16s %10.1f ns/buffer %10.1f MB/s\n", name, ns_per_buffer, mb_per_s);
+}
+
+static void bench_checksum(const char* name, checksum_fn fn, const uint8_t* data, uint64_t len) {
+    uint64_t iters = BENCH_BYTES / len;
+
+    uint64_t start = now_ns();
+    for (uint64_t idx = 0; idx < iters; idx++) {
+        s_sink += fn(0, data, len);
+    }
+    report(name, len, iters, now_ns() - start);
+}
+
+static void bench_crc32(const char* name, crc32_fn fn, const uint8_t* data, uint64_t len) {
+    uint64_t iters = BENCH_BYTES / len;
+
+    uint64_t start = now_ns();
+    for (uint64_t idx = 0; idx < iters; idx++) {
+        s_sink += fn(data, len);
+    }
+    report(name, len, iters, now_ns() - start);
+}
+
+int main(void) {
+
+    // Header sized, minimum IPv4 MTU, Ethernet MTU, jumbo and TSO sized
+    const uint64_t sizes[] = {20, 64, 576, 1514, 9000, 65535};
+    const uint64_t max_len = 65536;
+
+    // One spare byte so odd offsets can be tested
+    uint8_t* buffer = malloc(max_len + 1);
+    srand(1);
+    for (uint64_t idx = 0; idx < max_len + 1; idx++) {
+        buffer[idx] = rand();
+    }
+
+    // All paths agree, for every length and alignment up to a few blocks.
+    // checksum_add_neon and crc32_calc only take their NEON and CRC32
+    // instruction paths on an aarch64 host, elsewhere they fall back to
+    // the portable code and these checks compare it with itself
+    for (uint64_t offset = 0; offset < 2; offset++) {
+        for (uint64_t len = 0; len < 300; len++) {
+            uint64_t ref = checksum_fold(checksum_add_16(0x1234, buffer + offset, len));
+            assert(checksum_fold(checksum_add(0x1234, buffer + offset, len)) == ref);
+            assert(checksum_fold(checksum_add_neon(0x1234, buffer + offset, len)) == ref);
+            assert(crc32_calc(buffer + offset, len) == crc32_calc_table(buffer + offset, len));
+        }
+    }
+    assert(checksum_fold(checksum_add(0, buffer, max_len)) ==
+           checksum_fold(checksum_add_16(0, buffer, max_len)));
+    assert(checksum_fold(checksum_add_neon(0, buffer, max_len)) ==
+           checksum_fold(checksum_add_16(0, buffer, max_len)));
+
+    // CRC-32 check value
+    assert(crc32_calc("123456789", 9) == 0xCBF43926);
+
+    for (uint64_t idx = 0; idx < sizeof(sizes)/sizeof(sizes[0]); idx++) {
+        uint64_t len = sizes[idx];
+        printf("%lu bytes\n", (unsigned long)len);
+
+        bench_checksum("checksum_add_16", checksum_add_16, buffer, len);
+        bench_checksum("checksum_add", checksum_add, buffer, len);
+        bench_checksum("checksum_add_neon", checksum_add_neon, buffer, len);
+        bench_crc32("crc32_calc_table", crc32_calc_table, buffer, len);
+        bench_crc32("crc32_calc", crc32_calc, buffer, len);
+    }
+
+    free(buffer);
+
+    return 0;
+}
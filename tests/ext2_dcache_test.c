@@ -0,0 +1,97 @@
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "test_helpers.h"
+
+#include "kernel/fs/ext2/ext2_dcache.h"
+
+#define TEST_DIR_INODE 2
+
+static uint8_t test_name(char* name, int idx) {
+    return snprintf(name, EXT2_NAME_MAX + 1, "file%d", idx);
+}
+
+static ext2_dentry_t* test_get(ext2_dcache_t* dcache, int idx) {
+    char name[EXT2_NAME_MAX + 1];
+    uint8_t name_len = test_name(name, idx);
+    return ext2_dcache_get(dcache, TEST_DIR_INODE, name, name_len);
+}
+
+static void test_add(ext2_dcache_t* dcache, int idx) {
+    char name[EXT2_NAME_MAX + 1];
+    uint8_t name_len = test_name(name, idx);
+    ext2_dcache_add(dcache, TEST_DIR_INODE, name, name_len, idx + 100);
+}
+
+static void test_drop(ext2_dcache_t* dcache, int idx) {
+    char name[EXT2_NAME_MAX + 1];
+    uint8_t name_len = test_name(name, idx);
+    ext2_dcache_drop(dcache, TEST_DIR_INODE, name, name_len);
+}
+
+int main(void) {
+
+    ext2_dcache_t dcache;
+    ext2_dcache_init(&dcache);
+
+    assert(test_get(&dcache, 0) == NULL);
+    assert(dcache.lru_tail == NULL);
+
+    // Fill the cache twice over, every add past the limit evicts the
+    // oldest entry
+    const int N = 2 * EXT2_DCACHE_MAX;
+    for (int idx = 0; idx < N; idx++) {
+        assert(test_get(&dcache, idx) == NULL);
+        test_add(&dcache, idx);
+        assert(hashmap_len(dcache.dentries) <= EXT2_DCACHE_MAX);
+    }
+    assert(hashmap_len(dcache.dentries) == EXT2_DCACHE_MAX);
+    assert(lstruct_len(dcache.lru) == EXT2_DCACHE_MAX);
+
+    for (int idx = 0; idx < EXT2_DCACHE_MAX; idx++) {
+        assert(test_get(&dcache, idx) == NULL);
+    }
+    for (int idx = EXT2_DCACHE_MAX; idx < N; idx++) {
+        ext2_dentry_t* dentry = test_get(&dcache, idx);
+        assert(dentry != NULL);
+        assert(dentry->inode == idx + 100);
+    }
+
+    // The lookups above touched the entries oldest first, so the next
+    // add evicts the oldest one again unless it is used
+    ext2_dentry_t* dentry = test_get(&dcache, EXT2_DCACHE_MAX);
+    assert(dentry != NULL);
+    test_add(&dcache, N);
+    assert(test_get(&dcache, EXT2_DCACHE_MAX) != NULL);
+    assert(test_get(&dcache, EXT2_DCACHE_MAX + 1) == NULL);
+
+    // Dropping the least recently used entry moves the tail forward
+    ext2_dentry_t* tail = (ext2_dentry_t*)((uintptr_t)dcache.lru_tail - offsetof(ext2_dentry_t, lru_entry));
+    int tail_idx = tail->inode - 100;
+    test_drop(&dcache, tail_idx);
+    assert(hashmap_len(dcache.dentries) == EXT2_DCACHE_MAX - 1);
+    test_add(&dcache, N + 1);
+    test_add(&dcache, N + 2);
+    assert(hashmap_len(dcache.dentries) == EXT2_DCACHE_MAX);
+    assert(test_get(&dcache, N + 1) != NULL);
+    assert(test_get(&dcache, N + 2) != NULL);
+
+    // Drop everything, the tail follows the list down to empty
+    for (int idx = 0; idx <= N + 2; idx++) {
+        test_drop(&dcache, idx);
+    }
+    assert(hashmap_len(dcache.dentries) == 0);
+    assert(lstruct_empty(dcache.lru));
+    assert(dcache.lru_tail == NULL);
+
+    test_add(&dcache, 1);
+    assert(dcache.lru_tail != NULL);
+    assert(test_get(&dcache, 1)->inode == 101);
+
+    printf("ext2_dcache_test passed\n");
+
+    return 0;
+}
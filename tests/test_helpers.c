@@ -0,0 +1,34 @@
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "test_helpers.h"
+
+void* vmalloc(uint64_t size) {
+    return malloc(size);
+}
+
+void vfree(const void* mem) {
+    free((void*)mem);
+}
+
+void* slab_alloc(slab_cache_t* cache) {
+    return malloc(cache->obj_size);
+}
+
+void slab_free(slab_cache_t* cache, const void* obj) {
+    free((void*)obj);
+}
+
+void panic(char* file, uint64_t line, char* msg, ...) {
+
+    va_list args;
+    va_start(args, msg);
+    fprintf(stderr, "%s:%lu: ", file, (unsigned long)line);
+    vfprintf(stderr, msg, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+
+    abort();
+}
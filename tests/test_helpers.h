@@ -0,0 +1,11 @@
+#ifndef __TEST_HELPERS_H__
+#define __TEST_HELPERS_H__
+
+// Host implementations of the kernel allocator and panic used by the
+// code under test
+
+#include "kernel/panic.h"
+#include "kernel/lib/slab.h"
+#include "kernel/lib/vmalloc.h"
+
+#endif